@@ -148,6 +148,8 @@ void print_cpuinfo(void)
 		panic("Can't write FS Base from userspace, and no FASTCALL support!");
 		#endif
 	}
+	if (ebx & 0x00000020)
+		cpu_set_feat(CPU_FEAT_X86_AVX2);
 	cpuid(0x80000001, 0x0, &eax, &ebx, &ecx, &edx);
 	if (edx & (1 << 27)) {
 		printk("RDTSCP supported\n");
@@ -175,10 +177,13 @@ void print_cpuinfo(void)
 	#define CPUID_FXSR_SUPPORT          (1 << 24)
 	#define CPUID_XSAVE_SUPPORT         (1 << 26)
 	#define CPUID_XSAVEOPT_SUPPORT      (1 << 0)
+	#define CPUID_SSE2_SUPPORT          (1 << 26)
 
 	cpuid(0x01, 0x00, 0, 0, &ecx, &edx);
 	if (CPUID_FXSR_SUPPORT & edx)
 		cpu_set_feat(CPU_FEAT_X86_FXSR);
+	if (CPUID_SSE2_SUPPORT & edx)
+		cpu_set_feat(CPU_FEAT_X86_SSE2);
 	if (CPUID_XSAVE_SUPPORT & ecx)
 		cpu_set_feat(CPU_FEAT_X86_XSAVE);
 
@@ -17,6 +17,7 @@
 #include <assert.h>
 #include <err.h>
 #include <pmap.h>
+#include <page_alloc.h>
 #include <umem.h>
 #include <smp.h>
 #include <ip.h>
@@ -65,6 +66,7 @@ enum {
 	Qrealmem,
 	Qmsr,
 	Qperf,
+	Qnuma,
 
 	Qmax,
 };
@@ -84,6 +86,7 @@ static struct dirtab archdir[Qmax] = {
 	{"realmem", {Qrealmem, 0}, 0, 0444},
 	{"msr", {Qmsr, 0}, 0, 0666},
 	{"perf", {Qperf, 0}, 0, 0666},
+	{"numa", {Qnuma, 0}, 0, 0444},
 };
 /* White list entries needs to be ordered by start address, and never overlap.
  */
@@ -593,6 +596,12 @@ static long archread(struct chan *c, void *a, long n, int64_t offset)
 
 			return n;
 		}
+		case Qnuma:
+			buf = kzmalloc(PGSIZE, MEM_WAIT);
+			page_numa_print(buf, PGSIZE);
+			n = readstr(offset, a, n, buf);
+			kfree(buf);
+			return n;
 		default:
 			error(EINVAL, ERROR_FIXME);
 	}
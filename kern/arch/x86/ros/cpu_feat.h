@@ -16,4 +16,6 @@
 #define CPU_FEAT_X86_XSAVE				(__CPU_FEAT_ARCH_START + 3)
 #define CPU_FEAT_X86_XSAVEOPT			(__CPU_FEAT_ARCH_START + 4)
 #define CPU_FEAT_X86_FSGSBASE			(__CPU_FEAT_ARCH_START + 5)
+#define CPU_FEAT_X86_SSE2				(__CPU_FEAT_ARCH_START + 6)
+#define CPU_FEAT_X86_AVX2				(__CPU_FEAT_ARCH_START + 7)
 #define __NR_CPU_FEAT					(__CPU_FEAT_ARCH_START + 64)
@@ -233,8 +233,11 @@ uintptr_t smp_main(void)
 	/* This blob is the GDT, the GDT PD, and the TSS. */
 	unsigned int blob_size = sizeof(segdesc_t) * SEG_COUNT +
 	                         sizeof(pseudodesc_t) + sizeof(taskstate_t);
-	/* TODO: don't use kmalloc - might have issues in the future */
-	void *gdt_etc = kmalloc(blob_size, 0);		/* we'll never free this btw */
+	/* Comes from our own NUMA node, since only this core uses it.  We'll
+	 * never free this btw. */
+	assert(blob_size <= PGSIZE);
+	void *gdt_etc = get_cont_pages_node(numa_id_early(), 0, 0);
+	assert(gdt_etc);
 	taskstate_t *my_ts = gdt_etc;
 	pseudodesc_t *my_gdt_pd = (void*)my_ts + sizeof(taskstate_t);
 	segdesc_t *my_gdt = (void*)my_gdt_pd + sizeof(pseudodesc_t);
@@ -12,6 +12,7 @@
 #include <arch/arch.h>
 #include <arch/apic.h>
 #include <arch/topology.h>
+#include <page_alloc.h>
 
 struct topology_info cpu_topology_info;
 int *os_coreid_lookup;
@@ -327,6 +328,34 @@ static void build_flat_topology(void)
 	set_remaining_topology_info();
 }
 
+/* Returns our numa_id for a raw SRAT proximity domain, or -1 if no core is in
+ * that domain (e.g. memory-only domains). */
+static int raw_dom_to_numa_id(int dom)
+{
+	for (int i = 0; i < num_cores; i++) {
+		if (find_numa_domain(core_list[i].apic_id) == dom)
+			return core_list[i].numa_id;
+	}
+	return -1;
+}
+
+/* Tell the page allocator which memory belongs to which numa domain, so it can
+ * build its per-node pools. */
+static void init_numa_mem(void)
+{
+	if (srat == NULL || num_numa <= 1)
+		return;
+	for (int i = 0; i < srat->nchildren; i++) {
+		struct Srat *temp = srat->children[i]->tbl;
+
+		if (temp != NULL && temp->type == SRmem)
+			page_numa_add_range(raw_dom_to_numa_id(temp->mem.dom),
+			                    temp->mem.addr,
+			                    temp->mem.addr + temp->mem.len);
+	}
+	page_numa_init();
+}
+
 void topology_init(void)
 {
 	uint32_t eax, ebx, ecx, edx;
@@ -355,6 +384,7 @@ void topology_init(void)
 		build_topology(core_bits, cpu_bits);
 	else
 		build_flat_topology();
+	init_numa_mem();
 }
 
 void print_cpu_topology()
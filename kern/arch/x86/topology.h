@@ -60,6 +60,15 @@ static inline int numa_id(void)
 	return cpu_topology_info.core_list[os_coreid].numa_id;
 }
 
+/* numa_id() that is safe to call before topology_init(), at which point
+ * everything is in node 0. */
+static inline int numa_id_early(void)
+{
+	if (!os_coreid_lookup)
+		return 0;
+	return numa_id();
+}
+
 static inline int core_id(void)
 {
 	int coreid;
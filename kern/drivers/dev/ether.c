@@ -302,11 +302,33 @@ static inline int eaddrcmp(uint8_t *x, uint8_t *y)
 	return (a[0] ^ b[0]) | (a[1] ^ b[1]) | (a[2] ^ b[2]);
 }
 
-struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
+/*
+ *  is there a conversation for type that only hears rx queue qid?
+ */
+static bool etherqbound(struct ether *ether, int qid, int type)
+{
+	struct netfile **ep, *f, **fp;
+
+	if (qid < 0 || ether->queues[qid].nbound == 0)
+		return FALSE;
+	ep = &ether->f[Ntypes];
+	for (fp = ether->f; fp < ep; fp++)
+		if ((f = *fp) && f->rxq == qid && f->type == type)
+			return TRUE;
+	return FALSE;
+}
+
+/*
+ *  demux bp, which came in on rx queue qid, or -1 if it didn't come in
+ *  through a queue
+ */
+static struct block *etheriqx(struct ether *ether, struct block *bp,
+                              int fromwire, int qid)
 {
 	struct etherpkt *pkt;
 	uint16_t type;
 	int len, multi, tome, fromme, vlanid, i;
+	bool qbound;
 	struct netfile **ep, *f, **fp, *fx;
 	struct block *xbp;
 	struct ether *vlan;
@@ -351,6 +373,9 @@ struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 	tome = eaddrcmp(pkt->d, ether->ea) == 0;
 	fromme = eaddrcmp(pkt->s, ether->ea) == 0;
 
+	/* the queue's own conversation for type takes it from the device's */
+	qbound = etherqbound(ether, qid, type);
+
 	/*
 	 * Multiplex the packet to all the connections which want it.
 	 * If the packet is not to be used subsequently (fromwire != 0),
@@ -358,7 +383,11 @@ struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 	 * saving a copy of the data (usual case hopefully).
 	 */
 	for (fp = ether->f; fp < ep; fp++) {
-		if ((f = *fp) && (f->type == type || f->type < 0))
+		if ((f = *fp) && (f->type == type || f->type < 0)) {
+			if (f->rxq >= 0 && f->rxq != qid)
+				continue;
+			if (f->rxq < 0 && f->type == type && qbound)
+				continue;
 			if (tome || multi || f->prom) {
 				/* Don't want to hear bridged packets */
 				if (f->bridge && !fromwire && !fromme)
@@ -381,6 +410,7 @@ struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 				if (qpass(f->in, xbp) < 0)
 					ether->soverflows++;
 			}
+		}
 	}
 
 	if (fx) {
@@ -396,8 +426,353 @@ struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 	return bp;
 }
 
-static int etheroq(struct ether *ether, struct block *bp)
+struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
+{
+	return etheriqx(ether, bp, fromwire, -1);
+}
+
+/*
+ *  RSS: the Toeplitz hash of a frame's addresses and ports, with the
+ *  key everyone uses, so our hashes match the hardware's.  0 for frames
+ *  that aren't IP.
+ */
+static uint8_t rsskey[40] = {
+	0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+	0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+	0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+	0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+	0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+static uint32_t toeplitz(uint8_t *data, int n)
+{
+	uint32_t hash, v;
+	int i, b;
+
+	hash = 0;
+	v = nhgetl(rsskey);
+	for (i = 0; i < n; i++) {
+		for (b = 7; b >= 0; b--) {
+			if (data[i] & (1 << b))
+				hash ^= v;
+			v <<= 1;
+			if (rsskey[i + 4] & (1 << b))
+				v |= 1;
+		}
+	}
+	return hash;
+}
+
+uint32_t etherrsshash(struct block *bp)
+{
+	uint8_t buf[36], *ip;
+	int n, hl, proto;
+
+	if (BHLEN(bp) < ETHERHDRSIZE + 40)
+		return 0;
+	ip = bp->rp + ETHERHDRSIZE;
+	switch (nhgets(bp->rp + 2 * Eaddrlen)) {
+	case 0x0800:
+		hl = (ip[0] & 0xF) << 2;
+		proto = ip[9];
+		memmove(buf, ip + 12, 8);
+		n = 8;
+		/* only the first fragment has the ports */
+		if (nhgets(ip + 6) & 0x3FFF)
+			proto = 0;
+		break;
+	case 0x86DD:
+		hl = 40;
+		proto = ip[6];
+		memmove(buf, ip + 8, 32);
+		n = 32;
+		break;
+	default:
+		return 0;
+	}
+	if ((proto == 6 || proto == 17)
+	    && BHLEN(bp) >= ETHERHDRSIZE + hl + 4) {
+		memmove(buf + n, ip + hl, 4);
+		n += 4;
+	}
+	return toeplitz(buf, n);
+}
+
+/*
+ *  rx polling
+ */
+static void __etherpoll(uint32_t srcid, long a0, long a1, long a2);
+
+static void etherpoll1(struct etherpoll *ep)
+{
+	uint64_t now;
+	int n;
+
+	now = read_tsc();
+	if (now - ep->last > usec2tsc(EtherPollIdle * EtherPollUsec))
+		ep->streak = 0;
+	ep->last = now;
+
+	n = ep->poll(ep, EtherPollBudget);
+	ep->polls++;
+	ep->packets += n;
+	if (n >= EtherPollBudget) {
+		/* there's more, but give the rest of the core a turn first */
+		ep->exhausted++;
+		ep->streak++;
+		send_kernel_message(ep->core, __etherpoll, (long)ep, 0, 0,
+		                    KMSG_ROUTINE);
+		return;
+	}
+	if (n > 0) {
+		ep->streak++;
+		ep->idle = 0;
+	} else {
+		ep->streak = 0;
+		ep->idle++;
+	}
+	switch (ep->ether->busypoll) {
+	case EtherBusyOn:
+		ep->busy = TRUE;
+		break;
+	case EtherBusyAuto:
+		if (ep->streak >= EtherPollStreak)
+			ep->busy = TRUE;
+		else if (ep->idle >= EtherPollIdle)
+			ep->busy = FALSE;
+		break;
+	default:
+		ep->busy = FALSE;
+		break;
+	}
+	if (ep->busy) {
+		set_awaiter_rel(&ep->alarm, EtherPollUsec);
+		set_alarm(&per_cpu_info[ep->core].tchain, &ep->alarm);
+		return;
+	}
+	ep->idle = 0;
+	spin_lock_irqsave(&ep->lock);
+	ep->sched = FALSE;
+	spin_unlock_irqsave(&ep->lock);
+	if (ep->irqon != NULL)
+		ep->irqon(ep);
+}
+
+static void __etherpoll(uint32_t srcid, long a0, long a1, long a2)
+{
+	etherpoll1((struct etherpoll *)a0);
+}
+
+static void etherpollalarm(struct alarm_waiter *waiter)
+{
+	etherpoll1(container_of(waiter, struct etherpoll, alarm));
+}
+
+/*
+ *  called by the driver, usually from its interrupt handler with the rx
+ *  interrupt masked.  a poller is only ever running on one core at a time.
+ *  pollers that follow their irq move to this core, which is wherever the
+ *  interrupt is routed right now.  they only move when nothing is pending.
+ */
+void etherpollsched(struct etherpoll *ep)
+{
+	bool sched;
+
+	spin_lock_irqsave(&ep->lock);
+	sched = !ep->sched;
+	ep->sched = TRUE;
+	if (sched && ep->followirq)
+		ep->core = core_id();
+	spin_unlock_irqsave(&ep->lock);
+
+	if (sched)
+		send_kernel_message(ep->core, __etherpoll, (long)ep, 0, 0,
+		                    KMSG_ROUTINE);
+}
+
+/*
+ *  core < 0 polls on whichever core calls etherpollsched(), for drivers that
+ *  schedule from their interrupt handler and want to stay with the interrupt.
+ */
+void etherpollinit(struct etherpoll *ep, struct ether *ether, char *name,
+                   int core, int (*poll)(struct etherpoll *, int),
+                   void (*irqon)(struct etherpoll *), void *arg)
+{
+	ep->ether = ether;
+	ep->name = name;
+	ep->followirq = core < 0;
+	ep->core = core < 0 ? 0 : core;
+	ep->poll = poll;
+	ep->irqon = irqon;
+	ep->arg = arg;
+	spinlock_init_irqsave(&ep->lock);
+	init_awaiter(&ep->alarm, etherpollalarm);
+	/* pollers are added at reset and attach time, and never removed */
+	ep->next = ether->polls;
+	wmb();
+	ether->polls = ep;
+}
+
+int etherpollstats(struct ether *ether, char *p, int len)
 {
+	static char *modes[] = {
+		[EtherBusyOff] "off",
+		[EtherBusyOn] "on",
+		[EtherBusyAuto] "auto",
+	};
+	struct etherpoll *ep;
+	int l;
+
+	l = snprintf(p, len, "busypoll: %s\n", modes[ether->busypoll]);
+	for (ep = ether->polls; ep != NULL && l < len; ep = ep->next)
+		l += snprintf(p + l, len - l,
+		              "%s: core %d polls %lu packets %lu exhausted %lu%s\n",
+		              ep->name, ep->core, ep->polls, ep->packets,
+		              ep->exhausted, ep->busy ? " busy" : "");
+	return l;
+}
+
+/*
+ *  hand up at most budget of a queue's received frames, on the queue's core
+ */
+static int etherqpoll(struct etherpoll *ep, int budget)
+{
+	struct etherqueue *q = ep->arg;
+	struct block *bp, *last, *next;
+	int n;
+
+	spin_lock_irqsave(&q->rxlock);
+	bp = q->rxhead;
+	last = NULL;
+	for (n = 0, next = bp; next != NULL && n < budget; n++) {
+		last = next;
+		next = next->next;
+	}
+	q->rxhead = next;
+	if (next == NULL)
+		q->rxtail = NULL;
+	if (last != NULL)
+		last->next = NULL;
+	spin_unlock_irqsave(&q->rxlock);
+
+	for (; bp != NULL; bp = next) {
+		next = bp->next;
+		bp->next = NULL;
+		q->inpackets++;
+		etheriqx(q->ether, bp, 1, q->qid);
+	}
+	return n;
+}
+
+/*
+ *  there's no interrupt to turn back on, just catch what came in while we
+ *  were finishing up.
+ */
+static void etherqirqon(struct etherpoll *ep)
+{
+	struct etherqueue *q = ep->arg;
+	bool more;
+
+	spin_lock_irqsave(&q->rxlock);
+	more = q->rxhead != NULL;
+	spin_unlock_irqsave(&q->rxlock);
+	if (more)
+		etherpollsched(ep);
+}
+
+/*
+ *  a multi-queue device received bp on q.  this may be called from IRQ
+ *  context on any core; the frames are batched up and handed to q's core.
+ */
+void etheriqq(struct etherqueue *q, struct block *bp)
+{
+	spin_lock_irqsave(&q->rxlock);
+	if (q->rxhead == NULL)
+		q->rxhead = bp;
+	else
+		q->rxtail->next = bp;
+	q->rxtail = bp;
+	spin_unlock_irqsave(&q->rxlock);
+
+	etherpollsched(&q->poll);
+}
+
+/*
+ *  RSS in software, for devices that can't steer frames themselves
+ */
+void etheriqrss(struct ether *ether, struct block *bp)
+{
+	if (ether->nqueues == 0) {
+		etheriq(ether, bp, 1);
+		return;
+	}
+	etheriqq(&ether->queues[etherrsshash(bp) % ether->nqueues], bp);
+}
+
+/*
+ *  per-queue stats, for drivers' ifstat routines
+ */
+int etherqstats(struct ether *ether, char *p, int len)
+{
+	struct etherqueue *q;
+	int i, l;
+
+	l = snprintf(p, len, "queues: %d\n", ether->nqueues);
+	for (i = 0; i < ether->nqueues && l < len; i++) {
+		q = &ether->queues[i];
+		l += snprintf(p + l, len - l, "q%d: core %d in %lu out %lu\n",
+		              q->qid, q->core, q->inpackets, q->outpackets);
+	}
+	return l;
+}
+
+static void etherinitqueues(struct ether *ether, int qsize)
+{
+	struct etherqueue *q;
+	char *name;
+	int i;
+
+	if (ether->nqueues > MaxEtherQueues)
+		ether->nqueues = MaxEtherQueues;
+	ether->queues = kzmalloc(ether->nqueues * sizeof(struct etherqueue),
+	                         MEM_WAIT);
+	for (i = 0; i < ether->nqueues; i++) {
+		q = &ether->queues[i];
+		q->ether = ether;
+		q->qid = i;
+		q->core = i % num_cores;
+		q->oq = qopen(qsize / ether->nqueues, Qmsg, 0, 0);
+		if (q->oq == NULL)
+			panic("etherinitqueues %s", ether->name);
+		spinlock_init_irqsave(&q->rxlock);
+		name = kmalloc(KNAMELEN, MEM_WAIT);
+		snprintf(name, KNAMELEN, "q%d", i);
+		etherpollinit(&q->poll, ether, name, q->core, etherqpoll,
+		              etherqirqon, q);
+	}
+}
+
+/*
+ *  tell the device about what's been queued for it
+ */
+static void etherkick(struct ether *ether, struct etherqueue *q)
+{
+	if (q != NULL) {
+		if (ether->qtransmit != NULL)
+			ether->qtransmit(ether, q);
+	} else if (ether->transmit != NULL) {
+		ether->transmit(ether);
+	}
+}
+
+/*
+ *  queue one frame for the device, without kicking it
+ */
+static int etheroq1(struct ether *ether, struct etherqueue *q,
+                    struct block *bp)
+{
+	struct queue *oq;
+
 	int len, loopback;
 	struct etherpkt *pkt;
 	int8_t irq_state = 0;
@@ -441,9 +816,44 @@ static int etheroq(struct ether *ether, struct block *bp)
 	if ((ether->feat & NETF_PADMIN) == 0 && BLEN(bp) < ether->minmtu)
 		bp = adjustblock(bp, ether->minmtu);
 
-	qbwrite(ether->oq, bp);
-	if (ether->transmit != NULL)
-		ether->transmit(ether);
+	/* don't block on a full queue the device hasn't been told about */
+	oq = q != NULL ? q->oq : ether->oq;
+	if (qfull(oq))
+		etherkick(ether, q);
+	if (q != NULL)
+		q->outpackets++;
+	qbwrite(oq, bp);
+
+	return len;
+}
+
+/*
+ *  queue a packet for the device.  big TCP packets the device can't
+ *  segment are cut up here, as late as we can, and the whole batch is
+ *  queued before the device's transmit runs once to drain it.
+ */
+static int etheroq(struct ether *ether, struct block *bp)
+{
+	struct ether *ctlr;
+	struct etherqueue *q;
+	struct block *next;
+	int len;
+
+	ctlr = ether->vlanid ? ether->ctlr : ether;
+	/* a flow always goes out the same tx ring, so it stays in order */
+	q = NULL;
+	if (ctlr->nqueues)
+		q = &ctlr->queues[etherrsshash(bp) % ctlr->nqueues];
+	if ((bp->flag & Btso) && (ctlr->feat & NETF_TSO) == 0
+	    && BLEN(bp) > ether->maxmtu + ETHERHDRSIZE)
+		bp = tcpsegment(bp, ETHERHDRSIZE);
+	len = 0;
+	for (; bp != NULL; bp = next) {
+		next = bp->next;
+		bp->next = NULL;
+		len += etheroq1(ether, q, bp);
+	}
+	etherkick(ctlr, q);
 
 	return len;
 }
@@ -482,6 +892,22 @@ static long etherwrite(struct chan *chan, void *buf, long n, int64_t unused)
 			kfree(cb);
 			goto out;
 		}
+		if (strcmp(cb->f[0], "busypoll") == 0) {
+			if (cb->nf < 2)
+				ether->busypoll = EtherBusyOn;
+			else if (strcmp(cb->f[1], "on") == 0)
+				ether->busypoll = EtherBusyOn;
+			else if (strcmp(cb->f[1], "off") == 0)
+				ether->busypoll = EtherBusyOff;
+			else if (strcmp(cb->f[1], "auto") == 0)
+				ether->busypoll = EtherBusyAuto;
+			else {
+				kfree(cb);
+				error(EINVAL, "busypoll on|off|auto");
+			}
+			kfree(cb);
+			goto out;
+		}
 		kfree(cb);
 		if (ether->ctl != NULL) {
 			l = ether->ctl(ether, buf, n);
@@ -768,6 +1194,8 @@ static void etherreset(void)
 				ether->oq = qopen(qsize, Qmsg, 0, 0);
 			if (ether->oq == 0)
 				panic("etherreset %s", name);
+			if (ether->nqueues)
+				etherinitqueues(ether, qsize);
 			ether->alen = Eaddrlen;
 			memmove(ether->addr, ether->ea, Eaddrlen);
 			memset(ether->bcast, 0xFF, Eaddrlen);
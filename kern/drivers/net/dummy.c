@@ -0,0 +1,120 @@
+/*
+ * Software ether device, with no hardware behind it.  Everything sent to it
+ * comes right back in.  In multi-queue mode (CONFIG_NET_DUMMY_QUEUES > 0), the
+ * frames go out one of several tx queues and are steered back in by RSS to
+ * per-core rx queues, so the ether layer's multi-queue support can be exercised
+ * without a multi-queue NIC.  Multicast frames come back in too, which is how
+ * tests/etherq gets frames through the queues rather than the ether layer's
+ * own loopback.
+ */
+#include <vfs.h>
+#include <kfs.h>
+#include <slab.h>
+#include <kmalloc.h>
+#include <kref.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <error.h>
+#include <cpio.h>
+#include <pmap.h>
+#include <smp.h>
+#include <ip.h>
+
+#ifdef CONFIG_NET_DUMMY
+
+typedef struct Ctlr Ctlr;
+struct Ctlr {
+	/* bumped from every queue's transmit, on any core */
+	atomic_t ntx;
+	atomic_t nrx;
+};
+
+static void dummyloop(struct ether *edev, struct queue *oq)
+{
+	Ctlr *ctlr = edev->ctlr;
+	struct block *bp;
+
+	while ((bp = qget(oq)) != NULL) {
+		atomic_inc(&ctlr->ntx);
+		atomic_inc(&ctlr->nrx);
+		etheriqrss(edev, bp);
+	}
+}
+
+static void dummytransmit(struct ether *edev)
+{
+	int i;
+
+	dummyloop(edev, edev->oq);
+	for (i = 0; i < edev->nqueues; i++)
+		dummyloop(edev, edev->queues[i].oq);
+}
+
+static void dummyqtransmit(struct ether *edev, struct etherqueue *q)
+{
+	dummyloop(edev, q->oq);
+}
+
+static void dummyattach(struct ether *edev)
+{
+}
+
+/* we hear everything anyway; etheriq does the filtering */
+static void dummymulticast(void *arg, uint8_t *addr, int add)
+{
+}
+
+static long dummyifstat(struct ether *edev, void *a, long n, uint32_t offset)
+{
+	Ctlr *ctlr = edev->ctlr;
+	char *p;
+	int l;
+
+	p = kzmalloc(READSTR, 0);
+	if (p == NULL)
+		error(ENOMEM, ERROR_FIXME);
+	l = snprintf(p, READSTR, "type: dummy\ntx %ld\nrx %ld\n",
+	             atomic_read(&ctlr->ntx), atomic_read(&ctlr->nrx));
+	l += etherqstats(edev, p + l, READSTR - l);
+	etherpollstats(edev, p + l, READSTR - l);
+	n = readstr(offset, a, n, p);
+	kfree(p);
+
+	return n;
+}
+
+static int dummypnp(struct ether *edev)
+{
+	static bool claimed;
+	Ctlr *ctlr;
+
+	if (claimed)
+		return -1;
+	claimed = TRUE;
+
+	ctlr = kzmalloc(sizeof(Ctlr), MEM_WAIT);
+	edev->ctlr = ctlr;
+	/* locally administered */
+	edev->ea[0] = 0x02;
+	edev->ea[5] = edev->ctlrno;
+	edev->mbps = 10000;
+	edev->nqueues = MIN(CONFIG_NET_DUMMY_QUEUES, num_cores);
+	edev->feat = NETF_SG;
+
+	edev->attach = dummyattach;
+	edev->transmit = dummytransmit;
+	edev->qtransmit = dummyqtransmit;
+	edev->ifstat = dummyifstat;
+	edev->multicast = dummymulticast;
+	edev->arg = edev;
+
+	return 0;
+}
+
+linker_func_3(etherdummylink)
+{
+	addethercard("dummy", dummypnp);
+}
+
+#endif /* CONFIG_NET_DUMMY */
@@ -511,7 +511,7 @@ struct ctlr {
 	uint8_t	ra[Eaddrlen];		/* receive address */
 	uint32_t	mta[128];		/* multicast table array */
 
-	struct rendez	rrendez;
+	struct etherpoll	rpoll;
 	int	rim;
 	int	rdfree;
 	Rd*	rdba;			/* receive descriptor base address */
@@ -702,8 +702,9 @@ igbeifstat(struct ether* edev, void* a, long n, uint32_t offset)
 			r = miimir(ctlr->mii, i);
 			l += snprintf(p+l, READSTR-l, " %4.4uX", r);
 		}
-		snprintf(p+l, READSTR-l, "\n");
+		l += snprintf(p+l, READSTR-l, "\n");
 	}
+	etherpollstats(edev, p+l, READSTR-l);
 	n = readstr(offset, a, n, p);
 	kfree(p);
 	qunlock(&ctlr->slock);
@@ -1122,92 +1123,89 @@ igberxinit(struct ctlr* ctlr)
 	csr32w(ctlr, Rxcsum, Tuofl|Ipofl|(ETHERHDRSIZE<<PcssSHIFT));
 }
 
-static int
-igberim(void* ctlr)
+static void
+igberirqon(struct etherpoll* ep)
 {
-	return ((struct ctlr*)ctlr)->rim != 0;
+	struct ctlr *ctlr;
+
+	ctlr = ep->arg;
+	ctlr->rim = 0;
+	ctlr->rsleep++;
+	igbeim(ctlr, Rxt0|Rxo|Rxdmt0|Rxseq);
 }
 
-static void
-igberproc(void* arg)
+static int
+igberpoll(struct etherpoll* ep, int budget)
 {
 	Rd *rd;
 	struct block *bp;
 	struct ctlr *ctlr;
-	int r, rdh;
+	int n, rdh;
 	struct ether *edev;
 
-	edev = arg;
-	ctlr = edev->ctlr;
-
-	igberxinit(ctlr);
-	r = csr32r(ctlr, Rctl);
-	r |= Ren;
-	csr32w(ctlr, Rctl, r);
-
-	for(;;){
-		ctlr->rim = 0;
-		igbeim(ctlr, Rxt0|Rxo|Rxdmt0|Rxseq);
-		ctlr->rsleep++;
-		rendez_sleep(&ctlr->rrendez, igberim, ctlr);
+	ctlr = ep->arg;
+	edev = ctlr->edev;
 
-		rdh = ctlr->rdh;
-		for(;;){
-			rd = &ctlr->rdba[rdh];
+	n = 0;
+	rdh = ctlr->rdh;
+	while(n < budget){
+		rd = &ctlr->rdba[rdh];
 
-			if(!(rd->status & Rdd))
-				break;
+		if(!(rd->status & Rdd))
+			break;
 
-			/*
-			 * Accept eop packets with no errors.
-			 * With no errors and the Ixsm bit set,
-			 * the descriptor status Tpcs and Ipcs bits give
-			 * an indication of whether the checksums were
-			 * calculated and valid.
-			 */
-			if((rd->status & Reop) && rd->errors == 0){
-				bp = ctlr->rb[rdh];
-				ctlr->rb[rdh] = NULL;
-				bp->wp += rd->length;
-				bp->next = NULL;
-				if(!(rd->status & Ixsm)){
-					ctlr->ixsm++;
-					if(rd->status & Ipcs){
-						/*
-						 * IP checksum calculated
-						 * (and valid as errors == 0).
-						 */
-						ctlr->ipcs++;
-						bp->flag |= Bipck;
-					}
-					if(rd->status & Tcpcs){
-						/*
-						 * TCP/UDP checksum calculated
-						 * (and valid as errors == 0).
-						 */
-						ctlr->tcpcs++;
-						bp->flag |= Btcpck|Budpck;
-					}
-					bp->checksum = rd->checksum;
-					bp->flag |= Bpktck;
+		/*
+		 * Accept eop packets with no errors.
+		 * With no errors and the Ixsm bit set,
+		 * the descriptor status Tpcs and Ipcs bits give
+		 * an indication of whether the checksums were
+		 * calculated and valid.
+		 */
+		if((rd->status & Reop) && rd->errors == 0){
+			bp = ctlr->rb[rdh];
+			ctlr->rb[rdh] = NULL;
+			bp->wp += rd->length;
+			bp->next = NULL;
+			if(!(rd->status & Ixsm)){
+				ctlr->ixsm++;
+				if(rd->status & Ipcs){
+					/*
+					 * IP checksum calculated
+					 * (and valid as errors == 0).
+					 */
+					ctlr->ipcs++;
+					bp->flag |= Bipck;
 				}
-				etheriq(edev, bp, 1);
-			}
-			else if(ctlr->rb[rdh] != NULL){
-				freeb(ctlr->rb[rdh]);
-				ctlr->rb[rdh] = NULL;
+				if(rd->status & Tcpcs){
+					/*
+					 * TCP/UDP checksum calculated
+					 * (and valid as errors == 0).
+					 */
+					ctlr->tcpcs++;
+					bp->flag |= Btcpck|Budpck;
+				}
+				bp->checksum = rd->checksum;
+				bp->flag |= Bpktck;
 			}
-
-			memset(rd, 0, sizeof(Rd));
-			wmb();	/* make sure the zeroing happens before free (i think) */
-			ctlr->rdfree--;
-			rdh = NEXT_RING(rdh, ctlr->nrd);
+			etheriq(edev, bp, 1);
+			n++;
+		}
+		else if(ctlr->rb[rdh] != NULL){
+			freeb(ctlr->rb[rdh]);
+			ctlr->rb[rdh] = NULL;
 		}
-		ctlr->rdh = rdh;
 
-		if(ctlr->rdfree < ctlr->nrd/2 || (ctlr->rim & Rxdmt0))
-			igbereplenish(ctlr);
+		memset(rd, 0, sizeof(Rd));
+		wmb();	/* make sure the zeroing happens before free (i think) */
+		ctlr->rdfree--;
+		rdh = NEXT_RING(rdh, ctlr->nrd);
 	}
+	ctlr->rdh = rdh;
+
+	if(ctlr->rdfree < ctlr->nrd/2 || (ctlr->rim & Rxdmt0))
+		igbereplenish(ctlr);
+
+	return n;
 }
 
 static void
@@ -1262,9 +1260,13 @@ igbeattach(struct ether* edev)
 	snprintf(name, KNAMELEN, "#l%dlproc", edev->ctlrno);
 	ktask(name, igbelproc, edev);
 
+	/* rx is polled from the core that takes our interrupts */
 	name = kmalloc(KNAMELEN, MEM_WAIT);
-	snprintf(name, KNAMELEN, "#l%drproc", edev->ctlrno);
-	ktask(name, igberproc, edev);
+	snprintf(name, KNAMELEN, "#l%drpoll", edev->ctlrno);
+	etherpollinit(&ctlr->rpoll, edev, name, -1, igberpoll, igberirqon, ctlr);
+	igberxinit(ctlr);
+	csr32w(ctlr, Rctl, csr32r(ctlr, Rctl) | Ren);
+	igberirqon(&ctlr->rpoll);
 
 	igbetxinit(ctlr);
 
@@ -1276,7 +1278,7 @@ static void igbeinterrupt(struct hw_trapframe *hw_tf, void *arg)
 {
 	struct ctlr *ctlr;
 	struct ether *edev;
-	int icr, im, txdw;
+	int icr, im, txdw, rx;
 
 	edev = arg;
 	ctlr = edev->ctlr;
@@ -1285,6 +1287,7 @@ static void igbeinterrupt(struct hw_trapframe *hw_tf, void *arg)
 	csr32w(ctlr, Imc, ~0);
 	im = ctlr->im;
 	txdw = 0;
+	rx = 0;
 
 	while((icr = csr32r(ctlr, Icr) & ctlr->im) != 0){
 		if(icr & Lsc){
@@ -1296,7 +1299,7 @@ static void igbeinterrupt(struct hw_trapframe *hw_tf, void *arg)
 		if(icr & (Rxt0|Rxo|Rxdmt0|Rxseq)){
 			im &= ~(Rxt0|Rxo|Rxdmt0|Rxseq);
 			ctlr->rim = icr & (Rxt0|Rxo|Rxdmt0|Rxseq);
-			rendez_wakeup(&ctlr->rrendez);
+			rx++;
 			ctlr->rintr++;
 		}
 		if(icr & Txdw){
@@ -1310,6 +1313,8 @@ static void igbeinterrupt(struct hw_trapframe *hw_tf, void *arg)
 	csr32w(ctlr, Ims, im);
 	iunlock(&ctlr->imlock);
 
+	if(rx)
+		etherpollsched(&ctlr->rpoll);
 	if(txdw)
 		igbetransmit(edev);
 }
@@ -2004,7 +2009,6 @@ igbepci(void)
 		qlock_init(&ctlr->alock);
 		qlock_init(&ctlr->slock);
 		rendez_init(&ctlr->lrendez);
-		rendez_init(&ctlr->rrendez);
 		/* port seems to be unused, and only used for some comparison with edev.
 		 * plan9 just used the top of the raw bar, regardless of the type. */
 		ctlr->port = pcidev->bar[0].raw_bar & ~0x0f;
@@ -8,8 +8,13 @@
  * (picture running the ksched then).  The other style is to block/sleep on the
  * awaiter after the alarm is set.
  *
- * Like with most systems, you won't wake up til after the time you specify (for
- * now).  This might change, esp if we tweak things to coalesce alarms.
+ * Like with most systems, you won't wake up til after the time you specify.
+ * You may wake up later, either due to interrupt latency or because you gave
+ * your waiter some slack (set_awaiter_slack()).  Slack lets the tchain fire one
+ * interrupt for several alarms that are close together.
+ *
+ * The tchains are hierarchical timing wheels (see alarm.c), so setting and
+ * unsetting alarms is O(1), regardless of how many alarms are pending.
  *
  * All tchains come with locks.  Originally, I left these out, since the pcpu
  * tchains didn't need them (disable_irq was sufficient).  However, disabling
@@ -80,6 +85,7 @@
  * stack of the thread you're about to block on. */
 struct alarm_waiter {
 	uint64_t 					wake_up_time;	/* ugh, this is a TSC for now */
+	uint64_t					slack;		/* TSC ticks we can be late */
 	union {
 		void (*func) (struct alarm_waiter *waiter);
 		void (*func_irq) (struct alarm_waiter *waiter,
@@ -87,24 +93,46 @@ struct alarm_waiter {
 		struct semaphore			sem;		/* kthread will sleep on this */
 	};
 	void						*data;
-	TAILQ_ENTRY(alarm_waiter)	next;
+	BSD_LIST_ENTRY(alarm_waiter)	next;
+	uint8_t						wheel_lvl;
+	uint8_t						wheel_slot;
 	bool						on_tchain;
 	bool						irq_ok;
 	bool						holds_tchain_lock;
 	bool						has_func;
 };
-TAILQ_HEAD(awaiters_tailq, alarm_waiter);		/* ideally not a LL */
+BSD_LIST_HEAD(awaiters_list, alarm_waiter);
 
 typedef void (*alarm_handler)(struct alarm_waiter *waiter);
 
+/* Level 0 slots are 2^TCHAIN_WHEEL_SHIFT TSC ticks wide, and each level's slots
+ * are TCHAIN_WHEEL_SLOTS times wider than the level below.  With 6 levels, the
+ * wheel covers 2^48 ticks; alarms further out than that get refiled when the
+ * wheel gets around to them. */
+#define TCHAIN_WHEEL_SHIFT			12
+#define TCHAIN_WHEEL_BITS			6
+#define TCHAIN_WHEEL_SLOTS			(1 << TCHAIN_WHEEL_BITS)
+#define TCHAIN_WHEEL_LEVELS			6
+
+struct tchain_wheel {
+	uint64_t					pending[TCHAIN_WHEEL_LEVELS];	/* bitmaps */
+	struct awaiters_list		slots[TCHAIN_WHEEL_LEVELS][TCHAIN_WHEEL_SLOTS];
+};
+
 /* One of these per alarm source, such as a per-core timer.  All tchains come
  * with a lock, even if its rarely needed (like the pcpu tchains).
- * set_interrupt() is a method for setting the interrupt source. */
+ * set_interrupt() is a method for setting the interrupt source.
+ *
+ * earliest_time is when the interrupt should go off.  With slack, that can be
+ * after the earliest waiter's wake_up_time. */
 struct timer_chain {
 	spinlock_t					lock;
-	struct awaiters_tailq		waiters;
+	struct tchain_wheel			*wheel;
+	uint64_t					clk;		/* wheel time, in TSC ticks */
+	unsigned int				nr_waiters;
 	uint64_t					earliest_time;
-	uint64_t					latest_time;
+	unsigned long				nr_triggers;
+	unsigned long				nr_fired;
 	void (*set_interrupt)(struct timer_chain *);
 };
 
@@ -121,6 +149,8 @@ void init_awaiter_irq(struct alarm_waiter *waiter,
 void set_awaiter_abs(struct alarm_waiter *waiter, uint64_t abs_time);
 void set_awaiter_rel(struct alarm_waiter *waiter, uint64_t usleep);
 void set_awaiter_inc(struct alarm_waiter *waiter, uint64_t usleep);
+/* Lets the alarm go off up to usec late, so it can share an IRQ with others */
+void set_awaiter_slack(struct alarm_waiter *waiter, uint64_t usec);
 /* Arms/disarms the alarm. */
 void set_alarm(struct timer_chain *tchain, struct alarm_waiter *waiter);
 bool unset_alarm(struct timer_chain *tchain, struct alarm_waiter *waiter);
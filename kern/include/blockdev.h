@@ -11,6 +11,7 @@
 #include <slab.h>
 #include <pagemap.h>
 #include <kthread.h>
+#include <atomic.h>
 
 /* All block IO is done assuming a certain size sector, which is the smallest
  * possible unit of transfer between the kernel and the block layer.  This can
@@ -20,6 +21,32 @@
 #define SECTOR_SZ_LOG 9
 #define SECTOR_SZ (1 << SECTOR_SZ_LOG)
 
+/* The block layer never hands a driver an IO bigger than this. */
+#define BDEV_MAX_IO_SECTORS	256
+
+struct block_device;
+struct block_request;
+struct blk_io;
+TAILQ_HEAD(breq_tailq, block_request);
+
+/* Drivers provide these.  submit_io() starts an IO and must not block; the
+ * driver calls bdev_io_done() when the IO completes, from any context. */
+struct bdev_operations {
+	void (*submit_io)(struct block_device *bdev, struct blk_io *io);
+};
+
+/* Per-core software submission queue.  Requests sit here until the queue is
+ * run, at which point all of their BHs are sorted and merged into IOs. */
+struct bdev_queue {
+	spinlock_t					lock;
+	struct breq_tailq			reqs;
+	unsigned int				nr_reqs;
+	unsigned long				nr_submitted;	/* breqs */
+	unsigned long				nr_bhs;
+	unsigned long				nr_ios;			/* IOs sent to the driver */
+	unsigned long				nr_merged;		/* BHs merged into an IO */
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
 /* Every block device is represented by one of these, with custom methods, as
  * applicable for the type of device.  Subject to massive changes. */
 #define BDEV_INLINE_NAME 10
@@ -31,10 +58,8 @@ struct block_device {
 	struct page_map				b_pm;
 	void						*b_data;			/* dev-specific use */
 	char						b_name[BDEV_INLINE_NAME];
-	// TODO: list or something of buffer heads (?)
-	// list of outstanding requests
-	// io scheduler
-	// callbacks for completion
+	struct bdev_operations		*b_op;
+	struct bdev_queue			*b_queues;			/* one per core */
 };
 
 /* So far, only NEEDS_ZEROED is used */
@@ -74,7 +99,6 @@ void bdev_put_buffer(struct buffer_head *bh);
  * another array of BH pointers if you want more.  The BHs do not need to be
  * linked or otherwise associated with a page mapping. */
 #define NR_INLINE_BH (PGSIZE >> SECTOR_SZ_LOG)
-struct block_request;
 struct block_request {
 	unsigned int				flags;
 	void						(*callback)(struct block_request *breq);
@@ -83,6 +107,10 @@ struct block_request {
 	struct buffer_head			**bhs;				/* BHs describing the IOs */
 	unsigned int				nr_bhs;
 	struct buffer_head			*local_bhs[NR_INLINE_BH];
+	/* Managed by the block layer */
+	TAILQ_ENTRY(block_request)	link;
+	atomic_t					nr_pending;			/* BHs still in flight */
+	int							error;
 };
 struct kmem_cache *breq_kcache;	/* for the block requests */
 
@@ -90,9 +118,47 @@ struct kmem_cache *breq_kcache;	/* for the block requests */
 #define BREQ_READ 			0x001
 #define BREQ_WRITE 			0x002
 
+/* One BH of one request, as seen by a driver */
+struct blk_seg {
+	struct buffer_head			*bh;
+	struct block_request		*breq;
+	unsigned int				order;		/* submission order */
+};
+
+/* What the driver actually services: a run of BHs from one or more requests
+ * that are contiguous on the device and in the same direction.  The BH buffers
+ * are not contiguous in memory, so the driver does scatter-gather over segs. */
+struct blk_io {
+	unsigned int				flags;				/* BREQ_READ or WRITE */
+	unsigned long				sector;
+	unsigned int				nr_sector;
+	int							core;				/* submitting core */
+	void						*drv_data;			/* driver's use */
+	unsigned int				nr_segs;
+	struct blk_seg				segs[];
+};
+
+/* Plugging: while a kthread has a plug, its requests for the plug's bdev are
+ * held back, so a batch of requests can be merged into as few IOs as possible.
+ * Sleeping on a breq unplugs. */
+#define BDEV_PLUG_MAX		32
+struct blk_plug {
+	struct block_device			*bdev;
+	struct breq_tailq			reqs;
+	unsigned int				nr_reqs;
+};
+
 void block_init(void);
+void bdev_init(struct block_device *bdev);
 struct block_device *get_bdev(char *path);
 void free_bhs(struct page *page);
 int bdev_submit_request(struct block_device *bdev, struct block_request *breq);
+void bdev_io_done(struct block_device *bdev, struct blk_io *io, int error);
+void bdev_start_plug(struct blk_plug *plug, struct block_device *bdev);
+void bdev_finish_plug(struct blk_plug *plug);
 void generic_breq_done(struct block_request *breq);
 void sleep_on_breq(struct block_request *breq);
+void print_bdev_stats(struct block_device *bdev);
+
+/* ramdisk.c */
+struct block_device *ramdisk_create(char *name, void *data, size_t size);
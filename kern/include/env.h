@@ -85,15 +85,17 @@ struct proc {
 	spinlock_t vmr_lock;		/* Protects VMR tree (mem mgmt) */
 	spinlock_t pte_lock;		/* Protects page tables (mem mgmt) */
 	struct vmr_tailq vm_regions;
+	struct rb_root vm_tree;		/* same VMRs, indexed by address */
 	int vmr_history;
 
 	// Per process info and data pages
  	procinfo_t *procinfo;       // KVA of per-process shared info table (RO)
 	procdata_t *procdata;       // KVA of per-process shared data table (RW)
 	
-	// The backring pointers for processing asynchronous system calls from the user
-	// Note this is the actual backring, not a pointer to it somewhere else
-	syscall_back_ring_t syscallbackring;
+	/* ARSC: our private view of procdata's arsc_ring.  See arsc.c */
+	spinlock_t arsc_lock;		/* serializes pollers claiming slots */
+	uint32_t arsc_cons;			/* next slot to claim */
+	bool arsc_on;				/* on arsc_proc_list */
 	
 	// The front ring pointers for pushing asynchronous system events out to the user
 	// Note this is the actual frontring, not a pointer to it somewhere else
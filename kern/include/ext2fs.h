@@ -245,6 +245,10 @@ struct ext2_dirent {
 /* Every FS must extern it's type, and be included in vfs_init() */
 extern struct fs_type ext2_fs_type;
 
+/* The breq callback for readahead, exposed for the ktests */
+struct block_request;
+void ext2_readpages_done(struct block_request *breq);
+
 /* This hangs off the VFS's SB, and tracks in-memory copies of the disc SB and
  * the block group descriptor table.  For now, s_dirty (VFS) will track the
  * dirtiness of all things hanging off the sb.  Both of the objects contained
@@ -29,6 +29,7 @@
 
 #pragma once
 #include <ns.h>
+#include <alarm.h>
 
 enum {
 	Addrlen = 64,
@@ -171,6 +172,7 @@ struct medium {
 	void (*pref2addr) (uint8_t * pref, uint8_t * ea);
 
 	int unbindonclose;			/* if non-zero, unbind on last close */
+	int gso;					/* segments Btso blocks for the device */
 };
 
 /* logical interface associated with a physical one */
@@ -259,9 +261,25 @@ struct Ipmulti {
 
 /*
  *  hash table for 2 ip addresses + 2 ports
+ *
+ *  The table resizes itself incrementally: when it gets too full (or empty),
+ *  we allocate a new bucket array and every add or remove moves a few buckets
+ *  over from the old one.  While that's going on, a key lives in its old bucket
+ *  until that bucket is marked moved, and in the new table after.  Each bucket
+ *  has its own lock.
+ *
+ *  A lookup could still be looking at an old array after the migration is
+ *  done, so we free them after a grace period.  Users count themselves in
+ *  users[epoch & 1].  To retire arrays, we bump the epoch, and once the count
+ *  for the previous epoch drains, no one can see them.  New users go to the
+ *  other count, so that happens even under steady load.
  */
 enum {
-	Nipht = 521,				/* convenient prime */
+	Iphtmin = 64,		/* buckets, powers of 2 */
+	Iphtmax = 1 << 18,
+	Iphtgrow = 2,		/* grow when entries > buckets * Iphtgrow */
+	Iphtshrink = 8,		/* shrink when entries < buckets / Iphtshrink */
+	Iphtmigrate = 8,	/* buckets moved per add/remove */
 
 	IPmatchexact = 0,	/* match on 4 tuple */
 	IPmatchany,	/* *!* */
@@ -273,17 +291,41 @@ struct Iphash {
 	struct Iphash *next;
 	struct conv *c;
 	int match;
+	uint32_t hv;
 };
 
-struct Iphash;
-struct Ipht {
+struct Iphtbucket {
 	spinlock_t lock;
-	struct Iphash *tab[Nipht];
+	struct Iphash *head;
+	unsigned int n;
+	bool moved;			/* contents are in the next table */
+};
+
+struct Iphtab {
+	struct Iphtab *next;		/* on the retired list */
+	unsigned int mask;
+	struct Iphtbucket b[];
+};
+
+struct Ipht {
+	struct Iphtab *cur;
+	struct Iphtab *old;		/* being migrated from, if non-NULL */
+	unsigned int migrated;		/* buckets of old that have moved */
+	spinlock_t resizelock;
+	struct Iphtab *retired;		/* unlinked, grace period not started */
+	struct Iphtab *dying;		/* waiting for users[dyingidx] to drain */
+	unsigned int dyingidx;
+	unsigned int epoch;
+	atomic_t users[2];
+	atomic_t n;			/* total entries */
+	unsigned long nresize;
 };
+void iphtinit(struct Ipht *);
 void iphtadd(struct Ipht *, struct conv *);
 void iphtrem(struct Ipht *, struct conv *);
 struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
 					  uint16_t dp);
+char *iphtstats(struct Ipht *ht, char *p, char *e);
 
 /*
  *  one per multiplexed Protocol
@@ -660,7 +702,16 @@ extern int ipoput6(struct Fs *,
 				   struct block *, int unused_int, int, int, struct conv *);
 extern int ipstats(struct Fs *, char *unused_char_p_t, int);
 extern uint16_t ptclbsum(uint8_t * unused_uint8_p_t, int);
+extern uint16_t ptclbcopysum(uint8_t *, uint8_t *, int);
+/* ptclbsum's kernels, for testing.  ptclbsum() picks the best at boot. */
+enum {
+	PTCLBSUM_SCALAR,
+	PTCLBSUM_SSE2,
+	PTCLBSUM_AVX2,
+};
+extern int ptclbsum_kernel(int, uint8_t *, uint8_t *, int);
 extern uint16_t ptclcsum(struct block *, int unused_int, int);
+extern struct block *tcpsegment(struct block *, int);
 extern void ip_init(struct Fs *);
 extern void update_mtucache(uint8_t * unused_uint8_p_t, uint32_t);
 extern uint32_t restrict_mtu(uint8_t * unused_uint8_p_t, uint32_t);
@@ -939,6 +990,7 @@ struct netfile {
 	int scan;					/* base station scanning interval */
 	int bridge;					/* bridge mode */
 	int headersonly;			/* headers only - no data */
+	int rxq;					/* only hear this rx queue, if >= 0 */
 	uint8_t maddr[8];			/* bitmask of multicast addresses requested */
 	int nmaddr;					/* number of multicast addresses */
 
@@ -1050,6 +1102,70 @@ enum {
 	MaxEther = 32,
 	MaxFID = 16,
 	Ntypes = 8,
+	MaxEtherQueues = 32,
+
+	EtherPollBudget = 64,		/* frames per poll before yielding */
+	EtherPollUsec = 10,			/* between polls when busy polling */
+	EtherPollStreak = 16,		/* busy polls with frames: go busy */
+	EtherPollIdle = 64,			/* busy polls without: back to irqs */
+};
+
+/* busy polling modes */
+enum {
+	EtherBusyOff,
+	EtherBusyOn,
+	EtherBusyAuto,
+};
+
+/*
+ *  NAPI-style rx polling.  a driver's interrupt handler masks its rx
+ *  interrupt and calls etherpollsched().  poll() then runs on the poller's
+ *  core, handing up at most budget frames per call, and irqon() is called
+ *  once the ring is drained.  when busy polling, the ring is polled off an
+ *  alarm instead of waiting for the next interrupt.
+ */
+struct etherpoll {
+	struct etherpoll *next;		/* on the ether's list */
+	struct ether *ether;
+	char *name;
+	int core;
+	bool followirq;				/* core is whoever schedules us */
+	int (*poll) (struct etherpoll *, int);
+	void (*irqon) (struct etherpoll *);
+	void *arg;
+
+	spinlock_t lock;
+	bool sched;					/* poll pending or running */
+	bool busy;					/* busy polling right now */
+	int streak;					/* polls in a row with frames */
+	int idle;					/* busy polls in a row without */
+	uint64_t last;				/* tsc of the last poll */
+	struct alarm_waiter alarm;
+
+	unsigned long polls;
+	unsigned long packets;
+	unsigned long exhausted;	/* polls that used up the budget */
+};
+
+/*
+ *  one rx/tx ring pair of a multi-queue device.  frames are steered to a
+ *  queue by their RSS hash, and a queue's received frames are demuxed on
+ *  its core.  a conversation connected with "connect type q" hears type
+ *  only from queue q, instead of the conversation for type on the whole
+ *  device, so each queue can have its own reader.
+ */
+struct etherqueue {
+	struct ether *ether;
+	int qid;
+	int core;					/* core that runs this queue's rx */
+	struct queue *oq;			/* frames waiting for the tx ring */
+	spinlock_t rxlock;
+	struct block *rxhead;		/* frames waiting for core */
+	struct block *rxtail;
+	struct etherpoll poll;		/* drains rxhead on core */
+	int nbound;					/* netfiles that only hear this queue */
+	unsigned long inpackets;
+	unsigned long outpackets;
 };
 
 struct ether {
@@ -1079,6 +1195,14 @@ struct ether {
 
 	struct queue *oq;
 
+	/* multi-queue devices set nqueues and qtransmit in their reset */
+	int nqueues;				/* 0 if single queue */
+	struct etherqueue *queues;
+	void (*qtransmit) (struct ether *, struct etherqueue *);
+
+	int busypoll;				/* EtherBusy mode for the pollers */
+	struct etherpoll *polls;
+
 	qlock_t vlq;				/* array change */
 	int nvlan;
 	struct ether *vlans[MaxFID];
@@ -1087,6 +1211,15 @@ struct ether {
 };
 
 extern struct block *etheriq(struct ether *, struct block *, int);
+extern uint32_t etherrsshash(struct block *);
+extern void etheriqq(struct etherqueue *, struct block *);
+extern void etheriqrss(struct ether *, struct block *);
+extern int etherqstats(struct ether *, char *, int);
+extern void etherpollinit(struct etherpoll *, struct ether *, char *, int,
+                          int (*)(struct etherpoll *, int),
+                          void (*)(struct etherpoll *), void *);
+extern void etherpollsched(struct etherpoll *);
+extern int etherpollstats(struct ether *, char *, int);
 extern void addethercard(char *unused_char_p_t, int (*)(struct ether *));
 extern int archether(int unused_int, struct ether *);
 
@@ -21,6 +21,7 @@ struct errbuf {
 struct proc;
 struct kthread;
 struct semaphore;
+struct blk_plug;
 TAILQ_HEAD(kthread_tailq, kthread);
 TAILQ_HEAD(semaphore_tailq, semaphore);
 
@@ -28,6 +29,7 @@ TAILQ_HEAD(semaphore_tailq, semaphore);
 
 #define KTH_IS_KTASK			(1 << 0)
 #define KTH_SAVE_ADDR_SPACE		(1 << 1)
+#define KTH_ARSC_POLLER			(1 << 2)	/* see arsc.c */
 #define KTH_KTASK_FLAGS			(KTH_IS_KTASK)
 #define KTH_DEFAULT_FLAGS		(KTH_SAVE_ADDR_SPACE)
 
@@ -46,6 +48,10 @@ struct kthread {
 	char						*name;
 	char						generic_buf[GENBUF_SZ];
 	struct systrace_record		*strace;
+	struct blk_plug				*blk_plug;	/* see bdev_start_plug() */
+	/* Rest of a syscall batch, handed off if sysc blocks.  See syscall.c */
+	struct syscall				*batch;
+	unsigned int				batch_left;
 };
 
 /* Semaphore for kthreads to sleep on.  0 or less means you need to sleep */
@@ -101,6 +107,7 @@ TAILQ_HEAD(cv_lookup_tailq, cv_lookup_elm);
 
 uintptr_t get_kstack(void);
 void put_kstack(uintptr_t stacktop);
+void print_kstack_caches(void);
 uintptr_t *kstack_bottom_addr(uintptr_t stacktop);
 void kthread_init(void);
 struct kthread *__kthread_zalloc(void);
@@ -115,27 +115,9 @@ extern int ____ilog2_NaN;
 	LOG2_UP(n)				\
  )
 
-struct rb_node {
-	unsigned long  __rb_parent_color;
-	struct rb_node *rb_right;
-	struct rb_node *rb_left;
-};
-
-struct rb_root {
-	struct rb_node *rb_node;
-};
-
+/* struct rb_node and friends come from our rbtree.h */
 #define RB_ROOT	(struct rb_root) { NULL, }
 
-static inline void rb_link_node(struct rb_node * node, struct rb_node * parent,
-				struct rb_node ** rb_link)
-{
-	node->__rb_parent_color = (unsigned long)parent;
-	node->rb_left = node->rb_right = NULL;
-
-	*rb_link = node;
-}
-
 #define __printf(...)
 
 #define sprintf(s, fmt, ...) ({ \
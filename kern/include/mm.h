@@ -12,6 +12,7 @@
 #include <atomic.h>
 #include <sys/queue.h>
 #include <slab.h>
+#include <rbtree.h>
 
 struct file;
 struct proc;								/* preprocessor games */
@@ -24,6 +25,9 @@ struct proc;								/* preprocessor games */
 struct vm_region {
 	TAILQ_ENTRY(vm_region)		vm_link;
 	TAILQ_ENTRY(vm_region)		vm_pm_link;
+	struct rb_node				vm_rb;		/* in p->vm_tree, by vm_base */
+	uintptr_t					vm_gap;		/* free space below us */
+	uintptr_t					vm_max_gap;	/* largest vm_gap in subtree */
 	struct proc					*vm_proc;	/* owning process, for now */
 	uintptr_t					vm_base;
 	uintptr_t					vm_end;
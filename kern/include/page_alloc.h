@@ -60,6 +60,16 @@ extern page_list_t *colored_page_free_list;
 /*************** Functional Interface *******************/
 void page_alloc_init(struct multiboot_info *mbi);
 void colored_page_alloc_init(void);
+void free_area_init(void);
+void free_area_populate(void);
+size_t free_area_nr_blocks(size_t order);
+
+#define MAX_NUMA_NODES 16
+
+void page_numa_add_range(int node, physaddr_t start, physaddr_t end);
+void page_numa_init(void);
+int page_numa_nr_nodes(void);
+size_t page_numa_print(char *buf, size_t len);
 
 error_t upage_alloc(struct proc* p, page_t **page, int zero);
 error_t kpage_alloc(page_t **page);
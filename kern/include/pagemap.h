@@ -20,6 +20,25 @@ struct block_device;
 struct chan;
 struct page_map_operations;
 
+/* Sequential readahead, per page map.  The window is [ra_start, ra_start +
+ * ra_size).  When a reader gets to the page ra_async_size from the end of the
+ * window, we start reading the next window in the background, so a sequential
+ * reader shouldn't have to wait on IO after the first couple of misses.  The
+ * window doubles each time, up to PM_RA_MAX_PAGES, and random access resets it.
+ *
+ * Only PMs with a readpages op do readahead. */
+#define PM_RA_INIT_PAGES	4
+#define PM_RA_MAX_PAGES		32
+
+struct pm_readahead {
+	unsigned long				ra_start;
+	unsigned int				ra_size;
+	unsigned int				ra_async_size;
+	unsigned long				ra_prev_idx;	/* last page asked for */
+	unsigned long				nr_ra_pages;	/* pages we've read ahead */
+	unsigned long				nr_ra_windows;
+};
+
 /* Every object that has pages, like an inode or the swap (or even direct block
  * devices) has a page_map, tracking which of its pages are currently in memory.
  * It is a map, per object, from index to physical page frame. */
@@ -35,6 +54,7 @@ struct page_map {
 	spinlock_t					pm_lock;
 	struct vmr_tailq			pm_vmrs;
 	atomic_t					pm_removal;
+	struct pm_readahead			pm_ra;
 };
 
 /* Operations performed on a page_map.  These are usually FS specific, which
@@ -43,9 +63,17 @@ struct page_map {
 struct page_map_operations {
 	int (*readpage) (struct page_map *, struct page *);
 	int (*writepage) (struct page_map *, struct page *);
-/*	readpages: read a list of pages
-	writepage: write from a page to its backing store
-	writepages: write a list of pages
+	/* Starts filling the locked, !UPTODATE pages, and returns without waiting.
+	 * For each page, once its IO is done, set PG_UPTODATE (unless there was an
+	 * error), unlock it, and pm_put_page() it.  PMs with this op must have an
+	 * inode host. */
+	void (*readpages) (struct page_map *, struct page **, unsigned int);
+	/* Starts writing the locked pages, which have had PG_DIRTY cleared, and
+	 * returns without waiting.  Call pm_writeback_done() on each page once its
+	 * IO is done.  PMs with this op take part in writeback (writeback.h) and
+	 * must have an inode host. */
+	void (*writepages) (struct page_map *, struct page **, unsigned int);
+/*	writepage: write from a page to its backing store
 	sync_page: start the IO of already scheduled ops
 	set_page_dirty: mark the given page dirty
 	prepare_write: prepare to write (disk backed pages)
@@ -62,6 +90,10 @@ int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp);
 int pm_load_page_nowait(struct page_map *pm, unsigned long index,
                         struct page **pp);
 void pm_put_page(struct page *page);
+bool pm_set_page_dirty(struct page_map *pm, struct page *page);
+bool pm_clear_page_dirty(struct page_map *pm, struct page *page);
+unsigned long pm_writeback(struct page_map *pm);
+void pm_writeback_done(struct page_map *pm, struct page *page, int error);
 void pm_add_vmr(struct page_map *pm, struct vm_region *vmr);
 void pm_remove_vmr(struct page_map *pm, struct vm_region *vmr);
 int pm_remove_contig(struct page_map *pm, unsigned long index,
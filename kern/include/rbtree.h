@@ -0,0 +1,68 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Intrusive red-black tree, with optional augmentation.
+ *
+ * Like Linux's rbtree, the tree doesn't know about keys.  To insert, the caller
+ * walks down the tree to find the parent and the child link where the new node
+ * goes, then calls rb_link_node() and rb_insert_color().  Lookups are done by
+ * the caller, walking rb_left and rb_right.
+ *
+ * Augmented trees keep some per-subtree value in each node (e.g. the max of
+ * something in the subtree).  Pass a callback that recomputes a node's value
+ * from the node and its children; the tree calls it on every node whose subtree
+ * changes during inserts, erases, and rotations.  If a node's own contribution
+ * changes, call rb_augment_path() on it.  Non-augmented users pass 0. */
+
+#pragma once
+
+#include <ros/common.h>
+
+#define RB_RED		0
+#define RB_BLACK	1
+
+struct rb_node {
+	struct rb_node				*rb_parent;
+	struct rb_node				*rb_left;
+	struct rb_node				*rb_right;
+	int							rb_color;
+};
+
+struct rb_root {
+	struct rb_node				*rb_node;
+};
+
+typedef void (*rb_augment_f)(struct rb_node *node);
+
+#define RB_ROOT_INIT {0}
+
+static inline void rb_root_init(struct rb_root *root)
+{
+	root->rb_node = 0;
+}
+
+static inline bool rb_empty(struct rb_root *root)
+{
+	return root->rb_node == 0;
+}
+
+/* Hooks node into the tree as a leaf, at *link, which is a child pointer of
+ * parent (or the root pointer, with parent == 0). */
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent,
+                                struct rb_node **link)
+{
+	node->rb_parent = parent;
+	node->rb_left = 0;
+	node->rb_right = 0;
+	node->rb_color = RB_RED;
+	*link = node;
+}
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root,
+                     rb_augment_f augment);
+void rb_erase(struct rb_node *node, struct rb_root *root, rb_augment_f augment);
+void rb_augment_path(struct rb_node *node, rb_augment_f augment);
+struct rb_node *rb_first(struct rb_root *root);
+struct rb_node *rb_last(struct rb_root *root);
+struct rb_node *rb_next(struct rb_node *node);
+struct rb_node *rb_prev(struct rb_node *node);
@@ -12,11 +12,7 @@
 #include <ros/event.h>
 
 typedef struct procdata {
-	/*
-	syscall_sring_t			syscallring;
-	char					pad1[SYSCALLRINGSIZE - sizeof(syscall_sring_t)];
-	*/
-	syscall_sring_t			*syscallring;
+	void					*pad0;		/* was the old arsc ring */
 	sysevent_sring_t		syseventring;
 	char					pad2[SYSEVENTRINGSIZE - sizeof(sysevent_sring_t)];
 #if defined (__i386__) || defined (__x86_64) /* TODO: 64b */
@@ -26,6 +22,7 @@ typedef struct procdata {
 	 * rebuild glibc. */
 	struct resource_req		res_req[MAX_NUM_RESOURCES];
 	struct event_queue		*kernel_evts[MAX_NR_EVENT];
+	struct sysc_ring		arsc_ring;
 	/* Long range, would like these to be mapped in lazily, as the vcores are
 	 * requested.  Sharing MAX_NUM_CORES is a bit weird too. */
 	struct preempt_data		vcore_preempt_data[MAX_NUM_CORES];
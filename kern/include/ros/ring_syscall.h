@@ -1,32 +1,29 @@
+/* Copyright (c) 2009 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Asynchronous remote syscall (ARSC) ring.  The submission queue lives in
+ * procdata.  Userspace fills in a struct syscall, reserves a slot by bumping
+ * sq_prod, then writes the pointer into the slot.  A polling core (see
+ * kern/src/arsc.c) claims the slot, zeros it, advances sq_cons, and runs the
+ * syscall in the process's address space, without the process ever trapping.
+ *
+ * Completions are the usual syscall completions: SC_DONE gets set and the
+ * sysc's ev_q, if any, gets an EV_SYSCALL.  Syscalls that did not ask for an
+ * event get their EV_SYSCALL sent to the ring's ev_q instead, which lets
+ * userspace reap completions from a single UCQ or CEQ. */
+
 #pragma once
 
 #include <ros/common.h>
-#include <ros/ring_buffer.h>
-
-#define NUM_SYSCALL_ARGS 6
-/* This will need to change to represent sending pointers to syscalls, not the
- * syscalls themselves */
-struct syscall;
-typedef enum {
-	RES_free,  // The response has been digested by the user space, can be reallocated
-	REQ_alloc, // Space fo request is allocated
-	REQ_ready, // The request is populated by the caller
-	REQ_processing, // The request is being processed, 
-					// or a kernel thread is going to pick up the stack to process this later.
 
-	RES_ready // The response is ready to be picked up
-} syscall_status_t;
+#define SYSC_RING_SZ			256			/* must be a power of 2 */
 
-typedef struct syscall_req {
-    syscall_status_t status; // TODO:rethink this
-	void (*cleanup)(void* data);
-	void *data;
-	struct syscall* sc;
-} syscall_req_t, syscall_rsp_t;
-
-#define RSP_ERRNO(rsp) (rsp->sc->err)
-#define RSP_RESULT(rsp) (rsp->sc->retval)
+struct syscall;
+struct event_queue;
 
-// Generic Syscall Ring Buffer
-#define SYSCALLRINGSIZE    PGSIZE
-DEFINE_RING_TYPES(syscall, syscall_req_t, syscall_rsp_t);
+struct sysc_ring {
+	uint32_t					sq_prod;	/* user: next slot to reserve */
+	uint32_t					sq_cons;	/* kernel: next slot to run */
+	struct event_queue			*ev_q;		/* user: completion ev_q */
+	struct syscall				*sq[SYSC_RING_SZ];
+};
@@ -11,6 +11,8 @@
 #define SC_UEVENT				0x0004		/* user has an ev_q */
 #define SC_K_LOCK				0x0008		/* kernel locked sysc */
 #define SC_ABORT				0x0010		/* syscall abort attempted */
+#define SC_BATCH_LINK			0x0020		/* run after prev in batch, if ok */
+#define SC_ARSC					0x0040		/* kernel took it off the arsc ring */
 
 #define MAX_ERRSTR_LEN			128
 
@@ -30,6 +32,28 @@ struct syscall {
 	char						errstr[MAX_ERRSTR_LEN];
 };
 
+/* Syscalls that work on the caller's vcore or user context.  Some (yield, exec)
+ * never return to the caller, others change the context it returns to or read
+ * its vcore.  The kernel only runs them from a trap: not from the arsc ring,
+ * whose poller core has no caller context, nor from within a batch. */
+static inline bool syscall_needs_ctx(unsigned int num)
+{
+	switch (num) {
+	case SYS_getpcoreid:
+	case SYS_getvcoreid:
+	case SYS_yield:
+	case SYS_change_vcore:
+	case SYS_fork:
+	case SYS_exec:
+	case SYS_halt_core:
+	case SYS_change_to_m:
+	case SYS_vc_entry:
+	case SYS_pop_ctx:
+		return TRUE;
+	}
+	return FALSE;
+}
+
 struct childfdmap {
 	unsigned int				parentfd;
 	unsigned int				childfd;
@@ -13,12 +13,14 @@
 #include <corerequest.h>
 
 struct proc;	/* process.h includes us, but we need pointers now */
+struct ksched_lock;
 TAILQ_HEAD(proc_list, proc);		/* Declares 'struct proc_list' */
 
 /* One of these embedded in every struct proc */
 struct sched_proc_data {
 	TAILQ_ENTRY(proc)			proc_link;			/* tailq linkage */
 	struct proc_list 			*cur_list;			/* which tailq we're on */
+	struct ksched_lock			*cur_lock;			/* protects cur_list */
 	struct core_request_data	crd;				/* prov/alloc cores */
 	/* count of lists? */
 	/* other accounting info */
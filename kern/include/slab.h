@@ -24,6 +24,18 @@
  * overwrite things, so we need to add an extra 4-8 bytes per object for the
  * pointer, and then pass over that data when we return the actual object's
  * address.  This also might fuck with alignment.
+ *
+ * On top of the slab layer, each cache has a per-core magazine layer, based on
+ * Bonwick and Adams's "Magazines and Vmem" paper.  A magazine is an array of
+ * pointers to constructed objects (rounds).  Each core has a loaded and a
+ * previous magazine, and allocs/frees only touch that core's magazines.  When
+ * both are empty (or full), the core trades a magazine with the cache's depot,
+ * which is the only shared structure on the fast path.  Only when the depot
+ * can't help do we go to the slab layer and the cache_lock.
+ *
+ * The magazine layer is set up once we know num_cores (the percpu init).
+ * Until then, and for caches created with KMC_NOMAG, everything goes straight
+ * to the slabs.
  */
 
 #pragma once
@@ -38,6 +50,17 @@
 #define NUM_BUF_PER_SLAB 8
 #define SLAB_LARGE_CUTOFF (PGSIZE / NUM_BUF_PER_SLAB)
 
+/* Cache creation flags */
+#define KMC_NOMAG			0x0001	/* no per-core magazine layer */
+
+/* Magazine sizes.  The max fills a SLAB_LARGE_CUTOFF object, so magazines
+ * themselves come from a small-object slab.  The depot starts its cores at the
+ * min size and grows it when the depot lock is contended. */
+#define KMC_MAG_MIN_SZ		8
+#define KMC_MAG_MAX_SZ		62
+#define KMC_MAG_GROW_SZ		8
+#define KMC_MAG_BUSY_LIMIT	32	/* depot contentions per magazine growth */
+
 struct kmem_slab;
 
 /* Control block for buffers for large-object slabs */
@@ -64,6 +87,42 @@ struct kmem_slab {
 };
 TAILQ_HEAD(kmem_slab_list, kmem_slab);
 
+struct kmem_magazine {
+	SLIST_ENTRY(kmem_magazine) link;
+	unsigned int nr_rounds;
+	void *rounds[KMC_MAG_MAX_SZ];
+};
+SLIST_HEAD(kmem_mag_slist, kmem_magazine);
+
+/* Per-core state.  The lock is only grabbed by its own core, except when
+ * draining the magazines for a reap or destroy, so it is uncontended. */
+struct kmem_pcpu_cache {
+	spinlock_t lock;
+	unsigned int magsize;
+	struct kmem_magazine *loaded;
+	struct kmem_magazine *prev;
+	unsigned long nr_alloc_hits;		/* served from our magazines */
+	unsigned long nr_alloc_misses;		/* had to go to the depot or slab */
+	unsigned long nr_free_hits;
+	unsigned long nr_free_misses;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+/* not_empty magazines are full (nr_rounds == magsize when they were put in),
+ * empty magazines have no rounds. */
+struct kmem_depot {
+	spinlock_t lock;
+	struct kmem_mag_slist not_empty;
+	struct kmem_mag_slist empty;
+	unsigned int nr_not_empty;
+	unsigned int nr_empty;
+	unsigned int magsize;
+	unsigned int busy_count;
+	unsigned long nr_alloc_hits;		/* core got a full magazine */
+	unsigned long nr_alloc_misses;		/* went to the slab layer */
+	unsigned long nr_free_hits;			/* core got an empty magazine */
+	unsigned long nr_free_misses;		/* went to the slab layer */
+};
+
 /* Actual cache */
 struct kmem_cache {
 	SLIST_ENTRY(kmem_cache) link;
@@ -78,6 +137,8 @@ struct kmem_cache {
 	void (*ctor)(void *, size_t);
 	void (*dtor)(void *, size_t);
 	unsigned long nr_cur_alloc;
+	struct kmem_pcpu_cache *pcpu_caches;
+	struct kmem_depot depot;
 };
 
 /* List of all kmem_caches, sorted in order of size */
@@ -100,3 +161,4 @@ void kmem_cache_reap(struct kmem_cache *cp);
 /* Debug */
 void print_kmem_cache(struct kmem_cache *kc);
 void print_kmem_slab(struct kmem_slab *slab);
+void print_kmem_caches(void);
@@ -65,7 +65,9 @@ extern const struct sys_table_entry syscall_table[];
 extern const int max_syscall;
 /* Syscall invocation */
 void prep_syscalls(struct proc *p, struct syscall *sysc, unsigned int nr_calls);
-void run_local_syscall(struct syscall *sysc);
+int run_local_syscall(struct syscall *sysc);
+void run_arsc_syscall(struct syscall *sysc);
+void sysc_batch_blocked(struct kthread *kth);
 intreg_t syscall(struct proc *p, uintreg_t sc_num, uintreg_t a0, uintreg_t a1,
                  uintreg_t a2, uintreg_t a3, uintreg_t a4, uintreg_t a5);
 void set_errno(int errno);
@@ -139,6 +139,7 @@ struct super_block {
 	struct hashtable			*s_icache;		/* inode cache */
 	spinlock_t					s_icache_lock;
 	struct block_device			*s_bdev;
+	struct sb_writeback			*s_wb;			/* flusher, if any */
 	TAILQ_ENTRY(super_block)	s_instances;	/* list of sbs of this fs type*/
 	char						s_name[32];
 	void						*s_fs_info;
@@ -165,6 +166,7 @@ struct super_operations {
 
 /* Will need a bunch of states/flags for an inode.  TBD */
 #define I_STATE_DIRTY			0x001
+#define I_STATE_DIRTY_PAGES		0x002	/* on s_dirty_i, for writeback */
 
 /* Inode: represents a specific file */
 struct inode {
@@ -197,7 +199,7 @@ struct inode {
 		struct char_device			*i_cdev;
 	};
 	unsigned long				i_state;
-	unsigned long				dirtied_when;	/* in jiffies */
+	unsigned long				dirtied_when;	/* TSC, first dirty page */
 	unsigned int				i_flags;		/* filesystem mount flags */
 	bool						i_socket;
 	atomic_t					i_writecount;	/* number of writers */
@@ -0,0 +1,51 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Background writeback of dirty page map pages.
+ *
+ * Only page maps with a writepages op (files on block-backed FSs) take part.
+ * Their dirty pages are counted, and an inode goes on its SB's dirty list
+ * (s_dirty_i) when it gets its first dirty page.  Each such SB has a flusher
+ * ktask that wakes up every wb_interval_ms and writes back inodes that have
+ * been dirty for at least wb_expire_ms.  Once dirty pages pass
+ * wb_dirty_bg_ratio percent of RAM, the flushers are kicked and write back
+ * everything.  Writers that push dirty plus under-writeback pages past
+ * wb_dirty_ratio percent of RAM sleep until the flushers catch up.
+ *
+ * The knobs can be set with boot options of the same name, e.g.
+ * -wb_dirty_ratio=30, and read from #vars. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <sys/queue.h>
+#include <rendez.h>
+#include <atomic.h>
+
+struct super_block;
+struct inode;
+
+struct sb_writeback {
+	struct super_block			*sb;
+	TAILQ_ENTRY(sb_writeback)	link;			/* all flushers */
+	struct rendez				rv;				/* flusher sleeps here */
+	bool						kicked;
+	unsigned long				nr_runs;
+	unsigned long				nr_inodes;		/* written back */
+	unsigned long				nr_pages;
+};
+TAILQ_HEAD(sb_writeback_tailq, sb_writeback);
+
+extern unsigned int wb_dirty_ratio;
+extern unsigned int wb_dirty_bg_ratio;
+extern unsigned int wb_expire_ms;
+extern unsigned int wb_interval_ms;
+extern atomic_t wb_nr_dirty;
+extern atomic_t wb_nr_writeback;
+
+void writeback_init(void);
+void wb_start(struct super_block *sb);
+void wb_page_dirtied(struct inode *inode);
+void wb_page_written(void);
+void wb_balance_dirty(void);
+void print_writeback_info(void);
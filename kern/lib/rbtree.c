@@ -0,0 +1,286 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Red-black tree, following CLRS, with parent pointers and null leaves.  See
+ * rbtree.h for the interface and for how augmentation works.
+ *
+ * For augmentation, note that a rotation doesn't change the set of nodes below
+ * the top of the rotated pair, so only the two rotated nodes need their values
+ * recomputed.  Structural changes (linking or unlinking a node) change every
+ * subtree up to the root, so we walk that path once, before rebalancing. */
+
+#include <rbtree.h>
+#include <assert.h>
+
+static bool rb_is_black(struct rb_node *node)
+{
+	return !node || node->rb_color == RB_BLACK;
+}
+
+static bool rb_is_red(struct rb_node *node)
+{
+	return !rb_is_black(node);
+}
+
+/* Makes parent's child pointer that pointed to old point to new.  A parent of
+ * 0 means old was the root. */
+static void __rb_change_child(struct rb_root *root, struct rb_node *parent,
+                              struct rb_node *old, struct rb_node *new)
+{
+	if (!parent)
+		root->rb_node = new;
+	else if (parent->rb_left == old)
+		parent->rb_left = new;
+	else
+		parent->rb_right = new;
+}
+
+static void __rb_rotate_left(struct rb_node *x, struct rb_root *root,
+                             rb_augment_f augment)
+{
+	struct rb_node *y = x->rb_right;
+
+	x->rb_right = y->rb_left;
+	if (y->rb_left)
+		y->rb_left->rb_parent = x;
+	y->rb_parent = x->rb_parent;
+	__rb_change_child(root, x->rb_parent, x, y);
+	y->rb_left = x;
+	x->rb_parent = y;
+	if (augment) {
+		augment(x);
+		augment(y);
+	}
+}
+
+static void __rb_rotate_right(struct rb_node *x, struct rb_root *root,
+                              rb_augment_f augment)
+{
+	struct rb_node *y = x->rb_left;
+
+	x->rb_left = y->rb_right;
+	if (y->rb_right)
+		y->rb_right->rb_parent = x;
+	y->rb_parent = x->rb_parent;
+	__rb_change_child(root, x->rb_parent, x, y);
+	y->rb_right = x;
+	x->rb_parent = y;
+	if (augment) {
+		augment(x);
+		augment(y);
+	}
+}
+
+/* Recomputes the augmented value of node and all of its ancestors. */
+void rb_augment_path(struct rb_node *node, rb_augment_f augment)
+{
+	if (!augment)
+		return;
+	for (; node; node = node->rb_parent)
+		augment(node);
+}
+
+/* Call after rb_link_node(). */
+void rb_insert_color(struct rb_node *node, struct rb_root *root,
+                     rb_augment_f augment)
+{
+	struct rb_node *parent, *gparent, *uncle;
+
+	rb_augment_path(node, augment);
+	while ((parent = node->rb_parent) && rb_is_red(parent)) {
+		/* parent is red, so it isn't the root, and gparent exists */
+		gparent = parent->rb_parent;
+		if (parent == gparent->rb_left) {
+			uncle = gparent->rb_right;
+			if (rb_is_red(uncle)) {
+				parent->rb_color = RB_BLACK;
+				uncle->rb_color = RB_BLACK;
+				gparent->rb_color = RB_RED;
+				node = gparent;
+				continue;
+			}
+			if (node == parent->rb_right) {
+				node = parent;
+				__rb_rotate_left(node, root, augment);
+				parent = node->rb_parent;
+			}
+			parent->rb_color = RB_BLACK;
+			gparent->rb_color = RB_RED;
+			__rb_rotate_right(gparent, root, augment);
+		} else {
+			uncle = gparent->rb_left;
+			if (rb_is_red(uncle)) {
+				parent->rb_color = RB_BLACK;
+				uncle->rb_color = RB_BLACK;
+				gparent->rb_color = RB_RED;
+				node = gparent;
+				continue;
+			}
+			if (node == parent->rb_left) {
+				node = parent;
+				__rb_rotate_right(node, root, augment);
+				parent = node->rb_parent;
+			}
+			parent->rb_color = RB_BLACK;
+			gparent->rb_color = RB_RED;
+			__rb_rotate_left(gparent, root, augment);
+		}
+	}
+	root->rb_node->rb_color = RB_BLACK;
+}
+
+/* x took the place of a removed black node, and is 'doubly black'.  x may be
+ * 0, so we track its parent separately. */
+static void __rb_erase_fixup(struct rb_root *root, struct rb_node *x,
+                             struct rb_node *parent, rb_augment_f augment)
+{
+	struct rb_node *w;
+
+	while ((x != root->rb_node) && rb_is_black(x)) {
+		if (x == parent->rb_left) {
+			w = parent->rb_right;
+			if (rb_is_red(w)) {
+				w->rb_color = RB_BLACK;
+				parent->rb_color = RB_RED;
+				__rb_rotate_left(parent, root, augment);
+				w = parent->rb_right;
+			}
+			if (rb_is_black(w->rb_left) && rb_is_black(w->rb_right)) {
+				w->rb_color = RB_RED;
+				x = parent;
+				parent = x->rb_parent;
+				continue;
+			}
+			if (rb_is_black(w->rb_right)) {
+				w->rb_left->rb_color = RB_BLACK;
+				w->rb_color = RB_RED;
+				__rb_rotate_right(w, root, augment);
+				w = parent->rb_right;
+			}
+			w->rb_color = parent->rb_color;
+			parent->rb_color = RB_BLACK;
+			w->rb_right->rb_color = RB_BLACK;
+			__rb_rotate_left(parent, root, augment);
+			x = root->rb_node;
+			break;
+		} else {
+			w = parent->rb_left;
+			if (rb_is_red(w)) {
+				w->rb_color = RB_BLACK;
+				parent->rb_color = RB_RED;
+				__rb_rotate_right(parent, root, augment);
+				w = parent->rb_left;
+			}
+			if (rb_is_black(w->rb_left) && rb_is_black(w->rb_right)) {
+				w->rb_color = RB_RED;
+				x = parent;
+				parent = x->rb_parent;
+				continue;
+			}
+			if (rb_is_black(w->rb_left)) {
+				w->rb_right->rb_color = RB_BLACK;
+				w->rb_color = RB_RED;
+				__rb_rotate_left(w, root, augment);
+				w = parent->rb_left;
+			}
+			w->rb_color = parent->rb_color;
+			parent->rb_color = RB_BLACK;
+			w->rb_left->rb_color = RB_BLACK;
+			__rb_rotate_right(parent, root, augment);
+			x = root->rb_node;
+			break;
+		}
+	}
+	if (x)
+		x->rb_color = RB_BLACK;
+}
+
+void rb_erase(struct rb_node *node, struct rb_root *root, rb_augment_f augment)
+{
+	struct rb_node *y, *x, *x_parent;
+	int removed_color;
+
+	/* y is the node that actually leaves its spot in the tree: either node, or
+	 * node's successor, which has no left child. */
+	if (!node->rb_left || !node->rb_right) {
+		y = node;
+	} else {
+		for (y = node->rb_right; y->rb_left; y = y->rb_left)
+			;
+	}
+	x = y->rb_left ? y->rb_left : y->rb_right;
+	x_parent = y->rb_parent;
+	removed_color = y->rb_color;
+	if (x)
+		x->rb_parent = x_parent;
+	__rb_change_child(root, x_parent, y, x);
+	if (y != node) {
+		/* The successor takes node's place, color and all */
+		if (x_parent == node)
+			x_parent = y;
+		y->rb_left = node->rb_left;
+		y->rb_right = node->rb_right;
+		y->rb_color = node->rb_color;
+		y->rb_parent = node->rb_parent;
+		if (y->rb_left)
+			y->rb_left->rb_parent = y;
+		if (y->rb_right)
+			y->rb_right->rb_parent = y;
+		__rb_change_child(root, node->rb_parent, node, y);
+	}
+	rb_augment_path(x_parent, augment);
+	if (removed_color == RB_BLACK)
+		__rb_erase_fixup(root, x, x_parent, augment);
+}
+
+struct rb_node *rb_first(struct rb_root *root)
+{
+	struct rb_node *node = root->rb_node;
+
+	if (!node)
+		return 0;
+	while (node->rb_left)
+		node = node->rb_left;
+	return node;
+}
+
+struct rb_node *rb_last(struct rb_root *root)
+{
+	struct rb_node *node = root->rb_node;
+
+	if (!node)
+		return 0;
+	while (node->rb_right)
+		node = node->rb_right;
+	return node;
+}
+
+struct rb_node *rb_next(struct rb_node *node)
+{
+	struct rb_node *parent;
+
+	if (node->rb_right) {
+		node = node->rb_right;
+		while (node->rb_left)
+			node = node->rb_left;
+		return node;
+	}
+	while ((parent = node->rb_parent) && (node == parent->rb_right))
+		node = parent;
+	return parent;
+}
+
+struct rb_node *rb_prev(struct rb_node *node)
+{
+	struct rb_node *parent;
+
+	if (node->rb_left) {
+		node = node->rb_left;
+		while (node->rb_right)
+			node = node->rb_right;
+		return node;
+	}
+	while ((parent = node->rb_parent) && (node == parent->rb_left))
+		node = parent;
+	return parent;
+}
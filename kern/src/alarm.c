@@ -7,11 +7,27 @@
  * systems, you won't wake up til after the time you specify. (for now, this
  * might change).
  *
+ * Each tchain is a hierarchical timing wheel, indexed by TSC time.  A waiter is
+ * filed in the lowest level whose window (the range covered by one slot of the
+ * next level up) contains both the wheel's clk and the waiter's time, in the
+ * slot for its time.  So every waiter in level n goes off before every waiter
+ * in level n + 1, and within a level, slots are in time order.  Inserting and
+ * removing are O(1).  When the wheel's clk advances, the slots it passed over
+ * get refiled: waiters that are due fire, and the rest move down a level.
+ *
+ * The wheel is only an index; waiters still fire based on their exact
+ * wake_up_time.  To pick the next interrupt time, we look in the first busy
+ * slot for the earliest hard deadline (wake_up_time + slack), capped at the
+ * start of the next busy slot.  Waiters with slack can then share an interrupt
+ * with whatever else is due around then.
+ *
+ * Removing a waiter doesn't recompute the interrupt time, which would cost more
+ * than O(1).  Worst case, we take an interrupt for nothing and then sort it
+ * out.
+ *
  * TODO:
  * 	- have a kernel sense of time, instead of just the TSC or whatever timer the
- * 	chain uses...
- * 	- coalesce or otherwise deal with alarms that are close to cut down on
- * 	interrupt overhead. */
+ * 	chain uses... */
 
 #include <ros/common.h>
 #include <sys/queue.h>
@@ -21,19 +37,151 @@
 #include <smp.h>
 #include <kmalloc.h>
 
-/* Helper, resets the earliest/latest times, based on the elements of the list.
- * If the list is empty, we set the times to be the 12345 poison time.  Since
- * the list is empty, the alarm shouldn't be going off. */
+/* Marks waiters that are due and about to fire, in __trigger_tchain() */
+#define TCHAIN_WHEEL_EXPIRED 0xff
+
+static unsigned int wheel_shift(int lvl)
+{
+	return TCHAIN_WHEEL_SHIFT + lvl * TCHAIN_WHEEL_BITS;
+}
+
+/* Start of the window of wheel_shift(lvl) bits that holds time */
+static uint64_t wheel_window(uint64_t time, int lvl)
+{
+	return time & ~((1ULL << wheel_shift(lvl)) - 1);
+}
+
+/* Adds waiter to the wheel, relative to the wheel's clk. */
+static void __wheel_file(struct timer_chain *tchain,
+                         struct alarm_waiter *waiter)
+{
+	uint64_t key = MAX(waiter->wake_up_time, tchain->clk);
+	int lvl, slot;
+
+	for (lvl = 0; lvl < TCHAIN_WHEEL_LEVELS - 1; lvl++) {
+		if (wheel_window(key, lvl + 1) == wheel_window(tchain->clk, lvl + 1))
+			break;
+	}
+	/* Beyond the top level; park it in the last slot */
+	if (wheel_window(key, lvl + 1) != wheel_window(tchain->clk, lvl + 1))
+		key = wheel_window(tchain->clk, lvl + 1) +
+		      (1ULL << wheel_shift(lvl + 1)) - 1;
+	slot = (key >> wheel_shift(lvl)) & (TCHAIN_WHEEL_SLOTS - 1);
+	waiter->wheel_lvl = lvl;
+	waiter->wheel_slot = slot;
+	BSD_LIST_INSERT_HEAD(&tchain->wheel->slots[lvl][slot], waiter, next);
+	tchain->wheel->pending[lvl] |= 1ULL << slot;
+}
+
+static void __wheel_unfile(struct timer_chain *tchain,
+                           struct alarm_waiter *waiter)
+{
+	int lvl = waiter->wheel_lvl;
+	int slot = waiter->wheel_slot;
+
+	BSD_LIST_REMOVE(waiter, next);
+	if (lvl == TCHAIN_WHEEL_EXPIRED)
+		return;
+	if (BSD_LIST_EMPTY(&tchain->wheel->slots[lvl][slot]))
+		tchain->wheel->pending[lvl] &= ~(1ULL << slot);
+}
+
+/* Moves the wheel's clk up to now, putting any waiters that are due on
+ * expired, and refiling the others from the slots we passed. */
+static void __wheel_advance(struct timer_chain *tchain, uint64_t now,
+                            struct awaiters_list *expired)
+{
+	struct awaiters_list passed = BSD_LIST_HEAD_INITIALIZER(passed);
+	struct awaiters_list *list;
+	struct alarm_waiter *i;
+	uint64_t old = tchain->clk;
+	uint64_t mask;
+	int first, last, slot;
+
+	if (now < old)
+		now = old;
+	for (int lvl = 0; lvl < TCHAIN_WHEEL_LEVELS; lvl++) {
+		if (!tchain->wheel->pending[lvl])
+			continue;
+		if (wheel_window(old, lvl + 1) == wheel_window(now, lvl + 1)) {
+			first = (old >> wheel_shift(lvl)) & (TCHAIN_WHEEL_SLOTS - 1);
+			last = (now >> wheel_shift(lvl)) & (TCHAIN_WHEEL_SLOTS - 1);
+			mask = (~0ULL >> (63 - last)) & (~0ULL << first);
+		} else {
+			mask = ~0ULL;
+		}
+		mask &= tchain->wheel->pending[lvl];
+		tchain->wheel->pending[lvl] &= ~mask;
+		while (mask) {
+			slot = __builtin_ctzll(mask);
+			mask &= mask - 1;
+			list = &tchain->wheel->slots[lvl][slot];
+			while ((i = BSD_LIST_FIRST(list))) {
+				BSD_LIST_REMOVE(i, next);
+				BSD_LIST_INSERT_HEAD(&passed, i, next);
+			}
+		}
+	}
+	tchain->clk = now;
+	while ((i = BSD_LIST_FIRST(&passed))) {
+		BSD_LIST_REMOVE(i, next);
+		if (i->wake_up_time <= now) {
+			i->wheel_lvl = TCHAIN_WHEEL_EXPIRED;
+			BSD_LIST_INSERT_HEAD(expired, i, next);
+		} else {
+			__wheel_file(tchain, i);
+		}
+	}
+}
+
+static uint64_t awaiter_deadline(struct alarm_waiter *waiter)
+{
+	uint64_t deadline = waiter->wake_up_time + waiter->slack;
+
+	return deadline < waiter->wake_up_time ? (uint64_t)-1 : deadline;
+}
+
+/* Helper, resets the earliest time, based on the waiters in the wheel.  If the
+ * wheel is empty, we set the time to be the 12345 poison time.  Since the wheel
+ * is empty, the alarm shouldn't be going off. */
 static void reset_tchain_times(struct timer_chain *tchain)
 {
-	if (TAILQ_EMPTY(&tchain->waiters)) {
+	struct alarm_waiter *i;
+	uint64_t deadline = (uint64_t)-1;
+	uint64_t pending;
+	int lvl, slot;
+
+	if (!tchain->nr_waiters) {
 		tchain->earliest_time = ALARM_POISON_TIME;
-		tchain->latest_time = ALARM_POISON_TIME;
-	} else {
-		tchain->earliest_time = TAILQ_FIRST(&tchain->waiters)->wake_up_time;
-		tchain->latest_time =
-		        TAILQ_LAST(&tchain->waiters, awaiters_tailq)->wake_up_time;
+		return;
+	}
+	for (lvl = 0; lvl < TCHAIN_WHEEL_LEVELS; lvl++) {
+		if (tchain->wheel->pending[lvl])
+			break;
+	}
+	if (lvl == TCHAIN_WHEEL_LEVELS) {
+		/* Only waiters that are about to fire, from __trigger_tchain() */
+		tchain->earliest_time = tchain->clk;
+		return;
+	}
+	slot = __builtin_ctzll(tchain->wheel->pending[lvl]);
+	BSD_LIST_FOREACH(i, &tchain->wheel->slots[lvl][slot], next)
+		deadline = MIN(deadline, awaiter_deadline(i));
+	/* Everyone in later slots goes off no earlier than their slot's start */
+	pending = tchain->wheel->pending[lvl] & ~((2ULL << slot) - 1);
+	if (!pending) {
+		for (lvl++; lvl < TCHAIN_WHEEL_LEVELS; lvl++) {
+			pending = tchain->wheel->pending[lvl];
+			if (pending)
+				break;
+		}
+	}
+	if (pending) {
+		slot = __builtin_ctzll(pending);
+		deadline = MIN(deadline, wheel_window(tchain->clk, lvl + 1) +
+		                         ((uint64_t)slot << wheel_shift(lvl)));
 	}
+	tchain->earliest_time = deadline;
 }
 
 /* One time set up of a tchain, currently called in per_cpu_init() */
@@ -41,7 +189,11 @@ void init_timer_chain(struct timer_chain *tchain,
                       void (*set_interrupt)(struct timer_chain *))
 {
 	spinlock_init_irqsave(&tchain->lock);
-	TAILQ_INIT(&tchain->waiters);
+	tchain->wheel = kzmalloc(sizeof(struct tchain_wheel), MEM_WAIT);
+	tchain->clk = read_tsc();
+	tchain->nr_waiters = 0;
+	tchain->nr_triggers = 0;
+	tchain->nr_fired = 0;
 	tchain->set_interrupt = set_interrupt;
 	reset_tchain_times(tchain);
 }
@@ -51,6 +203,7 @@ void init_timer_chain(struct timer_chain *tchain,
 static void __init_awaiter(struct alarm_waiter *waiter)
 {
 	waiter->wake_up_time = ALARM_POISON_TIME;
+	waiter->slack = 0;
 	waiter->on_tchain = FALSE;
 	waiter->holds_tchain_lock = FALSE;
 	if (!waiter->has_func)
@@ -105,12 +258,17 @@ void set_awaiter_inc(struct alarm_waiter *waiter, uint64_t usleep)
 	waiter->wake_up_time += usec2tsc(usleep);
 }
 
+void set_awaiter_slack(struct alarm_waiter *waiter, uint64_t usec)
+{
+	waiter->slack = usec2tsc(usec);
+}
+
 /* Helper, makes sure the interrupt is turned on at the right time.  Most of the
  * heavy lifting is in the timer-source specific function pointer. */
 static void reset_tchain_interrupt(struct timer_chain *tchain)
 {
 	assert(!irq_is_enabled());
-	if (TAILQ_EMPTY(&tchain->waiters)) {
+	if (!tchain->nr_waiters) {
 		/* Turn it off */
 		printd("Turning alarm off\n");
 		tchain->set_interrupt(tchain);
@@ -152,35 +310,32 @@ static void wake_awaiter(struct alarm_waiter *waiter,
  * everyone whose time is up.  Called from IRQ context. */
 void __trigger_tchain(struct timer_chain *tchain, struct hw_trapframe *hw_tf)
 {
-	struct alarm_waiter *i, *temp;
-	uint64_t now = read_tsc();
-	bool changed_list = FALSE;
+	struct awaiters_list expired = BSD_LIST_HEAD_INITIALIZER(expired);
+	struct alarm_waiter *i;
 	/* why do we disable irqs here?  the lock is irqsave, but we (think we) know
 	 * the timer IRQ for this tchain won't fire again.  disabling irqs is nice
 	 * for the lock debugger.  i don't want to disable the debugger completely,
 	 * and we can't make the debugger ignore irq context code either in the
 	 * general case.  it might be nice for handlers to have IRQs disabled too.*/
 	spin_lock_irqsave(&tchain->lock);
-	TAILQ_FOREACH_SAFE(i, &tchain->waiters, next, temp) {
-		printd("Trying to wake up %p who is due at %llu and now is %llu\n",
-		       i, i->wake_up_time, now);
-		/* TODO: Could also do something in cases where we're close to now */
-		if (i->wake_up_time <= now) {
-			changed_list = TRUE;
-			i->on_tchain = FALSE;
-			TAILQ_REMOVE(&tchain->waiters, i, next);
-			cmb();	/* enforce waking after removal */
-			/* Don't touch the waiter after waking it, since it could be in use
-			 * on another core (and the waiter can be clobbered as the kthread
-			 * unwinds its stack).  Or it could be kfreed */
-			wake_awaiter(i, hw_tf);
-		} else {
-			break;
-		}
-	}
-	if (changed_list) {
-		reset_tchain_times(tchain);
+	tchain->nr_triggers++;
+	__wheel_advance(tchain, read_tsc(), &expired);
+	/* Handlers can set and unset alarms, including those still on expired.
+	 * Those stay on_tchain until we pull them off, and __remove_awaiter() knows
+	 * how to handle them. */
+	while ((i = BSD_LIST_FIRST(&expired))) {
+		printd("Waking up %p who is due at %llu\n", i, i->wake_up_time);
+		BSD_LIST_REMOVE(i, next);
+		tchain->nr_waiters--;
+		tchain->nr_fired++;
+		i->on_tchain = FALSE;
+		cmb();	/* enforce waking after removal */
+		/* Don't touch the waiter after waking it, since it could be in use
+		 * on another core (and the waiter can be clobbered as the kthread
+		 * unwinds its stack).  Or it could be kfreed */
+		wake_awaiter(i, hw_tf);
 	}
+	reset_tchain_times(tchain);
 	/* Need to reset the interrupt no matter what */
 	reset_tchain_interrupt(tchain);
 	spin_unlock_irqsave(&tchain->lock);
@@ -191,45 +346,23 @@ void __trigger_tchain(struct timer_chain *tchain, struct hw_trapframe *hw_tf)
 static bool __insert_awaiter(struct timer_chain *tchain,
                              struct alarm_waiter *waiter)
 {
-	struct alarm_waiter *i, *temp;
+	uint64_t deadline = awaiter_deadline(waiter);
+
 	/* This will fail if you don't set a time */
 	assert(waiter->wake_up_time != ALARM_POISON_TIME);
 	assert(!waiter->on_tchain);
 	waiter->on_tchain = TRUE;
-	/* Either the list is empty, or not. */
-	if (TAILQ_EMPTY(&tchain->waiters)) {
-		tchain->earliest_time = waiter->wake_up_time;
-		tchain->latest_time = waiter->wake_up_time;
-		TAILQ_INSERT_HEAD(&tchain->waiters, waiter, next);
-		/* Need to turn on the timer interrupt later */
-		return TRUE;
-	}
-	/* If not, either we're first, last, or in the middle.  Reset the interrupt
-	 * and adjust the tchain's times accordingly. */
-	if (waiter->wake_up_time < tchain->earliest_time) {
-		tchain->earliest_time = waiter->wake_up_time;
-		TAILQ_INSERT_HEAD(&tchain->waiters, waiter, next);
-		/* Changed the first entry; we'll need to reset the interrupt later */
+	/* An empty wheel's clk could be way behind; catch it up, so new waiters
+	 * land in the low levels. */
+	if (!tchain->nr_waiters)
+		tchain->clk = MAX(tchain->clk, read_tsc());
+	__wheel_file(tchain, waiter);
+	if (!tchain->nr_waiters++ || (deadline < tchain->earliest_time)) {
+		tchain->earliest_time = deadline;
+		/* Need to turn on or move up the timer interrupt later */
 		return TRUE;
 	}
-	/* If there is a tie for last, the newer one will really go last.  We need
-	 * to handle equality here since the loop later won't catch it. */
-	if (waiter->wake_up_time >= tchain->latest_time) {
-		tchain->latest_time = waiter->wake_up_time;
-		/* Proactively put it at the end if we know we're last */
-		TAILQ_INSERT_TAIL(&tchain->waiters, waiter, next);
-		return FALSE;
-	}
-	/* Insert before the first one you are earlier than.  This won't scale well
-	 * (TODO) if we have a lot of inserts.  The proactive insert_tail up above
-	 * will help a bit. */
-	TAILQ_FOREACH_SAFE(i, &tchain->waiters, next, temp) {
-		if (waiter->wake_up_time < i->wake_up_time) {
-			TAILQ_INSERT_BEFORE(i, waiter, next);
-			return FALSE;
-		}
-	}
-	panic("Could not find a spot for awaiter %p\n", waiter);
+	return FALSE;
 }
 
 static void __set_alarm(struct timer_chain *tchain, struct alarm_waiter *waiter)
@@ -253,26 +386,19 @@ void set_alarm(struct timer_chain *tchain, struct alarm_waiter *waiter)
 
 /* Helper, rips the waiter from the tchain, knowing that it is on the list.
  * Returns TRUE if the tchain interrupt needs to be reset.  Callers hold the
- * lock. */
+ * lock.
+ *
+ * We only reset the interrupt when the tchain is empty.  O/w, we leave it, and
+ * if it goes off early, __trigger_tchain() will sort it out. */
 static bool __remove_awaiter(struct timer_chain *tchain,
                              struct alarm_waiter *waiter)
 {
-	struct alarm_waiter *temp;
-	bool reset_int = FALSE;		/* whether or not to reset the interrupt */
-	/* Need to make sure earliest and latest are set, in case we're mucking with
-	 * the first and/or last element of the chain. */
-	if (TAILQ_FIRST(&tchain->waiters) == waiter) {
-		temp = TAILQ_NEXT(waiter, next);
-		tchain->earliest_time = (temp) ? temp->wake_up_time : ALARM_POISON_TIME;
-		reset_int = TRUE;		/* we'll need to reset the timer later */
-	}
-	if (TAILQ_LAST(&tchain->waiters, awaiters_tailq) == waiter) {
-		temp = TAILQ_PREV(waiter, awaiters_tailq, next);
-		tchain->latest_time = (temp) ? temp->wake_up_time : ALARM_POISON_TIME;
-	}
-	TAILQ_REMOVE(&tchain->waiters, waiter, next);
+	__wheel_unfile(tchain, waiter);
 	waiter->on_tchain = FALSE;
-	return reset_int;
+	if (--tchain->nr_waiters)
+		return FALSE;
+	reset_tchain_times(tchain);
+	return TRUE;
 }
 
 /* Removes waiter from the tchain before it goes off.  Returns TRUE if we
@@ -402,7 +528,7 @@ void set_pcpu_alarm_interrupt(struct timer_chain *tchain)
 		send_ipi(rem_pcpui - &per_cpu_info[0], IdtLAPIC_TIMER);
 		return;
 	}
-	time = TAILQ_EMPTY(&tchain->waiters) ? 0 : tchain->earliest_time;
+	time = tchain->nr_waiters ? tchain->earliest_time : 0;
 	if (time) {
 		/* Arm the alarm.  For times in the past, we just need to make sure it
 		 * goes off. */
@@ -423,32 +549,39 @@ void set_pcpu_alarm_interrupt(struct timer_chain *tchain)
 
 /* Debug helpers */
 
+static void print_awaiter(struct alarm_waiter *i)
+{
+	if (i->has_func) {
+		uintptr_t f;
+		if (i->irq_ok)
+			f = (uintptr_t)i->func_irq;
+		else
+			f = (uintptr_t)i->func;
+		char *f_name = get_fn_name(f);
+		printk("\tWaiter %p, time %llu, func %p (%s)\n", i,
+		       i->wake_up_time, f, f_name);
+		kfree(f_name);
+		return;
+	}
+	struct kthread *kthread = TAILQ_FIRST(&i->sem.waiters);
+	printk("\tWaiter %p, time: %llu, kthread: %p (%p) %s\n", i,
+	       i->wake_up_time, kthread, (kthread ? kthread->proc : 0),
+	       (kthread ? kthread->name : 0));
+}
+
 void print_chain(struct timer_chain *tchain)
 {
 	struct alarm_waiter *i;
 	spin_lock_irqsave(&tchain->lock);
-	printk("Chain %p is%s empty, early: %llu latest: %llu\n", tchain,
-	       TAILQ_EMPTY(&tchain->waiters) ? "" : " not",
-	       tchain->earliest_time,
-	       tchain->latest_time);
-	TAILQ_FOREACH(i, &tchain->waiters, next) {
-		if (i->has_func) {
-			uintptr_t f;
-			if (i->irq_ok)
-				f = (uintptr_t)i->func_irq;
-			else
-				f = (uintptr_t)i->func;
-			char *f_name = get_fn_name(f);
-			printk("\tWaiter %p, time %llu, func %p (%s)\n", i,
-			       i->wake_up_time, f, f_name);
-			kfree(f_name);
-			continue;
+	printk("Chain %p has %u waiters, clk: %llu next IRQ: %llu\n", tchain,
+	       tchain->nr_waiters, tchain->clk, tchain->earliest_time);
+	printk("\t%lu triggers, %lu alarms fired\n", tchain->nr_triggers,
+	       tchain->nr_fired);
+	for (int lvl = 0; lvl < TCHAIN_WHEEL_LEVELS; lvl++) {
+		for (int slot = 0; slot < TCHAIN_WHEEL_SLOTS; slot++) {
+			BSD_LIST_FOREACH(i, &tchain->wheel->slots[lvl][slot], next)
+				print_awaiter(i);
 		}
-		struct kthread *kthread = TAILQ_FIRST(&i->sem.waiters);
-		printk("\tWaiter %p, time: %llu, kthread: %p (%p) %s\n", i,
-		       i->wake_up_time, kthread, (kthread ? kthread->proc : 0),
-		       (kthread ? kthread->name : 0));
-
 	}
 	spin_unlock_irqsave(&tchain->lock);
 }
@@ -1,124 +1,231 @@
-/* See COPYRIGHT for copyright information. */
+/* See COPYRIGHT for copyright information.
+ *
+ * Asynchronous remote syscalls (ARSC).  A process that calls sys_init_arsc()
+ * gets its procdata's arsc_ring polled by the kernel: syscalls it puts on the
+ * ring get run without the process trapping.  See ros/ring_syscall.h for the
+ * ring itself.
+ *
+ * Polling happens in two places.  With CONFIG_ARSC_SERVER, the ksched gives us
+ * a core at boot, which runs arsc_server() as a self-perpetuating RKM.  Each
+ * run handles a batch from one process, then resends itself, so other RKMs
+ * (like kthread restarts) still get to run on that core.  Additionally, idle
+ * cores check the rings before halting (arsc_idle_poll()).
+ *
+ * Pollers run syscalls from an RKM, switched into the process's address space,
+ * just like a syscall batch.  If a syscall blocks, the poller's kthread is
+ * marked with KTH_ARSC_POLLER, and sem_down() calls arsc_poller_blocked(),
+ * which starts a new poller.  The blocked kthread stops polling once it
+ * finishes its syscall.
+ *
+ * Claiming a slot is done under the per-proc arsc_lock, so multiple pollers
+ * can work on the same ring.  Our copy of the consumer index, p->arsc_cons, is
+ * the one we trust; the ring's sq_cons is just published for userspace. */
 
 #include <ros/common.h>
 #include <ros/ring_syscall.h>
 #include <arch/types.h>
 #include <arch/arch.h>
-#include <arch/mmu.h>
 #include <error.h>
 
 #include <syscall.h>
 #include <kmalloc.h>
 #include <pmap.h>
 #include <stdio.h>
-#include <hashtable.h>
 #include <smp.h>
+#include <kthread.h>
 #include <arsc_server.h>
-#include <kref.h>
-
-
 
 struct proc_list arsc_proc_list = TAILQ_HEAD_INITIALIZER(arsc_proc_list);
 spinlock_t arsc_proc_lock = SPINLOCK_INITIALIZER_IRQSAVE;
+/* The core running arsc_server(), if any */
+static int arsc_core = -1;
 
-intreg_t inline syscall_async(struct proc *p, syscall_req_t *call)
+/* Registers p with the pollers.  The ring is already mapped; it's in procdata.
+ * The list holds a ref, which is dropped by arsc_proc_unregister() when p is
+ * destroyed. */
+intreg_t sys_init_arsc(struct proc *p)
 {
-	struct syscall* sc = call->sc;
-	return syscall(p, sc->num, sc->arg0, sc->arg1,
-	               sc->arg2, sc->arg3, sc->arg4, sc->arg5);
+#ifndef CONFIG_ARSC_SERVER
+	set_errno(ENOSYS);
+	return -1;
+#endif
+	spin_lock_irqsave(&arsc_proc_lock);
+	/* proc_destroy() sets DYING before it unregisters, so if we see it alive,
+	 * our registration will get cleaned up. */
+	if (p->state == PROC_DYING) {
+		spin_unlock_irqsave(&arsc_proc_lock);
+		set_errno(ESRCH);
+		return -1;
+	}
+	if (!p->arsc_on) {
+		proc_incref(p, 1);
+		p->arsc_cons = ACCESS_ONCE(p->procdata->arsc_ring.sq_cons);
+		p->arsc_on = TRUE;
+		TAILQ_INSERT_TAIL(&arsc_proc_list, p, proc_arsc_link);
+	}
+	spin_unlock_irqsave(&arsc_proc_lock);
+	return 0;
 }
 
-syscall_sring_t* sys_init_arsc(struct proc *p)
+void arsc_proc_unregister(struct proc *p)
 {
-	kref_get(&p->p_kref, 1);		/* we're storing an external ref here */
-	syscall_sring_t* sring;
-	void * va;
-	// TODO: need to pin this page in the future when swapping happens
-	va = do_mmap(p,MMAP_LOWEST_VA, SYSCALLRINGSIZE, PROT_READ | PROT_WRITE,
-	             MAP_ANONYMOUS | MAP_POPULATE, NULL, 0);
-	pte_t pte = pgdir_walk(p->env_pgdir, (void*)va, 0);
-	assert(pte_walk_okay(pte));
-	sring = (syscall_sring_t*) KADDR(pte_get_paddr(pte));
-	/*make sure we are able to allocate the shared ring */
-	assert(sring != NULL);
- 	p->procdata->syscallring = sring;
-	/* Initialize the generic syscall ring buffer */
-	SHARED_RING_INIT(sring);
-
-	BACK_RING_INIT(&p->syscallbackring,
-	               sring,
-	               SYSCALLRINGSIZE);
+	bool was_on;
 
 	spin_lock_irqsave(&arsc_proc_lock);
-	TAILQ_INSERT_TAIL(&arsc_proc_list, p, proc_arsc_link);
+	was_on = p->arsc_on;
+	if (was_on) {
+		TAILQ_REMOVE(&arsc_proc_list, p, proc_arsc_link);
+		p->arsc_on = FALSE;
+	}
 	spin_unlock_irqsave(&arsc_proc_lock);
-	return (syscall_sring_t*)va;
+	if (was_on)
+		proc_decref(p);
 }
 
-void arsc_server(uint32_t srcid, long a0, long a1, long a2)
+/* Whether p's next slot has a syscall in it.  A reserved slot that userspace
+ * hasn't written yet is still 0, and doesn't count. */
+static bool arsc_has_work(struct proc *p)
+{
+	struct sysc_ring *ring = &p->procdata->arsc_ring;
+	uint32_t cons = ACCESS_ONCE(p->arsc_cons);
+
+	if (cons == ACCESS_ONCE(ring->sq_prod))
+		return FALSE;
+	rmb();	/* read the slot after reading prod */
+	return ACCESS_ONCE(ring->sq[cons & (SYSC_RING_SZ - 1)]) != 0;
+}
+
+/* Returns a proc with work, with a ref, or 0.  Procs we pick go to the back of
+ * the list, so everyone gets a turn. */
+static struct proc *arsc_next_proc(void)
 {
-	struct proc *p = NULL;
-	TAILQ_INIT(&arsc_proc_list);
-	while (1) {
-		while (TAILQ_EMPTY(&arsc_proc_list))
-			cpu_relax();
-		
-		TAILQ_FOREACH(p, &arsc_proc_list, proc_arsc_link) {
-			/* Probably want to try to process a dying process's syscalls.  If
-			 * not, just move it to an else case */
-			process_generic_syscalls (p, MAX_ASRC_BATCH); 
-			if (p->state == PROC_DYING) {
-				TAILQ_REMOVE(&arsc_proc_list, p, proc_arsc_link);
-				proc_decref(p);
-				/* Need to break out, so the TAILQ_FOREACH doesn't flip out.
-				 * It's not fair, but we're not dealing with that yet anyway */
-				break;
-			}
+	struct proc *p;
+
+	spin_lock_irqsave(&arsc_proc_lock);
+	TAILQ_FOREACH(p, &arsc_proc_list, proc_arsc_link) {
+		if (arsc_has_work(p)) {
+			TAILQ_REMOVE(&arsc_proc_list, p, proc_arsc_link);
+			TAILQ_INSERT_TAIL(&arsc_proc_list, p, proc_arsc_link);
+			proc_incref(p, 1);
+			spin_unlock_irqsave(&arsc_proc_lock);
+			return p;
 		}
 	}
+	spin_unlock_irqsave(&arsc_proc_lock);
+	return 0;
 }
 
-static intreg_t process_generic_syscalls(struct proc *p, size_t max)
+/* Takes the next syscall off p's ring, if there is one.  We zero the slot
+ * before publishing sq_cons, so userspace never sees a free slot that we might
+ * still read. */
+static struct syscall *arsc_claim(struct proc *p)
 {
-	size_t count = 0;
-	syscall_back_ring_t* sysbr = &p->syscallbackring;
-	struct per_cpu_info* pcpui = &per_cpu_info[core_id()];
+	struct sysc_ring *ring = &p->procdata->arsc_ring;
+	struct syscall **slot;
+	struct syscall *sysc = 0;
+
+	spin_lock(&p->arsc_lock);
+	if (p->arsc_cons != ACCESS_ONCE(ring->sq_prod)) {
+		rmb();	/* read the slot after reading prod */
+		slot = &ring->sq[p->arsc_cons & (SYSC_RING_SZ - 1)];
+		sysc = ACCESS_ONCE(*slot);
+		if (sysc) {
+			*slot = 0;
+			p->arsc_cons++;
+			wmb();	/* zero the slot before freeing it */
+			ring->sq_cons = p->arsc_cons;
+		}
+	}
+	spin_unlock(&p->arsc_lock);
+	return sysc;
+}
+
+/* Runs up to max syscalls from p's ring.  Stops early if a syscall blocked,
+ * since by the time we get back, someone else is polling. */
+static void arsc_drain(struct proc *p, unsigned int max)
+{
+	struct kthread *kth = per_cpu_info[core_id()].cur_kthread;
+	struct syscall *sysc;
 	uintptr_t old_proc;
-	// looking at a process not initialized to perform arsc. 
-	if (sysbr == NULL) 
-		return count;
-	/* Bail out if there is nothing to do */
-	if (!RING_HAS_UNCONSUMED_REQUESTS(sysbr))
-		return 0;
-	/* Switch to the address space of the process, so we can handle their
-	 * pointers, etc. */
+
 	old_proc = switch_to(p);
-	// max is the most we'll process.  max = 0 means do as many as possible
-	// TODO: check for initialization of the ring. 
-	while (RING_HAS_UNCONSUMED_REQUESTS(sysbr) && ((!max)||(count < max)) ) {
-		// ASSUME: one queue per process
-		count++;
-		//printk("DEBUG PRE: sring->req_prod: %d, sring->rsp_prod: %d\n",
-		//	   sysbr->sring->req_prod, sysbr->sring->rsp_prod);
-		// might want to think about 0-ing this out, if we aren't
-		// going to explicitly fill in all fields
-		syscall_rsp_t rsp;
-		// this assumes we get our answer immediately for the syscall.
-		syscall_req_t* req = RING_GET_REQUEST(sysbr, ++sysbr->req_cons);
-		
-		pcpui->cur_kthread->sysc = req->sc;
-		run_local_syscall(req->sc); // TODO: blocking call will block arcs as well.
-		
-		// need to keep the slot in the ring buffer if it is blocked
-		(sysbr->rsp_prod_pvt)++;
-		req->status = RES_ready;
-		RING_PUSH_RESPONSES(sysbr);
-
-		//printk("DEBUG POST: sring->req_prod: %d, sring->rsp_prod: %d\n",
-		//	   sysbr->sring->req_prod, sysbr->sring->rsp_prod);
+	for (int i = 0; i < max; i++) {
+		if (p->state == PROC_DYING)
+			break;
+		sysc = arsc_claim(p);
+		if (!sysc)
+			break;
+		run_arsc_syscall(sysc);
+		/* We could be on another core, but we're the same kthread */
+		if (!(kth->flags & KTH_ARSC_POLLER))
+			break;
 	}
-	/* switch back to whatever context we were in before */
 	switch_back(p, old_proc);
-	return (intreg_t)count;
 }
 
+/* Runs a batch from the next proc with work.  Returns FALSE if we blocked, in
+ * which case we are no longer a poller. */
+static bool arsc_poll_once(void)
+{
+	struct kthread *kth = per_cpu_info[core_id()].cur_kthread;
+	struct proc *p;
+
+	p = arsc_next_proc();
+	if (!p)
+		return TRUE;
+	kth->flags |= KTH_ARSC_POLLER;
+	arsc_drain(p, MAX_ASRC_BATCH);
+	proc_decref(p);
+	if (!(kth->flags & KTH_ARSC_POLLER))
+		return FALSE;
+	kth->flags &= ~KTH_ARSC_POLLER;
+	return TRUE;
+}
+
+/* The dedicated poller.  Never halts; it just keeps resending itself. */
+void arsc_server(uint32_t srcid, long a0, long a1, long a2)
+{
+	arsc_core = core_id();
+	if (!arsc_poll_once())
+		return;		/* a new arsc_server took over when we blocked */
+	send_kernel_message(core_id(), arsc_server, 0, 0, 0, KMSG_ROUTINE);
+}
+
+static void __arsc_idle_poll(uint32_t srcid, long a0, long a1, long a2)
+{
+	arsc_poll_once();
+}
+
+/* Called by idle cores before halting.  If any ring has work, we send
+ * ourselves an RKM to do some of it, and return TRUE so the caller PRKMs
+ * instead of halting. */
+bool arsc_idle_poll(void)
+{
+	struct proc *p;
+	bool work = FALSE;
+
+	if (TAILQ_EMPTY(&arsc_proc_list))
+		return FALSE;
+	spin_lock_irqsave(&arsc_proc_lock);
+	TAILQ_FOREACH(p, &arsc_proc_list, proc_arsc_link) {
+		if (arsc_has_work(p)) {
+			work = TRUE;
+			break;
+		}
+	}
+	spin_unlock_irqsave(&arsc_proc_lock);
+	if (!work)
+		return FALSE;
+	send_kernel_message(core_id(), __arsc_idle_poll, 0, 0, 0, KMSG_ROUTINE);
+	return TRUE;
+}
+
+/* Called by sem_down() when kth, a poller, is about to sleep.  IRQs are off.
+ * The dedicated core needs a new poller; idle cores will just check again
+ * before they halt. */
+void arsc_poller_blocked(struct kthread *kth)
+{
+	kth->flags &= ~KTH_ARSC_POLLER;
+	if (core_id() == arsc_core)
+		send_kernel_message(core_id(), arsc_server, 0, 0, 0, KMSG_ROUTINE);
+}
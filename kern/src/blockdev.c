@@ -2,7 +2,19 @@
  * Barret Rhoden <brho@cs.berkeley.edu>
  * See LICENSE for details.
  *
- * Block devices and generic blockdev infrastructure */
+ * Block devices and generic blockdev infrastructure
+ *
+ * Requests go through a small multi-queue block layer.  Each bdev has a
+ * software queue per core.  bdev_submit_request() puts the request on the
+ * calling core's queue (or on the kthread's plug), and running a queue takes
+ * every BH from every pending request, sorts them by direction and sector, and
+ * merges device-contiguous BHs into struct blk_io's for the driver.  When the
+ * driver finishes an IO, bdev_io_done() drops each request's pending count and
+ * runs the breq callback once all of a request's BHs are done.
+ *
+ * There's no ordering between requests that are in flight at the same time:
+ * someone who needs a write to land before a read of the same block has to wait
+ * for the write to complete, just like with real hardware. */
 
 #include <devfs.h>
 #include <blockdev.h>
@@ -10,9 +22,8 @@
 #include <slab.h>
 #include <page_alloc.h>
 #include <pmap.h>
-/* These two are needed for the fake interrupt */
-#include <alarm.h>
 #include <smp.h>
+#include <sort.h>
 
 struct file_operations block_f_op;
 struct page_map_operations block_pm_op;
@@ -30,15 +41,10 @@ void block_init(void)
 	extern uint8_t _binary_mnt_ext2fs_img_size[];
 	extern uint8_t _binary_mnt_ext2fs_img_start[];
 	/* Build and init the block device */
-	struct block_device *ram_bd = kmalloc(sizeof(struct block_device), 0);
-	memset(ram_bd, 0, sizeof(struct block_device));
+	struct block_device *ram_bd;
+	ram_bd = ramdisk_create("RAMDISK", _binary_mnt_ext2fs_img_start,
+	                        (size_t)_binary_mnt_ext2fs_img_size);
 	ram_bd->b_id = 31337;
-	ram_bd->b_sector_sz = 512;
-	ram_bd->b_nr_sector = (unsigned long)_binary_mnt_ext2fs_img_size / 512;
-	kref_init(&ram_bd->b_kref, fake_release, 1);
-	pm_init(&ram_bd->b_pm, &block_pm_op, ram_bd);
-	ram_bd->b_data = _binary_mnt_ext2fs_img_start;
-	strlcpy(ram_bd->b_name, "RAMDISK", BDEV_INLINE_NAME);
 	/* Connect it to the file system */
 	struct file *ram_bf = make_device("/dev/ramdisk", S_IRUSR | S_IWUSR,
 	                                  __S_IFBLK, &block_f_op);
@@ -49,6 +55,21 @@ void block_init(void)
 	#endif /* CONFIG_EXT2FS */
 }
 
+/* Drivers call this on a new bdev, after filling in the sizes and b_op, and
+ * before submitting any requests. */
+void bdev_init(struct block_device *bdev)
+{
+	struct bdev_queue *q;
+
+	pm_init(&bdev->b_pm, &block_pm_op, bdev);
+	bdev->b_queues = kzmalloc(sizeof(struct bdev_queue) * num_cores, MEM_WAIT);
+	for (int i = 0; i < num_cores; i++) {
+		q = &bdev->b_queues[i];
+		spinlock_init_irqsave(&q->lock);
+		TAILQ_INIT(&q->reqs);
+	}
+}
+
 /* Generic helper, returns a kref'd reference out of principle. */
 struct block_device *get_bdev(char *path)
 {
@@ -79,53 +100,236 @@ void free_bhs(struct page *page)
 	page->pg_private = 0;		/* catch bugs */
 }
 
-/* This ultimately will handle the actual request processing, all the way down
- * to the driver, and will deal with blocking.  For now, we just fulfill the
- * request right away (RAM based block devs). */
+static int blk_seg_cmp(const void *a, const void *b)
+{
+	const struct blk_seg *sa = a, *sb = b;
+
+	/* Reads first, since someone is usually waiting on them */
+	if ((sa->breq->flags & BREQ_READ) != (sb->breq->flags & BREQ_READ))
+		return sa->breq->flags & BREQ_READ ? -1 : 1;
+	if (sa->bh->bh_sector != sb->bh->bh_sector)
+		return sa->bh->bh_sector < sb->bh->bh_sector ? -1 : 1;
+	/* sort() isn't stable.  Two writes of the same sector have to go out in
+	 * the order they came in, or the older data could land last. */
+	if (sa->order != sb->order)
+		return sa->order < sb->order ? -1 : 1;
+	return 0;
+}
+
+/* Can seg be tacked onto the end of io? */
+static bool blk_io_can_merge(struct blk_io *io, struct blk_seg *seg)
+{
+	return ((io->flags & BREQ_READ) == (seg->breq->flags & BREQ_READ)) &&
+	       (io->sector + io->nr_sector == seg->bh->bh_sector) &&
+	       (io->nr_sector + seg->bh->bh_nr_sector <= BDEV_MAX_IO_SECTORS);
+}
+
+static void __bdev_send_io(struct block_device *bdev, struct bdev_queue *q,
+                           struct blk_seg *segs, unsigned int nr_segs)
+{
+	struct blk_io *io;
+
+	io = kmalloc(sizeof(struct blk_io) + nr_segs * sizeof(struct blk_seg),
+	             MEM_WAIT);
+	io->flags = segs[0].breq->flags & (BREQ_READ | BREQ_WRITE);
+	io->sector = segs[0].bh->bh_sector;
+	io->nr_sector = 0;
+	for (int i = 0; i < nr_segs; i++)
+		io->nr_sector += segs[i].bh->bh_nr_sector;
+	io->core = core_id();
+	io->drv_data = 0;
+	io->nr_segs = nr_segs;
+	memcpy(io->segs, segs, nr_segs * sizeof(struct blk_seg));
+	q->nr_ios++;
+	q->nr_merged += nr_segs - 1;
+	bdev->b_op->submit_io(bdev, io);
+}
+
+/* Sorts and merges all of the BHs of the requests on reqs, and sends the
+ * resulting IOs to the driver.  The requests can't be touched after this. */
+static void __bdev_dispatch(struct block_device *bdev, struct bdev_queue *q,
+                            struct breq_tailq *reqs)
+{
+	struct block_request *breq;
+	struct blk_seg *segs;
+	struct blk_io io_hdr;
+	unsigned int nr_segs = 0, run_start;
+
+	TAILQ_FOREACH(breq, reqs, link)
+		nr_segs += breq->nr_bhs;
+	if (!nr_segs)
+		return;
+	segs = kmalloc(nr_segs * sizeof(struct blk_seg), MEM_WAIT);
+	nr_segs = 0;
+	/* Once the first IO goes out, the driver can complete and free requests,
+	 * so we're done with reqs after this loop. */
+	TAILQ_FOREACH(breq, reqs, link) {
+		for (int i = 0; i < breq->nr_bhs; i++) {
+			segs[nr_segs].bh = breq->bhs[i];
+			segs[nr_segs].breq = breq;
+			segs[nr_segs].order = nr_segs;
+			nr_segs++;
+		}
+	}
+	TAILQ_INIT(reqs);
+	sort(segs, nr_segs, sizeof(struct blk_seg), blk_seg_cmp);
+	/* io_hdr tracks the run we're building, without any segs */
+	run_start = 0;
+	io_hdr.flags = segs[0].breq->flags;
+	io_hdr.sector = segs[0].bh->bh_sector;
+	io_hdr.nr_sector = segs[0].bh->bh_nr_sector;
+	for (int i = 1; i < nr_segs; i++) {
+		if (blk_io_can_merge(&io_hdr, &segs[i])) {
+			io_hdr.nr_sector += segs[i].bh->bh_nr_sector;
+			continue;
+		}
+		__bdev_send_io(bdev, q, &segs[run_start], i - run_start);
+		run_start = i;
+		io_hdr.flags = segs[i].breq->flags;
+		io_hdr.sector = segs[i].bh->bh_sector;
+		io_hdr.nr_sector = segs[i].bh->bh_nr_sector;
+	}
+	__bdev_send_io(bdev, q, &segs[run_start], nr_segs - run_start);
+	kfree(segs);
+}
+
+/* Drains the queue and dispatches everything that was on it.  Anything that
+ * shows up while we're dispatching will get picked up by its submitter. */
+static void bdev_run_queue(struct block_device *bdev, struct bdev_queue *q)
+{
+	struct breq_tailq reqs = TAILQ_HEAD_INITIALIZER(reqs);
+
+	spin_lock_irqsave(&q->lock);
+	TAILQ_CONCAT(&reqs, &q->reqs, link);
+	q->nr_reqs = 0;
+	spin_unlock_irqsave(&q->lock);
+	__bdev_dispatch(bdev, q, &reqs);
+}
+
+/* Puts reqs on this core's queue and runs it. */
+static void bdev_queue_reqs(struct block_device *bdev, struct breq_tailq *reqs,
+                            unsigned int nr_reqs)
+{
+	struct bdev_queue *q = &bdev->b_queues[core_id()];
+
+	spin_lock_irqsave(&q->lock);
+	TAILQ_CONCAT(&q->reqs, reqs, link);
+	q->nr_reqs += nr_reqs;
+	spin_unlock_irqsave(&q->lock);
+	bdev_run_queue(bdev, q);
+}
+
+static void __bdev_empty_breq(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct block_request *breq = (struct block_request*)a0;
+
+	if (breq->callback)
+		breq->callback(breq);
+}
+
+/* Submits breq to bdev.  breq->callback runs once all of the BHs are done, in
+ * whatever context the driver completes IOs in.  Returns -1 if the request is
+ * malformed, in which case the callback will not run. */
 int bdev_submit_request(struct block_device *bdev, struct block_request *breq)
 {
-	void *src, *dst;
-	unsigned long first_sector;
-	unsigned int nr_sector;
+	struct blk_plug *plug = per_cpu_info[core_id()].cur_kthread->blk_plug;
+	struct bdev_queue *q;
+	struct breq_tailq reqs = TAILQ_HEAD_INITIALIZER(reqs);
 
+	if (!(breq->flags & (BREQ_READ | BREQ_WRITE)))
+		panic("Need a request type!\n");
 	for (int i = 0; i < breq->nr_bhs; i++) {
-		first_sector = breq->bhs[i]->bh_sector;
-		nr_sector = breq->bhs[i]->bh_nr_sector;
 		/* Sectors are indexed starting with 0, for now. */
-		if (first_sector + nr_sector > bdev->b_nr_sector) {
+		if (breq->bhs[i]->bh_sector + breq->bhs[i]->bh_nr_sector >
+		    bdev->b_nr_sector) {
 			warn("Exceeding the num sectors!");
 			return -1;
 		}
-		if (breq->flags & BREQ_READ) {
-			dst = breq->bhs[i]->bh_buffer;
-			src = bdev->b_data + (first_sector << SECTOR_SZ_LOG);
-		} else if (breq->flags & BREQ_WRITE) {
-			dst = bdev->b_data + (first_sector << SECTOR_SZ_LOG);
-			src = breq->bhs[i]->bh_buffer;
-		} else {
-			panic("Need a request type!\n");
+	}
+	breq->error = 0;
+	atomic_init(&breq->nr_pending, breq->nr_bhs);
+	q = &bdev->b_queues[core_id()];
+	q->nr_submitted++;
+	q->nr_bhs += breq->nr_bhs;
+	if (!breq->nr_bhs) {
+		/* Nothing for the driver to do, but the caller may be about to sleep
+		 * on the breq, so we can't complete it from here. */
+		send_kernel_message(core_id(), __bdev_empty_breq, (long)breq, 0, 0,
+		                    KMSG_ROUTINE);
+		return 0;
+	}
+	if (plug && (plug->bdev == bdev)) {
+		TAILQ_INSERT_TAIL(&plug->reqs, breq, link);
+		if (++plug->nr_reqs >= BDEV_PLUG_MAX) {
+			bdev_queue_reqs(bdev, &plug->reqs, plug->nr_reqs);
+			plug->nr_reqs = 0;
 		}
-		memcpy(dst, src, nr_sector << SECTOR_SZ_LOG);
+		return 0;
 	}
-	/* Faking the device interrupt with an alarm */
-	void breq_handler(struct alarm_waiter *waiter)
-	{
-		/* In the future, we'll need to figure out which breq this was in
-		 * response to */
-		struct block_request *breq = (struct block_request*)waiter->data;
-		if (breq->callback)
+	TAILQ_INSERT_TAIL(&reqs, breq, link);
+	bdev_queue_reqs(bdev, &reqs, 1);
+	return 0;
+}
+
+/* Drivers call this when they finish an IO.  This frees the IO. */
+void bdev_io_done(struct block_device *bdev, struct blk_io *io, int error)
+{
+	struct block_request *breq;
+
+	for (int i = 0; i < io->nr_segs; i++) {
+		breq = io->segs[i].breq;
+		if (error)
+			breq->error = error;
+		if (atomic_sub_and_test(&breq->nr_pending, 1) && breq->callback)
 			breq->callback(breq);
-		kfree(waiter);
 	}
-	struct timer_chain *tchain = &per_cpu_info[core_id()].tchain;
-	struct alarm_waiter *waiter = kmalloc(sizeof(struct alarm_waiter), 0);
-	init_awaiter(waiter, breq_handler);
-	/* Stitch things up, so we know how to find things later */
-	waiter->data = breq;
-	/* Set for 5ms. */
-	set_awaiter_rel(waiter, 5000);
-	set_alarm(tchain, waiter);
-	return 0;
+	kfree(io);
+}
+
+/* Holds back the calling kthread's requests for bdev until
+ * bdev_finish_plug(), or until it sleeps on a breq.  Plugs don't nest; an inner
+ * plug is a noop. */
+void bdev_start_plug(struct blk_plug *plug, struct block_device *bdev)
+{
+	struct kthread *kth = per_cpu_info[core_id()].cur_kthread;
+
+	plug->bdev = bdev;
+	TAILQ_INIT(&plug->reqs);
+	plug->nr_reqs = 0;
+	if (!kth->blk_plug)
+		kth->blk_plug = plug;
+}
+
+static void bdev_flush_plug(struct blk_plug *plug)
+{
+	if (!plug->nr_reqs)
+		return;
+	bdev_queue_reqs(plug->bdev, &plug->reqs, plug->nr_reqs);
+	plug->nr_reqs = 0;
+}
+
+void bdev_finish_plug(struct blk_plug *plug)
+{
+	struct kthread *kth = per_cpu_info[core_id()].cur_kthread;
+
+	bdev_flush_plug(plug);
+	if (kth->blk_plug == plug)
+		kth->blk_plug = 0;
+}
+
+void print_bdev_stats(struct block_device *bdev)
+{
+	struct bdev_queue *q;
+
+	printk("Bdev %s: %lu sectors of %u bytes\n", bdev->b_name,
+	       bdev->b_nr_sector, bdev->b_sector_sz);
+	for (int i = 0; i < num_cores; i++) {
+		q = &bdev->b_queues[i];
+		if (!q->nr_submitted)
+			continue;
+		printk("\tCore %3d: %lu breqs, %lu bhs, %lu ios, %lu merged\n", i,
+		       q->nr_submitted, q->nr_bhs, q->nr_ios, q->nr_merged);
+	}
 }
 
 /* Helper method, unblocks someone blocked on sleep_on_breq(). */
@@ -144,9 +348,14 @@ void generic_breq_done(struct block_request *breq)
 void sleep_on_breq(struct block_request *breq)
 {
 	int8_t irq_state = 0;
+	struct blk_plug *plug;
 	/* Since printk takes a while, this may make you lose the race */
 	printd("Sleeping on breq %p\n", breq);
 	assert(irq_is_enabled());
+	/* Our breq might be sitting in our plug */
+	plug = per_cpu_info[core_id()].cur_kthread->blk_plug;
+	if (plug)
+		bdev_flush_plug(plug);
 	sem_down_irqsave(&breq->sem, &irq_state);
 }
 
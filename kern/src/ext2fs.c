@@ -693,22 +693,20 @@ int ext2_mappage(struct page_map *pm, struct page *page)
 	return 0;
 }
 
-/* Fills page with its contents from its backing store file.  Note that we do
- * the zero padding here, instead of higher in the VFS.  Might change in the
- * future.  TODO: make this a block FS generic call. */
-int ext2_readpage(struct page_map *pm, struct page *page)
+/* Maps page's blocks and builds a read request for them, zeroing any blocks
+ * that don't need to be read.  The caller sets the callback. */
+static int ext2_page_breq(struct page_map *pm, struct page *page,
+                          struct block_request **breq_p)
 {
 	int retval;
-	struct block_device *bdev = pm->pm_host->i_sb->s_bdev;
 	struct buffer_head *bh;
 	struct block_request *breq;
-	void *eobh;
 
 	atomic_or(&page->pg_flags, PG_BUFFER);
 	retval = ext2_mappage(pm, page);
 	if (retval)
 		return retval;
-	/* Build and submit the request */
+	/* Build the request */
 	breq = kmem_cache_alloc(breq_kcache, 0);
 	if (!breq)
 		return -ENOMEM;
@@ -731,13 +729,16 @@ int ext2_readpage(struct page_map *pm, struct page *page)
 		} else {
 			memset(bh->bh_buffer, 0, pm->pm_host->i_sb->s_blocksize);
 			bh->bh_flags |= BH_DIRTY;
-			atomic_or(&bh->bh_page->pg_flags, PG_DIRTY);
+			pm_set_page_dirty(pm, bh->bh_page);
 		}
 	}
-	retval = bdev_submit_request(bdev, breq);
-	assert(!retval);
-	sleep_on_breq(breq);
-	kmem_cache_free(breq_kcache, breq);
+	*breq_p = breq;
+	return 0;
+}
+
+/* Called once page's blocks are read in. */
+static void ext2_page_read_done(struct page_map *pm, struct page *page)
+{
 	/* zero out whatever is beyond the EOF.  we could do this by figuring out
 	 * where the BHs end and zeroing from there, but I'd rather zero from where
 	 * the file ends (which could be in the middle of an FS block */
@@ -749,14 +750,153 @@ int ext2_readpage(struct page_map *pm, struct page *page)
 		memset(eof_off + page2kva(page), 0, PGSIZE - eof_off);
 	/* Now the page is up to date */
 	atomic_or(&page->pg_flags, PG_UPTODATE);
+}
+
+/* Fills page with its contents from its backing store file.  Note that we do
+ * the zero padding here, instead of higher in the VFS.  Might change in the
+ * future.  TODO: make this a block FS generic call. */
+int ext2_readpage(struct page_map *pm, struct page *page)
+{
+	int retval;
+	struct block_device *bdev = pm->pm_host->i_sb->s_bdev;
+	struct block_request *breq;
+
+	retval = ext2_page_breq(pm, page, &breq);
+	if (retval)
+		return retval;
+	retval = bdev_submit_request(bdev, breq);
+	assert(!retval);
+	sleep_on_breq(breq);
+	kmem_cache_free(breq_kcache, breq);
+	ext2_page_read_done(pm, page);
 	/* Useful debugging.  Put one higher up if the page is not getting mapped */
 	//print_pageinfo(page);
 	return 0;
 }
 
+void ext2_readpages_done(struct block_request *breq)
+{
+	struct page *page = (struct page*)breq->data;
+
+	/* On an error, leave it !UPTODATE for readpage, which maps it again */
+	if (!breq->error)
+		ext2_page_read_done(page->pg_mapping, page);
+	else
+		free_bhs(page);
+	kmem_cache_free(breq_kcache, breq);
+	unlock_page(page);
+	pm_put_page(page);
+}
+
+/* Readahead: submits reads for all of the pages under one plug, so the block
+ * layer can merge them, and finishes each page from its breq callback. */
+void ext2_readpages(struct page_map *pm, struct page **pages, unsigned int nr)
+{
+	struct block_device *bdev = pm->pm_host->i_sb->s_bdev;
+	struct block_request *breq;
+	struct blk_plug plug;
+
+	bdev_start_plug(&plug, bdev);
+	for (int i = 0; i < nr; i++) {
+		if (ext2_page_breq(pm, pages[i], &breq)) {
+			/* Leave it !UPTODATE.  Whoever wants it will try readpage. */
+			free_bhs(pages[i]);
+			unlock_page(pages[i]);
+			pm_put_page(pages[i]);
+			continue;
+		}
+		breq->callback = ext2_readpages_done;
+		breq->data = pages[i];
+		if (bdev_submit_request(bdev, breq)) {
+			kmem_cache_free(breq_kcache, breq);
+			free_bhs(pages[i]);
+			unlock_page(pages[i]);
+			pm_put_page(pages[i]);
+		}
+	}
+	bdev_finish_plug(&plug);
+}
+
+/* Builds a write request for all of page's blocks, mapping them if needed. */
+static int ext2_page_write_breq(struct page_map *pm, struct page *page,
+                                struct block_request **breq_p)
+{
+	int retval;
+	struct buffer_head *bh;
+	struct block_request *breq;
+
+	if (!page->pg_private) {
+		atomic_or(&page->pg_flags, PG_BUFFER);
+		retval = ext2_mappage(pm, page);
+		if (retval)
+			return retval;
+	}
+	breq = kmem_cache_alloc(breq_kcache, 0);
+	if (!breq)
+		return -ENOMEM;
+	breq->flags = BREQ_WRITE;
+	breq->callback = generic_breq_done;
+	breq->data = 0;
+	sem_init_irqsave(&breq->sem, 0);
+	breq->bhs = breq->local_bhs;
+	breq->nr_bhs = 0;
+	for (bh = (struct buffer_head*)page->pg_private; bh; bh = bh->bh_next) {
+		bh->bh_flags &= ~(BH_DIRTY | BH_NEEDS_ZEROED);
+		breq->bhs[breq->nr_bhs++] = bh;
+	}
+	*breq_p = breq;
+	return 0;
+}
+
 int ext2_writepage(struct page_map *pm, struct page *page)
 {
-	return -1;
+	int retval;
+	struct block_device *bdev = pm->pm_host->i_sb->s_bdev;
+	struct block_request *breq;
+
+	retval = ext2_page_write_breq(pm, page, &breq);
+	if (retval)
+		return retval;
+	retval = bdev_submit_request(bdev, breq);
+	assert(!retval);
+	sleep_on_breq(breq);
+	retval = breq->error;
+	kmem_cache_free(breq_kcache, breq);
+	return retval;
+}
+
+static void ext2_writepages_done(struct block_request *breq)
+{
+	struct page *page = (struct page*)breq->data;
+	int error = breq->error;
+
+	kmem_cache_free(breq_kcache, breq);
+	pm_writeback_done(page->pg_mapping, page, error);
+}
+
+/* Writeback: like readpages, all of the writes go out under one plug. */
+void ext2_writepages(struct page_map *pm, struct page **pages, unsigned int nr)
+{
+	struct block_device *bdev = pm->pm_host->i_sb->s_bdev;
+	struct block_request *breq;
+	struct blk_plug plug;
+	int retval;
+
+	bdev_start_plug(&plug, bdev);
+	for (int i = 0; i < nr; i++) {
+		retval = ext2_page_write_breq(pm, pages[i], &breq);
+		if (retval) {
+			pm_writeback_done(pm, pages[i], retval);
+			continue;
+		}
+		breq->callback = ext2_writepages_done;
+		breq->data = pages[i];
+		if (bdev_submit_request(bdev, breq)) {
+			kmem_cache_free(breq_kcache, breq);
+			pm_writeback_done(pm, pages[i], -EINVAL);
+		}
+	}
+	bdev_finish_plug(&plug);
 }
 
 /* Super Operations */
@@ -1441,6 +1581,8 @@ int ext2_check_flags(int flags)
 struct page_map_operations ext2_pm_op = {
 	ext2_readpage,
 	ext2_writepage,
+	ext2_readpages,
+	ext2_writepages,
 };
 
 struct super_operations ext2_s_op = {
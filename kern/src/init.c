@@ -46,6 +46,7 @@
 #include <ip.h>
 #include <acpi.h>
 #include <coreboot_tables.h>
+#include <writeback.h>
 
 #define MAX_BOOT_CMDLINE_SIZE 4096
 
@@ -162,6 +163,7 @@ void kernel_init(multiboot_info_t *mboot_info)
 	kb_buf_init(&cons_buf);
 	arch_init();
 	block_init();
+	writeback_init();
 	enable_irq();
 	run_linker_funcs();
 	/* reset/init devtab after linker funcs 3 and 4.  these run NIC and medium
@@ -1,6 +1,8 @@
 #include <ip.h>
 #include <ktest.h>
 #include <linker_func.h>
+#include <smp.h>
+#include <trap.h>
 
 KTEST_SUITE("NET")
 
@@ -44,6 +46,43 @@ bool test_ptclbsum(void)
 	return true;
 }
 
+/* Every checksum kernel we can run, plain and copying, against simplesum. */
+bool test_ptclbsum_kernels(void)
+{
+	static const int kernels[] = {PTCLBSUM_SCALAR, PTCLBSUM_SSE2,
+	                              PTCLBSUM_AVX2};
+	uint8_t *buf, *dst;
+	int i, k, off, len, csum, expected;
+	uint32_t x = 1;
+
+	buf = kmalloc(2048, MEM_WAIT);
+	dst = kmalloc(2048, MEM_WAIT);
+	for (i = 0; i < 2048; i++) {
+		x = x * 1103515245 + 12345;
+		buf[i] = x >> 16;
+	}
+	for (k = 0; k < ARRAY_SIZE(kernels); k++) {
+		if (ptclbsum_kernel(kernels[k], NULL, buf, 0) < 0)
+			continue;
+		for (off = 0; off < 64; off += 3) {
+			for (len = 0; len < 1900; len += len < 200 ? 1 : 61) {
+				expected = simplesum(buf + off, len);
+				csum = ptclbsum_kernel(kernels[k], NULL, buf + off, len);
+				KT_ASSERT_M("checksum matches simplesum", csum == expected);
+				memset(dst, 0, 2048);
+				csum = ptclbsum_kernel(kernels[k], dst + 1, buf + off, len);
+				KT_ASSERT_M("copying checksum matches simplesum",
+				            csum == expected);
+				KT_ASSERT_M("copying checksum copies",
+				            !memcmp(dst + 1, buf + off, len));
+			}
+		}
+	}
+	kfree(buf);
+	kfree(dst);
+	return true;
+}
+
 #define CSUM_BENCH_BUFSIZE 4000
 
 bool test_simplesum_bench(void)
@@ -80,10 +119,93 @@ bool test_ptclbsum_bench(void)
 	return true;
 }
 
+/* Conversation hash table: lookups on other cores while we grow and shrink
+ * the table under them.  The first IPHT_NR_RESIDENT convs stay in the table,
+ * and every lookup for one of them has to find it. */
+#define IPHT_NR_CONVS 2048
+#define IPHT_NR_RESIDENT 64
+#define IPHT_NR_LOOKERS 3
+
+static struct Ipht ipht_test_ht;
+static struct conv *ipht_test_convs;
+static atomic_t ipht_nr_running;
+static atomic_t ipht_nr_misses;
+static bool ipht_stop;
+
+static void ipht_test_init_conv(struct conv *c, int i)
+{
+	v4tov6(c->raddr, (uint8_t[]){10, 0, i >> 8, i});
+	v4tov6(c->laddr, (uint8_t[]){10, 1, 0, 1});
+	c->rport = 1024 + i;
+	c->lport = 80;
+}
+
+static void __ipht_looker(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct conv *c;
+
+	while (!ACCESS_ONCE(ipht_stop)) {
+		for (int i = 0; i < IPHT_NR_RESIDENT; i++) {
+			c = &ipht_test_convs[i];
+			if (iphtlook(&ipht_test_ht, c->raddr, c->rport, c->laddr,
+			             c->lport) != c)
+				atomic_inc(&ipht_nr_misses);
+		}
+	}
+	atomic_dec(&ipht_nr_running);
+}
+
+bool test_ipht_resize(void)
+{
+	struct Ipht *ht = &ipht_test_ht;
+	int nr_lookers = MIN(IPHT_NR_LOOKERS, num_cores - 1);
+	unsigned long nresize;
+
+	ipht_test_convs = kzmalloc(sizeof(struct conv) * IPHT_NR_CONVS, MEM_WAIT);
+	iphtinit(ht);
+	for (int i = 0; i < IPHT_NR_CONVS; i++)
+		ipht_test_init_conv(&ipht_test_convs[i], i);
+	for (int i = 0; i < IPHT_NR_RESIDENT; i++)
+		iphtadd(ht, &ipht_test_convs[i]);
+	ipht_stop = FALSE;
+	atomic_init(&ipht_nr_misses, 0);
+	atomic_init(&ipht_nr_running, nr_lookers);
+	for (int i = 0; i < nr_lookers; i++)
+		send_kernel_message(i + 1, __ipht_looker, 0, 0, 0, KMSG_ROUTINE);
+	nresize = ht->nresize;
+	/* each round grows the table a few times, then shrinks it back */
+	for (int round = 0; round < 20; round++) {
+		for (int i = IPHT_NR_RESIDENT; i < IPHT_NR_CONVS; i++)
+			iphtadd(ht, &ipht_test_convs[i]);
+		for (int i = IPHT_NR_RESIDENT; i < IPHT_NR_CONVS; i++)
+			iphtrem(ht, &ipht_test_convs[i]);
+	}
+	ipht_stop = TRUE;
+	while (atomic_read(&ipht_nr_running))
+		cpu_relax();
+	KT_ASSERT_M("The table resized", ht->nresize != nresize);
+	KT_ASSERT_M("Lookups found every conv during resizes",
+	            atomic_read(&ipht_nr_misses) == 0);
+	/* with no one else in the table, retired tables get freed */
+	for (int i = 0; i < IPHT_NR_RESIDENT; i++)
+		iphtrem(ht, &ipht_test_convs[i]);
+	for (int i = 0; i < 1000 && (ht->old || ht->retired || ht->dying); i++) {
+		iphtadd(ht, &ipht_test_convs[0]);
+		iphtrem(ht, &ipht_test_convs[0]);
+	}
+	KT_ASSERT_M("Retired tables were freed",
+	            !ht->old && !ht->retired && !ht->dying);
+	kfree(ht->cur);
+	kfree(ipht_test_convs);
+	return true;
+}
+
 static struct ktest ktests[] = {
 	KTEST_REG(ptclbsum,				CONFIG_TEST_ptclbsum),
+	KTEST_REG(ptclbsum_kernels,		CONFIG_TEST_ptclbsum_kernels),
 	KTEST_REG(simplesum_bench,		CONFIG_TEST_simplesum_bench),
 	KTEST_REG(ptclbsum_bench,		CONFIG_TEST_ptclbsum_bench),
+	KTEST_REG(ipht_resize,			CONFIG_TEST_ipht_resize),
 };
 
 static int num_ktests = sizeof(ktests) / sizeof(struct ktest);
@@ -43,6 +43,8 @@
 #include <ucq.h>
 #include <setjmp.h>
 #include <sort.h>
+#include <blockdev.h>
+#include <ext2fs.h>
 
 #include <apipe.h>
 #include <rwlock.h>
@@ -731,6 +733,27 @@ void a_dtor(void *buf, size_t size)
 	printk("destructin tests\n");
 }
 
+/* Contiguous allocations come from the free area tree.  They should be
+ * naturally aligned and busy while allocated. */
+bool test_cont_pages(void)
+{
+	void *bufs[8];
+
+	for (int order = 0; order < ARRAY_SIZE(bufs); order++) {
+		bufs[order] = get_cont_pages(order, 0);
+		KT_ASSERT_M("get_cont_pages failed", bufs[order]);
+		KT_ASSERT_M("Block not aligned to its order",
+		            !(kva2ppn(bufs[order]) & ((1UL << order) - 1)));
+		for (int i = 0; i < 1 << order; i++)
+			KT_ASSERT_M("Allocated page is free",
+			            !page_is_free(kva2ppn(bufs[order]) + i));
+	}
+	/* free_cont_pages() asserts the pages are free afterwards */
+	for (int order = 0; order < ARRAY_SIZE(bufs); order++)
+		free_cont_pages(bufs[order], order);
+	return true;
+}
+
 // TODO: Make test_single_cache return something, and then add assertions here.
 bool test_slab(void)
 {
@@ -741,6 +764,50 @@ bool test_slab(void)
 	return true;
 }
 
+/* Cycles enough objects through a cache to use the depot, then makes sure
+ * draining the magazines gives everything back to the slab layer. */
+bool test_slab_magazines(void)
+{
+	struct kmem_cache *kc;
+	struct kmem_pcpu_cache *pcc;
+	int nr_objs = KMC_MAG_MAX_SZ * 4;
+	void **objs = kmalloc(sizeof(void*) * nr_objs, MEM_WAIT);
+	int8_t irq_state = 0;
+
+	kc = kmem_cache_create("test_nomag", 64, 8, KMC_NOMAG, 0, 0);
+	KT_ASSERT_M("KMC_NOMAG cache has magazines", !kc->pcpu_caches);
+	kmem_cache_destroy(kc);
+
+	kc = kmem_cache_create("test_mag", 64, 8, 0, 0, 0);
+	KT_ASSERT_M("Cache has no magazines", kc->pcpu_caches);
+	/* Stay on this core, so that the counters we check are ours */
+	disable_irqsave(&irq_state);
+	pcc = &kc->pcpu_caches[core_id()];
+	for (int i = 0; i < nr_objs; i++)
+		objs[i] = kmem_cache_alloc(kc, 0);
+	KT_ASSERT_M("Fresh cache had magazine hits", !pcc->nr_alloc_hits);
+	for (int i = 0; i < nr_objs; i++)
+		kmem_cache_free(kc, objs[i]);
+	KT_ASSERT_M("Frees didn't hit the magazines", pcc->nr_free_hits);
+	KT_ASSERT_M("Frees didn't fill up the depot", kc->depot.nr_not_empty);
+	KT_ASSERT_M("Magazine rounds aren't counted as allocated",
+	            kc->nr_cur_alloc);
+	for (int i = 0; i < nr_objs; i++)
+		objs[i] = kmem_cache_alloc(kc, 0);
+	KT_ASSERT_M("Allocs didn't hit the magazines", pcc->nr_alloc_hits);
+	KT_ASSERT_M("Allocs didn't use the depot", kc->depot.nr_alloc_hits);
+	for (int i = 0; i < nr_objs; i++)
+		kmem_cache_free(kc, objs[i]);
+	enable_irqsave(&irq_state);
+	kmem_cache_reap(kc);
+	KT_ASSERT_M("Reap didn't drain the depot",
+	            !kc->depot.nr_not_empty && !kc->depot.nr_empty);
+	/* Destroy asserts that no slab has busy objects */
+	kmem_cache_destroy(kc);
+	kfree(objs);
+	return true;
+}
+
 // TODO: Add assertions.
 bool test_kmalloc(void)
 {
@@ -1155,6 +1222,7 @@ bool test_vm_regions(void)
 	struct proc pr, *p = &pr;	/* too lazy to even create one */
 	int n = 0;
 	TAILQ_INIT(&p->vm_regions);
+	rb_root_init(&p->vm_tree);
 
 	struct vmr_summary {
 		uintptr_t base; 
@@ -2029,6 +2097,249 @@ bool test_alarm(void)
 	return true;
 }
 
+/* Exercises the tchain's timing wheel on a private tchain, which never gets a
+ * real interrupt.  We trigger it by hand. */
+bool test_alarm_wheel(void)
+{
+	#define NR_WHEEL_WAITERS 64
+	struct timer_chain tchain;
+	struct alarm_waiter *waiters, *slacker;
+	uint64_t now, min_future = (uint64_t)-1;
+	int nr_ran = 0, nr_past = 0;
+
+	void no_interrupt(struct timer_chain *tchain)
+	{
+	}
+	void count_run(struct alarm_waiter *waiter, struct hw_trapframe *hw_tf)
+	{
+		(*(int*)waiter->data)++;
+	}
+
+	init_timer_chain(&tchain, no_interrupt);
+	waiters = kzmalloc(sizeof(struct alarm_waiter) * (NR_WHEEL_WAITERS + 1),
+	                   MEM_WAIT);
+	slacker = &waiters[NR_WHEEL_WAITERS];
+	now = read_tsc();
+	/* Every fourth one is in the past, the rest are spread from a few usec to
+	 * many hours out, across all levels of the wheel. */
+	for (int i = 0; i < NR_WHEEL_WAITERS; i++) {
+		init_awaiter_irq(&waiters[i], count_run);
+		waiters[i].data = &nr_ran;
+		if (!(i % 4)) {
+			set_awaiter_abs(&waiters[i], now - i);
+			nr_past++;
+		} else {
+			set_awaiter_abs(&waiters[i], now + usec2tsc(1000000000) +
+			                            (1ULL << (i % 48)) * i);
+			min_future = MIN(min_future, waiters[i].wake_up_time);
+		}
+		set_alarm(&tchain, &waiters[i]);
+	}
+	KT_ASSERT(tchain.nr_waiters == NR_WHEEL_WAITERS);
+	__trigger_tchain(&tchain, 0);
+	KT_ASSERT_M("Only the past waiters should have run", nr_ran == nr_past);
+	KT_ASSERT(tchain.nr_waiters == NR_WHEEL_WAITERS - nr_past);
+	KT_ASSERT_M("The next IRQ should be for the earliest waiter",
+	            tchain.earliest_time == min_future);
+	/* Triggering early shouldn't run anything */
+	__trigger_tchain(&tchain, 0);
+	KT_ASSERT(nr_ran == nr_past);
+	/* Slack can push the IRQ back, but only as far as the next waiter */
+	init_awaiter_irq(slacker, count_run);
+	slacker->data = &nr_ran;
+	set_awaiter_abs(slacker, min_future - usec2tsc(1000));
+	set_awaiter_slack(slacker, 500);
+	set_alarm(&tchain, slacker);
+	KT_ASSERT(tchain.earliest_time == slacker->wake_up_time + slacker->slack);
+	reset_alarm_abs(&tchain, slacker, min_future - usec2tsc(10));
+	__trigger_tchain(&tchain, 0);
+	KT_ASSERT_M("Slack shouldn't push past another waiter",
+	            tchain.earliest_time <= min_future);
+	for (int i = 0; i < NR_WHEEL_WAITERS; i++) {
+		if (i % 4)
+			KT_ASSERT(unset_alarm(&tchain, &waiters[i]));
+	}
+	KT_ASSERT(unset_alarm(&tchain, slacker));
+	KT_ASSERT(!tchain.nr_waiters);
+	KT_ASSERT(nr_ran == nr_past);
+	kfree(waiters);
+	kfree(tchain.wheel);
+	return true;
+}
+
+bool test_bdev_merge(void)
+{
+	#define NR_MERGE_BREQS 4
+	struct block_device *bdev;
+	struct block_request *breqs;
+	struct buffer_head *bhs;
+	struct blk_plug plug;
+	static struct bdev_operations test_op;
+	int nr_ios = 0, nr_done = 0;
+	unsigned long last_sector = 0;
+	unsigned int last_nr_sector = 0;
+
+	void test_submit_io(struct block_device *bdev, struct blk_io *io)
+	{
+		nr_ios++;
+		last_sector = io->sector;
+		last_nr_sector = io->nr_sector;
+		bdev_io_done(bdev, io, 0);
+	}
+	void count_done(struct block_request *breq)
+	{
+		nr_done++;
+	}
+
+	test_op.submit_io = test_submit_io;
+	bdev = kzmalloc(sizeof(struct block_device), MEM_WAIT);
+	bdev->b_sector_sz = SECTOR_SZ;
+	bdev->b_nr_sector = 1024;
+	bdev->b_op = &test_op;
+	strlcpy(bdev->b_name, "KTEST", BDEV_INLINE_NAME);
+	bdev_init(bdev);
+	breqs = kzmalloc(sizeof(struct block_request) * (NR_MERGE_BREQS + 1),
+	                 MEM_WAIT);
+	bhs = kzmalloc(sizeof(struct buffer_head) * NR_MERGE_BREQS * 2, MEM_WAIT);
+	/* Breq i reads sectors 8i and 8i + 32, so the BHs are out of order across
+	 * the breqs, but together they cover sectors 0-63. */
+	for (int i = 0; i < NR_MERGE_BREQS; i++) {
+		breqs[i].flags = BREQ_READ;
+		breqs[i].callback = count_done;
+		breqs[i].bhs = breqs[i].local_bhs;
+		breqs[i].nr_bhs = 2;
+		for (int j = 0; j < 2; j++) {
+			bhs[i * 2 + j].bh_sector = i * 8 + j * 32;
+			bhs[i * 2 + j].bh_nr_sector = 8;
+			breqs[i].bhs[j] = &bhs[i * 2 + j];
+		}
+	}
+	/* Unplugged, each breq's BHs aren't adjacent, so they're separate IOs */
+	KT_ASSERT(!bdev_submit_request(bdev, &breqs[0]));
+	KT_ASSERT(nr_ios == 2);
+	KT_ASSERT(nr_done == 1);
+	/* Plugged, everything merges into one IO, plus a write to sector 0 */
+	nr_ios = 0;
+	nr_done = 0;
+	breqs[NR_MERGE_BREQS].flags = BREQ_WRITE;
+	breqs[NR_MERGE_BREQS].callback = count_done;
+	breqs[NR_MERGE_BREQS].bhs = breqs[NR_MERGE_BREQS].local_bhs;
+	breqs[NR_MERGE_BREQS].bhs[0] = &bhs[0];
+	breqs[NR_MERGE_BREQS].nr_bhs = 1;
+	bdev_start_plug(&plug, bdev);
+	for (int i = 0; i < NR_MERGE_BREQS + 1; i++)
+		KT_ASSERT(!bdev_submit_request(bdev, &breqs[i]));
+	KT_ASSERT_M("Plugged requests shouldn't be dispatched", !nr_ios);
+	bdev_finish_plug(&plug);
+	KT_ASSERT(nr_ios == 2);
+	KT_ASSERT(nr_done == NR_MERGE_BREQS + 1);
+	/* Reads sort before writes, so the write went out last */
+	KT_ASSERT(last_sector == 0 && last_nr_sector == 8);
+	KT_ASSERT(bdev->b_queues[core_id()].nr_merged >= 7);
+	/* Out of range */
+	bhs[0].bh_sector = 1020;
+	KT_ASSERT(bdev_submit_request(bdev, &breqs[NR_MERGE_BREQS]) == -1);
+	kfree(bhs);
+	kfree(breqs);
+	kfree(bdev->b_queues);
+	kfree(bdev);
+	return true;
+}
+
+/* Loads pages from a PM whose readahead IO always fails, using ext2's readahead
+ * completion.  The loads fall back to readpage, which ext2 does by mapping the
+ * page again, so the failed readahead can't leave the page's BHs behind. */
+bool test_ext2_readpages_error(void)
+{
+	#define NR_RA_ERR_PGS 4
+	static struct page_map_operations test_pm_op;
+	static struct bdev_operations test_bdev_op;
+	struct block_device *bdev;
+	struct inode *inode;
+	struct page_map *pm;
+	struct page *page;
+	int nr_ios = 0, nr_readpage = 0, nr_had_bhs = 0;
+
+	void fail_io(struct block_device *bdev, struct blk_io *io)
+	{
+		nr_ios++;
+		bdev_io_done(bdev, io, -EIO);
+	}
+	/* ext2_readpages(), with one BH per page instead of ext2's mapping */
+	void test_readpages(struct page_map *pm, struct page **pages,
+	                    unsigned int nr)
+	{
+		struct block_request *breq;
+		struct buffer_head *bh;
+		struct blk_plug plug;
+
+		bdev_start_plug(&plug, bdev);
+		for (int i = 0; i < nr; i++) {
+			bh = kmem_cache_alloc(bh_kcache, MEM_WAIT);
+			bh->bh_page = pages[i];
+			bh->bh_buffer = page2kva(pages[i]);
+			bh->bh_flags = 0;
+			bh->bh_next = NULL;
+			bh->bh_bdev = bdev;
+			bh->bh_nr_sector = PGSIZE / SECTOR_SZ;
+			bh->bh_sector = pages[i]->pg_index * bh->bh_nr_sector;
+			atomic_or(&pages[i]->pg_flags, PG_BUFFER);
+			pages[i]->pg_private = bh;
+			breq = kmem_cache_alloc(breq_kcache, MEM_WAIT);
+			breq->flags = BREQ_READ;
+			breq->callback = ext2_readpages_done;
+			breq->data = pages[i];
+			breq->bhs = breq->local_bhs;
+			breq->bhs[0] = bh;
+			breq->nr_bhs = 1;
+			assert(!bdev_submit_request(bdev, breq));
+		}
+		bdev_finish_plug(&plug);
+	}
+	/* ext2_mappage() asserts there are no BHs; we count them instead */
+	int test_readpage(struct page_map *pm, struct page *page)
+	{
+		nr_readpage++;
+		if (page->pg_private)
+			nr_had_bhs++;
+		atomic_or(&page->pg_flags, PG_UPTODATE);
+		return 0;
+	}
+
+	test_bdev_op.submit_io = fail_io;
+	bdev = kzmalloc(sizeof(struct block_device), MEM_WAIT);
+	bdev->b_sector_sz = SECTOR_SZ;
+	bdev->b_nr_sector = 1024;
+	bdev->b_op = &test_bdev_op;
+	strlcpy(bdev->b_name, "KTEST", BDEV_INLINE_NAME);
+	bdev_init(bdev);
+	test_pm_op.readpage = test_readpage;
+	test_pm_op.readpages = test_readpages;
+	inode = kzmalloc(sizeof(struct inode), MEM_WAIT);
+	inode->i_size = NR_RA_ERR_PGS * PGSIZE;
+	pm = kzmalloc(sizeof(struct page_map), MEM_WAIT);
+	pm_init(pm, &test_pm_op, inode);
+
+	/* The miss on page 0 reads it along with the rest of the window */
+	KT_ASSERT(!pm_load_page(pm, 0, &page));
+	KT_ASSERT(atomic_read(&page->pg_flags) & PG_UPTODATE);
+	pm_put_page(page);
+	KT_ASSERT_M("Readahead should have gone to the device", nr_ios);
+	/* Page 1 is in the PM from the failed readahead, but isn't UPTODATE */
+	KT_ASSERT(!pm_load_page(pm, 1, &page));
+	KT_ASSERT(atomic_read(&page->pg_flags) & PG_UPTODATE);
+	pm_put_page(page);
+	KT_ASSERT(nr_readpage == 2);
+	KT_ASSERT_M("Failed readahead left BHs on its pages", !nr_had_bhs);
+
+	KT_ASSERT(pm_remove_contig(pm, 0, NR_RA_ERR_PGS) == NR_RA_ERR_PGS);
+	kfree(pm);
+	kfree(inode);
+	kfree(bdev->b_queues);
+	kfree(bdev);
+	return true;
+}
+
 bool test_kmalloc_incref(void)
 {
 	/* this test is a bit invasive of the kmalloc internals */
@@ -2407,7 +2718,9 @@ static struct ktest ktests[] = {
 	KTEST_REG(bitmasks,           CONFIG_TEST_bitmasks),
 	KTEST_REG(checklists,         CONFIG_TEST_checklists),
 	KTEST_REG(smp_call_functions, CONFIG_TEST_smp_call_functions),
+	KTEST_REG(cont_pages,         CONFIG_TEST_cont_pages),
 	KTEST_REG(slab,               CONFIG_TEST_slab),
+	KTEST_REG(slab_magazines,     CONFIG_TEST_slab_magazines),
 	KTEST_REG(kmalloc,            CONFIG_TEST_kmalloc),
 	KTEST_REG(hashtable,          CONFIG_TEST_hashtable),
 	KTEST_REG(circular_buffer,    CONFIG_TEST_circular_buffer),
@@ -2427,6 +2740,9 @@ static struct ktest ktests[] = {
 	KTEST_REG(rwlock,             CONFIG_TEST_rwlock),
 	KTEST_REG(rv,                 CONFIG_TEST_rv),
 	KTEST_REG(alarm,              CONFIG_TEST_alarm),
+	KTEST_REG(alarm_wheel,        CONFIG_TEST_alarm_wheel),
+	KTEST_REG(bdev_merge,         CONFIG_TEST_bdev_merge),
+	KTEST_REG(ext2_readpages_error, CONFIG_TEST_ext2_readpages_error),
 	KTEST_REG(kmalloc_incref,     CONFIG_TEST_kmalloc_incref),
 	KTEST_REG(u16pool,            CONFIG_TEST_u16pool),
 	KTEST_REG(uaccess,            CONFIG_TEST_uaccess),
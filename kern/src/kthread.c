@@ -12,12 +12,53 @@
 #include <smp.h>
 #include <schedule.h>
 #include <kstack.h>
+#include <percpu.h>
 #include <arch/uaccess.h>
+#include <syscall.h>
+#include <arsc_server.h>
 
-uintptr_t get_kstack(void)
+/* Each core keeps a small stash of free kernel stacks, so that blocking in
+ * sem_down() and launching ktasks don't hit the page allocator (and the slow
+ * get_cont_pages() path, for multi-page stacks) every time.  When a core runs
+ * out, it grabs a batch; when it has too many, it gives a batch back.
+ *
+ * The caches are only touched by their own core, with irqs disabled.  Until the
+ * per-cpu area is set up, we go straight to the page allocator. */
+#define KSTACK_CACHE_SZ		16
+#define KSTACK_CACHE_BATCH	4
+
+struct kstack_cache {
+	unsigned int				nr_stacks;
+	uintptr_t					stacks[KSTACK_CACHE_SZ];
+	unsigned long				nr_hits;
+	unsigned long				nr_refills;
+	unsigned long				nr_frees;
+	unsigned long				nr_drains;
+};
+
+static DEFINE_PERCPU(struct kstack_cache, kstack_caches);
+static bool kstack_cache_ready;
+
+DEFINE_PERCPU_INIT(kstack_cache_init);
+
+static void kstack_cache_init(void)
+{
+	for (int i = 0; i < num_cores; i++)
+		memset(_PERCPU_VARPTR(kstack_caches, i), 0,
+		       sizeof(struct kstack_cache));
+	wmb();
+	kstack_cache_ready = TRUE;
+}
+
+/* Stacks come from the calling core's NUMA node, if we know about NUMA. */
+static uintptr_t __alloc_kstack(void)
 {
 	uintptr_t stackbot;
-	if (KSTKSIZE == PGSIZE)
+
+	if (page_numa_nr_nodes() > 1)
+		stackbot = (uintptr_t)get_cont_pages_node(numa_id_early(),
+		                                          KSTKSHIFT - PGSHIFT, 0);
+	else if (KSTKSIZE == PGSIZE)
 		stackbot = (uintptr_t)kpage_alloc_addr();
 	else
 		stackbot = (uintptr_t)get_cont_pages(KSTKSHIFT - PGSHIFT, 0);
@@ -25,7 +66,7 @@ uintptr_t get_kstack(void)
 	return stackbot + KSTKSIZE;
 }
 
-void put_kstack(uintptr_t stacktop)
+static void __free_kstack(uintptr_t stacktop)
 {
 	uintptr_t stackbot = stacktop - KSTKSIZE;
 	if (KSTKSIZE == PGSIZE)
@@ -34,6 +75,65 @@ void put_kstack(uintptr_t stacktop)
 		free_cont_pages((void*)stackbot, KSTKSHIFT - PGSHIFT);
 }
 
+uintptr_t get_kstack(void)
+{
+	struct kstack_cache *kc;
+	uintptr_t stacktop;
+	int8_t irq_state = 0;
+
+	if (!kstack_cache_ready)
+		return __alloc_kstack();
+	disable_irqsave(&irq_state);
+	kc = _PERCPU_VARPTR(kstack_caches, core_id_early());
+	if (kc->nr_stacks) {
+		kc->nr_hits++;
+	} else {
+		kc->nr_refills++;
+		for (int i = 0; i < KSTACK_CACHE_BATCH; i++)
+			kc->stacks[kc->nr_stacks++] = __alloc_kstack();
+	}
+	stacktop = kc->stacks[--kc->nr_stacks];
+	enable_irqsave(&irq_state);
+	return stacktop;
+}
+
+void put_kstack(uintptr_t stacktop)
+{
+	struct kstack_cache *kc;
+	int8_t irq_state = 0;
+
+	if (!kstack_cache_ready) {
+		__free_kstack(stacktop);
+		return;
+	}
+	disable_irqsave(&irq_state);
+	kc = _PERCPU_VARPTR(kstack_caches, core_id_early());
+	kc->nr_frees++;
+	if (kc->nr_stacks == KSTACK_CACHE_SZ) {
+		kc->nr_drains++;
+		for (int i = 0; i < KSTACK_CACHE_BATCH; i++)
+			__free_kstack(kc->stacks[--kc->nr_stacks]);
+	}
+	kc->stacks[kc->nr_stacks++] = stacktop;
+	enable_irqsave(&irq_state);
+}
+
+void print_kstack_caches(void)
+{
+	struct kstack_cache *kc;
+
+	printk("Kstack caches (%d stacks max, batch %d, %d bytes each)\n",
+	       KSTACK_CACHE_SZ, KSTACK_CACHE_BATCH, KSTKSIZE);
+	printk("Core   Cached     Hits  Refills    Frees   Drains\n");
+	if (!kstack_cache_ready)
+		return;
+	for (int i = 0; i < num_cores; i++) {
+		kc = _PERCPU_VARPTR(kstack_caches, i);
+		printk("%4d %8u %8lu %8lu %8lu %8lu\n", i, kc->nr_stacks,
+		       kc->nr_hits, kc->nr_refills, kc->nr_frees, kc->nr_drains);
+	}
+}
+
 uintptr_t *kstack_bottom_addr(uintptr_t stacktop)
 {
 	/* canary at the bottom of the stack */
@@ -343,6 +443,9 @@ void sem_down(struct semaphore *sem)
 		new_kthread->flags = KTH_DEFAULT_FLAGS;
 		new_kthread->proc = 0;
 		new_kthread->name = 0;
+		new_kthread->blk_plug = 0;
+		new_kthread->batch = 0;
+		new_kthread->batch_left = 0;
 	} else {
 		new_kthread = __kthread_zalloc();
 		new_kthread->flags = KTH_DEFAULT_FLAGS;
@@ -396,6 +499,14 @@ void sem_down(struct semaphore *sem)
 		 * allows us to atomically unlock and 'yield'.  Also, IRQs might have
 		 * already been disabled if this was an irqsave sem. */
 		disable_irq();
+		/* Let the rest of our syscall batch run while we sleep.  Do this
+		 * before unlocking, since once we unlock, we could be restarted and
+		 * looking at our batch. */
+		if (kthread->batch_left)
+			sysc_batch_blocked(kthread);
+		/* Same deal for the ARSC pollers: someone else polls while we sleep */
+		if (kthread->flags & KTH_ARSC_POLLER)
+			arsc_poller_blocked(kthread);
 		spin_unlock(&sem->lock);
 		/* Switch to the core's default stack.  After this, don't use local
 		 * variables. */
@@ -45,12 +45,111 @@ void vmr_init(void)
 	                               __alignof__(struct dentry), 0, 0, 0);
 }
 
+/* VMRs are kept in two structures: the vm_regions TAILQ, sorted by address,
+ * which is what most code walks, and the vm_tree, an rbtree keyed on vm_base
+ * for lookups.  The tree is augmented with the free space below each VMR
+ * (vm_gap, measured from the end of the previous VMR), and each node tracks the
+ * largest gap in its subtree, so create_vmr() can find a hole without walking
+ * every VMR.  The first VMR's gap is 0; create_vmr() handles that one itself.
+ *
+ * Anyone changing a VMR's vm_base or vm_end must fix up the gaps of it and its
+ * successor, with __vmr_update_gap(). */
+static void vmr_augment(struct rb_node *node)
+{
+	struct vm_region *vmr = container_of(node, struct vm_region, vm_rb);
+	struct vm_region *child;
+	uintptr_t max_gap = vmr->vm_gap;
+
+	if (node->rb_left) {
+		child = container_of(node->rb_left, struct vm_region, vm_rb);
+		max_gap = MAX(max_gap, child->vm_max_gap);
+	}
+	if (node->rb_right) {
+		child = container_of(node->rb_right, struct vm_region, vm_rb);
+		max_gap = MAX(max_gap, child->vm_max_gap);
+	}
+	vmr->vm_max_gap = max_gap;
+}
+
+static void __vmr_update_gap(struct vm_region *vmr)
+{
+	struct vm_region *prev;
+
+	if (!vmr)
+		return;
+	prev = TAILQ_PREV(vmr, vmr_tailq, vm_link);
+	vmr->vm_gap = prev ? vmr->vm_base - prev->vm_end : 0;
+	rb_augment_path(&vmr->vm_rb, vmr_augment);
+}
+
+/* Adds vmr, whose vm_base and vm_end are set, to p's list and tree. */
+static void __vmr_insert(struct proc *p, struct vm_region *vmr)
+{
+	struct rb_node **link = &p->vm_tree.rb_node;
+	struct rb_node *parent = 0;
+	struct vm_region *vm_i;
+
+	while (*link) {
+		parent = *link;
+		vm_i = container_of(parent, struct vm_region, vm_rb);
+		if (vmr->vm_base < vm_i->vm_base)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rb_link_node(&vmr->vm_rb, parent, link);
+	/* Our list neighbor is our tree neighbor */
+	parent = rb_prev(&vmr->vm_rb);
+	if (parent) {
+		vm_i = container_of(parent, struct vm_region, vm_rb);
+		TAILQ_INSERT_AFTER(&p->vm_regions, vm_i, vmr, vm_link);
+	} else {
+		TAILQ_INSERT_HEAD(&p->vm_regions, vmr, vm_link);
+	}
+	vmr->vm_gap = 0;
+	vmr->vm_max_gap = 0;
+	rb_insert_color(&vmr->vm_rb, &p->vm_tree, vmr_augment);
+	__vmr_update_gap(vmr);
+	__vmr_update_gap(TAILQ_NEXT(vmr, vm_link));
+}
+
+static void __vmr_remove(struct proc *p, struct vm_region *vmr)
+{
+	struct vm_region *next = TAILQ_NEXT(vmr, vm_link);
+
+	TAILQ_REMOVE(&p->vm_regions, vmr, vm_link);
+	rb_erase(&vmr->vm_rb, &p->vm_tree, vmr_augment);
+	__vmr_update_gap(next);
+}
+
+/* Returns the lowest VMR in node's subtree that starts above va and has at
+ * least len free below it. */
+static struct vm_region *__vmr_find_gap(struct rb_node *node, uintptr_t va,
+                                        size_t len)
+{
+	struct vm_region *vmr, *ret;
+
+	if (!node)
+		return 0;
+	vmr = container_of(node, struct vm_region, vm_rb);
+	if (vmr->vm_max_gap < len)
+		return 0;
+	if (vmr->vm_base > va) {
+		ret = __vmr_find_gap(node->rb_left, va, len);
+		if (ret)
+			return ret;
+		if (vmr->vm_gap >= len && TAILQ_PREV(vmr, vmr_tailq, vm_link))
+			return vmr;
+	}
+	return __vmr_find_gap(node->rb_right, va, len);
+}
+
 /* For now, the caller will set the prot, flags, file, and offset.  In the
  * future, we may put those in here, to do clever things with merging vm_regions
  * that are the same.
  *
- * TODO: take a look at solari's vmem alloc.  And consider keeping these in a
- * tree of some sort for easier lookups. */
+ * We take the first hole that ends above va and fits len, placing the VMR at va
+ * if it fits there, o/w at the bottom of the hole. */
 struct vm_region *create_vmr(struct proc *p, uintptr_t va, size_t len)
 {
 	struct vm_region *vmr = 0, *vm_i, *vm_next;
@@ -69,35 +168,34 @@ struct vm_region *create_vmr(struct proc *p, uintptr_t va, size_t len)
 			panic("EOM!");
 		memset(vmr, 0, sizeof(struct vm_region));
 		vmr->vm_base = va;
-		TAILQ_INSERT_HEAD(&p->vm_regions, vmr, vm_link);
 	} else {
-		TAILQ_FOREACH(vm_i, &p->vm_regions, vm_link) {
-			vm_next = TAILQ_NEXT(vm_i, vm_link);
-			gap_end = vm_next ? vm_next->vm_base : UMAPTOP;
-			/* skip til we get past the 'hint' va */
-			if (va >= gap_end)
-				continue;
-			/* Find a gap that is big enough */
-			if (gap_end - vm_i->vm_end >= len) {
-				vmr = kmem_cache_alloc(vmr_kcache, 0);
-				if (!vmr)
-					panic("EOM!");
-				memset(vmr, 0, sizeof(struct vm_region));
-				/* if we can put it at va, let's do that.  o/w, put it so it
-				 * fits */
-				if ((gap_end >= va + len) && (va >= vm_i->vm_end))
-					vmr->vm_base = va;
-				else
-					vmr->vm_base = vm_i->vm_end;
-				TAILQ_INSERT_AFTER(&p->vm_regions, vm_i, vmr, vm_link);
-				break;
-			}
+		/* The hole below vm_next, if any, o/w the one up to UMAPTOP */
+		vm_next = __vmr_find_gap(p->vm_tree.rb_node, va, len);
+		if (vm_next) {
+			vm_i = TAILQ_PREV(vm_next, vmr_tailq, vm_link);
+			gap_end = vm_next->vm_base;
+		} else {
+			vm_i = TAILQ_LAST(&p->vm_regions, vmr_tailq);
+			gap_end = UMAPTOP;
+		}
+		if ((va < gap_end) && (gap_end - vm_i->vm_end >= len)) {
+			vmr = kmem_cache_alloc(vmr_kcache, 0);
+			if (!vmr)
+				panic("EOM!");
+			memset(vmr, 0, sizeof(struct vm_region));
+			/* if we can put it at va, let's do that.  o/w, put it so it
+			 * fits */
+			if ((gap_end >= va + len) && (va >= vm_i->vm_end))
+				vmr->vm_base = va;
+			else
+				vmr->vm_base = vm_i->vm_end;
 		}
 	}
 	/* Finalize the creation, if we got one */
 	if (vmr) {
 		vmr->vm_proc = p;
 		vmr->vm_end = vmr->vm_base + len;
+		__vmr_insert(p, vmr);
 	}
 	if (!vmr)
 		warn("Not making a VMR, wanted %p, + %p = %p", va, len, va + len);
@@ -115,12 +213,11 @@ struct vm_region *split_vmr(struct vm_region *old_vmr, uintptr_t va)
 	if ((old_vmr->vm_base >= va) || (old_vmr->vm_end <= va))
 		return 0;
 	new_vmr = kmem_cache_alloc(vmr_kcache, 0);
-	TAILQ_INSERT_AFTER(&old_vmr->vm_proc->vm_regions, old_vmr, new_vmr,
-	                   vm_link);
 	new_vmr->vm_proc = old_vmr->vm_proc;
 	new_vmr->vm_base = va;
 	new_vmr->vm_end = old_vmr->vm_end;
 	old_vmr->vm_end = va;
+	__vmr_insert(old_vmr->vm_proc, new_vmr);
 	new_vmr->vm_prot = old_vmr->vm_prot;
 	new_vmr->vm_flags = old_vmr->vm_flags;
 	if (old_vmr->vm_file) {
@@ -183,6 +280,7 @@ int grow_vmr(struct vm_region *vmr, uintptr_t va)
 	if (va <= vmr->vm_end)
 		return -1;
 	vmr->vm_end = va;
+	__vmr_update_gap(next);
 	return 0;
 }
 
@@ -194,6 +292,7 @@ int shrink_vmr(struct vm_region *vmr, uintptr_t va)
 	if ((va < vmr->vm_base) || (va > vmr->vm_end))
 		return -1;
 	vmr->vm_end = va;
+	__vmr_update_gap(TAILQ_NEXT(vmr, vm_link));
 	return 0;
 }
 
@@ -205,7 +304,7 @@ void destroy_vmr(struct vm_region *vmr)
 		pm_remove_vmr(file2pm(vmr->vm_file), vmr);
 		kref_put(&vmr->vm_file->f_kref);
 	}
-	TAILQ_REMOVE(&vmr->vm_proc->vm_regions, vmr, vm_link);
+	__vmr_remove(vmr->vm_proc, vmr);
 	kmem_cache_free(vmr_kcache, vmr);
 }
 
@@ -213,10 +312,16 @@ void destroy_vmr(struct vm_region *vmr)
  * if there is none. */
 struct vm_region *find_vmr(struct proc *p, uintptr_t va)
 {
+	struct rb_node *node = p->vm_tree.rb_node;
 	struct vm_region *vmr;
-	/* ugly linear seach */
-	TAILQ_FOREACH(vmr, &p->vm_regions, vm_link) {
-		if ((vmr->vm_base <= va) && (vmr->vm_end > va))
+
+	while (node) {
+		vmr = container_of(node, struct vm_region, vm_rb);
+		if (va < vmr->vm_base)
+			node = node->rb_left;
+		else if (va >= vmr->vm_end)
+			node = node->rb_right;
+		else
 			return vmr;
 	}
 	return 0;
@@ -226,15 +331,20 @@ struct vm_region *find_vmr(struct proc *p, uintptr_t va)
  * none. */
 struct vm_region *find_first_vmr(struct proc *p, uintptr_t va)
 {
-	struct vm_region *vmr;
-	/* ugly linear seach */
-	TAILQ_FOREACH(vmr, &p->vm_regions, vm_link) {
-		if ((vmr->vm_base <= va) && (vmr->vm_end > va))
-			return vmr;
-		if (vmr->vm_base > va)
-			return vmr;
+	struct rb_node *node = p->vm_tree.rb_node;
+	struct vm_region *vmr, *ret = 0;
+
+	/* VMRs don't overlap, so ordering by vm_base also orders by vm_end */
+	while (node) {
+		vmr = container_of(node, struct vm_region, vm_rb);
+		if (vmr->vm_end > va) {
+			ret = vmr;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
 	}
-	return 0;
+	return ret;
 }
 
 /* Makes sure that no VMRs cross either the start or end of the given region
@@ -244,7 +354,6 @@ void isolate_vmrs(struct proc *p, uintptr_t va, size_t len)
 	struct vm_region *vmr;
 	if ((vmr = find_vmr(p, va)))
 		split_vmr(vmr, va);
-	/* TODO: don't want to do another find (linear search) */
 	if ((vmr = find_vmr(p, va + len)))
 		split_vmr(vmr, va + len);
 }
@@ -381,7 +490,7 @@ int duplicate_vmrs(struct proc *p, struct proc *new_p)
 			kmem_cache_free(vmr_kcache, vm_i);
 			return ret;
 		}
-		TAILQ_INSERT_TAIL(&new_p->vm_regions, vmr, vm_link);
+		__vmr_insert(new_p, vmr);
 	}
 	return 0;
 }
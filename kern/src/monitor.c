@@ -20,6 +20,9 @@
 #include <kdebug.h>
 #include <syscall.h>
 #include <kmalloc.h>
+#include <slab.h>
+#include <blockdev.h>
+#include <writeback.h>
 #include <elf.h>
 #include <event.h>
 #include <trap.h>
@@ -1071,10 +1074,37 @@ int mon_db(int argc, char **argv, struct hw_trapframe *hw_tf)
 		printk("Usage: db OPTION\n");
 		printk("\tsem: print all semaphore info\n");
 		printk("\taddr: for PID lookup ADDR's file/vmr info\n");
+		printk("\tslab: print all kmem_caches and magazine stats\n");
+		printk("\tkstack: print the per-core kernel stack caches\n");
+		printk("\tbdev: for PATH print the block queue stats\n");
+		printk("\twb: print dirty page and writeback stats\n");
 		return 1;
 	}
 	if (!strcmp(argv[1], "sem")) {
 		print_all_sem_info();
+	} else if (!strcmp(argv[1], "slab")) {
+		print_kmem_caches();
+	} else if (!strcmp(argv[1], "kstack")) {
+		print_kstack_caches();
+	} else if (!strcmp(argv[1], "wb")) {
+		print_writeback_info();
+	} else if (!strcmp(argv[1], "bdev")) {
+		struct file *bdev_f;
+
+		if (argc < 3) {
+			printk("Usage: db bdev PATH\n");
+			return 1;
+		}
+		bdev_f = do_file_open(argv[2], O_RDONLY, 0);
+		if (!bdev_f) {
+			printk("Can't open %s\n", argv[2]);
+			return 1;
+		}
+		if (bdev_f->f_dentry->d_inode->i_bdev)
+			print_bdev_stats(bdev_f->f_dentry->d_inode->i_bdev);
+		else
+			printk("%s is not a block device\n", argv[2]);
+		kref_put(&bdev_f->f_kref);
 	} else if (!strcmp(argv[1], "addr")) {
 		if (argc < 4) {
 			printk("Usage: db addr PID 0xADDR\n");
@@ -1200,6 +1230,13 @@ int mon_gfp(int argc, char **argv, struct hw_trapframe *hw_tf)
 		}
 	}
 	spin_unlock_irqsave(&colored_page_free_list_lock);
+	printk("%9s %9s\n", "order", "blocks");
+	for (int i = 0; i <= LOG2_UP(naddrpages); i++) {
+		size_t nr = free_area_nr_blocks(i);
+
+		if (nr)
+			printk("%9d %9lu\n", i, nr);
+	}
 	return 0;
 }
 
@@ -87,6 +87,7 @@ struct medium ethermedium = {
 	.ares = arpenter,
 	.areg = sendgarp,
 	.pref2addr = etherpref2addr,
+	.gso = 1,
 };
 
 struct medium trexmedium = {
@@ -103,19 +104,95 @@ struct medium trexmedium = {
 	.ares = arpenter,
 	.areg = sendgarp,
 	.pref2addr = etherpref2addr,
+	.gso = 1,
+};
+
+/*
+ *  generic receive offload.  a v4 reader pulls in whatever frames the
+ *  device has already queued and merges in-order TCP segments of a flow
+ *  into one packet before passing them up, so a bulk receive pays for the
+ *  IP and TCP input paths once per run of segments rather than per frame.
+ *  the frames after the first hang off it as extra data, without copying.
+ */
+enum {
+	IP4HDR = 20,	/* sizeof(Ip4hdr) */
+	IP_HLEN4 = 0x05,	/* Header length in words */
+	IP_DF = 0x4000,	/* Don't fragment */
+	IP_TCPPROTO = 6,
+	TCPACK = 0x10,
+	TCPPSH = 0x08,
+
+	GROHDR = 40,	/* IP + TCP headers, no options */
+	GROMAX = 0xffff,	/* longest merged IP packet */
+	Ngroflow = 8,	/* flows being merged at once */
+	Ngrobatch = 64,	/* frames read before passing everything up */
+};
+
+typedef struct Grohdr Grohdr;
+struct Grohdr {
+	/* ip header */
+	uint8_t vihl;
+	uint8_t tos;
+	uint8_t length[2];
+	uint8_t id[2];
+	uint8_t frag[2];
+	uint8_t ttl;
+	uint8_t proto;
+	uint8_t cksum[2];
+	uint8_t src[4];
+	uint8_t dst[4];
+	/* tcp header */
+	uint8_t sport[2];
+	uint8_t dport[2];
+	uint8_t seq[4];
+	uint8_t ack[4];
+	uint8_t flag[2];
+	uint8_t win[2];
+	uint8_t tcpcksum[2];
+	uint8_t urg[2];
+	uint8_t opt[1];
+};
+
+typedef struct Groflow Groflow;
+struct Groflow {
+	struct block *bp;			/* merged packet so far */
+	uint32_t seq;				/* next in order sequence number */
+	int hlen;					/* IP + TCP header length */
+};
+
+/*
+ *  a v4 reader and its GRO state.  there's one for the frames that come
+ *  in on the device as a whole, and one per rx queue of a multi-queue
+ *  device.  a queue's frames are queued for its reader on the queue's
+ *  core, which is where the reader wakes up, so each queue's frames are
+ *  merged and passed up on its own core.
+ */
+typedef struct Etherrx Etherrx;
+struct Etherrx {
+	struct Ipifc *ifc;
+	struct Fs *f;				/* file system we belong to */
+	int qid;					/* rx queue, or -1 for the device */
+	struct proc *readp;			/* reading process */
+	struct chan *mchan;			/* Data channel */
+	struct chan *nbchan;		/* Non-blocking data channel */
+	int gro;					/* merge received TCP segments */
+	Groflow groflows[Ngroflow];
+	int ngroflows;
 };
 
 typedef struct Etherrock Etherrock;
 struct Etherrock {
 	struct Fs *f;				/* file system we belong to */
 	struct proc *arpp;			/* arp process */
-	struct proc *read4p;		/* reading process (v4) */
 	struct proc *read6p;		/* reading process (v6) */
 	struct chan *mchan4;		/* Data channel for v4 */
 	struct chan *achan;			/* Arp channel */
 	struct chan *cchan4;		/* Control channel for v4 */
 	struct chan *mchan6;		/* Data channel for v6 */
 	struct chan *cchan6;		/* Control channel for v6 */
+	Etherrx rx4;				/* v4 from the device */
+	Etherrx *rxq;				/* v4 from each rx queue */
+	int nrxq;
 };
 
 /*
@@ -166,6 +243,58 @@ static unsigned int parsefeat(char *ptr)
 	return feat;
 }
 
+static void etherrxinit(Etherrx *rx, struct Ipifc *ifc, int qid,
+                       struct chan *mchan, struct chan *nbchan)
+{
+	rx->ifc = ifc;
+	rx->f = ifc->conv->p->f;
+	rx->qid = qid;
+	rx->mchan = mchan;
+	rx->nbchan = nbchan;
+	/* don't bother if the device merges them itself */
+	rx->gro = (ifc->feat & NETF_LRO) == 0;
+}
+
+/*
+ *  open a v4 conversation on each rx queue of dev, until it says it has
+ *  no more.  the frames of a queue without one go to the device's.
+ */
+static void etheropenrxq(struct Ipifc *ifc, Etherrock *er, char *dev)
+{
+	struct chan *mchan, *nbchan;
+	char *addr, *dir, qid[12];
+	int fd, nbfd;
+
+	addr = kmalloc(Maxpath, MEM_WAIT);
+	dir = kmalloc(Maxpath, MEM_WAIT);
+	er->rxq = kzmalloc(MaxEtherQueues * sizeof(Etherrx), MEM_WAIT);
+	while (er->nrxq < MaxEtherQueues) {
+		snprintf(addr, Maxpath, "%s!0x800", dev);
+		snprintf(qid, sizeof(qid), "%d", er->nrxq);
+		fd = kdial(addr, qid, dir, NULL);
+		if (fd < 0)
+			break;
+		snprintf(addr, Maxpath, "%s/data", dir);
+		nbfd = sysopen(addr, O_READ | O_NONBLOCK);
+		if (nbfd < 0) {
+			sysclose(fd);
+			break;
+		}
+		mchan = commonfdtochan(fd, O_RDWR, 0, 1);
+		nbchan = commonfdtochan(nbfd, O_READ, 0, 1);
+		sysclose(fd);
+		sysclose(nbfd);
+		etherrxinit(&er->rxq[er->nrxq], ifc, er->nrxq, mchan, nbchan);
+		er->nrxq++;
+	}
+	if (er->nrxq == 0) {
+		kfree(er->rxq);
+		er->rxq = NULL;
+	}
+	kfree(addr);
+	kfree(dir);
+}
+
 /*
  *  called to bind an IP ifc to an ethernet device
  *  called with ifc wlock'd
@@ -173,9 +302,9 @@ static unsigned int parsefeat(char *ptr)
 static void etherbind(struct Ipifc *ifc, int argc, char **argv)
 {
 	ERRSTACK(1);
-	struct chan *mchan4, *cchan4, *achan, *mchan6, *cchan6;
+	struct chan *mchan4, *nbchan4, *cchan4, *achan, *mchan6, *cchan6;
 	char *addr, *dir, *buf;
-	int fd, cfd, n;
+	int fd, cfd, n, i;
 	char *ptr;
 	Etherrock *er;
 
@@ -184,11 +313,13 @@ static void etherbind(struct Ipifc *ifc, int argc, char **argv)
 
 	addr = kmalloc(Maxpath, MEM_WAIT);	//char addr[2*KNAMELEN];
 	dir = kmalloc(Maxpath, MEM_WAIT);	//char addr[2*KNAMELEN];
-	mchan4 = cchan4 = achan = mchan6 = cchan6 = NULL;
+	mchan4 = nbchan4 = cchan4 = achan = mchan6 = cchan6 = NULL;
 	buf = NULL;
 	if (waserror()) {
 		if (mchan4 != NULL)
 			cclose(mchan4);
+		if (nbchan4 != NULL)
+			cclose(nbchan4);
 		if (cchan4 != NULL)
 			cclose(cchan4);
 		if (achan != NULL)
@@ -224,6 +355,17 @@ static void etherbind(struct Ipifc *ifc, int argc, char **argv)
 	 */
 	devtab[cchan4->type].write(cchan4, nbmsg, strlen(nbmsg), 0);
 
+	/*
+	 *  a second handle on the v4 data, for grabbing whatever frames
+	 *  are already queued without blocking
+	 */
+	snprintf(addr, Maxpath, "%s/data", dir);
+	fd = sysopen(addr, O_READ | O_NONBLOCK);
+	if (fd < 0)
+		error(EFAIL, "can't open ether data: %s", get_cur_errbuf());
+	nbchan4 = commonfdtochan(fd, O_READ, 0, 1);
+	sysclose(fd);
+
 	/*
 	 *  get mac address and speed
 	 */
@@ -297,6 +439,7 @@ static void etherbind(struct Ipifc *ifc, int argc, char **argv)
 	er->mchan6 = mchan6;
 	er->cchan6 = cchan6;
 	er->f = ifc->conv->p->f;
+	etherrxinit(&er->rx4, ifc, -1, mchan4, nbchan4);
 	ifc->arg = er;
 
 	kfree(buf);
@@ -304,7 +447,12 @@ static void etherbind(struct Ipifc *ifc, int argc, char **argv)
 	kfree(dir);
 	poperror();
 
-	ktask("etherread4", etherread4, ifc);
+	/* a multi-queue device gets a v4 reader per queue */
+	etheropenrxq(ifc, er, argv[2]);
+
+	ktask("etherread4", etherread4, &er->rx4);
+	for (i = 0; i < er->nrxq; i++)
+		ktask("etherread4q", etherread4, &er->rxq[i]);
 	ktask("recvarpproc", recvarpproc, ifc);
 	ktask("etherread6", etherread6, ifc);
 }
@@ -315,12 +463,14 @@ static void etherbind(struct Ipifc *ifc, int argc, char **argv)
 static void etherunbind(struct Ipifc *ifc)
 {
 	Etherrock *er = ifc->arg;
+	int i;
+
 	printk("[kernel] etherunbind not supported yet!\n");
 
 	// we'll need to tell the ktasks to exit, maybe via flags and a wakeup
 #if 0
-	if (er->read4p)
-		postnote(er->read4p, 1, "unbind", 0);
+	if (er->rx4.readp)
+		postnote(er->rx4.readp, 1, "unbind", 0);
 	if (er->read6p)
 		postnote(er->read6p, 1, "unbind", 0);
 	if (er->arpp)
@@ -328,12 +478,22 @@ static void etherunbind(struct Ipifc *ifc)
 #endif
 
 	/* wait for readers to die */
-	while (er->arpp != 0 || er->read4p != 0 || er->read6p != 0)
+	while (er->arpp != 0 || er->rx4.readp != 0 || er->read6p != 0)
 		cpu_relax();
+	for (i = 0; i < er->nrxq; i++)
+		while (er->rxq[i].readp != 0)
+			cpu_relax();
 	kthread_usleep(300 * 1000);
 
+	for (i = 0; i < er->nrxq; i++) {
+		cclose(er->rxq[i].mchan);
+		cclose(er->rxq[i].nbchan);
+	}
+	kfree(er->rxq);
 	if (er->mchan4 != NULL)
 		cclose(er->mchan4);
+	if (er->rx4.nbchan != NULL)
+		cclose(er->rx4.nbchan);
 	if (er->achan != NULL)
 		cclose(er->achan);
 	if (er->cchan4 != NULL)
@@ -421,6 +581,178 @@ etherbwrite(struct Ipifc *ifc, struct block *bp, int version, uint8_t * ip)
 	ifc->out++;
 }
 
+/*
+ *  if bp is a TCP segment we can merge, return its IP + TCP header
+ *  length, else 0.  merged packets go up marked as already checksummed,
+ *  so this checks each segment, as IP and TCP would have.
+ */
+static int grohdrlen(struct block *bp)
+{
+	Grohdr *h;
+	int len, hlen, bad;
+	uint8_t ttl, cksum[2];
+
+	if (bp->next != NULL || bp->free != NULL || bp->nr_extra_bufs != 0)
+		return 0;
+	if (BHLEN(bp) < GROHDR)
+		return 0;
+	h = (Grohdr *)bp->rp;
+	if (h->vihl != (IP_VER4 | IP_HLEN4) || h->proto != IP_TCPPROTO)
+		return 0;
+	if (nhgets(h->frag) & ~IP_DF)
+		return 0;
+	if ((h->flag[1] & ~TCPPSH) != TCPACK)
+		return 0;
+	len = nhgets(h->length);
+	hlen = IP4HDR + ((h->flag[0] >> 4) << 2);
+	if (hlen < GROHDR || len <= hlen || len > BHLEN(bp))
+		return 0;
+
+	if ((bp->flag & Bipck) == 0 && ipcsum(&h->vihl))
+		return 0;
+	if ((bp->flag & Btcpck) == 0) {
+		if (h->tcpcksum[0] == 0 && h->tcpcksum[1] == 0)
+			return 0;
+		/* the TCP pseudo header overlays the end of the IP header */
+		ttl = h->ttl;
+		memmove(cksum, h->cksum, 2);
+		h->ttl = 0;
+		hnputs(h->cksum, len - IP4HDR);
+		bad = ptclcsum(bp, IP4HDR - 12, len - (IP4HDR - 12));
+		h->ttl = ttl;
+		memmove(h->cksum, cksum, 2);
+		if (bad)
+			return 0;
+	}
+	bp->flag |= Bipck | Btcpck;
+	return hlen;
+}
+
+/*
+ *  the flow bp belongs to, if we're merging it
+ */
+static Groflow *grofind(Etherrx *rx, struct block *bp)
+{
+	Grohdr *h, *fh;
+	int i;
+
+	if (rx->ngroflows == 0 || BHLEN(bp) < GROHDR)
+		return NULL;
+	h = (Grohdr *)bp->rp;
+	if (h->vihl != (IP_VER4 | IP_HLEN4) || h->proto != IP_TCPPROTO)
+		return NULL;
+	for (i = 0; i < rx->ngroflows; i++) {
+		fh = (Grohdr *)rx->groflows[i].bp->rp;
+		/* addresses and ports */
+		if (memcmp(h->src, fh->src, 12) == 0)
+			return &rx->groflows[i];
+	}
+	return NULL;
+}
+
+static void groflushflow(Etherrx *rx, struct Ipifc *ifc, Groflow *fl)
+{
+	struct block *bp;
+
+	bp = fl->bp;
+	*fl = rx->groflows[--rx->ngroflows];
+	ipiput4(rx->f, ifc, bp);
+}
+
+static void groflush(Etherrx *rx, struct Ipifc *ifc)
+{
+	while (rx->ngroflows > 0)
+		groflushflow(rx, ifc, &rx->groflows[0]);
+}
+
+static void grodrop(Etherrx *rx)
+{
+	while (rx->ngroflows > 0)
+		freeb(rx->groflows[--rx->ngroflows].bp);
+}
+
+/*
+ *  merge bp into the packet for its flow if it's the next in order,
+ *  otherwise pass up whatever we had for the flow and start over.
+ */
+static void gro4(Etherrx *rx, struct Ipifc *ifc, struct block *bp)
+{
+	Groflow *fl;
+	Grohdr *h, *fh;
+	int hlen, dlen, flen;
+	uint8_t v6dst[IPaddrlen];
+
+	if (!rx->gro) {
+		ipiput4(rx->f, ifc, bp);
+		return;
+	}
+	fl = grofind(rx, bp);
+	hlen = grohdrlen(bp);
+	if (hlen == 0) {
+		/* keep the flow in order */
+		if (fl != NULL)
+			groflushflow(rx, ifc, fl);
+		ipiput4(rx->f, ifc, bp);
+		return;
+	}
+	h = (Grohdr *)bp->rp;
+	dlen = nhgets(h->length) - hlen;
+
+	if (fl != NULL) {
+		fh = (Grohdr *)fl->bp->rp;
+		flen = nhgets(fh->length);
+		if (nhgetl(h->seq) == fl->seq && hlen == fl->hlen
+			&& flen + dlen <= GROMAX
+			&& memcmp(h->ack, fh->ack, 4) == 0
+			&& memcmp(h->opt, fh->opt, hlen - GROHDR) == 0
+			&& block_append_extra(fl->bp, (uintptr_t)bp,
+			                      bp->rp + hlen - (uint8_t *)bp, dlen,
+			                      MEM_ATOMIC) == 0) {
+			/* bp now belongs to fl->bp, and goes with it */
+			hnputs(fh->length, flen + dlen);
+			memmove(fh->win, h->win, 2);
+			fh->flag[1] |= h->flag[1];
+			fl->seq += dlen;
+			if (h->flag[1] & TCPPSH)
+				groflushflow(rx, ifc, fl);
+			return;
+		}
+		groflushflow(rx, ifc, fl);
+	}
+
+	/* pushed segments and forwarded packets go straight up */
+	v4tov6(v6dst, h->dst);
+	if ((h->flag[1] & TCPPSH) || ipforme(rx->f, v6dst) == 0) {
+		ipiput4(rx->f, ifc, bp);
+		return;
+	}
+	if (rx->ngroflows == Ngroflow)
+		groflush(rx, ifc);
+	/* the extra data goes after whatever is in the block */
+	bp->wp = bp->rp + hlen + dlen;
+	fl = &rx->groflows[rx->ngroflows++];
+	fl->bp = bp;
+	fl->seq = nhgetl(h->seq) + dlen;
+	fl->hlen = hlen;
+}
+
+/*
+ *  a frame the device has already queued, or NULL
+ */
+static struct block *etherbreadnb(Etherrx *rx)
+{
+	ERRSTACK(1);
+	struct block *bp;
+
+	if (waserror()) {
+		poperror();
+		return NULL;
+	}
+	bp = devtab[rx->nbchan->type].bread(rx->nbchan, 128 * 1024, 0);
+	poperror();
+	return bp;
+}
+
 /*
  *  process to read from the ethernet
  */
@@ -429,33 +761,40 @@ static void etherread4(void *a)
 	ERRSTACK(2);
 	struct Ipifc *ifc;
 	struct block *bp;
-	Etherrock *er;
+	Etherrx *rx;
+	int n;
 
-	ifc = a;
-	er = ifc->arg;
-	er->read4p = current;	/* hide identity under a rock for unbind */
+	rx = a;
+	ifc = rx->ifc;
+	rx->readp = current;	/* hide identity under a rock for unbind */
 	if (waserror()) {
-		er->read4p = 0;
+		rx->readp = 0;
 		poperror();
 		warn("etherread4 returns, probably unexpectedly\n");
 		return;
 	}
 	for (;;) {
-		bp = devtab[er->mchan4->type].bread(er->mchan4, 128 * 1024, 0);
+		bp = devtab[rx->mchan->type].bread(rx->mchan, 128 * 1024, 0);
 		if (!canrlock(&ifc->rwlock)) {
 			freeb(bp);
 			continue;
 		}
 		if (waserror()) {
+			grodrop(rx);
 			runlock(&ifc->rwlock);
 			nexterror();
 		}
-		ifc->in++;
-		bp->rp += ifc->m->hsize;
-		if (ifc->lifc == NULL)
-			freeb(bp);
-		else
-			ipiput4(er->f, ifc, bp);
+		/* take what else is waiting and merge it before passing it up */
+		n = 0;
+		do {
+			ifc->in++;
+			bp->rp += ifc->m->hsize;
+			if (ifc->lifc == NULL)
+				freeb(bp);
+			else
+				gro4(rx, ifc, bp);
+		} while (++n < Ngrobatch && (bp = etherbreadnb(rx)) != NULL);
+		groflush(rx, ifc);
 		runlock(&ifc->rwlock);
 		poperror();
 	}
@@ -323,7 +323,8 @@ ipoput4(struct Fs *f,
 
 	/* If we dont need to fragment just send it */
 	medialen = ifc->maxtu - ifc->m->hsize;
-	if (bp->flag & Btso || len <= medialen) {
+	if (len <= medialen
+	    || ((bp->flag & Btso) && ((ifc->feat & NETF_TSO) || ifc->m->gso))) {
 		if (!gating)
 			hnputs(eh->id, NEXT_ID(ip->id4));
 		hnputs(eh->length, len);
@@ -794,19 +795,7 @@ struct fragment4 *ipfragallo4(struct IP *ip)
  */
 uint16_t ipchecksum(uint8_t *addr, int len)
 {
-	uint16_t sum = 0;
-
-	while (len > 0) {
-		sum += addr[0] << 8 | addr[1];
-		len -= 2;
-		addr += 2;
-	}
-
-	sum = (sum & 0xffff) + (sum >> 16);
-	sum = (sum & 0xffff) + (sum >> 16);
-
-	return (sum ^ 0xffff);
-
+	return ptclbsum(addr, len) ^ 0xffff;
 }
 
 /* change this to call ipchecksum later.
@@ -343,6 +343,117 @@ uint16_t ptclcsum(struct block *bp, int offset, int len)
 	return ~losum & 0xffff;
 }
 
+enum {
+	IP4HDR = 20,				/* sizeof(Ip4hdr) */
+	IP_HLEN4 = 0x05,	/* Header length in words */
+	IP_TCPPROTO = 6,
+	TCP_HDRMIN = 20,	/* TCP header without options */
+	TCP_PSH = 0x08,
+	TCP_FIN = 0x01,
+};
+
+/*
+ *  software segmentation offload.  bp is a TCP packet marked Btso, hsize
+ *  bytes into the block past the medium header, carrying more than bp->mss
+ *  of data.  cut it into a list of mss sized packets, each with a copy of
+ *  the headers and the payload shared with bp.  the TCP checksums are left
+ *  for ptclcsum_finalize(), so a device that can do them still does.
+ *  returns NULL if bp isn't something we can cut up, after freeing it.
+ */
+struct block *tcpsegment(struct block *bp, int hsize)
+{
+	struct block *nbp, *first, **l;
+	uint8_t *ip, *tcp, *th;
+	uint8_t ph[40];
+	int iphlen, hdrlen, dlen, off, n, phlen, v4;
+	uint32_t seq;
+	uint16_t id;
+	uint8_t flags;
+
+	if (bp->mss == 0)
+		goto drop;
+	bp = pullupblock(bp, hsize + IP4HDR);
+	if (bp == NULL)
+		return NULL;
+	ip = bp->rp + hsize;
+	v4 = (ip[0] & 0xF0) == IP_VER4;
+	if (v4) {
+		if ((ip[0] & 0x0F) != IP_HLEN4 || ip[9] != IP_TCPPROTO)
+			goto drop;
+		iphlen = IP4HDR;
+	} else {
+		bp = pullupblock(bp, hsize + IPV6HDR_LEN);
+		if (bp == NULL)
+			return NULL;
+		ip = bp->rp + hsize;
+		if (ip[6] != IP_TCPPROTO)
+			goto drop;
+		iphlen = IPV6HDR_LEN;
+	}
+	bp = pullupblock(bp, hsize + iphlen + TCP_HDRMIN);
+	if (bp == NULL)
+		return NULL;
+	tcp = bp->rp + hsize + iphlen;
+	hdrlen = hsize + iphlen + ((tcp[12] >> 4) << 2);
+	bp = pullupblock(bp, hdrlen);
+	if (bp == NULL)
+		return NULL;
+	ip = bp->rp + hsize;
+	tcp = ip + iphlen;
+	dlen = BLEN(bp) - hdrlen;
+	seq = nhgetl(tcp + 4);
+	flags = tcp[13];
+	id = v4 ? nhgets(ip + 4) : 0;
+
+	first = NULL;
+	l = &first;
+	for (off = 0; off < dlen; off += n) {
+		n = MIN(bp->mss, dlen - off);
+		nbp = blist_clone(bp, hdrlen, n, hdrlen + off);
+		/* the clone's main body is empty, the data is all extra */
+		memmove(nbp->wp, bp->rp, hdrlen);
+		nbp->wp += hdrlen;
+		ip = nbp->rp + hsize;
+		th = ip + iphlen;
+
+		hnputl(th + 4, seq + off);
+		/* FIN and PSH belong to the last segment */
+		if (off + n < dlen)
+			th[13] = flags & ~(TCP_FIN | TCP_PSH);
+
+		/* pseudo header */
+		phlen = hdrlen - hsize - iphlen + n;
+		memset(ph, 0, sizeof(ph));
+		if (v4) {
+			hnputs(ip + 2, iphlen + phlen);
+			hnputs(ip + 4, id++);
+			ip[10] = ip[11] = 0;
+			hnputs(ip + 10, ipcsum(ip));
+			memmove(ph, ip + 12, 2 * IPv4addrlen);
+			ph[9] = IP_TCPPROTO;
+			hnputs(ph + 10, phlen);
+			hnputs(th + 16, ptclbsum(ph, 12));
+		} else {
+			hnputs(ip + 4, phlen);
+			memmove(ph, ip + 8, 2 * IPaddrlen);
+			hnputl(ph + 32, phlen);
+			ph[39] = IP_TCPPROTO;
+			hnputs(th + 16, ptclbsum(ph, 40));
+		}
+		nbp->checksum_start = hsize + iphlen;
+		nbp->checksum_offset = 16;
+		nbp->flag |= Btcpck;
+
+		*l = nbp;
+		l = &nbp->next;
+	}
+	freeb(bp);
+	return first;
+drop:
+	freeblist(bp);
+	return NULL;
+}
+
 enum {
 	Isprefix = 16,
 };
@@ -582,24 +693,214 @@ int parsemac(uint8_t * to, char *from, int len)
 
 /*
  *  hashing tcp, udp, ... connections
- *  gcc weirdness: it gave a bogus result until ron split the %= out.
+ *
+ *  the interesting bits of both v4 and v6 addresses are at the end.  we mix
+ *  the whole thing, since the table size varies and we use the low bits.
  */
 uint32_t iphash(uint8_t * sa, uint16_t sp, uint8_t * da, uint16_t dp)
 {
 	uint32_t ret;
-	ret = (sa[IPaddrlen - 1] << 24) ^ (sp << 16) ^ (da[IPaddrlen - 1] << 8)
-		^ dp;
-	ret %= Nhash;
+
+	ret = nhgetl(sa + IPaddrlen - 4) * 0x9e3779b1;
+	ret ^= nhgetl(da + IPaddrlen - 4);
+	ret = (ret ^ ((sp << 16) | dp)) * 0x9e3779b1;
+	ret ^= ret >> 16;
 	return ret;
 }
 
+static struct Iphtab *iphtaballoc(unsigned int nbuckets, int flags)
+{
+	struct Iphtab *t;
+
+	t = kzmalloc(sizeof(struct Iphtab) +
+				 nbuckets * sizeof(struct Iphtbucket), flags);
+	if (t == NULL)
+		return NULL;
+	t->mask = nbuckets - 1;
+	for (int i = 0; i < nbuckets; i++)
+		spinlock_init(&t->b[i].lock);
+	return t;
+}
+
+void iphtinit(struct Ipht *ht)
+{
+	ht->cur = iphtaballoc(Iphtmin, MEM_WAIT);
+	ht->old = NULL;
+	ht->migrated = 0;
+	spinlock_init(&ht->resizelock);
+	ht->retired = NULL;
+	ht->dying = NULL;
+	ht->dyingidx = 0;
+	ht->epoch = 0;
+	atomic_init(&ht->users[0], 0);
+	atomic_init(&ht->users[1], 0);
+	atomic_init(&ht->n, 0);
+	ht->nresize = 0;
+}
+
+/* Everyone who touches the tables is a user, counted in the epoch they saw.
+ * Returns the index to pass to iphtput().  If the epoch changes after we count
+ * ourselves, iphtreap() might have already checked that count, so we try again
+ * with the new one.  We haven't looked at any tables yet, so that's safe. */
+static int iphtget(struct Ipht *ht)
+{
+	int idx;
+
+	for (;;) {
+		idx = ACCESS_ONCE(ht->epoch) & 1;
+		atomic_inc(&ht->users[idx]);
+		mb();
+		if ((ACCESS_ONCE(ht->epoch) & 1) == idx)
+			return idx;
+		atomic_dec(&ht->users[idx]);
+	}
+}
+
+/* Frees the dying tables if their grace period is over, then starts one for
+ * the retired tables.  Only one grace period is in flight at a time, so an
+ * epoch's count is never reused before it drains.  Hold the resizelock. */
+static void iphtreap(struct Ipht *ht)
+{
+	struct Iphtab *t, *next;
+
+	if (ht->dying != NULL) {
+		mb();	/* read the count after bumping the epoch */
+		if (atomic_read(&ht->users[ht->dyingidx]) != 0)
+			return;
+		for (t = ht->dying; t != NULL; t = next) {
+			next = t->next;
+			kfree(t);
+		}
+		ht->dying = NULL;
+	}
+	if (ht->retired == NULL)
+		return;
+	ht->dying = ht->retired;
+	ht->retired = NULL;
+	ht->dyingidx = ht->epoch & 1;
+	wmb();	/* unlink the tables before new users can show up */
+	ht->epoch++;
+}
+
+static void iphtput(struct Ipht *ht, int idx)
+{
+	if (!atomic_sub_and_test(&ht->users[idx], 1))
+		return;
+	/* the last user of a dying epoch frees its tables.  if we miss the lock,
+	 * the next add or remove will. */
+	if (ht->dying == NULL || ht->dyingidx != idx)
+		return;
+	if (!spin_trylock(&ht->resizelock))
+		return;
+	iphtreap(ht);
+	spin_unlock(&ht->resizelock);
+}
+
+/* Returns the locked bucket that hv currently lives in.  Resizers publish old
+ * before cur, and we read them in the opposite order, so if we see the new cur,
+ * we see the old table too. */
+static struct Iphtbucket *iphtlock(struct Ipht *ht, uint32_t hv)
+{
+	struct Iphtab *cur, *old;
+	struct Iphtbucket *b;
+
+	for (;;) {
+		cur = ACCESS_ONCE(ht->cur);
+		rmb();
+		old = ACCESS_ONCE(ht->old);
+		if (old != NULL && old != cur) {
+			b = &old->b[hv & old->mask];
+			spin_lock(&b->lock);
+			if (!b->moved)
+				return b;
+			spin_unlock(&b->lock);
+		}
+		b = &cur->b[hv & cur->mask];
+		spin_lock(&b->lock);
+		if (!b->moved)
+			return b;
+		/* cur became old under us */
+		spin_unlock(&b->lock);
+		cpu_relax();
+	}
+}
+
+/* Moves one old bucket into cur.  Lock order is old bucket, then new. */
+static void iphtmovebucket(struct Ipht *ht, struct Iphtbucket *ob)
+{
+	struct Iphtab *cur = ht->cur;
+	struct Iphtbucket *nb;
+	struct Iphash *h;
+
+	spin_lock(&ob->lock);
+	while ((h = ob->head) != NULL) {
+		ob->head = h->next;
+		nb = &cur->b[h->hv & cur->mask];
+		spin_lock(&nb->lock);
+		h->next = nb->head;
+		nb->head = h;
+		nb->n++;
+		spin_unlock(&nb->lock);
+	}
+	ob->n = 0;
+	ob->moved = TRUE;
+	spin_unlock(&ob->lock);
+}
+
+/* Called by adders and removers: moves a few buckets if we're resizing, or
+ * starts a resize if the table is too full or too empty.  Only one thread
+ * resizes at a time; everyone else skips it. */
+static void iphtresize(struct Ipht *ht)
+{
+	struct Iphtab *old, *new;
+	unsigned int nbuckets, n, target;
+
+	if (!spin_trylock(&ht->resizelock))
+		return;
+	iphtreap(ht);
+	old = ht->old;
+	if (old != NULL) {
+		for (int i = 0; i < Iphtmigrate && ht->migrated <= old->mask; i++)
+			iphtmovebucket(ht, &old->b[ht->migrated++]);
+		if (ht->migrated > old->mask) {
+			ht->old = NULL;
+			old->next = ht->retired;
+			ht->retired = old;
+			iphtreap(ht);
+		}
+		spin_unlock(&ht->resizelock);
+		return;
+	}
+	nbuckets = ht->cur->mask + 1;
+	n = atomic_read(&ht->n);
+	if (n > nbuckets * Iphtgrow && nbuckets < Iphtmax)
+		target = nbuckets * 2;
+	else if (n < nbuckets / Iphtshrink && nbuckets > Iphtmin)
+		target = nbuckets / 2;
+	else
+		target = 0;
+	if (target != 0) {
+		/* we hold a spinlock, and can try again on the next add */
+		new = iphtaballoc(target, MEM_ATOMIC);
+		if (new != NULL) {
+			ht->migrated = 0;
+			ht->old = ht->cur;
+			wmb();
+			ht->cur = new;
+			ht->nresize++;
+		}
+	}
+	spin_unlock(&ht->resizelock);
+}
+
 void iphtadd(struct Ipht *ht, struct conv *c)
 {
-	uint32_t hv;
 	struct Iphash *h;
+	struct Iphtbucket *b;
+	int idx;
 
-	hv = iphash(c->raddr, c->rport, c->laddr, c->lport);
 	h = kzmalloc(sizeof(*h), 0);
+	h->hv = iphash(c->raddr, c->rport, c->laddr, c->lport);
 	if (ipcmp(c->raddr, IPnoaddr) != 0)
 		h->match = IPmatchexact;
 	else {
@@ -617,27 +918,84 @@ void iphtadd(struct Ipht *ht, struct conv *c)
 	}
 	h->c = c;
 
-	spin_lock(&ht->lock);
-	h->next = ht->tab[hv];
-	ht->tab[hv] = h;
-	spin_unlock(&ht->lock);
+	idx = iphtget(ht);
+	b = iphtlock(ht, h->hv);
+	h->next = b->head;
+	b->head = h;
+	b->n++;
+	spin_unlock(&b->lock);
+	atomic_inc(&ht->n);
+	iphtresize(ht);
+	iphtput(ht, idx);
 }
 
 void iphtrem(struct Ipht *ht, struct conv *c)
 {
 	uint32_t hv;
-	struct Iphash **l, *h;
+	struct Iphash **l, *h = NULL;
+	struct Iphtbucket *b;
+	int idx;
 
 	hv = iphash(c->raddr, c->rport, c->laddr, c->lport);
-	spin_lock(&ht->lock);
-	for (l = &ht->tab[hv]; (*l) != NULL; l = &(*l)->next)
+	idx = iphtget(ht);
+	b = iphtlock(ht, hv);
+	for (l = &b->head; (*l) != NULL; l = &(*l)->next)
 		if ((*l)->c == c) {
 			h = *l;
 			(*l) = h->next;
-			kfree(h);
+			b->n--;
 			break;
 		}
-	spin_unlock(&ht->lock);
+	spin_unlock(&b->lock);
+	if (h != NULL) {
+		kfree(h);
+		atomic_dec(&ht->n);
+		iphtresize(ht);
+	}
+	iphtput(ht, idx);
+}
+
+static bool iphtmatch(struct Iphash *h, int match, uint8_t * sa, uint16_t sp,
+					  uint8_t * da, uint16_t dp)
+{
+	struct conv *c = h->c;
+
+	if (h->match != match)
+		return FALSE;
+	switch (match) {
+		case IPmatchexact:
+			return sp == c->rport && dp == c->lport
+				&& ipcmp(sa, c->raddr) == 0 && ipcmp(da, c->laddr) == 0;
+		case IPmatchpa:
+			return dp == c->lport && ipcmp(da, c->laddr) == 0;
+		case IPmatchport:
+			return dp == c->lport;
+		case IPmatchaddr:
+			return ipcmp(da, c->laddr) == 0;
+		case IPmatchany:
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Looks in the bucket for hv for an entry of type match. */
+static struct conv *iphtprobe(struct Ipht *ht, uint32_t hv, int match,
+							  uint8_t * sa, uint16_t sp, uint8_t * da,
+							  uint16_t dp)
+{
+	struct Iphtbucket *b;
+	struct Iphash *h;
+	struct conv *c = NULL;
+
+	b = iphtlock(ht, hv);
+	for (h = b->head; h != NULL; h = h->next) {
+		if (h->hv == hv && iphtmatch(h, match, sa, sp, da, dp)) {
+			c = h->c;
+			break;
+		}
+	}
+	spin_unlock(&b->lock);
+	return c;
 }
 
 /* look for a matching conversation with the following precedence
@@ -650,69 +1008,61 @@ void iphtrem(struct Ipht *ht, struct conv *c)
 struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
 					  uint16_t dp)
 {
-	uint32_t hv;
-	struct Iphash *h;
 	struct conv *c;
+	int idx;
 
+	idx = iphtget(ht);
 	/* exact 4 pair match (connection) */
-	hv = iphash(sa, sp, da, dp);
-	spin_lock(&ht->lock);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchexact)
-			continue;
-		c = h->c;
-		if (sp == c->rport && dp == c->lport
-			&& ipcmp(sa, c->raddr) == 0 && ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
-			return c;
-		}
-	}
-
+	c = iphtprobe(ht, iphash(sa, sp, da, dp), IPmatchexact, sa, sp, da, dp);
 	/* match local address and port */
-	hv = iphash(IPnoaddr, 0, da, dp);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchpa)
-			continue;
-		c = h->c;
-		if (dp == c->lport && ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
-			return c;
-		}
-	}
-
+	if (c == NULL)
+		c = iphtprobe(ht, iphash(IPnoaddr, 0, da, dp), IPmatchpa,
+					  sa, sp, da, dp);
 	/* match just port */
-	hv = iphash(IPnoaddr, 0, IPnoaddr, dp);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchport)
-			continue;
-		c = h->c;
-		if (dp == c->lport) {
-			spin_unlock(&ht->lock);
-			return c;
-		}
-	}
-
+	if (c == NULL)
+		c = iphtprobe(ht, iphash(IPnoaddr, 0, IPnoaddr, dp), IPmatchport,
+					  sa, sp, da, dp);
 	/* match local address */
-	hv = iphash(IPnoaddr, 0, da, 0);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchaddr)
-			continue;
-		c = h->c;
-		if (ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
-			return c;
-		}
-	}
-
+	if (c == NULL)
+		c = iphtprobe(ht, iphash(IPnoaddr, 0, da, 0), IPmatchaddr,
+					  sa, sp, da, dp);
 	/* look for something that matches anything */
-	hv = iphash(IPnoaddr, 0, IPnoaddr, 0);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchany)
+	if (c == NULL)
+		c = iphtprobe(ht, iphash(IPnoaddr, 0, IPnoaddr, 0), IPmatchany,
+					  sa, sp, da, dp);
+	iphtput(ht, idx);
+	return c;
+}
+
+/* Prints the table's size and bucket occupancy, for the protocol stats files.
+ * The bucket counts are read without locks, so they're approximate. */
+char *iphtstats(struct Ipht *ht, char *p, char *e)
+{
+	struct Iphtab *t;
+	unsigned int n, maxn = 0;
+	unsigned int hist[5] = {0};
+	int idx;
+
+	idx = iphtget(ht);
+	for (int i = 0; i < 2; i++) {
+		t = i == 0 ? ACCESS_ONCE(ht->cur) : ACCESS_ONCE(ht->old);
+		if (t == NULL)
 			continue;
-		c = h->c;
-		spin_unlock(&ht->lock);
-		return c;
+		for (int j = 0; j <= t->mask; j++) {
+			if (t->b[j].moved)
+				continue;
+			n = t->b[j].n;
+			maxn = MAX(maxn, n);
+			hist[MIN(n, 4)]++;
+		}
 	}
-	spin_unlock(&ht->lock);
-	return NULL;
+	p = seprintf(p, e, "HashEntries: %ld\n", atomic_read(&ht->n));
+	p = seprintf(p, e, "HashBuckets: %u\n", ht->cur->mask + 1);
+	p = seprintf(p, e, "HashResizing: %d\n", ht->old != NULL);
+	p = seprintf(p, e, "HashResizes: %lu\n", ht->nresize);
+	p = seprintf(p, e, "HashMaxChain: %u\n", maxn);
+	p = seprintf(p, e, "HashChains: 0:%u 1:%u 2:%u 3:%u 4+:%u\n",
+				 hist[0], hist[1], hist[2], hist[3], hist[4]);
+	iphtput(ht, idx);
+	return p;
 }
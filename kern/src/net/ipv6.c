@@ -236,7 +236,8 @@ int ipoput6(struct Fs *f, struct block *bp,
 
 	/* If we dont need to fragment just send it */
 	medialen = ifc->maxtu - ifc->m->hsize;
-	if (len <= medialen) {
+	if (len <= medialen
+	    || ((bp->flag & Btso) && ((ifc->feat & NETF_TSO) || ifc->m->gso))) {
 		hnputs(eh->ploadlen, len - IPV6HDR_LEN);
 		ifc->m->bwrite(ifc, bp, V6, gate);
 		runlock(&ifc->rwlock);
@@ -346,13 +346,16 @@ struct block *netifbread(struct ether *nif, struct chan *c, long n,
 	if ((c->qid.type & QTDIR) || NETTYPE(c->qid.path) != Ndataqid)
 		return devbread(c, n, offset);
 
+	if (c->flag & O_NONBLOCK)
+		return qbread_nonblock(nif->f[NETID(c->qid.path)]->in, n);
 	return qbread(nif->f[NETID(c->qid.path)]->in, n);
 }
 
 /*
- *  make sure this type isn't already in use on this device
+ *  make sure this type isn't already in use on this device, or on this
+ *  rx queue of it
  */
-static int typeinuse(struct ether *nif, int type)
+static int typeinuse(struct ether *nif, int type, int rxq)
 {
 	struct netfile *f, **fp, **efp;
 
@@ -364,12 +367,24 @@ static int typeinuse(struct ether *nif, int type)
 		f = *fp;
 		if (f == 0)
 			continue;
-		if (f->type == type)
+		if (f->type == type && f->rxq == rxq)
 			return 1;
 	}
 	return 0;
 }
 
+/*
+ *  bind f to rx queue rxq, or to none if rxq < 0.  called with nif qlocked.
+ */
+static void netifbindq(struct ether *nif, struct netfile *f, int rxq)
+{
+	if (f->rxq >= 0)
+		nif->queues[f->rxq].nbound--;
+	f->rxq = rxq;
+	if (f->rxq >= 0)
+		nif->queues[f->rxq].nbound++;
+}
+
 /*
  *  the devxxx.c that calls us handles writing data, it knows best
  */
@@ -377,8 +392,8 @@ long netifwrite(struct ether *nif, struct chan *c, void *a, long n)
 {
 	ERRSTACK(1);
 	struct netfile *f;
-	int type;
-	char *p, buf[64];
+	int type, rxq;
+	char *p, *e, buf[64];
 	uint8_t binaddr[Nmaxaddr];
 
 	if (NETTYPE(c->qid.path) != Nctlqid)
@@ -397,9 +412,16 @@ long netifwrite(struct ether *nif, struct chan *c, void *a, long n)
 
 	f = nif->f[NETID(c->qid.path)];
 	if ((p = matchtoken(buf, "connect")) != 0) {
-		type = strtol(p, 0, 0);	/* allows any base, though usually hex */
-		if (typeinuse(nif, type))
+		type = strtol(p, &p, 0);	/* allows any base, though usually hex */
+		/* optionally only hear frames from one rx queue */
+		rxq = strtol(p, &e, 0);
+		if (e == p)
+			rxq = -1;
+		else if (rxq < 0 || rxq >= nif->nqueues)
+			error(EINVAL, "no rx queue %d", rxq);
+		if (typeinuse(nif, type, rxq))
 			error(EBUSY, ERROR_FIXME);
+		netifbindq(nif, f, rxq);
 		f->type = type;
 		if (f->type < 0)
 			nif->all++;
@@ -517,9 +539,11 @@ void netifclose(struct ether *nif, struct chan *c)
 			qunlock(&nif->qlock);
 			f->nmaddr = 0;
 		}
-		if (f->type < 0) {
+		if (f->type < 0 || f->rxq >= 0) {
 			qlock(&nif->qlock);
-			--(nif->all);
+			if (f->type < 0)
+				--(nif->all);
+			netifbindq(nif, f, -1);
 			qunlock(&nif->qlock);
 		}
 		f->owner[0] = 0;
@@ -612,6 +636,7 @@ static int openfile(struct ether *nif, int id)
 			}
 		}
 		f->inuse = 1;
+		f->rxq = -1;
 		qreopen(f->in);
 		netown(f, current->user, 0);
 		qunlock(&f->qlock);
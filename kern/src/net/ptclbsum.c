@@ -40,6 +40,8 @@
 #include <smp.h>
 #include <ip.h>
 #include <endian.h>
+#include <cpu_feat.h>
+#include <linker_func.h>
 
 static short endian = 1;
 static uint8_t *aendian = (uint8_t *) & endian;
@@ -207,16 +209,248 @@ in_cksumdata(const void *buf, int len)
 	REDUCE32;
 	return sum;
 }
-uint16_t ptclbsum(uint8_t * addr, int len)
+
+static uint64_t cksum_scalar(uint8_t *dst, const uint8_t *src, int len)
+{
+	uint64_t sum = in_cksumdata(src, len);
+
+	if (dst)
+		memmove(dst, src, len);
+	if ((uintptr_t)src & 1)
+		sum <<= 8;
+	return sum;
+}
+
+/*
+ * SIMD kernels.  The kernel is built without SSE, so gcc never touches the
+ * vector registers, and whatever is in them belongs to the user.  The SSE2
+ * kernel saves the xmm registers it uses on the stack and puts them back before
+ * returning.  Legacy SSE leaves the upper halves of ymm/zmm alone, so that's
+ * enough, and anything that nests (an IRQ) saves and restores in turn.
+ *
+ * VEX instructions zero bits 511:256 of the zmm registers they write, and
+ * vzeroupper clears the upper halves of all of them, so the AVX2 kernel XSAVEs
+ * the SSE, AVX and ZMM_Hi256 components to a per-core area and XRSTORs them
+ * when it's done.  IRQs are off in between, so nothing nests on that area.
+ *
+ * The kernels return the sum of the little-endian 32-bit words of src, counted
+ * from src itself.  They only run the vector loop over whole blocks; the rest
+ * is summed by cksum_tail().
+ */
+static uint64_t cksum_tail(uint8_t *dst, const uint8_t *src, int len)
+{
+	uint64_t sum = 0;
+	uint32_t w;
+
+	if (dst)
+		memmove(dst, src, len);
+	for (; len >= 4; len -= 4, src += 4) {
+		memcpy(&w, src, 4);
+		sum += w;
+	}
+	w = 0;
+	memcpy(&w, src, len);
+	return sum + w;
+}
+
+static uint64_t cksum_sse2(uint8_t *dst, const uint8_t *src, int len)
+{
+	uint8_t save[4 * 16];
+	uint64_t acc[2];
+	long n = len / 16;
+
+	if (n == 0)
+		return cksum_tail(dst, src, len);
+	asm volatile("movdqu %%xmm0, 0(%[save]);"
+	             "movdqu %%xmm1, 16(%[save]);"
+	             "movdqu %%xmm2, 32(%[save]);"
+	             "movdqu %%xmm3, 48(%[save]);"
+	             "pxor %%xmm1, %%xmm1;"
+	             "pxor %%xmm2, %%xmm2;"
+	             "test %[dst], %[dst];"
+	             "jz 2f;"
+	             "1: movdqu (%[src]), %%xmm0;"
+	             "movdqu %%xmm0, (%[dst]);"
+	             "movdqa %%xmm0, %%xmm3;"
+	             "punpckldq %%xmm1, %%xmm0;"
+	             "punpckhdq %%xmm1, %%xmm3;"
+	             "paddq %%xmm0, %%xmm2;"
+	             "paddq %%xmm3, %%xmm2;"
+	             "add $16, %[src];"
+	             "add $16, %[dst];"
+	             "dec %[n];"
+	             "jnz 1b;"
+	             "jmp 3f;"
+	             "2: movdqu (%[src]), %%xmm0;"
+	             "movdqa %%xmm0, %%xmm3;"
+	             "punpckldq %%xmm1, %%xmm0;"
+	             "punpckhdq %%xmm1, %%xmm3;"
+	             "paddq %%xmm0, %%xmm2;"
+	             "paddq %%xmm3, %%xmm2;"
+	             "add $16, %[src];"
+	             "dec %[n];"
+	             "jnz 2b;"
+	             "3: movdqu %%xmm2, (%[acc]);"
+	             "movdqu 0(%[save]), %%xmm0;"
+	             "movdqu 16(%[save]), %%xmm1;"
+	             "movdqu 32(%[save]), %%xmm2;"
+	             "movdqu 48(%[save]), %%xmm3;"
+	             : [src] "+r" (src), [dst] "+r" (dst), [n] "+r" (n)
+	             : [save] "r" (save), [acc] "r" (acc)
+	             : "memory", "cc");
+	return acc[0] + acc[1] + cksum_tail(dst, src, len % 16);
+}
+
+/* State components the AVX2 kernel disturbs: SSE, AVX and ZMM_Hi256 */
+#define CKSUM_AVX2_XSTATE	((1 << 1) | (1 << 2) | (1 << 6))
+
+/* Per-core save areas for the AVX2 kernel, allocated at boot if we use it */
+static struct ancillary_state *cksum_xsave;
+
+static void cksum_xsave_save(struct ancillary_state *xs)
+{
+	uint64_t mask = __proc_global_info.x86_default_xcr0 & CKSUM_AVX2_XSTATE;
+
+	asm volatile("xsave64 %0" : "=m"(*xs) : "a"((uint32_t)mask),
+	             "d"((uint32_t)(mask >> 32)) : "memory");
+}
+
+static void cksum_xsave_restore(struct ancillary_state *xs)
+{
+	uint64_t mask = __proc_global_info.x86_default_xcr0 & CKSUM_AVX2_XSTATE;
+
+	asm volatile("xrstor64 %0" : : "m"(*xs), "a"((uint32_t)mask),
+	             "d"((uint32_t)(mask >> 32)) : "memory");
+}
+
+static uint64_t cksum_avx2(uint8_t *dst, const uint8_t *src, int len)
+{
+	uint64_t acc[4];
+	long n = len / 64;
+	int8_t irq_state = 0;
+	struct ancillary_state *xs;
+
+	if (n == 0)
+		return cksum_sse2(dst, src, len);
+	disable_irqsave(&irq_state);
+	xs = &cksum_xsave[core_id()];
+	cksum_xsave_save(xs);
+	asm volatile("vpxor %%ymm2, %%ymm2, %%ymm2;"
+	             "vpxor %%ymm3, %%ymm3, %%ymm3;"
+	             "test %[dst], %[dst];"
+	             "jz 2f;"
+	             "1: vmovdqu (%[src]), %%ymm0;"
+	             "vmovdqu 32(%[src]), %%ymm1;"
+	             "vmovdqu %%ymm0, (%[dst]);"
+	             "vmovdqu %%ymm1, 32(%[dst]);"
+	             "add $64, %[dst];"
+	             "2: vpmovzxdq (%[src]), %%ymm0;"
+	             "vpmovzxdq 16(%[src]), %%ymm1;"
+	             "vpaddq %%ymm0, %%ymm2, %%ymm2;"
+	             "vpaddq %%ymm1, %%ymm3, %%ymm3;"
+	             "vpmovzxdq 32(%[src]), %%ymm0;"
+	             "vpmovzxdq 48(%[src]), %%ymm1;"
+	             "vpaddq %%ymm0, %%ymm2, %%ymm2;"
+	             "vpaddq %%ymm1, %%ymm3, %%ymm3;"
+	             "add $64, %[src];"
+	             "dec %[n];"
+	             "jz 3f;"
+	             "test %[dst], %[dst];"
+	             "jnz 1b;"
+	             "jmp 2b;"
+	             "3: vpaddq %%ymm3, %%ymm2, %%ymm2;"
+	             "vmovdqu %%ymm2, (%[acc]);"
+	             "vzeroupper;"
+	             : [src] "+r" (src), [dst] "+r" (dst), [n] "+r" (n)
+	             : [acc] "r" (acc)
+	             : "memory", "cc");
+	cksum_xsave_restore(xs);
+	enable_irqsave(&irq_state);
+	return acc[0] + acc[1] + acc[2] + acc[3]
+	       + cksum_sse2(dst, src, len % 64);
+}
+
+static bool cksum_has_sse2(void)
+{
+	return cpu_has_feat(CPU_FEAT_X86_SSE2);
+}
+
+static bool cksum_has_avx2(void)
+{
+	/* the OS has to have turned on the ymm state, too */
+	return cpu_has_feat(CPU_FEAT_X86_AVX2)
+	       && cpu_has_feat(CPU_FEAT_X86_XSAVE)
+	       && (__proc_global_info.x86_default_xcr0 & 0x6) == 0x6;
+}
+
+static struct cksum_kernel {
+	char *name;
+	bool (*usable)(void);
+	uint64_t (*sum)(uint8_t *dst, const uint8_t *src, int len);
+} cksum_kernels[] = {
+	[PTCLBSUM_SCALAR] {"scalar", NULL, cksum_scalar},
+	[PTCLBSUM_SSE2] {"sse2", cksum_has_sse2, cksum_sse2},
+	[PTCLBSUM_AVX2] {"avx2", cksum_has_avx2, cksum_avx2},
+};
+
+/* below this, saving and restoring the vector registers isn't worth it */
+enum {
+	CKSUM_SIMD_MIN = 64,
+};
+
+static uint64_t (*cksum_best)(uint8_t *, const uint8_t *, int) = cksum_scalar;
+
+static uint16_t cksum_fold(uint64_t sum)
 {
-	uint64_t sum = in_cksumdata(addr, len);
 	union q_util q_util;
 	union l_util l_util;
-	if ((uintptr_t)addr & 1)
-		sum <<= 8;
+
 	REDUCE16;
 	return cpu_to_be16(sum);
 }
+
+uint16_t ptclbsum(uint8_t *addr, int len)
+{
+	if (len < CKSUM_SIMD_MIN)
+		return cksum_fold(cksum_scalar(NULL, addr, len));
+	return cksum_fold(cksum_best(NULL, addr, len));
+}
+
+uint16_t ptclbcopysum(uint8_t *dst, uint8_t *src, int len)
+{
+	if (len < CKSUM_SIMD_MIN)
+		return cksum_fold(cksum_scalar(dst, src, len));
+	return cksum_fold(cksum_best(dst, src, len));
+}
+
+int ptclbsum_kernel(int kernel, uint8_t *dst, uint8_t *src, int len)
+{
+	struct cksum_kernel *k;
+
+	if (kernel < 0 || kernel >= ARRAY_SIZE(cksum_kernels))
+		return -1;
+	k = &cksum_kernels[kernel];
+	if (k->usable && !k->usable())
+		return -1;
+	return cksum_fold(k->sum(dst, src, len));
+}
+
+/* pick the best kernel we have.  this runs after arch_init() has set xcr0. */
+linker_func_1(ptclbsum_init)
+{
+	int i;
+
+	/* zeroed, so the XSAVE headers start out valid for XRSTOR */
+	if (cksum_has_avx2())
+		cksum_xsave = kzmalloc_align(sizeof(struct ancillary_state) * num_cores,
+		                             MEM_WAIT, 64);
+	for (i = ARRAY_SIZE(cksum_kernels) - 1; i > 0; i--) {
+		if (cksum_kernels[i].usable())
+			break;
+	}
+	cksum_best = cksum_kernels[i].sum;
+	printk("ptclbsum: using %s checksums\n", cksum_kernels[i].name);
+}
 #else
 uint16_t ptclbsum(uint8_t * addr, int len)
 {
@@ -284,4 +518,19 @@ uint16_t ptclbsum(uint8_t * addr, int len)
 
 	return losum & 0xffff;
 }
+
+uint16_t ptclbcopysum(uint8_t *dst, uint8_t *src, int len)
+{
+	memmove(dst, src, len);
+	return ptclbsum(src, len);
+}
+
+int ptclbsum_kernel(int kernel, uint8_t *dst, uint8_t *src, int len)
+{
+	if (kernel != PTCLBSUM_SCALAR)
+		return -1;
+	if (dst)
+		return ptclbcopysum(dst, src, len);
+	return ptclbsum(src, len);
+}
 #endif
@@ -90,8 +90,14 @@ enum {
 	MSS_LENGTH = 4,	/* Mean segment size */
 	WSOPT = 3,
 	WS_LENGTH = 3,	/* Bits to scale window size by */
+	SACKOKOPT = 4,
+	SACKOK_LENGTH = 2,	/* Selective acks permitted */
+	SACKOPT = 5,
+	SACKBLK_LENGTH = 8,	/* Per block of a selective ack */
+	TSOPT = 8,
+	TS_LENGTH = 10,	/* Timestamp value and echo reply */
 	MSL2 = 10,
-	MSPTICK = 50,	/* Milliseconds per timer tick */
+	MSPTICK = 50,	/* Milliseconds per limbo retransmit tick */
 	DEF_MSS = 1460,	/* Default mean segment */
 	DEF_MSS6 = 1280,	/* Default mean segment (min) for v6 */
 	DEF_RTT = 500,	/* Default round trip */
@@ -101,6 +107,23 @@ enum {
 	SYNACK_RXTIMER = 250,	/* ms between SYNACK retransmits */
 
 	TCPREXMTTHRESH = 3,	/* dupack threshhold for rxt */
+	PAWSIDLE = 24 * 24 * 60 * 60 * 1000,	/* ms until ts.recent goes stale */
+
+	Nsack = 4,	/* most SACK blocks in a segment */
+	Nscoreboard = 16,	/* SACK blocks remembered by the sender */
+	Nxmit = 64,	/* transmissions remembered for RACK, at first */
+	Nxmitmax = 8192,	/* the ring grows with the flight up to this */
+
+	Xrexmit = 1,	/* Tcpxmit flags */
+	Xdelivered = 2,
+	Xlost = 4,
+
+	Bbrstartup = 0,	/* BBR modes */
+	Bbrdrain,
+	Bbrprobebw,
+	Bbrprobertt,
+	Nbbrbw = 10,	/* rounds of bandwidth samples BBR keeps */
+	BBRUNIT = 256,	/* fixed point 1.0 for BBR gains */
 
 	FORCE = 1,
 	CLONE = 2,
@@ -140,12 +163,12 @@ char *tcpstates[] = {
 
 typedef struct Tcptimer Tcptimer;
 struct Tcptimer {
-	Tcptimer *next;
-	Tcptimer *prev;
-	Tcptimer *readynext;
+	struct alarm_waiter alarm;
+	struct timer_chain *tchain;	/* pcpu wheel we're armed on, if any */
+	spinlock_t lock;
 	int state;
-	uint64_t start;
-	uint64_t count;
+	uint64_t start;				/* in ms */
+	uint64_t armed;				/* TSC when last started */
 	void (*func) (void *);
 	void *arg;
 };
@@ -198,6 +221,12 @@ struct Tcp6hdr {
 	uint8_t tcpopt[1];
 };
 
+typedef struct Sackblk Sackblk;
+struct Sackblk {
+	uint32_t left;
+	uint32_t right;				/* first seq after the block */
+};
+
 /*
  *  this represents the control info
  *  for a single packet.  It is derived from
@@ -216,6 +245,24 @@ struct Tcp {
 	uint16_t urg;
 	uint16_t mss;				/* max segment size option (if not zero) */
 	uint16_t len;				/* size of data */
+	uint8_t sackok;				/* sack permitted option (SYN only) */
+	uint8_t nsacks;				/* number of sack blocks */
+	Sackblk sacks[Nsack];
+	uint8_t ts;					/* timestamp option present */
+	uint32_t tsval;
+	uint32_t tsecr;
+};
+
+/*
+ *  a transmitted segment, remembered for RACK loss detection.
+ *  they're kept in the order they were sent.
+ */
+typedef struct Tcpxmit Tcpxmit;
+struct Tcpxmit {
+	uint32_t seq;
+	uint32_t end;
+	uint64_t time;				/* TSC when sent */
+	int flags;
 };
 
 /*
@@ -230,6 +277,8 @@ struct Reseq {
 	uint16_t length;
 };
 
+typedef struct Tcpcc Tcpcc;
+
 /*
  *  the qlock in the Conv locks this structure
  */
@@ -250,6 +299,11 @@ struct Tcpctl {
 		uint32_t dupacks;		/* number of duplicate acks rcvd */
 		int recovery;			/* loss recovery flag */
 		uint32_t rxt;			/* right window marker for recovery */
+		/* SACK scoreboard, sorted and disjoint */
+		Sackblk sacks[Nscoreboard];
+		int nsacks;
+		uint32_t hole;			/* holes below this have been resent */
+		uint32_t lost;			/* holes below this are lost */
 	} snd;
 	struct {
 		uint32_t nxt;			/* Receive pointer to next uint8_t slot */
@@ -258,12 +312,19 @@ struct Tcpctl {
 		int blocked;
 		int una;				/* unacked data segs */
 		int scale;				/* how much to left shift window in rcved packets */
+		uint32_t lastsack;		/* seq of latest out of order segment */
+		uint32_t lastack;		/* ack in the last segment we sent */
 	} rcv;
 	uint32_t iss;				/* Initial sequence number */
 	int sawwsopt;				/* true if we saw a wsopt on the incoming SYN */
+	int sackok;					/* both ends do selective acks */
+	int tsok;					/* both ends do timestamps */
+	uint32_t tsoffset;			/* added to our clock for tsval */
+	uint32_t tsrecent;			/* tsval to echo */
+	uint64_t tsrecentage;		/* ms when tsrecent was set */
 	uint32_t cwind;				/* Congestion window */
 	int scale;					/* desired snd.scale */
-	uint16_t ssthresh;			/* Slow start threshold */
+	uint32_t ssthresh;			/* Slow start threshold */
 	int resent;					/* Bytes just resent */
 	int irs;					/* Initial received squence */
 	uint16_t mss;				/* Mean segment size */
@@ -277,6 +338,49 @@ struct Tcpctl {
 	Tcptimer acktimer;			/* Acknowledge timer */
 	Tcptimer rtt_timer;			/* Round trip timer */
 	Tcptimer katimer;			/* keep alive timer */
+	Tcptimer racktimer;			/* RACK reordering timer */
+	struct {
+		uint64_t xmit;			/* send time of latest delivered segment */
+		uint32_t end;			/* and its end */
+		uint64_t rtt;			/* and its round trip, in TSC ticks */
+		uint64_t minrtt;
+		Tcpxmit *xmits;			/* ring of transmissions */
+		int xmitsize;
+		int xmittail;
+		int nxmit;
+	} rack;
+	Tcpcc *cc;					/* congestion control */
+	union {
+		struct {
+			uint32_t wmax;		/* cwind at the last loss */
+			uint64_t epoch;		/* TSC when growth restarted, 0 if not yet */
+			uint64_t k;			/* ms from epoch until back at wmax */
+			uint32_t west;		/* what reno would have by now */
+			uint64_t minrtt;	/* us */
+		} cubic;
+		struct {
+			int mode;
+			uint64_t btlbw;		/* bytes/sec, max of bws */
+			uint64_t bws[Nbbrbw];	/* delivery rate of recent rounds */
+			uint64_t minrtt;	/* us */
+			uint64_t minrttstamp;	/* TSC when minrtt was seen */
+			uint64_t delivered;	/* bytes acked */
+			uint64_t rounds;
+			uint32_t roundend;	/* the round is over when this is acked */
+			uint64_t roundstart;	/* TSC */
+			uint64_t rounddelivered;
+			uint64_t fullbw;	/* startup is over once bw stops growing */
+			int fullbwcnt;
+			int fullbwreached;
+			int cycle;			/* place in the probe_bw gain cycle */
+			uint64_t probertt;	/* TSC when probe_rtt is over */
+			uint32_t priorcwind;
+		} bbr;
+	} ccs;
+	uint64_t pacerate;			/* bytes/sec, 0 to not pace */
+	uint64_t pacetokens;		/* bytes we may send now */
+	uint64_t pacetime;			/* TSC of the last refill */
+	Tcptimer pacetimer;
 	uint32_t rttseq;			/* Round trip sequence */
 	int srtt;					/* Shortened round trip */
 	int mdev;					/* Mean deviation of round trip */
@@ -292,6 +396,21 @@ struct Tcpctl {
 	} protohdr;					/* prototype header */
 };
 
+/*
+ *  congestion control modules.  ack is called for every ack of new data,
+ *  after snd.una moves; rttus is a round trip sample or 0.  loss is called
+ *  on entering fast recovery and timeout on a retransmit timeout, after
+ *  which we go back to a single segment.
+ */
+struct Tcpcc {
+	char *name;
+	void (*init) (Tcpctl *);
+	void (*ack) (Tcpctl *, uint32_t acked, uint64_t rttus);
+	void (*loss) (Tcpctl *);
+	void (*timeout) (Tcpctl *);
+	void (*recovered) (Tcpctl *);	/* may be NULL */
+};
+
 /*
  *  New calls are put in limbo rather than having a conversation structure
  *  allocated.  Thus, a SYN attack results in lots of limbo'd calls but not
@@ -321,6 +440,10 @@ struct Limbo {
 	uint64_t lastsend;			/* last time we sent a synack */
 	uint8_t version;			/* v4 or v6 */
 	uint8_t rexmits;			/* number of retransmissions */
+	uint8_t sackok;				/* they sent sack permitted */
+	uint8_t tsok;				/* they sent a timestamp */
+	uint32_t tsrecent;			/* their latest tsval */
+	uint32_t tsoffset;			/* added to our clock for tsval */
 };
 
 int tcp_irtt = DEF_RTT;			/* Initial guess at round trip time */
@@ -345,6 +468,13 @@ enum {
 	HlenErrs,
 	LenErrs,
 	OutOfOrder,
+	FastRecovery,
+	SackRecovery,
+	RackRecovery,
+	SackRexmitSegs,
+	RackLostSegs,
+	RackTimeouts,
+	PawsDrops,
 
 	Nstats
 };
@@ -365,14 +495,17 @@ static char *statnames[] = {
 	[HlenErrs] "HlenErrs",
 	[LenErrs] "LenErrs",
 	[OutOfOrder] "OutOfOrder",
+	[FastRecovery] "FastRecovery",
+	[SackRecovery] "SackRecovery",
+	[RackRecovery] "RackRecovery",
+	[SackRexmitSegs] "SackRexmitSegs",
+	[RackLostSegs] "RackLostSegs",
+	[RackTimeouts] "RackTimeouts",
+	[PawsDrops] "PawsDrops",
 };
 
 typedef struct Tcppriv Tcppriv;
 struct tcppriv {
-	/* List of active timers */
-	qlock_t tl;
-	Tcptimer *timers;
-
 	/* hash table for matching conversations */
 	struct Ipht ht;
 
@@ -380,7 +513,7 @@ struct tcppriv {
 	int nlimbo;
 	Limbo *lht[NLHT];
 
-	/* for keeping track of tcpackproc */
+	/* for keeping track of tcpackproc, which retransmits limbo SYN ACKs */
 	qlock_t apl;
 	int ackprocstarted;
 
@@ -398,6 +531,16 @@ struct tcppriv {
  */
 int tcpporthogdefense = 0;
 
+/*
+ *  offer and accept selective acks (RFC 2018)
+ */
+int tcpsack = 1;
+
+/*
+ *  offer and accept timestamps (RFC 7323)
+ */
+int tcpts = 1;
+
 int addreseq(Tcpctl *, struct tcppriv *, Tcp *, struct block *, uint16_t);
 void getreseq(Tcpctl *, Tcp *, struct block **, uint16_t *);
 void localclose(struct conv *, char *unused_char_p_t);
@@ -410,6 +553,8 @@ void tcptimeout(void *);
 void tcpsndsyn(struct conv *, Tcpctl *);
 void tcprcvwin(struct conv *);
 void tcpacktimer(void *);
+void tcpracktimer(void *);
+void tcppacetimer(void *);
 void tcpkeepalive(void *);
 void tcpsetkacounter(Tcpctl *);
 void tcprxmit(struct conv *);
@@ -418,6 +563,11 @@ void tcpsynackrtt(struct conv *);
 void tcpsetscale(struct conv *, Tcpctl *, uint16_t, uint16_t);
 
 static void limborexmit(struct Proto *);
+static Tcpcc renocc;
+static void tcpsetcc(Tcpctl *, Tcpcc *);
+static uint32_t tcppace(struct conv *, uint32_t);
+static void tcppacerate(Tcpctl *, uint64_t);
+static uint64_t tcptimerleft(Tcptimer *);
 static void limbo(struct conv *, uint8_t * unused_uint8_p_t, uint8_t *, Tcp *,
 				  int);
 
@@ -476,14 +626,15 @@ static int tcpstate(struct conv *c, char *state, int n)
 	s = (Tcpctl *) (c->ptcl);
 
 	return snprintf(state, n,
-					"%s qin %d qout %d srtt %d mdev %d cwin %u swin %u>>%d rwin %u>>%d timer.start %llu timer.count %llu rerecv %d katimer.start %d katimer.count %d\n",
+					"%s qin %d qout %d srtt %d rttvar %d sack %d ts %d cwin %u swin %u>>%d rwin %u>>%d timer.start %llu timer.count %llu rerecv %d katimer.start %llu katimer.count %llu cc %s ssthresh %u\n",
 					tcpstates[s->state],
 					c->rq ? qlen(c->rq) : 0,
 					c->wq ? qlen(c->wq) : 0,
-					s->srtt, s->mdev,
+					s->srtt >> LOGAGAIN, s->mdev >> LOGDGAIN, s->sackok, s->tsok,
 					s->cwind, s->snd.wnd, s->rcv.scale, s->rcv.wnd,
-					s->snd.scale, s->timer.start, s->timer.count, s->rerecv,
-					s->katimer.start, s->katimer.count);
+					s->snd.scale, s->timer.start, tcptimerleft(&s->timer),
+					s->rerecv, s->katimer.start, tcptimerleft(&s->katimer),
+					s->cc != NULL ? s->cc->name : "none", s->ssthresh);
 }
 
 static int tcpinuse(struct conv *c)
@@ -642,94 +793,94 @@ static void tcpcreate(struct conv *c)
 	c->wq = qopen(8 * QMAX, Qkick, tcpkick, c);
 }
 
-static void timerstate(struct tcppriv *priv, Tcptimer * t, int newstate)
+/*
+ *  timers sit on the per-core timer wheels (tchains) of whichever core
+ *  armed them, with ms resolution, so acks and retransmits for different
+ *  conversations fire on time and in parallel.  they are RKM alarms, so the
+ *  handlers may qlock the conversation.
+ */
+static void tcptimerfire(struct alarm_waiter *a)
 {
-	if (newstate != TcptimerON) {
-		if (t->state == TcptimerON) {
-			// unchain
-			if (priv->timers == t) {
-				priv->timers = t->next;
-				if (t->prev != NULL)
-					panic("timerstate1");
-			}
-			if (t->next)
-				t->next->prev = t->prev;
-			if (t->prev)
-				t->prev->next = t->next;
-			t->next = t->prev = NULL;
-		}
-	} else {
-		if (t->state != TcptimerON) {
-			// chain
-			if (t->prev != NULL || t->next != NULL)
-				panic("timerstate2");
-			t->prev = NULL;
-			t->next = priv->timers;
-			if (t->next)
-				t->next->prev = t;
-			priv->timers = t;
-		}
+	ERRSTACK(1);
+	Tcptimer *t = container_of(a, Tcptimer, alarm);
+
+	spin_lock(&t->lock);
+	/* a halted or rearmed timer can still have an old RKM in flight.  the
+	 * current arm's RKM is only sent once its alarm is off the tchain, so if
+	 * the alarm is still on one, we're a stale RKM, even if we're late. */
+	if (t->state != TcptimerON || a->on_tchain) {
+		spin_unlock(&t->lock);
+		return;
 	}
-	t->state = newstate;
+	t->state = TcptimerDONE;
+	t->tchain = NULL;
+	spin_unlock(&t->lock);
+
+	/* discard error style */
+	if (!waserror())
+		(*t->func) (t->arg);
+	poperror();
+}
+
+static void tcptimerinit(Tcptimer * t, void (*func) (void *), void *arg)
+{
+	init_awaiter(&t->alarm, tcptimerfire);
+	spinlock_init(&t->lock);
+	t->tchain = NULL;
+	t->state = TcptimerOFF;
+	t->func = func;
+	t->arg = arg;
+}
+
+/* ms until t goes off, for status reports */
+static uint64_t tcptimerleft(Tcptimer * t)
+{
+	uint64_t now = read_tsc();
+	uint64_t when = t->alarm.wake_up_time;
+
+	if (t->state != TcptimerON || t->tchain == NULL || now >= when)
+		return 0;
+	return tsc2msec(when - now);
+}
+
+/* ms since t was last started */
+static uint64_t tcptimerelapsed(Tcptimer * t)
+{
+	return tsc2msec(read_tsc() - t->armed);
 }
 
 void tcpackproc(void *a)
 {
-	ERRSTACK(1);
-	Tcptimer *t, *tp, *timeo;
 	struct Proto *tcp;
-	struct tcppriv *priv;
-	int loop;
 
 	tcp = a;
-	priv = tcp->priv;
-
 	for (;;) {
 		kthread_usleep(MSPTICK * 1000);
-
-		qlock(&priv->tl);
-		timeo = NULL;
-		loop = 0;
-		for (t = priv->timers; t != NULL; t = tp) {
-			if (loop++ > 10000)
-				panic("tcpackproc1");
-			tp = t->next;
-			if (t->state == TcptimerON) {
-				t->count--;
-				if (t->count == 0) {
-					timerstate(priv, t, TcptimerDONE);
-					t->readynext = timeo;
-					timeo = t;
-				}
-			}
-		}
-		qunlock(&priv->tl);
-
-		loop = 0;
-		for (t = timeo; t != NULL; t = t->readynext) {
-			if (loop++ > 10000)
-				panic("tcpackproc2");
-			if (t->state == TcptimerDONE && t->func != NULL) {
-				/* discard error style */
-				if (!waserror())
-					(*t->func) (t->arg);
-				poperror();
-			}
-		}
-
 		limborexmit(tcp);
 	}
 }
 
 void tcpgo(struct tcppriv *priv, Tcptimer * t)
 {
+	struct timer_chain *tchain;
+
 	if (t == NULL || t->start == 0)
 		return;
 
-	qlock(&priv->tl);
-	t->count = t->start;
-	timerstate(priv, t, TcptimerON);
-	qunlock(&priv->tl);
+	spin_lock(&t->lock);
+	if (t->tchain != NULL)
+		unset_alarm(t->tchain, &t->alarm);
+	t->tchain = NULL;
+	t->state = TcptimerON;
+	t->armed = read_tsc();
+	/* timers without a func (rtt_timer) are just stopwatches */
+	if (t->func != NULL) {
+		tchain = &per_cpu_info[core_id()].tchain;
+		set_awaiter_rel(&t->alarm, t->start * 1000);
+		set_alarm(tchain, &t->alarm);
+		t->tchain = tchain;
+	}
+	spin_unlock(&t->lock);
 }
 
 void tcphalt(struct tcppriv *priv, Tcptimer * t)
@@ -737,9 +888,12 @@ void tcphalt(struct tcppriv *priv, Tcptimer * t)
 	if (t == NULL)
 		return;
 
-	qlock(&priv->tl);
-	timerstate(priv, t, TcptimerOFF);
-	qunlock(&priv->tl);
+	spin_lock(&t->lock);
+	if (t->tchain != NULL)
+		unset_alarm(t->tchain, &t->alarm);
+	t->tchain = NULL;
+	t->state = TcptimerOFF;
+	spin_unlock(&t->lock);
 }
 
 int backoff(int n)
@@ -762,6 +916,8 @@ void localclose(struct conv *s, char *reason)
 	tcphalt(tpriv, &tcb->rtt_timer);
 	tcphalt(tpriv, &tcb->acktimer);
 	tcphalt(tpriv, &tcb->katimer);
+	tcphalt(tpriv, &tcb->racktimer);
+	tcphalt(tpriv, &tcb->pacetimer);
 
 	/* Flush reassembly queue; nothing more can arrive */
 	for (rp = tcb->reseq; rp != NULL; rp = rp1) {
@@ -771,6 +927,11 @@ void localclose(struct conv *s, char *reason)
 	}
 	tcb->reseq = NULL;
 
+	kfree(tcb->rack.xmits);
+	tcb->rack.xmits = NULL;
+	tcb->rack.xmitsize = 0;
+	tcb->rack.nxmit = 0;
+
 	if (tcb->state == Syn_sent)
 		Fsconnected(s, reason);
 
@@ -814,7 +975,8 @@ int tcpmtu(struct Proto *tcp, uint8_t * addr, int version, int *scale,
 			*scale = HaveWS | 1;
 		else
 			*scale = HaveWS | 0;
-		if (ifc->feat & NETF_TSO)
+		/* the device or its medium segments big blocks for us */
+		if ((ifc->feat & NETF_TSO) || ifc->m->gso)
 			*flags |= TSO;
 	} else
 		*scale = HaveWS | 0;
@@ -831,23 +993,26 @@ void inittcpctl(struct conv *s, int mode)
 
 	tcb = (Tcpctl *) s->ptcl;
 
+	kfree(tcb->rack.xmits);
 	memset(tcb, 0, sizeof(Tcpctl));
 
-	tcb->ssthresh = 65535;
+	tcb->ssthresh = 0xffffffff;
 	tcb->srtt = tcp_irtt << LOGAGAIN;
 	tcb->mdev = 0;
 
 	/* setup timers */
-	tcb->timer.start = tcp_irtt / MSPTICK;
-	tcb->timer.func = tcptimeout;
-	tcb->timer.arg = s;
+	tcptimerinit(&tcb->timer, tcptimeout, s);
+	tcb->timer.start = tcp_irtt;
+	tcptimerinit(&tcb->rtt_timer, NULL, s);
 	tcb->rtt_timer.start = MAX_TIME;
-	tcb->acktimer.start = TCP_ACK / MSPTICK;
-	tcb->acktimer.func = tcpacktimer;
-	tcb->acktimer.arg = s;
-	tcb->katimer.start = DEF_KAT / MSPTICK;
-	tcb->katimer.func = tcpkeepalive;
-	tcb->katimer.arg = s;
+	tcptimerinit(&tcb->acktimer, tcpacktimer, s);
+	tcb->acktimer.start = TCP_ACK;
+	tcptimerinit(&tcb->katimer, tcpkeepalive, s);
+	tcb->katimer.start = DEF_KAT;
+	tcptimerinit(&tcb->racktimer, tcpracktimer, s);
+	tcptimerinit(&tcb->pacetimer, tcppacetimer, s);
+	tcb->pacetimer.start = 1;
+	tcpsetcc(tcb, &renocc);
 
 	mss = DEF_MSS;
 
@@ -956,26 +1121,143 @@ static char *tcpflag(uint16_t flag)
 	return buf;
 }
 
+/*
+ *  length of tcph's options, padded to a multiple of 4
+ */
+static int tcpoptlen(Tcp * tcph)
+{
+	int n;
+
+	n = 0;
+	if (tcph->flags & SYN) {
+		if (tcph->mss)
+			n += MSS_LENGTH;
+		if (tcph->ws)
+			n += WS_LENGTH;
+		if (tcph->sackok)
+			n += SACKOK_LENGTH;
+	}
+	if (tcph->ts)
+		n += TS_LENGTH;
+	if (tcph->nsacks)
+		n += 2 + tcph->nsacks * SACKBLK_LENGTH;
+	return (n + 3) & ~3;
+}
+
+static void tcpputopts(Tcp * tcph, uint8_t * opt, int optlen)
+{
+	uint8_t *e;
+	int i;
+
+	e = opt + optlen;
+	if (tcph->flags & SYN) {
+		if (tcph->mss != 0) {
+			*opt++ = MSSOPT;
+			*opt++ = MSS_LENGTH;
+			hnputs(opt, tcph->mss);
+			opt += 2;
+		}
+		if (tcph->ws != 0) {
+			*opt++ = WSOPT;
+			*opt++ = WS_LENGTH;
+			*opt++ = tcph->ws;
+		}
+		if (tcph->sackok) {
+			*opt++ = SACKOKOPT;
+			*opt++ = SACKOK_LENGTH;
+		}
+	}
+	if (tcph->ts) {
+		*opt++ = TSOPT;
+		*opt++ = TS_LENGTH;
+		hnputl(opt, tcph->tsval);
+		hnputl(opt + 4, tcph->tsecr);
+		opt += 8;
+	}
+	if (tcph->nsacks) {
+		*opt++ = SACKOPT;
+		*opt++ = 2 + tcph->nsacks * SACKBLK_LENGTH;
+		for (i = 0; i < tcph->nsacks; i++) {
+			hnputl(opt, tcph->sacks[i].left);
+			hnputl(opt + 4, tcph->sacks[i].right);
+			opt += SACKBLK_LENGTH;
+		}
+	}
+	while (opt < e)
+		*opt++ = NOOPOPT;
+}
+
+static void tcpgetopts(Tcp * tcph, uint8_t * optr, int n)
+{
+	uint16_t optlen;
+	int i;
+
+	tcph->mss = 0;
+	tcph->ws = 0;
+	tcph->sackok = 0;
+	tcph->nsacks = 0;
+	tcph->ts = 0;
+	while (n > 0 && *optr != EOLOPT) {
+		if (*optr == NOOPOPT) {
+			n--;
+			optr++;
+			continue;
+		}
+		optlen = optr[1];
+		if (optlen < 2 || optlen > n)
+			break;
+		switch (*optr) {
+			case MSSOPT:
+				if (optlen == MSS_LENGTH)
+					tcph->mss = nhgets(optr + 2);
+				break;
+			case WSOPT:
+				if (optlen == WS_LENGTH && *(optr + 2) <= 14)
+					tcph->ws = HaveWS | *(optr + 2);
+				break;
+			case SACKOKOPT:
+				if (optlen == SACKOK_LENGTH)
+					tcph->sackok = 1;
+				break;
+			case SACKOPT:
+				for (i = 2; i + SACKBLK_LENGTH <= optlen; i += SACKBLK_LENGTH) {
+					if (tcph->nsacks == Nsack)
+						break;
+					tcph->sacks[tcph->nsacks].left = nhgetl(optr + i);
+					tcph->sacks[tcph->nsacks].right = nhgetl(optr + i + 4);
+					tcph->nsacks++;
+				}
+				break;
+			case TSOPT:
+				if (optlen == TS_LENGTH) {
+					tcph->ts = 1;
+					tcph->tsval = nhgetl(optr + 2);
+					tcph->tsecr = nhgetl(optr + 6);
+				}
+				break;
+		}
+		n -= optlen;
+		optr += optlen;
+	}
+}
+
+/*
+ *  our timestamp clock ticks in ms, from a random offset per connection
+ */
+static uint32_t tcptsnow(Tcpctl * tcb)
+{
+	return NOW + tcb->tsoffset;
+}
+
 struct block *htontcp6(Tcp * tcph, struct block *data, Tcp6hdr * ph,
 					   Tcpctl * tcb)
 {
 	int dlen;
 	Tcp6hdr *h;
 	uint16_t csum;
-	uint16_t hdrlen, optpad = 0;
-	uint8_t *opt;
+	uint16_t hdrlen;
 
-	hdrlen = TCP6_HDRSIZE;
-	if (tcph->flags & SYN) {
-		if (tcph->mss)
-			hdrlen += MSS_LENGTH;
-		if (tcph->ws)
-			hdrlen += WS_LENGTH;
-		optpad = hdrlen & 3;
-		if (optpad)
-			optpad = 4 - optpad;
-		hdrlen += optpad;
-	}
+	hdrlen = TCP6_HDRSIZE + tcpoptlen(tcph);
 
 	if (data) {
 		dlen = blocklen(data);
@@ -1006,23 +1288,7 @@ struct block *htontcp6(Tcp * tcph, struct block *data, Tcp6hdr * ph,
 	hnputs(h->tcpflag, (hdrlen << 10) | tcph->flags);
 	hnputs(h->tcpwin, tcph->wnd >> (tcb != NULL ? tcb->snd.scale : 0));
 	hnputs(h->tcpurg, tcph->urg);
-
-	if (tcph->flags & SYN) {
-		opt = h->tcpopt;
-		if (tcph->mss != 0) {
-			*opt++ = MSSOPT;
-			*opt++ = MSS_LENGTH;
-			hnputs(opt, tcph->mss);
-			opt += 2;
-		}
-		if (tcph->ws != 0) {
-			*opt++ = WSOPT;
-			*opt++ = WS_LENGTH;
-			*opt++ = tcph->ws;
-		}
-		while (optpad-- > 0)
-			*opt++ = NOOPOPT;
-	}
+	tcpputopts(tcph, h->tcpopt, hdrlen - TCP6_HDRSIZE);
 
 	if (tcb != NULL && tcb->nochecksum) {
 		h->tcpcksum[0] = h->tcpcksum[1] = 0;
@@ -1046,20 +1312,9 @@ struct block *htontcp4(Tcp * tcph, struct block *data, Tcp4hdr * ph,
 	int dlen;
 	Tcp4hdr *h;
 	uint16_t csum;
-	uint16_t hdrlen, optpad = 0;
-	uint8_t *opt;
+	uint16_t hdrlen;
 
-	hdrlen = TCP4_HDRSIZE;
-	if (tcph->flags & SYN) {
-		if (tcph->mss)
-			hdrlen += MSS_LENGTH;
-		if (tcph->ws)
-			hdrlen += WS_LENGTH;
-		optpad = hdrlen & 3;
-		if (optpad)
-			optpad = 4 - optpad;
-		hdrlen += optpad;
-	}
+	hdrlen = TCP4_HDRSIZE + tcpoptlen(tcph);
 
 	if (data) {
 		dlen = blocklen(data);
@@ -1086,23 +1341,7 @@ struct block *htontcp4(Tcp * tcph, struct block *data, Tcp4hdr * ph,
 	hnputs(h->tcpflag, (hdrlen << 10) | tcph->flags);
 	hnputs(h->tcpwin, tcph->wnd >> (tcb != NULL ? tcb->snd.scale : 0));
 	hnputs(h->tcpurg, tcph->urg);
-
-	if (tcph->flags & SYN) {
-		opt = h->tcpopt;
-		if (tcph->mss != 0) {
-			*opt++ = MSSOPT;
-			*opt++ = MSS_LENGTH;
-			hnputs(opt, tcph->mss);
-			opt += 2;
-		}
-		if (tcph->ws != 0) {
-			*opt++ = WSOPT;
-			*opt++ = WS_LENGTH;
-			*opt++ = tcph->ws;
-		}
-		while (optpad-- > 0)
-			*opt++ = NOOPOPT;
-	}
+	tcpputopts(tcph, h->tcpopt, hdrlen - TCP4_HDRSIZE);
 
 	if (tcb != NULL && tcb->nochecksum) {
 		h->tcpcksum[0] = h->tcpcksum[1] = 0;
@@ -1120,10 +1359,7 @@ struct block *htontcp4(Tcp * tcph, struct block *data, Tcp4hdr * ph,
 int ntohtcp6(Tcp * tcph, struct block **bpp)
 {
 	Tcp6hdr *h;
-	uint8_t *optr;
 	uint16_t hdrlen;
-	uint16_t optlen;
-	int n;
 
 	*bpp = pullupblock(*bpp, TCP6_PKT + TCP6_HDRSIZE);
 	if (*bpp == NULL)
@@ -1143,48 +1379,21 @@ int ntohtcp6(Tcp * tcph, struct block **bpp)
 	tcph->flags = h->tcpflag[1];
 	tcph->wnd = nhgets(h->tcpwin);
 	tcph->urg = nhgets(h->tcpurg);
-	tcph->mss = 0;
-	tcph->ws = 0;
 	tcph->len = nhgets(h->ploadlen) - hdrlen;
 
 	*bpp = pullupblock(*bpp, hdrlen + TCP6_PKT);
 	if (*bpp == NULL)
 		return -1;
 
-	optr = h->tcpopt;
-	n = hdrlen - TCP6_HDRSIZE;
-	while (n > 0 && *optr != EOLOPT) {
-		if (*optr == NOOPOPT) {
-			n--;
-			optr++;
-			continue;
-		}
-		optlen = optr[1];
-		if (optlen < 2 || optlen > n)
-			break;
-		switch (*optr) {
-			case MSSOPT:
-				if (optlen == MSS_LENGTH)
-					tcph->mss = nhgets(optr + 2);
-				break;
-			case WSOPT:
-				if (optlen == WS_LENGTH && *(optr + 2) <= 14)
-					tcph->ws = HaveWS | *(optr + 2);
-				break;
-		}
-		n -= optlen;
-		optr += optlen;
-	}
+	h = (Tcp6hdr *) ((*bpp)->rp);
+	tcpgetopts(tcph, h->tcpopt, hdrlen - TCP6_HDRSIZE);
 	return hdrlen;
 }
 
 int ntohtcp4(Tcp * tcph, struct block **bpp)
 {
 	Tcp4hdr *h;
-	uint8_t *optr;
 	uint16_t hdrlen;
-	uint16_t optlen;
-	int n;
 
 	*bpp = pullupblock(*bpp, TCP4_PKT + TCP4_HDRSIZE);
 	if (*bpp == NULL)
@@ -1205,38 +1414,14 @@ int ntohtcp4(Tcp * tcph, struct block **bpp)
 	tcph->flags = h->tcpflag[1];
 	tcph->wnd = nhgets(h->tcpwin);
 	tcph->urg = nhgets(h->tcpurg);
-	tcph->mss = 0;
-	tcph->ws = 0;
 	tcph->len = nhgets(h->length) - (hdrlen + TCP4_PKT);
 
 	*bpp = pullupblock(*bpp, hdrlen + TCP4_PKT);
 	if (*bpp == NULL)
 		return -1;
 
-	optr = h->tcpopt;
-	n = hdrlen - TCP4_HDRSIZE;
-	while (n > 0 && *optr != EOLOPT) {
-		if (*optr == NOOPOPT) {
-			n--;
-			optr++;
-			continue;
-		}
-		optlen = optr[1];
-		if (optlen < 2 || optlen > n)
-			break;
-		switch (*optr) {
-			case MSSOPT:
-				if (optlen == MSS_LENGTH)
-					tcph->mss = nhgets(optr + 2);
-				break;
-			case WSOPT:
-				if (optlen == WS_LENGTH && *(optr + 2) <= 14)
-					tcph->ws = HaveWS | *(optr + 2);
-				break;
-		}
-		n -= optlen;
-		optr += optlen;
-	}
+	h = (Tcp4hdr *) ((*bpp)->rp);
+	tcpgetopts(tcph, h->tcpopt, hdrlen - TCP4_HDRSIZE);
 	return hdrlen;
 }
 
@@ -1247,6 +1432,7 @@ int ntohtcp4(Tcp * tcph, struct block **bpp)
 void tcpsndsyn(struct conv *s, Tcpctl * tcb)
 {
 	urandom_read(&tcb->iss, sizeof(tcb->iss));
+	urandom_read(&tcb->tsoffset, sizeof(tcb->tsoffset));
 	tcb->rttseq = tcb->iss;
 	tcb->snd.wl2 = tcb->iss;
 	tcb->snd.una = tcb->iss;
@@ -1326,6 +1512,9 @@ sndrst(struct Proto *tcp, uint8_t * source, uint8_t * dest,
 	seg->urg = 0;
 	seg->mss = 0;
 	seg->ws = 0;
+	seg->sackok = 0;
+	seg->nsacks = 0;
+	seg->ts = 0;
 	switch (version) {
 		case V4:
 			hbp = htontcp4(seg, NULL, &ph4, NULL);
@@ -1367,6 +1556,9 @@ static void tcphangup(struct conv *s)
 			seg.urg = 0;
 			seg.mss = 0;
 			seg.ws = 0;
+			seg.sackok = 0;
+			seg.nsacks = 0;
+			seg.ts = 0;
 			switch (s->ipversion) {
 				case V4:
 					tcb->protohdr.tcp4hdr.vihl = IP_VER4;
@@ -1440,6 +1632,11 @@ int sndsynack(struct Proto *tcp, Limbo * lp)
 		seg.ws = 0;
 		lp->sndscale = 0;
 	}
+	seg.sackok = lp->sackok;
+	seg.nsacks = 0;
+	seg.ts = lp->tsok;
+	seg.tsval = NOW + lp->tsoffset;
+	seg.tsecr = lp->tsrecent;
 
 	switch (lp->version) {
 		case V4:
@@ -1490,6 +1687,7 @@ limbo(struct conv *s, uint8_t * source, uint8_t * dest, Tcp * seg, int version)
 
 		/* each new SYN restarts the retransmits */
 		lp->irs = seg->seq;
+		lp->tsrecent = seg->tsval;
 		break;
 	}
 	lp = *l;
@@ -1512,8 +1710,12 @@ limbo(struct conv *s, uint8_t * source, uint8_t * dest, Tcp * seg, int version)
 		lp->rport = seg->source;
 		lp->mss = seg->mss;
 		lp->rcvscale = seg->ws;
+		lp->sackok = tcpsack && seg->sackok;
+		lp->tsok = tcpts && seg->ts;
+		lp->tsrecent = seg->tsval;
 		lp->irs = seg->seq;
 		urandom_read(&lp->iss, sizeof(lp->iss));
+		urandom_read(&lp->tsoffset, sizeof(lp->tsoffset));
 	}
 
 	if (sndsynack(s->p, lp) < 0) {
@@ -1669,14 +1871,18 @@ static struct conv *tcpincoming(struct conv *s, Tcp * segp, uint8_t * src,
 	memmove(new->ptcl, s->ptcl, sizeof(Tcpctl));
 	tcb = (Tcpctl *) new->ptcl;
 	tcb->flags &= ~CLONE;
-	tcb->timer.arg = new;
-	tcb->timer.state = TcptimerOFF;
-	tcb->acktimer.arg = new;
-	tcb->acktimer.state = TcptimerOFF;
-	tcb->katimer.arg = new;
-	tcb->katimer.state = TcptimerOFF;
-	tcb->rtt_timer.arg = new;
-	tcb->rtt_timer.state = TcptimerOFF;
+	/* the copied alarms belong to the listener */
+	tcptimerinit(&tcb->timer, tcptimeout, new);
+	tcptimerinit(&tcb->acktimer, tcpacktimer, new);
+	tcptimerinit(&tcb->katimer, tcpkeepalive, new);
+	tcptimerinit(&tcb->rtt_timer, NULL, new);
+	tcptimerinit(&tcb->racktimer, tcpracktimer, new);
+	tcptimerinit(&tcb->pacetimer, tcppacetimer, new);
+	/* and so is the transmission ring, if it has one */
+	tcb->rack.xmits = NULL;
+	tcb->rack.xmitsize = 0;
+	tcb->rack.xmittail = 0;
+	tcb->rack.nxmit = 0;
 
 	tcb->irs = lp->irs;
 	tcb->rcv.nxt = tcb->irs + 1;
@@ -1698,9 +1904,19 @@ static struct conv *tcpincoming(struct conv *s, Tcp * segp, uint8_t * src,
 	/* window scaling */
 	tcpsetscale(new, tcb, lp->rcvscale, lp->sndscale);
 
+	tcb->sackok = lp->sackok;
+
+	/* timestamps; the ack that got us here has the latest tsval */
+	tcb->tsok = lp->tsok;
+	tcb->tsoffset = lp->tsoffset;
+	tcb->tsrecent = segp->ts ? segp->tsval : lp->tsrecent;
+	tcb->tsrecentage = NOW;
+	tcb->rcv.lastack = tcb->rcv.nxt;
+
 	/* the congestion window always starts out as a single segment */
 	tcb->snd.wnd = segp->wnd;
 	tcb->cwind = tcb->mss;
+	tcpsetcc(tcb, tcb->cc);
 
 	/* set initial round trip time */
 	tcb->sndsyntime = lp->lastsend + lp->rexmits * SYNACK_RXTIMER;
@@ -1792,41 +2008,957 @@ void tcpsynackrtt(struct conv *s)
 	tcphalt(tpriv, &tcb->rtt_timer);
 }
 
-void update(struct conv *s, Tcp * seg)
+/*
+ *  Congestion control.  Each conversation picks a module with the "cc"
+ *  ctl; new calls get their listener's.
+ */
+
+/* half of what's outstanding, but at least two segments */
+static uint32_t tcphalfflight(Tcpctl * tcb)
 {
-	int rtt, delta;
-	Tcpctl *tcb;
-	uint32_t acked;
-	uint32_t expand;
-	struct tcppriv *tpriv;
+	uint32_t x;
 
-	tpriv = s->p->priv;
-	tcb = (Tcpctl *) s->ptcl;
+	x = (tcb->snd.nxt - tcb->snd.una) / 2;
+	if (x < 2 * tcb->mss)
+		x = 2 * tcb->mss;
+	return x;
+}
 
-	/* if everything has been acked, force output(?) */
-	if (seq_gt(seg->ack, tcb->snd.nxt)) {
-		tcb->flags |= FORCE;
-		return;
-	}
+static void renoinit(Tcpctl * tcb)
+{
+}
 
-	/* added by Dong Lin for fast retransmission */
-	if (seg->ack == tcb->snd.una
-		&& tcb->snd.una != tcb->snd.nxt
-		&& seg->len == 0 && seg->wnd == tcb->snd.wnd) {
+static void renoack(Tcpctl * tcb, uint32_t acked, uint64_t rttus)
+{
+	uint32_t expand;
 
-		/* this is a pure ack w/o window update */
-		netlog(s->p->f, Logtcprxmt, "dupack %lu ack %lu sndwnd %d advwin %d\n",
-			   tcb->snd.dupacks, seg->ack, tcb->snd.wnd, seg->wnd);
+	/* slow start as long as we're not recovering from lost packets */
+	if (tcb->cwind >= tcb->snd.wnd || tcb->snd.recovery)
+		return;
+	if (tcb->cwind < tcb->ssthresh) {
+		expand = tcb->mss;
+		if (acked < expand)
+			expand = acked;
+	} else
+		expand = ((uint64_t)tcb->mss * tcb->mss) / tcb->cwind;
 
-		if (++tcb->snd.dupacks == TCPREXMTTHRESH) {
+	if (tcb->cwind + expand < tcb->cwind)
+		expand = tcb->snd.wnd - tcb->cwind;
+	if (tcb->cwind + expand > tcb->snd.wnd)
+		expand = tcb->snd.wnd - tcb->cwind;
+	tcb->cwind += expand;
+}
+
+static void renoloss(Tcpctl * tcb)
+{
+	tcb->ssthresh = tcphalfflight(tcb);
+	tcb->cwind = tcb->ssthresh;
+}
+
+static void renotimeout(Tcpctl * tcb)
+{
+	tcb->ssthresh = tcphalfflight(tcb);
+}
+
+static Tcpcc renocc = {
+	.name = "reno",
+	.init = renoinit,
+	.ack = renoack,
+	.loss = renoloss,
+	.timeout = renotimeout,
+};
+
+/*
+ *  CUBIC (RFC 8312).  After a loss, cwind follows
+ *	W(t) = C*(t - K)^3 + wmax
+ *  with C = 0.4 segments/sec^3, so it grows quickly back toward wmax,
+ *  levels off there, then probes beyond it.  It backs off by 0.7 instead of
+ *  0.5, and never grows slower than reno would.
+ */
+static uint64_t cubicroot(uint64_t a)
+{
+	uint64_t x, y;
+
+	if (a == 0)
+		return 0;
+	/* newton's method, starting above the root */
+	x = 1ULL << ((LOG2_UP(a) + 2) / 3);
+	for (;;) {
+		y = (2 * x + a / (x * x)) / 3;
+		if (y >= x)
+			return x;
+		x = y;
+	}
+}
+
+static void cubicinit(Tcpctl * tcb)
+{
+	memset(&tcb->ccs.cubic, 0, sizeof(tcb->ccs.cubic));
+}
+
+static void cubicack(Tcpctl * tcb, uint32_t acked, uint64_t rttus)
+{
+	typeof(tcb->ccs.cubic) *c = &tcb->ccs.cubic;
+	int64_t d, target;
+	uint64_t inc;
+
+	if (rttus && (c->minrtt == 0 || rttus < c->minrtt))
+		c->minrtt = rttus;
+	if (tcb->cwind >= tcb->snd.wnd || tcb->snd.recovery)
+		return;
+	if (tcb->cwind < tcb->ssthresh) {
+		tcb->cwind += MIN(acked, tcb->mss);
+		return;
+	}
+
+	if (c->epoch == 0) {
+		c->epoch = read_tsc();
+		if (tcb->cwind < c->wmax) {
+			/* K = cbrt((wmax - cwind) / C), in ms */
+			c->k = cubicroot((uint64_t)(c->wmax - tcb->cwind) *
+			                 2500000000ULL / tcb->mss);
+		} else {
+			c->k = 0;
+			c->wmax = tcb->cwind;
+		}
+		c->west = tcb->cwind;
+	}
+
+	/* where W says we should be a round trip from now */
+	d = (int64_t)(tsc2msec(read_tsc() - c->epoch) + c->minrtt / 1000) -
+	    (int64_t)c->k;
+	if (d > 50000)
+		d = 50000;
+	if (d < -50000)
+		d = -50000;
+	target = c->wmax + 4 * (int64_t)tcb->mss * d * d * d / 10000000000LL;
+
+	/* reno, with the increase that has the same average rate as cubic */
+	c->west += (uint64_t)acked * tcb->mss * 529 / (1000 * (uint64_t)c->west);
+	if (target < c->west)
+		target = c->west;
+
+	if (target > tcb->cwind) {
+		inc = (uint64_t)(target - tcb->cwind) * acked / tcb->cwind;
+		if (inc > acked)
+			inc = acked;
+	} else
+		inc = (uint64_t)acked * tcb->mss / (100 * (uint64_t)tcb->cwind);
+	if (inc == 0)
+		inc = 1;
+	if (tcb->cwind + inc > tcb->snd.wnd)
+		inc = tcb->snd.wnd - tcb->cwind;
+	tcb->cwind += inc;
+}
+
+static void cubicbackoff(Tcpctl * tcb)
+{
+	typeof(tcb->ccs.cubic) *c = &tcb->ccs.cubic;
+	uint32_t x;
+
+	c->epoch = 0;
+	/* fast convergence: give up some room if we lost before getting back */
+	if (tcb->cwind < c->wmax)
+		c->wmax = (uint64_t)tcb->cwind * 17 / 20;
+	else
+		c->wmax = tcb->cwind;
+	x = (uint64_t)tcb->cwind * 7 / 10;
+	if (x < 2 * tcb->mss)
+		x = 2 * tcb->mss;
+	tcb->ssthresh = x;
+}
+
+static void cubicloss(Tcpctl * tcb)
+{
+	cubicbackoff(tcb);
+	tcb->cwind = tcb->ssthresh;
+}
+
+static Tcpcc cubiccc = {
+	.name = "cubic",
+	.init = cubicinit,
+	.ack = cubicack,
+	.loss = cubicloss,
+	.timeout = cubicbackoff,
+};
+
+/*
+ *  A BBR-style model.  Rather than reacting to loss, keep estimates of the
+ *  bottleneck bandwidth (the best delivery rate over the last Nbbrbw round
+ *  trips) and the minimum RTT, pace at about the bandwidth, and keep about
+ *  two bandwidth-delay products in flight.  Startup doubles the rate every
+ *  round until the bandwidth stops growing, drain gets rid of the queue
+ *  that built, and probe_bw then cycles its pacing gain around 1.0.  Every
+ *  10 seconds without a new min RTT, probe_rtt drains the pipe for 200 ms
+ *  to measure it again.
+ */
+static uint32_t bbrprobegain[] = {
+	BBRUNIT * 5 / 4, BBRUNIT * 3 / 4, BBRUNIT, BBRUNIT,
+	BBRUNIT, BBRUNIT, BBRUNIT, BBRUNIT,
+};
+
+enum {
+	BBRHIGHGAIN = BBRUNIT * 2885 / 1000 + 1,	/* 2/ln(2) */
+	BBRDRAINGAIN = BBRUNIT * 1000 / 2885,
+	BBRCWNDGAIN = BBRUNIT * 2,
+	BBRMINRTTWIN = 10 * 1000,	/* ms a min RTT is good for */
+	BBRPROBERTT = 200,	/* ms to spend in probe_rtt */
+};
+
+static void bbrinit(Tcpctl * tcb)
+{
+	memset(&tcb->ccs.bbr, 0, sizeof(tcb->ccs.bbr));
+	tcb->ccs.bbr.roundend = tcb->snd.nxt;
+	tcb->ccs.bbr.roundstart = read_tsc();
+}
+
+/* bytes the model says are in the pipe */
+static uint64_t bbrbdp(Tcpctl * tcb)
+{
+	return tcb->ccs.bbr.btlbw * tcb->ccs.bbr.minrtt / 1000000;
+}
+
+static void bbrnewround(Tcpctl * tcb, uint64_t now)
+{
+	typeof(tcb->ccs.bbr) *b = &tcb->ccs.bbr;
+	uint64_t bw, us;
+	int i;
+
+	us = tsc2usec(now - b->roundstart);
+	if (us != 0) {
+		bw = (b->delivered - b->rounddelivered) * 1000000 / us;
+		b->bws[b->rounds % Nbbrbw] = bw;
+		b->btlbw = 0;
+		for (i = 0; i < Nbbrbw; i++)
+			b->btlbw = MAX(b->btlbw, b->bws[i]);
+	}
+	b->rounds++;
+	b->roundend = tcb->snd.nxt;
+	b->roundstart = now;
+	b->rounddelivered = b->delivered;
+
+	switch (b->mode) {
+		case Bbrstartup:
+			if (b->btlbw >= b->fullbw * 5 / 4) {
+				b->fullbw = b->btlbw;
+				b->fullbwcnt = 0;
+			} else if (++b->fullbwcnt >= 3) {
+				b->fullbwreached = 1;
+				b->mode = Bbrdrain;
+			}
+			break;
+		case Bbrdrain:
+			if (tcb->snd.nxt - tcb->snd.una <= bbrbdp(tcb)) {
+				b->mode = Bbrprobebw;
+				b->cycle = 2;
+			}
+			break;
+		case Bbrprobebw:
+			b->cycle = (b->cycle + 1) % COUNT_OF(bbrprobegain);
+			break;
+	}
+}
+
+static void bbrack(Tcpctl * tcb, uint32_t acked, uint64_t rttus)
+{
+	typeof(tcb->ccs.bbr) *b = &tcb->ccs.bbr;
+	uint64_t now, target, x;
+	uint32_t pgain, cgain;
+
+	now = read_tsc();
+	b->delivered += acked;
+	if (rttus && (b->minrtt == 0 || rttus <= b->minrtt)) {
+		b->minrtt = rttus;
+		b->minrttstamp = now;
+	}
+	if (seq_ge(tcb->snd.una, b->roundend))
+		bbrnewround(tcb, now);
+
+	if (b->mode != Bbrprobertt && b->minrtt
+		&& tsc2msec(now - b->minrttstamp) > BBRMINRTTWIN) {
+		b->mode = Bbrprobertt;
+		b->priorcwind = tcb->cwind;
+		b->probertt = now + msec2tsc(BBRPROBERTT);
+	}
+	if (b->mode == Bbrprobertt && now >= b->probertt) {
+		/* whatever we saw while drained is the min RTT now */
+		b->minrttstamp = now;
+		b->mode = b->fullbwreached ? Bbrprobebw : Bbrstartup;
+		tcb->cwind = MAX(tcb->cwind, b->priorcwind);
+	}
+
+	switch (b->mode) {
+		default:
+		case Bbrstartup:
+			pgain = cgain = BBRHIGHGAIN;
+			break;
+		case Bbrdrain:
+			pgain = BBRDRAINGAIN;
+			cgain = BBRHIGHGAIN;
+			break;
+		case Bbrprobebw:
+			pgain = bbrprobegain[b->cycle];
+			cgain = BBRCWNDGAIN;
+			break;
+		case Bbrprobertt:
+			pgain = cgain = BBRUNIT;
+			break;
+	}
+
+	if (b->btlbw == 0) {
+		/* no model yet, so grow like slow start */
+		tcb->pacerate = 0;
+		if (!tcb->snd.recovery)
+			tcb->cwind += acked;
+		return;
+	}
+	tcppacerate(tcb, b->btlbw * pgain / BBRUNIT);
+
+	target = bbrbdp(tcb) * cgain / BBRUNIT + 3 * tcb->mss;
+	if (b->mode == Bbrprobertt)
+		target = 4 * tcb->mss;
+	if (target < 4 * tcb->mss)
+		target = 4 * tcb->mss;
+	if (tcb->snd.recovery) {
+		/* packet conservation: send one for each one that left */
+		x = (uint64_t)(tcb->snd.nxt - tcb->snd.una) + acked;
+		if (x < tcb->cwind)
+			tcb->cwind = MAX(x, 4 * tcb->mss);
+	} else if (!b->fullbwreached)
+		tcb->cwind += acked;
+	else
+		tcb->cwind = MIN(tcb->cwind + acked, target);
+	if (tcb->cwind > target && b->fullbwreached)
+		tcb->cwind = target;
+}
+
+static void bbrloss(Tcpctl * tcb)
+{
+	tcb->ccs.bbr.priorcwind = tcb->cwind;
+	tcb->cwind = MAX(tcb->snd.nxt - tcb->snd.una, 4 * tcb->mss);
+}
+
+static void bbrtimeout(Tcpctl * tcb)
+{
+	tcb->ccs.bbr.priorcwind = tcb->cwind;
+}
+
+static void bbrrecovered(Tcpctl * tcb)
+{
+	tcb->cwind = MAX(tcb->cwind, tcb->ccs.bbr.priorcwind);
+}
+
+static Tcpcc bbrcc = {
+	.name = "bbr",
+	.init = bbrinit,
+	.ack = bbrack,
+	.loss = bbrloss,
+	.timeout = bbrtimeout,
+	.recovered = bbrrecovered,
+};
+
+static Tcpcc *tcpccs[] = {
+	&renocc,
+	&cubiccc,
+	&bbrcc,
+	NULL,
+};
+
+static void tcpsetcc(Tcpctl * tcb, Tcpcc * cc)
+{
+	tcb->cc = cc;
+	tcb->pacerate = 0;
+	cc->init(tcb);
+}
+
+/*
+ *  set the pacing rate.  the bucket starts filling when pacing starts, not
+ *  from whenever we last paced.
+ */
+static void tcppacerate(Tcpctl *tcb, uint64_t rate)
+{
+	if (tcb->pacerate == 0 && rate != 0)
+		tcb->pacetime = read_tsc();
+	tcb->pacerate = rate;
+}
+
+/*
+ *  when pacing, cut ssize down to what the token bucket allows.  if that's
+ *  less than a segment, send nothing and try again when there's more.
+ */
+static uint32_t tcppace(struct conv *s, uint32_t ssize)
+{
+	Tcpctl *tcb;
+	uint64_t now, max, us, burstus;
+
+	tcb = (Tcpctl *) s->ptcl;
+	if (tcb->pacerate == 0 || ssize == 0)
+		return ssize;
+
+	/* at most 1 ms, or two segments, of burst.  time past what it takes to
+	 * fill that adds nothing, and would overflow the multiply after a long
+	 * idle. */
+	now = read_tsc();
+	max = MAX(tcb->pacerate / 1000, 2 * tcb->mss);
+	burstus = max * 1000000 / tcb->pacerate + 1;
+	us = MIN(tsc2usec(now - tcb->pacetime), burstus);
+	tcb->pacetokens += tcb->pacerate * us / 1000000;
+	if (tcb->pacetokens > max)
+		tcb->pacetokens = max;
+	tcb->pacetime = now;
+
+	if (ssize <= tcb->pacetokens)
+		return ssize;
+	if (tcb->pacetokens >= tcb->mss)
+		return tcb->pacetokens / tcb->mss * tcb->mss;
+	if (tcb->pacetimer.state != TcptimerON)
+		tcpgo(s->p->priv, &tcb->pacetimer);
+	return 0;
+}
+
+/*
+ *  Selective acks (RFC 2018).  As a receiver, we describe the resequence
+ *  queue in the SACK blocks of our acks.  As a sender, we keep the blocks
+ *  the other end reports in a scoreboard, and when in recovery we resend
+ *  the holes between them (RFC 6675) rather than going back to snd.una.
+ *
+ *  Holes become lost either when enough data above them has been sacked
+ *  (the dupack threshold, counted in bytes) or when RACK (RFC 8985) decides
+ *  they should have shown up by now: something sent after them has been
+ *  delivered and a round trip plus a reordering window has gone by.
+ */
+
+/*
+ *  fill in seg's SACK blocks from the resequence queue.  the block with the
+ *  latest segment in it goes first.
+ */
+static void tcpsackblocks(Tcpctl * tcb, Tcp * seg)
+{
+	Sackblk blk[Nscoreboard];
+	Reseq *rp;
+	uint32_t left, right;
+	int i, n, first, max;
+
+	/* a timestamp leaves room for one less block */
+	max = seg->ts ? Nsack - 1 : Nsack;
+	n = 0;
+	for (rp = tcb->reseq; rp != NULL; rp = rp->next) {
+		left = rp->seg.seq;
+		right = left + rp->length;
+		if (rp->seg.flags & FIN)
+			right++;
+		if (seq_le(right, tcb->rcv.nxt))
+			continue;
+		if (n > 0 && seq_le(left, blk[n - 1].right)) {
+			if (seq_gt(right, blk[n - 1].right))
+				blk[n - 1].right = right;
+			continue;
+		}
+		if (n == Nscoreboard)
+			break;
+		blk[n].left = left;
+		blk[n].right = right;
+		n++;
+	}
+
+	first = 0;
+	for (i = 0; i < n; i++) {
+		if (seq_within(tcb->rcv.lastsack, blk[i].left, blk[i].right - 1)) {
+			first = i;
+			break;
+		}
+	}
+	seg->nsacks = 0;
+	if (n == 0)
+		return;
+	seg->sacks[seg->nsacks++] = blk[first];
+	for (i = 0; i < n && seg->nsacks < max; i++)
+		if (i != first)
+			seg->sacks[seg->nsacks++] = blk[i];
+}
+
+/* drop the parts of the scoreboard at or below una */
+static void tcpsacktrim(Tcpctl * tcb, uint32_t una)
+{
+	Sackblk *sb;
+	int i, n;
+
+	sb = tcb->snd.sacks;
+	n = tcb->snd.nsacks;
+	for (i = 0; i < n && seq_le(sb[i].right, una); i++)
+		;
+	if (i > 0) {
+		memmove(sb, sb + i, (n - i) * sizeof(Sackblk));
+		n -= i;
+	}
+	if (n > 0 && seq_lt(sb[0].left, una))
+		sb[0].left = una;
+	tcb->snd.nsacks = n;
+}
+
+/* merge [left, right) into the scoreboard */
+static void tcpsackadd(Tcpctl * tcb, uint32_t left, uint32_t right)
+{
+	Sackblk *sb;
+	int i, j, n;
+
+	sb = tcb->snd.sacks;
+	n = tcb->snd.nsacks;
+
+	/* blocks i up to j touch the new one */
+	for (i = 0; i < n && seq_lt(sb[i].right, left); i++)
+		;
+	for (j = i; j < n && seq_le(sb[j].left, right); j++) {
+		if (seq_lt(sb[j].left, left))
+			left = sb[j].left;
+		if (seq_gt(sb[j].right, right))
+			right = sb[j].right;
+	}
+
+	if (i == j) {
+		/* when full, forget the highest block; the low holes matter most */
+		if (n == Nscoreboard) {
+			if (i == n)
+				return;
+			n--;
+		}
+		memmove(sb + i + 1, sb + i, (n - i) * sizeof(Sackblk));
+		n++;
+	} else if (j - i > 1) {
+		memmove(sb + i + 1, sb + j, (n - j) * sizeof(Sackblk));
+		n -= j - i - 1;
+	}
+	sb[i].left = left;
+	sb[i].right = right;
+	tcb->snd.nsacks = n;
+}
+
+/* is all of [seq, end) sacked? */
+static int tcpsacked(Tcpctl * tcb, uint32_t seq, uint32_t end)
+{
+	int i;
+
+	for (i = 0; i < tcb->snd.nsacks; i++) {
+		if (seq_le(end, tcb->snd.sacks[i].left))
+			break;
+		if (seq_le(tcb->snd.sacks[i].left, seq)
+			&& seq_le(end, tcb->snd.sacks[i].right))
+			return 1;
+	}
+	return 0;
+}
+
+/* bytes of [seq, end) that have not been sacked */
+static uint32_t tcpunsacked(Tcpctl * tcb, uint32_t seq, uint32_t end)
+{
+	Sackblk *sb;
+	uint32_t n, l, r;
+	int i;
+
+	if (!seq_lt(seq, end))
+		return 0;
+	n = end - seq;
+	for (i = 0; i < tcb->snd.nsacks; i++) {
+		sb = &tcb->snd.sacks[i];
+		l = seq_gt(sb->left, seq) ? sb->left : seq;
+		r = seq_lt(sb->right, end) ? sb->right : end;
+		if (seq_lt(l, r))
+			n -= r - l;
+	}
+	return n;
+}
+
+/*
+ *  the holes below a block with TCPREXMTTHRESH segments' worth of sacked
+ *  data at or above it are lost
+ */
+static void tcpsacklost(Tcpctl * tcb)
+{
+	Sackblk *sb;
+	uint32_t above;
+	int i;
+
+	above = 0;
+	for (i = tcb->snd.nsacks - 1; i >= 0; i--) {
+		sb = &tcb->snd.sacks[i];
+		above += sb->right - sb->left;
+		if (above >= TCPREXMTTHRESH * tcb->mss) {
+			if (seq_gt(sb->left, tcb->snd.lost))
+				tcb->snd.lost = sb->left;
+			break;
+		}
+	}
+}
+
+/*
+ *  data in the network: everything unsacked, less the lost holes we haven't
+ *  resent yet
+ */
+static uint32_t tcppipe(Tcpctl * tcb)
+{
+	uint32_t pipe;
+
+	pipe = tcpunsacked(tcb, tcb->snd.una, tcb->snd.nxt);
+	if (seq_lt(tcb->snd.hole, tcb->snd.lost))
+		pipe -= tcpunsacked(tcb, tcb->snd.hole, tcb->snd.lost);
+	return pipe;
+}
+
+/*
+ *  find the next lost hole to resend.  returns its length, 0 if there isn't
+ *  one.
+ */
+static uint32_t tcpnexthole(Tcpctl * tcb, uint32_t * seq)
+{
+	Sackblk *sb;
+	uint32_t h, end;
+	int i;
+
+	h = tcb->snd.hole;
+	if (seq_lt(h, tcb->snd.una))
+		h = tcb->snd.una;
+	for (i = 0; i < tcb->snd.nsacks; i++) {
+		sb = &tcb->snd.sacks[i];
+		if (seq_le(sb->right, h))
+			continue;
+		if (seq_gt(sb->left, h))
+			break;
+		h = sb->right;
+	}
+	end = tcb->snd.nxt;
+	if (i < tcb->snd.nsacks)
+		end = tcb->snd.sacks[i].left;
+	if (seq_gt(end, tcb->snd.lost))
+		end = tcb->snd.lost;
+	if (!seq_lt(h, end))
+		return 0;
+	*seq = h;
+	return end - h;
+}
+
+/*
+ *  start resending holes.  the congestion control decides how far cwind
+ *  comes down, instead of to one segment like the non-SACK path.
+ */
+static void tcpsackrecovery(struct conv *s, int why)
+{
+	Tcpctl *tcb;
+	struct tcppriv *tpriv;
+
+	tcb = (Tcpctl *) s->ptcl;
+	tpriv = s->p->priv;
+
+	tcb->snd.recovery = 1;
+	tcb->snd.rxt = tcb->snd.nxt;
+	tcb->snd.hole = tcb->snd.una;
+	if (seq_lt(tcb->snd.lost, tcb->snd.una))
+		tcb->snd.lost = tcb->snd.una;
+
+	tcb->cc->loss(tcb);
+
+	tpriv->stats[why]++;
+	netlog(s->p->f, Logtcprxmt, "sack rxt %s una %lu lost %lu nxt %lu\n",
+		   statnames[why], tcb->snd.una, tcb->snd.lost, tcb->snd.nxt);
+}
+
+/*
+ *  forget the scoreboard and the transmission history, e.g. after a
+ *  timeout, when we go back to snd.una anyway and the other end may
+ *  have reneged on its SACKs
+ */
+static void tcpsackreset(struct conv *s)
+{
+	Tcpctl *tcb;
+
+	tcb = (Tcpctl *) s->ptcl;
+	tcb->snd.nsacks = 0;
+	tcb->snd.hole = tcb->snd.una;
+	tcb->snd.lost = tcb->snd.una;
+	tcb->rack.nxmit = 0;
+	tcphalt(s->p->priv, &tcb->racktimer);
+}
+
+/* the i'th oldest transmission in the ring */
+static Tcpxmit *tcprackx(Tcpctl * tcb, int i)
+{
+	return &tcb->rack.xmits[(tcb->rack.xmittail + i) % tcb->rack.xmitsize];
+}
+
+/*
+ *  make room in the ring for one more transmission.  the oldest records are
+ *  the ones RACK most needs, so the ring grows with the flight.  if it can't,
+ *  we merge the two oldest when they're contiguous, keeping the later send
+ *  time, which can only make RACK slower to call a loss.  dropping the oldest
+ *  is the last resort.  returns FALSE if there's no ring at all.
+ */
+static bool tcprackroom(Tcpctl * tcb)
+{
+	Tcpxmit *ring, *x, *y;
+	int size;
+
+	if (tcb->rack.nxmit < tcb->rack.xmitsize)
+		return TRUE;
+	size = tcb->rack.xmitsize ? tcb->rack.xmitsize * 2 : Nxmit;
+	if (size <= Nxmitmax) {
+		ring = kmalloc(size * sizeof(Tcpxmit), MEM_ATOMIC);
+		if (ring != NULL) {
+			for (int i = 0; i < tcb->rack.nxmit; i++)
+				ring[i] = *tcprackx(tcb, i);
+			kfree(tcb->rack.xmits);
+			tcb->rack.xmits = ring;
+			tcb->rack.xmitsize = size;
+			tcb->rack.xmittail = 0;
+			return TRUE;
+		}
+	}
+	if (tcb->rack.xmitsize == 0)
+		return FALSE;
+	x = tcprackx(tcb, 0);
+	y = tcprackx(tcb, 1);
+	if (x->end == y->seq && x->flags == y->flags)
+		y->seq = x->seq;
+	tcb->rack.xmittail = (tcb->rack.xmittail + 1) % tcb->rack.xmitsize;
+	tcb->rack.nxmit--;
+	return TRUE;
+}
+
+/* remember a transmission of [seq, end) for RACK */
+static void tcprackxmit(Tcpctl * tcb, uint32_t seq, uint32_t end, int rexmit)
+{
+	Tcpxmit *x;
+	int i;
+
+	if (rexmit) {
+		/* this send supersedes the earlier ones of the same data */
+		for (i = 0; i < tcb->rack.nxmit; i++) {
+			x = tcprackx(tcb, i);
+			if (seq_lt(x->seq, end) && seq_gt(x->end, seq))
+				x->flags |= Xlost;
+		}
+	}
+	if (!tcprackroom(tcb))
+		return;
+	x = tcprackx(tcb, tcb->rack.nxmit);
+	tcb->rack.nxmit++;
+	x->seq = seq;
+	x->end = end;
+	x->time = read_tsc();
+	x->flags = rexmit ? Xrexmit : 0;
+}
+
+/*
+ *  mark as lost the transmissions sent before the latest delivered one
+ *  that have had rack.rtt plus a reordering window to get there.  arm the
+ *  RACK timer for the ones that still have time left.
+ */
+static void tcprackdetect(struct conv *s)
+{
+	Tcpctl *tcb;
+	struct tcppriv *tpriv;
+	Tcpxmit *x;
+	uint64_t now, reo, when, wait;
+	int i, lost;
+
+	tcb = (Tcpctl *) s->ptcl;
+	tpriv = s->p->priv;
+	now = read_tsc();
+	reo = tcb->rack.minrtt / 4;
+	wait = 0;
+	lost = 0;
+	for (i = 0; i < tcb->rack.nxmit; i++) {
+		x = tcprackx(tcb, i);
+		if (x->time > tcb->rack.xmit)
+			break;
+		if (x->flags & (Xdelivered | Xlost))
+			continue;
+		if (x->time == tcb->rack.xmit && !seq_lt(x->end, tcb->rack.end))
+			continue;
+		if (seq_le(x->end, tcb->snd.una))
+			continue;
+		when = x->time + tcb->rack.rtt + reo;
+		if (when > now) {
+			if (when - now > wait)
+				wait = when - now;
+			continue;
+		}
+		x->flags |= Xlost;
+		lost++;
+		/* a lost retransmission has to go again */
+		if ((x->flags & Xrexmit) && seq_lt(x->seq, tcb->snd.hole))
+			tcb->snd.hole = x->seq;
+		if (seq_gt(x->end, tcb->snd.lost))
+			tcb->snd.lost = x->end;
+	}
+	if (lost) {
+		tpriv->stats[RackLostSegs] += lost;
+		if (!tcb->snd.recovery)
+			tcpsackrecovery(s, RackRecovery);
+	}
+	if (wait) {
+		tcb->racktimer.start = tsc2msec(wait) + 1;
+		tcpgo(tpriv, &tcb->racktimer);
+	} else
+		tcphalt(tpriv, &tcb->racktimer);
+}
+
+/* note which transmissions ack has delivered */
+static void tcprackupdate(Tcpctl * tcb, uint32_t ack)
+{
+	Tcpxmit *x;
+	uint64_t now, rtt;
+	int i;
+
+	now = read_tsc();
+	for (i = 0; i < tcb->rack.nxmit; i++) {
+		x = tcprackx(tcb, i);
+		if (x->flags & Xdelivered)
+			continue;
+		if (!seq_le(x->end, ack) && !tcpsacked(tcb, x->seq, x->end))
+			continue;
+		x->flags |= Xdelivered;
+		rtt = now - x->time;
+		/* too quick, this must be the ack for the original */
+		if ((x->flags & Xrexmit) && rtt < tcb->rack.minrtt)
+			continue;
+		if (tcb->rack.minrtt == 0 || rtt < tcb->rack.minrtt)
+			tcb->rack.minrtt = rtt;
+		/* the ring is in send order, so this is the latest so far */
+		tcb->rack.xmit = x->time;
+		tcb->rack.end = x->end;
+		tcb->rack.rtt = rtt;
+	}
+
+	/* retire what's been cumulatively acked */
+	while (tcb->rack.nxmit > 0) {
+		x = &tcb->rack.xmits[tcb->rack.xmittail];
+		if (!seq_le(x->end, ack))
+			break;
+		tcb->rack.xmittail = (tcb->rack.xmittail + 1) % tcb->rack.xmitsize;
+		tcb->rack.nxmit--;
+	}
+}
+
+/*
+ *  process the SACK blocks in an incoming ack
+ */
+static void tcpsackinput(struct conv *s, Tcp * seg)
+{
+	Tcpctl *tcb;
+	uint32_t una, left, right;
+	int i;
+
+	tcb = (Tcpctl *) s->ptcl;
+	una = tcb->snd.una;
+	if (seq_gt(seg->ack, una))
+		una = seg->ack;
+
+	if (seq_lt(tcb->snd.hole, una))
+		tcb->snd.hole = una;
+	if (seq_lt(tcb->snd.lost, una))
+		tcb->snd.lost = una;
+
+	tcpsacktrim(tcb, una);
+	for (i = 0; i < seg->nsacks; i++) {
+		left = seg->sacks[i].left;
+		right = seg->sacks[i].right;
+		/* ignore D-SACKs and anything we haven't sent */
+		if (!seq_lt(left, right) || seq_le(right, una)
+			|| seq_gt(right, tcb->snd.nxt))
+			continue;
+		if (seq_lt(left, una))
+			left = una;
+		tcpsackadd(tcb, left, right);
+	}
+
+	tcpsacklost(tcb);
+	tcprackupdate(tcb, una);
+	tcprackdetect(s);
+	if (!tcb->snd.recovery && seq_gt(tcb->snd.lost, una))
+		tcpsackrecovery(s, SackRecovery);
+}
+
+/*
+ *  fold a round trip sample, in ms, into srtt and mdev
+ */
+static void tcprttsample(Tcpctl * tcb, int rtt)
+{
+	int delta;
+
+	tcb->backoff = 0;
+	tcb->backedoff = 0;
+	if (rtt == 0)
+		rtt = 1;	/* otherwise all close systems will rexmit in 0 time */
+	if (tcb->srtt == 0) {
+		tcb->srtt = rtt << LOGAGAIN;
+		tcb->mdev = rtt << LOGDGAIN;
+	} else {
+		delta = rtt - (tcb->srtt >> LOGAGAIN);
+		tcb->srtt += delta;
+		if (tcb->srtt <= 0)
+			tcb->srtt = 1;
+
+		delta = abs(delta) - (tcb->mdev >> LOGDGAIN);
+		tcb->mdev += delta;
+		if (tcb->mdev <= 0)
+			tcb->mdev = 1;
+	}
+	tcpsettimer(tcb);
+}
+
+void update(struct conv *s, Tcp * seg)
+{
+	int rtt;
+	Tcpctl *tcb;
+	uint32_t acked, x;
+	uint64_t rttus;
+	struct tcppriv *tpriv;
+
+	tpriv = s->p->priv;
+	tcb = (Tcpctl *) s->ptcl;
+	rttus = 0;
+
+	/* if everything has been acked, force output(?) */
+	if (seq_gt(seg->ack, tcb->snd.nxt)) {
+		tcb->flags |= FORCE;
+		return;
+	}
+
+	if (tcb->sackok)
+		tcpsackinput(s, seg);
+
+	/* added by Dong Lin for fast retransmission */
+	if (seg->ack == tcb->snd.una
+		&& tcb->snd.una != tcb->snd.nxt
+		&& seg->len == 0 && seg->wnd == tcb->snd.wnd) {
+
+		/* this is a pure ack w/o window update */
+		netlog(s->p->f, Logtcprxmt, "dupack %lu ack %lu sndwnd %d advwin %d\n",
+			   tcb->snd.dupacks, seg->ack, tcb->snd.wnd, seg->wnd);
+
+		if (++tcb->snd.dupacks == TCPREXMTTHRESH && tcb->sackok) {
+			/*
+			 *  the first segment is lost, the scoreboard
+			 *  knows about the rest
+			 */
+			if (!tcb->snd.recovery) {
+				x = tcb->snd.una + tcb->mss;
+				if (tcb->snd.nsacks && seq_lt(tcb->snd.sacks[0].left, x))
+					x = tcb->snd.sacks[0].left;
+				if (seq_gt(x, tcb->snd.lost))
+					tcb->snd.lost = x;
+				tcpsackrecovery(s, SackRecovery);
+			}
+		} else if (tcb->snd.dupacks == TCPREXMTTHRESH) {
 			/*
 			 *  tahoe tcp rxt the packet, half sshthresh,
 			 *  and set cwnd to one packet
 			 */
 			tcb->snd.recovery = 1;
 			tcb->snd.rxt = tcb->snd.nxt;
+			tpriv->stats[FastRecovery]++;
 			netlog(s->p->f, Logtcprxmt, "fast rxt %lu, nxt %lu\n", tcb->snd.una,
 				   tcb->snd.nxt);
+			tcb->cc->loss(tcb);
 			tcprxmit(s);
 		} else {
 			/* do reno tcp here. */
@@ -1858,6 +2990,8 @@ void update(struct conv *s, Tcp * seg)
 	 *  (should we do new-reno on partial acks?)
 	 */
 	if (!tcb->snd.recovery || seq_ge(seg->ack, tcb->snd.rxt)) {
+		if (tcb->snd.recovery && tcb->cc->recovered != NULL)
+			tcb->cc->recovered(tcb);
 		tcb->snd.dupacks = 0;
 		tcb->snd.recovery = 0;
 	} else
@@ -1875,50 +3009,26 @@ void update(struct conv *s, Tcp * seg)
 		goto done;
 	}
 
-	/* slow start as long as we're not recovering from lost packets */
-	if (tcb->cwind < tcb->snd.wnd && !tcb->snd.recovery) {
-		if (tcb->cwind < tcb->ssthresh) {
-			expand = tcb->mss;
-			if (acked < expand)
-				expand = acked;
-		} else
-			expand = ((int)tcb->mss * tcb->mss) / tcb->cwind;
-
-		if (tcb->cwind + expand < tcb->cwind)
-			expand = tcb->snd.wnd - tcb->cwind;
-		if (tcb->cwind + expand > tcb->snd.wnd)
-			expand = tcb->snd.wnd - tcb->cwind;
-		tcb->cwind += expand;
-	}
-
 	/* Adjust the timers according to the round trip time */
 	if (tcb->rtt_timer.state == TcptimerON && seq_ge(seg->ack, tcb->rttseq)) {
 		tcphalt(tpriv, &tcb->rtt_timer);
 		if ((tcb->flags & RETRAN) == 0) {
-			tcb->backoff = 0;
-			tcb->backedoff = 0;
-			rtt = tcb->rtt_timer.start - tcb->rtt_timer.count;
-			if (rtt == 0)
-				rtt = 1;	/* otherwise all close systems will rexmit in 0 time */
-			rtt *= MSPTICK;
-			if (tcb->srtt == 0) {
-				tcb->srtt = rtt << LOGAGAIN;
-				tcb->mdev = rtt << LOGDGAIN;
-			} else {
-				delta = rtt - (tcb->srtt >> LOGAGAIN);
-				tcb->srtt += delta;
-				if (tcb->srtt <= 0)
-					tcb->srtt = 1;
-
-				delta = abs(delta) - (tcb->mdev >> LOGDGAIN);
-				tcb->mdev += delta;
-				if (tcb->mdev <= 0)
-					tcb->mdev = 1;
-			}
-			tcpsettimer(tcb);
+			rttus = tsc2usec(read_tsc() - tcb->rtt_timer.armed);
+			if (!tcb->tsok)
+				tcprttsample(tcb, tcptimerelapsed(&tcb->rtt_timer));
 		}
 	}
 
+	/*
+	 *  with timestamps, every ack of new data is a sample.  the echo
+	 *  tells us which transmission got acked, so rexmits count too.
+	 */
+	if (tcb->tsok && seg->ts && seg->tsecr != 0) {
+		rtt = (int32_t)(tcptsnow(tcb) - seg->tsecr);
+		if (rtt >= 0 && rtt < MAXBACKMS)
+			tcprttsample(tcb, rtt);
+	}
+
 done:
 	if (qdiscard(s->wq, acked) < acked)
 		tcb->flgcnt--;
@@ -1938,6 +3048,9 @@ done:
 	tcb->flags &= ~RETRAN;
 	tcb->backoff = 0;
 	tcb->backedoff = 0;
+
+	if (acked)
+		tcb->cc->ack(tcb, acked, rttus);
 }
 
 void tcpiput(struct Proto *tcp, struct Ipifc *unused, struct block *bp)
@@ -1949,6 +3062,7 @@ void tcpiput(struct Proto *tcp, struct Ipifc *unused, struct block *bp)
 	int hdrlen;
 	Tcpctl *tcb;
 	uint16_t length;
+	uint32_t seq;
 	uint8_t source[IPaddrlen], dest[IPaddrlen];
 	struct conv *s;
 	struct Fs *f;
@@ -2165,7 +3279,24 @@ reset:
 		}
 	}
 
+	/*
+	 *  PAWS: a timestamp older than the last one we took is from an old
+	 *  duplicate, perhaps from before the sequence space wrapped.  ack it
+	 *  and drop it.  after 24 idle days ts.recent may itself have wrapped.
+	 */
+	if (tcb->tsok && seg.ts && (seg.flags & (RST | SYN)) == 0
+		&& seq_lt(seg.tsval, tcb->tsrecent)
+		&& NOW - tcb->tsrecentage < PAWSIDLE) {
+		netlog(f, Logtcp, "paws drop %I.%d tsval %lu recent %lu\n",
+			   source, seg.source, seg.tsval, tcb->tsrecent);
+		tpriv->stats[PawsDrops]++;
+		freeblist(bp);
+		tcb->flags |= FORCE;
+		goto output;
+	}
+
 	/* Cut the data to fit the receive window */
+	seq = seg.seq;
 	if (tcptrim(tcb, &seg, &bp, &length) == -1) {
 		netlog(f, Logtcp, "tcp len < 0, %lu %d\n", seg.seq, length);
 		update(s, &seg);
@@ -2174,7 +3305,7 @@ reset:
 			tcphalt(tpriv, &tcb->acktimer);
 			tcphalt(tpriv, &tcb->katimer);
 			tcpsetstate(s, Time_wait);
-			tcb->timer.start = MSL2 * (1000 / MSPTICK);
+			tcb->timer.start = MSL2 * 1000;
 			tcpgo(tpriv, &tcb->timer);
 		}
 		if (!(seg.flags & RST)) {
@@ -2186,6 +3317,13 @@ reset:
 		return;
 	}
 
+	/* the segment is acceptable; remember its timestamp to echo */
+	if (tcb->tsok && seg.ts && seq_ge(seg.tsval, tcb->tsrecent)
+		&& seq_le(seq, tcb->rcv.lastack)) {
+		tcb->tsrecent = seg.tsval;
+		tcb->tsrecentage = NOW;
+	}
+
 	/* Cannot accept so answer with a rst */
 	if (length && tcb->state == Closed) {
 		sndrst(tcp, source, dest, length, &seg, version, "sending to Closed");
@@ -2198,6 +3336,7 @@ reset:
 	if (seg.seq != tcb->rcv.nxt)
 		if (length != 0 || (seg.flags & (SYN | FIN))) {
 			update(s, &seg);
+			tcb->rcv.lastsack = seg.seq;
 			if (addreseq(tcb, tpriv, &seg, bp, length) < 0)
 				printd("reseq %I.%d -> %I.%d\n", s->raddr, s->rport, s->laddr,
 					   s->lport);
@@ -2247,7 +3386,7 @@ reset:
 					tcpsetkacounter(tcb);
 					tcb->time = NOW;
 					tcpsetstate(s, Finwait2);
-					tcb->katimer.start = MSL2 * (1000 / MSPTICK);
+					tcb->katimer.start = MSL2 * 1000;
 					tcpgo(tpriv, &tcb->katimer);
 				}
 				break;
@@ -2261,7 +3400,7 @@ reset:
 					tcphalt(tpriv, &tcb->acktimer);
 					tcphalt(tpriv, &tcb->katimer);
 					tcpsetstate(s, Time_wait);
-					tcb->timer.start = MSL2 * (1000 / MSPTICK);
+					tcb->timer.start = MSL2 * 1000;
 					tcpgo(tpriv, &tcb->timer);
 				}
 				break;
@@ -2366,7 +3505,7 @@ reset:
 						tcphalt(tpriv, &tcb->acktimer);
 						tcphalt(tpriv, &tcb->katimer);
 						tcpsetstate(s, Time_wait);
-						tcb->timer.start = MSL2 * (1000 / MSPTICK);
+						tcb->timer.start = MSL2 * 1000;
 						tcpgo(tpriv, &tcb->timer);
 					} else
 						tcpsetstate(s, Closing);
@@ -2377,7 +3516,7 @@ reset:
 					tcphalt(tpriv, &tcb->acktimer);
 					tcphalt(tpriv, &tcb->katimer);
 					tcpsetstate(s, Time_wait);
-					tcb->timer.start = MSL2 * (1000 / MSPTICK);
+					tcb->timer.start = MSL2 * 1000;
 					tcpgo(tpriv, &tcb->timer);
 					break;
 				case Close_wait:
@@ -2430,8 +3569,8 @@ void tcpoutput(struct conv *s)
 	int msgs;
 	Tcpctl *tcb;
 	struct block *hbp, *bp;
-	int sndcnt, n;
-	uint32_t ssize, dsize, usable, sent;
+	int sndcnt, n, mss;
+	uint32_t ssize, dsize, usable, sent, pipe, hseq, hlen;
 	struct Fs *f;
 	struct tcppriv *tpriv;
 	uint8_t version;
@@ -2463,6 +3602,24 @@ void tcpoutput(struct conv *s)
 		if (tcb->snd.ptr != tcb->iss && (tcb->flags & SYNACK) == 0)
 			break;
 
+		/* SACK recovery resends lost holes before any new data */
+		hlen = 0;
+		if (tcb->snd.recovery && tcb->sackok) {
+			hlen = tcpnexthole(tcb, &hseq);
+			if (hlen) {
+				tcb->snd.ptr = hseq;
+				sent = tcb->snd.ptr - tcb->snd.una;
+			}
+		}
+
+		/* room for timestamps and SACK blocks comes out of the data */
+		seg.flags = 0;
+		seg.ts = tcb->tsok;
+		seg.nsacks = 0;
+		if (tcb->sackok && tcb->reseq != NULL)
+			tcpsackblocks(tcb, &seg);
+		mss = tcb->mss - tcpoptlen(&seg);
+
 		/* Compute usable segment based on offered window and limit
 		 * window probes to one
 		 */
@@ -2473,6 +3630,20 @@ void tcpoutput(struct conv *s)
 //              tcb->snd.ptr = tcb->snd.una;
 			}
 			usable = 1;
+		} else if (tcb->snd.recovery && tcb->sackok) {
+			/* only what has left the network can go back in */
+			pipe = tcppipe(tcb);
+			usable = 0;
+			if (tcb->cwind > pipe)
+				usable = tcb->cwind - pipe;
+			if (hlen) {
+				if (usable > hlen)
+					usable = hlen;
+			} else if (tcb->snd.wnd > sent) {
+				if (usable > tcb->snd.wnd - sent)
+					usable = tcb->snd.wnd - sent;
+			} else
+				usable = 0;
 		} else {
 			usable = tcb->cwind;
 			if (tcb->snd.wnd < usable)
@@ -2485,9 +3656,19 @@ void tcpoutput(struct conv *s)
 				   tcb->snd.wnd, tcb->cwind);
 		if (usable < ssize)
 			ssize = usable;
-		if (ssize > tcb->mss) {
+		/* and no runts while recovering, unless the hole is a runt */
+		if (tcb->snd.recovery && tcb->sackok && ssize < mss
+			&& ssize < sndcnt - sent && (hlen == 0 || ssize < hlen))
+			ssize = 0;
+		ssize = tcppace(s, ssize);
+		if (ssize == 0 && hlen) {
+			tcb->snd.ptr = tcb->snd.nxt;
+			sent = tcb->snd.ptr - tcb->snd.una;
+			hlen = 0;
+		}
+		if (ssize > mss) {
 			if ((tcb->flags & TSO) == 0) {
-				ssize = tcb->mss;
+				ssize = mss;
 			} else {
 				int segs, window;
 
@@ -2504,8 +3685,8 @@ void tcpoutput(struct conv *s)
 				 * next multiple of 4, to ensure we
 				 * still yeild.
 				 */
-				segs = ssize / tcb->mss;
-				ssize = segs * tcb->mss;
+				segs = ssize / mss;
+				ssize = segs * mss;
 				msgs += segs;
 				if (segs > 3)
 					msgs = (msgs + 4) & ~3;
@@ -2530,6 +3711,7 @@ void tcpoutput(struct conv *s)
 		seg.flags = ACK;
 		seg.mss = 0;
 		seg.ws = 0;
+		seg.sackok = 0;
 		switch (tcb->state) {
 			case Syn_sent:
 				seg.flags = 0;
@@ -2538,6 +3720,8 @@ void tcpoutput(struct conv *s)
 					dsize--;
 					seg.mss = tcb->mss;
 					seg.ws = tcb->scale;
+					seg.sackok = tcpsack;
+					seg.ts = tcpts;
 				}
 				break;
 			case Syn_received:
@@ -2552,12 +3736,16 @@ void tcpoutput(struct conv *s)
 					ssize = 1;
 					seg.mss = tcb->mss;
 					seg.ws = tcb->scale;
+					seg.sackok = tcb->sackok;
 				}
 				break;
 		}
 		seg.seq = tcb->snd.ptr;
 		seg.ack = tcb->rcv.nxt;
 		seg.wnd = tcb->rcv.wnd;
+		seg.tsval = tcptsnow(tcb);
+		seg.tsecr = tcb->tsrecent;
+		tcb->rcv.lastack = seg.ack;
 
 		/* Pull out data to send */
 		bp = NULL;
@@ -2567,9 +3755,9 @@ void tcpoutput(struct conv *s)
 				seg.flags |= FIN;
 				dsize--;
 			}
-			if (BLEN(bp) > tcb->mss) {
+			if (BLEN(bp) > mss) {
 				bp->flag |= Btso;
-				bp->mss = tcb->mss;
+				bp->mss = mss;
 			}
 		}
 
@@ -2589,6 +3777,18 @@ void tcpoutput(struct conv *s)
 		}
 
 		tcb->snd.ptr += ssize;
+		if (tcb->pacerate)
+			tcb->pacetokens -= MIN(ssize, tcb->pacetokens);
+
+		if (ssize != 0 && tcb->sackok)
+			tcprackxmit(tcb, seg.seq, tcb->snd.ptr,
+						seq_lt(seg.seq, tcb->snd.nxt));
+		if (hlen) {
+			/* next time, pick up at the next hole */
+			tcb->snd.hole = tcb->snd.ptr;
+			tcb->snd.ptr = tcb->snd.nxt;
+			tpriv->stats[SackRexmitSegs]++;
+		}
 
 		/* Pull up the send pointer so we can accept acks
 		 * for this window
@@ -2631,7 +3831,7 @@ void tcpoutput(struct conv *s)
 			 *  transmission time dominates RTT
 			 */
 			if (tcb->rtt_timer.state != TcptimerON)
-				if (ssize == tcb->mss) {
+				if (ssize == mss && hlen == 0) {
 					tcpgo(tpriv, &tcb->rtt_timer);
 					tcb->rttseq = tcb->snd.ptr;
 				}
@@ -2684,6 +3884,11 @@ void tcpsendka(struct conv *s)
 	seg.flags = ACK | PSH;
 	seg.mss = 0;
 	seg.ws = 0;
+	seg.sackok = 0;
+	seg.nsacks = 0;
+	seg.ts = tcb->tsok;
+	seg.tsval = tcptsnow(tcb);
+	seg.tsecr = tcb->tsrecent;
 	if (tcpporthogdefense)
 		urandom_read(&seg.seq, sizeof(seg.seq));
 	else
@@ -2724,7 +3929,7 @@ void tcpsendka(struct conv *s)
  */
 void tcpsetkacounter(Tcpctl * tcb)
 {
-	tcb->kacounter = (12 * 60 * 1000) / (tcb->katimer.start * MSPTICK);
+	tcb->kacounter = (12 * 60 * 1000) / tcb->katimer.start;
 	if (tcb->kacounter < 3)
 		tcb->kacounter = 3;
 }
@@ -2772,7 +3977,7 @@ static void tcpstartka(struct conv *s, char **f, int n)
 	if (n > 1) {
 		x = atoi(f[1]);
 		if (x >= MSPTICK)
-			tcb->katimer.start = x / MSPTICK;
+			tcb->katimer.start = x;
 	}
 	tcpsetkacounter(tcb);
 	tcpgo(s->p->priv, &tcb->katimer);
@@ -2799,13 +4004,8 @@ void tcprxmit(struct conv *s)
 	tcb->snd.ptr = tcb->snd.una;
 
 	/*
-	 *  We should be halving the slow start threshhold (down to one
-	 *  mss) but leaving it at mss seems to work well enough
-	 */
-	tcb->ssthresh = tcb->mss;
-
-	/*
-	 *  pull window down to a single packet
+	 *  pull window down to a single packet.  the congestion
+	 *  control has already set ssthresh.
 	 */
 	tcb->cwind = tcb->mss;
 	tcpoutput(s);
@@ -2835,7 +4035,7 @@ void tcptimeout(void *arg)
 				maxback = MAXBACKMS / 2;
 			else
 				maxback = MAXBACKMS;
-			tcb->backedoff += tcb->timer.start * MSPTICK;
+			tcb->backedoff += tcb->timer.start;
 			if (tcb->backedoff >= maxback) {
 				localclose(s, "connection timed out");
 				break;
@@ -2843,6 +4043,11 @@ void tcptimeout(void *arg)
 			netlog(s->p->f, Logtcprxmt, "timeout rexmit 0x%lx %llu/%llu\n",
 				   tcb->snd.una, tcb->timer.start, NOW);
 			tcpsettimer(tcb);
+			if (tcb->sackok) {
+				tcb->snd.recovery = 0;
+				tcpsackreset(s);
+			}
+			tcb->cc->timeout(tcb);
 			tcprxmit(s);
 			tpriv->stats[RetransTimeouts]++;
 			tcb->snd.dupacks = 0;
@@ -2857,6 +4062,51 @@ void tcptimeout(void *arg)
 	poperror();
 }
 
+void tcpracktimer(void *v)
+{
+	ERRSTACK(1);
+	Tcpctl *tcb;
+	struct conv *s;
+	struct tcppriv *tpriv;
+
+	s = v;
+	tcb = (Tcpctl *) s->ptcl;
+	tpriv = s->p->priv;
+
+	qlock(&s->qlock);
+	if (waserror()) {
+		qunlock(&s->qlock);
+		nexterror();
+	}
+	if (tcb->state != Closed && tcb->sackok) {
+		tpriv->stats[RackTimeouts]++;
+		tcprackdetect(s);
+		tcpoutput(s);
+	}
+	qunlock(&s->qlock);
+	poperror();
+}
+
+void tcppacetimer(void *v)
+{
+	ERRSTACK(1);
+	Tcpctl *tcb;
+	struct conv *s;
+
+	s = v;
+	tcb = (Tcpctl *) s->ptcl;
+
+	qlock(&s->qlock);
+	if (waserror()) {
+		qunlock(&s->qlock);
+		nexterror();
+	}
+	if (tcb->state != Closed)
+		tcpoutput(s);
+	qunlock(&s->qlock);
+	poperror();
+}
+
 int inwindow(Tcpctl * tcb, int seq)
 {
 	return seq_within(seq, tcb->rcv.nxt, tcb->rcv.nxt + tcb->rcv.wnd - 1);
@@ -2880,6 +4130,14 @@ void procsyn(struct conv *s, Tcp * seg)
 	if (seg->mss != 0 && seg->mss < tcb->mss)
 		tcb->mss = seg->mss;
 
+	/* we offered in our SYN, so it's up to them */
+	tcb->sackok = tcpsack && seg->sackok;
+	tcb->tsok = tcpts && seg->ts;
+	if (tcb->tsok) {
+		tcb->tsrecent = seg->tsval;
+		tcb->tsrecentage = NOW;
+	}
+
 	/* the congestion window always starts out as a single segment */
 	tcb->snd.wnd = seg->wnd;
 	tcb->cwind = tcb->mss;
@@ -3087,6 +4345,41 @@ void tcpadvise(struct Proto *tcp, struct block *bp, char *msg)
 	freeblist(bp);
 }
 
+static void tcpccctl(struct conv *c, char *name)
+{
+	Tcpctl *tcb;
+	Tcpcc **cc;
+
+	tcb = (Tcpctl *) c->ptcl;
+	for (cc = tcpccs; *cc != NULL; cc++) {
+		if (strcmp((*cc)->name, name) == 0) {
+			tcpsetcc(tcb, *cc);
+			return;
+		}
+	}
+	error(EINVAL, "unknown congestion control %s", name);
+}
+
+static void tcpsackctl(char *val)
+{
+	if (strcmp(val, "on") == 0)
+		tcpsack = 1;
+	else if (strcmp(val, "off") == 0)
+		tcpsack = 0;
+	else
+		error(EINVAL, "unknown value for sack");
+}
+
+static void tcptsctl(char *val)
+{
+	if (strcmp(val, "on") == 0)
+		tcpts = 1;
+	else if (strcmp(val, "off") == 0)
+		tcpts = 0;
+	else
+		error(EINVAL, "unknown value for timestamps");
+}
+
 static void tcpporthogdefensectl(char *val)
 {
 	if (strcmp(val, "on") == 0)
@@ -3108,6 +4401,12 @@ static void tcpctl(struct conv *c, char **f, int n)
 		tcpsetchecksum(c, f, n);
 	else if (n >= 1 && strcmp(f[0], "tcpporthogdefense") == 0)
 		tcpporthogdefensectl(f[1]);
+	else if (n >= 2 && strcmp(f[0], "sack") == 0)
+		tcpsackctl(f[1]);
+	else if (n >= 2 && strcmp(f[0], "timestamps") == 0)
+		tcptsctl(f[1]);
+	else if (n == 2 && strcmp(f[0], "cc") == 0)
+		tcpccctl(c, f[1]);
 	else
 		error(EINVAL, "unknown command to %s", __func__);
 }
@@ -3123,6 +4422,7 @@ int tcpstats(struct Proto *tcp, char *buf, int len)
 	e = p + len;
 	for (i = 0; i < Nstats; i++)
 		p = seprintf(p, e, "%s: %u\n", statnames[i], priv->stats[i]);
+	p = iphtstats(&priv->ht, p, e);
 	return p - buf;
 }
 
@@ -3175,13 +4475,13 @@ void tcpsettimer(Tcpctl * tcb)
 
 	/* round trip dependency */
 	x = backoff(tcb->backoff) *
-		(tcb->mdev + (tcb->srtt >> LOGAGAIN) + MSPTICK) / MSPTICK;
+		(tcb->mdev + (tcb->srtt >> LOGAGAIN) + MSPTICK);
 
 	/* bounded twixt 1/2 and 64 seconds */
-	if (x < 500 / MSPTICK)
-		x = 500 / MSPTICK;
-	else if (x > (64000 / MSPTICK))
-		x = 64000 / MSPTICK;
+	if (x < 500)
+		x = 500;
+	else if (x > 64000)
+		x = 64000;
 	tcb->timer.start = x;
 }
 
@@ -3192,8 +4492,8 @@ void tcpinit(struct Fs *fs)
 
 	tcp = kzmalloc(sizeof(struct Proto), 0);
 	tpriv = tcp->priv = kzmalloc(sizeof(struct tcppriv), 0);
-	qlock_init(&tpriv->tl);
 	qlock_init(&tpriv->apl);
+	iphtinit(&tpriv->ht);
 	tcp->name = "tcp";
 	tcp->connect = tcpconnect;
 	tcp->announce = tcpannounce;
@@ -651,6 +651,7 @@ int udpstats(struct Proto *udp, char *buf, int len)
 	p = seprintf(p, e, "NoPorts: %u\n", upriv->ustats.udpNoPorts);
 	p = seprintf(p, e, "InErrors: %u\n", upriv->ustats.udpInErrors);
 	p = seprintf(p, e, "OutDatagrams: %u\n", upriv->ustats.udpOutDatagrams);
+	p = iphtstats(&upriv->ht, p, e);
 	return p - buf;
 }
 
@@ -668,6 +669,7 @@ void udpinit(struct Fs *fs)
 
 	udp = kzmalloc(sizeof(struct Proto), 0);
 	udp->priv = kzmalloc(sizeof(Udppriv), 0);
+	iphtinit(&((Udppriv *)udp->priv)->ht);
 	udp->name = "udp";
 	udp->connect = udpconnect;
 	udp->announce = udpannounce;
@@ -21,6 +21,8 @@
 
 static void __page_decref(page_t *page);
 static error_t __page_alloc_specific(page_t **page, size_t ppn);
+static void __free_area_update(size_t first_ppn, size_t nr_pgs);
+static void __numa_account(size_t ppn, long delta);
 
 #ifdef CONFIG_PAGE_COLORING
 #define NUM_KERNEL_COLORS 8
@@ -64,6 +66,7 @@ static void __page_init(struct page *page)
 		*page = BSD_LIST_FIRST(&colored_page_free_list[i]);                 \
 		BSD_LIST_REMOVE(*page, pg_link);                                    \
 		__page_init(*page);                                                 \
+		__free_area_update(page2ppn(*page), 1);                             \
 		return i;                                                           \
 	}                                                                       \
 	return -ENOMEM;
@@ -94,10 +97,149 @@ static ssize_t __colored_page_alloc(uint8_t* map, page_t** page,
 	return ret;
 }
 
+/* Free area tree: an order-indexed index of contiguous free memory, used for
+ * the multi-page allocations.  The colored free lists are still the only place
+ * where free pages live; this just tracks which of them are free.
+ *
+ * It's a complete binary tree over the physical pages, stored as an array (the
+ * root is at 1, the children of i are at 2i and 2i + 1, and the leaf for ppn p
+ * is at fa_nr_leaves + p).  Each node holds the largest order of a naturally
+ * aligned, fully free block in its subtree, or -1 if there is none.  A node of
+ * height h whose children are both fully free (h - 1) is fully free itself.
+ * Finding a 2^order block is a walk down the tree, and page allocs and frees
+ * walk back up, both O(log n).
+ *
+ * Protected by the colored_page_free_list_lock, like the free lists. */
+static int8_t *fa_tree;
+static size_t fa_nr_leaves;
+static int fa_height;
+
+static int8_t __fa_combine(int8_t left, int8_t right, int height)
+{
+	if ((left == height - 1) && (right == height - 1))
+		return height;
+	return MAX(left, right);
+}
+
+/* Recomputes the tree for pages [first_ppn, first_ppn + nr_pgs), based on
+ * their refcnts.  Call this after changing whether or not pages are free.
+ * Costs O(nr_pgs + log n). */
+static void __free_area_update(size_t first_ppn, size_t nr_pgs)
+{
+	size_t lo = fa_nr_leaves + first_ppn;
+	size_t hi = lo + nr_pgs - 1;
+
+	int8_t new;
+
+	if (!fa_tree || !nr_pgs)
+		return;
+	for (size_t i = lo; i <= hi; i++) {
+		new = page_is_free(i - fa_nr_leaves) ? 0 : -1;
+		if (new != fa_tree[i])
+			__numa_account(i - fa_nr_leaves, new ? -1 : 1);
+		fa_tree[i] = new;
+	}
+	for (int h = 1; lo > 1; h++) {
+		lo >>= 1;
+		hi >>= 1;
+		for (size_t i = lo; i <= hi; i++)
+			fa_tree[i] = __fa_combine(fa_tree[2 * i], fa_tree[2 * i + 1], h);
+	}
+}
+
+/* Returns the first ppn of a free, naturally aligned 2^order block, or -1.
+ * Prefers high memory, like the old linear scan did, to leave low memory for
+ * those who need it. */
+static long __free_area_find(size_t order)
+{
+	size_t i = 1;
+
+	if (!fa_tree || (order > fa_height) || (fa_tree[1] < (int)order))
+		return -1;
+	for (int h = fa_height; h > order; h--) {
+		if (fa_tree[2 * i + 1] >= (int)order)
+			i = 2 * i + 1;
+		else
+			i = 2 * i;
+	}
+	return (i << order) - fa_nr_leaves;
+}
+
+/* Like __free_area_find(), but the block must be within [lo, hi).  Searches the
+ * subtree at node i, of the given height.  Subtrees entirely inside the range
+ * are a straight walk down, so this is O(log n) per range boundary. */
+static long __free_area_find_in(size_t i, int height, size_t order,
+                                size_t lo, size_t hi)
+{
+	size_t first = (i << height) - fa_nr_leaves;
+	size_t last = first + (1UL << height);
+	long ret;
+
+	if ((fa_tree[i] < (int)order) || (last <= lo) || (first >= hi))
+		return -1;
+	if (height == order)
+		return (lo <= first) && (last <= hi) ? first : -1;
+	ret = __free_area_find_in(2 * i + 1, height - 1, order, lo, hi);
+	if (ret != -1)
+		return ret;
+	return __free_area_find_in(2 * i, height - 1, order, lo, hi);
+}
+
+/* Allocates the tree.  Needs to be called before page_alloc_init(), since it
+ * uses boot_alloc.  Every page starts out busy. */
+void free_area_init(void)
+{
+	fa_height = LOG2_UP(max_nr_pages);
+	fa_nr_leaves = 1UL << fa_height;
+	fa_tree = boot_alloc(fa_nr_leaves * 2 * sizeof(int8_t), PGSIZE);
+	memset(fa_tree, -1, fa_nr_leaves * 2 * sizeof(int8_t));
+}
+
+/* Builds the tree from the pages' refcnts, once page_alloc_init() has set up
+ * the free lists. */
+void free_area_populate(void)
+{
+	spin_lock_irqsave(&colored_page_free_list_lock);
+	__free_area_update(0, max_nr_pages);
+	spin_unlock_irqsave(&colored_page_free_list_lock);
+}
+
+/* Returns the number of free 2^order blocks that exist without splitting a
+ * larger free block.  Mostly for diagnostics; O(n). */
+size_t free_area_nr_blocks(size_t order)
+{
+	size_t nr = 0;
+	size_t lvl_start;
+
+	if (!fa_tree || (order > fa_height))
+		return 0;
+	lvl_start = fa_nr_leaves >> order;
+	spin_lock_irqsave(&colored_page_free_list_lock);
+	for (size_t i = lvl_start; i < 2 * lvl_start; i++) {
+		/* Only count blocks whose parent isn't also fully free */
+		if ((fa_tree[i] == order) && ((i == 1) || (fa_tree[i / 2] != order + 1)))
+			nr++;
+	}
+	spin_unlock_irqsave(&colored_page_free_list_lock);
+	return nr;
+}
+
 static void __real_page_alloc(struct page *page)
 {
 	BSD_LIST_REMOVE(page, pg_link);
 	__page_init(page);
+	__free_area_update(page2ppn(page), 1);
+}
+
+/* Takes nr_pgs free pages, starting at first_ppn, off the free lists.  Only
+ * updates the free area tree once.  Grab the lock first. */
+static void __cont_page_alloc(size_t first_ppn, size_t nr_pgs)
+{
+	for (size_t i = first_ppn; i < first_ppn + nr_pgs; i++) {
+		BSD_LIST_REMOVE(ppn2page(i), pg_link);
+		__page_init(ppn2page(i));
+	}
+	__free_area_update(first_ppn, nr_pgs);
 }
 
 /* Internal version of page_alloc_specific.  Grab the lock first. */
@@ -187,45 +329,160 @@ void *kpage_zalloc_addr(void)
 void *get_cont_pages(size_t order, int flags)
 {
 	size_t npages = 1 << order;	
+	long first;
 
-	size_t naddrpages = max_paddr / PGSIZE;
-	// Find 'npages' free consecutive pages
-	int first = -1;
 	spin_lock_irqsave(&colored_page_free_list_lock);
-	for(int i=(naddrpages-1); i>=(npages-1); i--) {
-		int j;
-		for(j=i; j>=(i-(npages-1)); j--) {
-			if( !page_is_free(j) ) {
-				i = j - 1;
-				break;
-			}
-		}
-		if( j == (i-(npages-1)-1)) {
-			first = j+1;
-			break;
-		}
-	}
+	first = __free_area_find(order);
 	//If we couldn't find them, return NULL
-	if( first == -1 ) {
+	if (first == -1) {
 		spin_unlock_irqsave(&colored_page_free_list_lock);
 		if (flags & MEM_ERROR)
 			error(ENOMEM, ERROR_FIXME);
 		return NULL;
 	}
+	__cont_page_alloc(first, npages);
+	spin_unlock_irqsave(&colored_page_free_list_lock);
+	return ppn2kva(first);
+}
+
+/* NUMA memory pools.  The arch tells us which physical ranges belong to which
+ * node (on x86, from the ACPI SRAT), and a node's pool is the part of the free
+ * area tree covering its ranges.  We also track the free pages per node.
+ *
+ * Until page_numa_init(), or if the arch never adds any ranges, there is only
+ * one pool, and allocations for any node come from anywhere. */
+#define MAX_NUMA_MEM_RANGES		64
+
+struct numa_mem_range {
+	size_t start_ppn;
+	size_t end_ppn;
+	int node;
+};
+
+static struct numa_mem_range numa_mem_ranges[MAX_NUMA_MEM_RANGES];
+static int nr_numa_mem_ranges;
+static int nr_numa_nodes;
+static long numa_nr_free[MAX_NUMA_NODES];
+static size_t numa_nr_total[MAX_NUMA_NODES];
+static bool numa_ready;
+
+/* Returns the node of ppn, or -1 if it isn't in any node's range. */
+static int ppn2node(size_t ppn)
+{
+	int lo = 0, hi = nr_numa_mem_ranges - 1, mid;
+
+	/* The ranges are sorted and don't overlap */
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (ppn < numa_mem_ranges[mid].start_ppn)
+			hi = mid - 1;
+		else if (ppn >= numa_mem_ranges[mid].end_ppn)
+			lo = mid + 1;
+		else
+			return numa_mem_ranges[mid].node;
+	}
+	return -1;
+}
+
+static void __numa_account(size_t ppn, long delta)
+{
+	int node;
+
+	if (!numa_ready)
+		return;
+	node = ppn2node(ppn);
+	if (node >= 0)
+		numa_nr_free[node] += delta;
+}
+
+/* Called by the arch during boot, before page_numa_init(). */
+void page_numa_add_range(int node, physaddr_t start, physaddr_t end)
+{
+	struct numa_mem_range *r;
+	int i;
+
+	start = MIN(ROUNDUP(start, PGSIZE), max_paddr);
+	end = MIN(ROUNDDOWN(end, PGSIZE), max_paddr);
+	if ((node < 0) || (start >= end))
+		return;
+	if (node >= MAX_NUMA_NODES) {
+		printk("NUMA node %d is beyond MAX_NUMA_NODES, ignoring\n", node);
+		return;
+	}
+	if (nr_numa_mem_ranges == MAX_NUMA_MEM_RANGES) {
+		printk("Out of NUMA memory ranges, ignoring %p-%p\n", start, end);
+		return;
+	}
+	/* Keep them sorted for ppn2node() */
+	for (i = nr_numa_mem_ranges; i > 0; i--) {
+		if (numa_mem_ranges[i - 1].start_ppn < pa2ppn(start))
+			break;
+		numa_mem_ranges[i] = numa_mem_ranges[i - 1];
+	}
+	r = &numa_mem_ranges[i];
+	r->start_ppn = pa2ppn(start);
+	r->end_ppn = pa2ppn(end);
+	r->node = node;
+	nr_numa_mem_ranges++;
+	nr_numa_nodes = MAX(nr_numa_nodes, node + 1);
+}
+
+/* Called by the arch once it has added all of the ranges. */
+void page_numa_init(void)
+{
+	struct numa_mem_range *r;
 
-	for(int i=0; i<npages; i++) {
-		page_t* page;
-		__page_alloc_specific(&page, first+i);
+	if (!nr_numa_mem_ranges)
+		return;
+	spin_lock_irqsave(&colored_page_free_list_lock);
+	for (int i = 0; i < nr_numa_mem_ranges; i++) {
+		r = &numa_mem_ranges[i];
+		numa_nr_total[r->node] += r->end_ppn - r->start_ppn;
+		for (size_t j = r->start_ppn; j < r->end_ppn; j++) {
+			if (page_is_free(j))
+				numa_nr_free[r->node]++;
+		}
 	}
+	numa_ready = TRUE;
 	spin_unlock_irqsave(&colored_page_free_list_lock);
-	return ppn2kva(first);
+}
+
+int page_numa_nr_nodes(void)
+{
+	return MAX(nr_numa_nodes, 1);
+}
+
+/* Prints the per-node ranges and usage into [buf, buf + len).  Returns the
+ * number of bytes written. */
+size_t page_numa_print(char *buf, size_t len)
+{
+	char *p = buf, *e = buf + len;
+	struct numa_mem_range *r;
+
+	if (!numa_ready)
+		return snprintf(buf, len, "No NUMA memory info, one pool: %lu free\n",
+		                nr_free_pages);
+	p = seprintf(p, e, "%4s %12s %12s\n", "node", "total_pgs", "free_pgs");
+	for (int i = 0; i < nr_numa_nodes; i++)
+		p = seprintf(p, e, "%4d %12lu %12ld\n", i, numa_nr_total[i],
+		             numa_nr_free[i]);
+	p = seprintf(p, e, "\n%4s %18s %18s\n", "node", "start_pa", "end_pa");
+	for (int i = 0; i < nr_numa_mem_ranges; i++) {
+		r = &numa_mem_ranges[i];
+		p = seprintf(p, e, "%4d %18p %18p\n", r->node,
+		             r->start_ppn << PGSHIFT, r->end_ppn << PGSHIFT);
+	}
+	return p - buf;
 }
 
 /**
  * @brief Allocated 2^order contiguous physical pages.  Will increment the
  * reference count for the pages. Get them from NUMA node node.
  *
- * @param[in] node which node to allocate from. Unimplemented.
+ * If the node has no suitable free block (or we don't know about NUMA), this
+ * falls back to any node.
+ *
+ * @param[in] node which node to allocate from.
  * @param[in] order order of the allocation
  * @param[in] flags memory allocation flags
  *
@@ -233,20 +490,39 @@ void *get_cont_pages(size_t order, int flags)
  */
 void *get_cont_pages_node(int node, size_t order, int flags)
 {
-	return get_cont_pages(order, flags);
+	struct numa_mem_range *r;
+	long first = -1;
+
+	if (!numa_ready || (node < 0) || (node >= nr_numa_nodes))
+		return get_cont_pages(order, flags);
+	spin_lock_irqsave(&colored_page_free_list_lock);
+	for (int i = nr_numa_mem_ranges - 1; i >= 0; i--) {
+		r = &numa_mem_ranges[i];
+		if (r->node != node)
+			continue;
+		first = __free_area_find_in(1, fa_height, order, r->start_ppn,
+		                            r->end_ppn);
+		if (first != -1)
+			break;
+	}
+	if (first == -1) {
+		spin_unlock_irqsave(&colored_page_free_list_lock);
+		return get_cont_pages(order, flags);
+	}
+	__cont_page_alloc(first, 1 << order);
+	spin_unlock_irqsave(&colored_page_free_list_lock);
+	return ppn2kva(first);
 }
 
 /**
  * @brief Allocated 2^order contiguous physical pages starting at paddr 'at'.
  * Will increment the reference count for the pages.
  *
- * We might need some restrictions on size of the alloc and its 'at' alignment.
- * For instance, for a future buddy allocator (if we go that route), it might be
- * easier if the order was aligned to the 'at'.  e.g., a 1GB alloc must be at a
- * 1GB aligned addr.  A 2GB alloc would not be allowed at a merely 1GB
- * alignment.
+ * Unlike get_cont_pages(), 'at' need not be aligned to the order.  The free
+ * area tree doesn't care: it is updated from the pages' state, and a misaligned
+ * alloc just breaks up more blocks.
  *
- * For now, anything goes.  Note that the request is for a physical starting
+ * Anything goes.  Note that the request is for a physical starting
  * point, but the return is the KVA.
  *
  * @param[in] order order of the allocation
@@ -271,8 +547,7 @@ void *get_cont_phys_pages_at(size_t order, physaddr_t at, int flags)
 			return NULL;
 		}
 	}
-	for (unsigned long i = first_pg_nr; i < first_pg_nr + nr_pgs; i++)
-		__real_page_alloc(ppn2page(i));
+	__cont_page_alloc(first_pg_nr, nr_pgs);
 	spin_unlock_irqsave(&colored_page_free_list_lock);
 	return KADDR(at);
 }
@@ -365,6 +640,7 @@ static void page_release(struct kref *kref)
 	   page,
 	   pg_link
 	);
+	__free_area_update(page2ppn(page), 1);
 }
 
 /* Helper when initializing a page - just to prevent the proliferation of
@@ -11,6 +11,8 @@
 #include <kref.h>
 #include <assert.h>
 #include <stdio.h>
+#include <vfs.h>
+#include <writeback.h>
 
 void pm_add_vmr(struct page_map *pm, struct vm_region *vmr)
 {
@@ -103,6 +105,7 @@ void pm_init(struct page_map *pm, struct page_map_operations *op, void *host)
 	spinlock_init(&pm->pm_lock);
 	TAILQ_INIT(&pm->pm_vmrs);
 	atomic_set(&pm->pm_removal, 0);
+	memset(&pm->pm_ra, 0, sizeof(struct pm_readahead));
 }
 
 /* Looks up the index'th page in the page map, returning a refcnt'd reference
@@ -186,6 +189,202 @@ void pm_put_page(struct page *page)
 	atomic_add((atomic_t*)tree_slot, -(1UL << PM_REFCNT_SHIFT));
 }
 
+/* Sets PG_DIRTY, returning TRUE if the page was clean.  Dirty pages in PMs that
+ * do writeback are accounted for, and their inode gets written back later. */
+bool pm_set_page_dirty(struct page_map *pm, struct page *page)
+{
+	long old_flags;
+
+	do {
+		old_flags = atomic_read(&page->pg_flags);
+		if (old_flags & PG_DIRTY)
+			return FALSE;
+	} while (!atomic_cas(&page->pg_flags, old_flags, old_flags | PG_DIRTY));
+	if (pm->pm_op->writepages) {
+		atomic_inc(&wb_nr_dirty);
+		wb_page_dirtied(pm->pm_host);
+	}
+	return TRUE;
+}
+
+/* Clears PG_DIRTY, returning TRUE if the page was dirty.  Whoever gets TRUE
+ * needs to write the page back. */
+bool pm_clear_page_dirty(struct page_map *pm, struct page *page)
+{
+	long old_flags;
+
+	do {
+		old_flags = atomic_read(&page->pg_flags);
+		if (!(old_flags & PG_DIRTY))
+			return FALSE;
+	} while (!atomic_cas(&page->pg_flags, old_flags, old_flags & ~PG_DIRTY));
+	if (pm->pm_op->writepages)
+		atomic_dec(&wb_nr_dirty);
+	return TRUE;
+}
+
+/* Starts writeback of all of pm's dirty pages, in batches, and returns the
+ * number of pages it started writing.  Doesn't wait for the IO, but it does
+ * wait for any page that's locked, e.g. for a previous writeback. */
+unsigned long pm_writeback(struct page_map *pm)
+{
+	#define PM_WB_BATCH 64
+	struct page *pages[PM_WB_BATCH];
+	struct page *page;
+	unsigned int nr = 0;
+	unsigned long nr_written = 0;
+	unsigned long nr_pgs = ROUNDUP(pm->pm_host->i_size, PGSIZE) >> PGSHIFT;
+
+	assert(pm->pm_op->writepages);
+	for (unsigned long i = 0; i < nr_pgs; i++) {
+		page = pm_find_page(pm, i);
+		if (!page)
+			continue;
+		if (!(atomic_read(&page->pg_flags) & PG_DIRTY)) {
+			pm_put_page(page);
+			continue;
+		}
+		lock_page(page);
+		if (!pm_clear_page_dirty(pm, page)) {
+			unlock_page(page);
+			pm_put_page(page);
+			continue;
+		}
+		atomic_inc(&wb_nr_writeback);
+		pages[nr++] = page;
+		if (nr == PM_WB_BATCH) {
+			pm->pm_op->writepages(pm, pages, nr);
+			nr_written += nr;
+			nr = 0;
+		}
+	}
+	if (nr) {
+		pm->pm_op->writepages(pm, pages, nr);
+		nr_written += nr;
+	}
+	return nr_written;
+}
+
+/* writepages calls this when a page's IO is done.  On error, the page stays
+ * dirty, so we'll try again later. */
+void pm_writeback_done(struct page_map *pm, struct page *page, int error)
+{
+	if (error)
+		pm_set_page_dirty(pm, page);
+	unlock_page(page);
+	pm_put_page(page);
+	wb_page_written();
+}
+
+/* Updates the readahead state for a request for page index.  miss is TRUE if
+ * the page wasn't in the PM and the caller is about to read it.  Returns how many
+ * pages to read ahead, starting at *ra_idx.
+ *
+ * The state is protected by the PM lock, but the reads it decides on happen
+ * later, so two readers racing on a file might both think they're sequential.
+ * That just costs us a few PM lookups for pages that are already there. */
+static unsigned int pm_ra_next(struct page_map *pm, unsigned long index,
+                               bool miss, unsigned long *ra_idx)
+{
+	struct pm_readahead *ra = &pm->pm_ra;
+	unsigned int nr = 0;
+
+	spin_lock(&pm->pm_lock);
+	if (miss) {
+		if (!index || (index == ra->ra_prev_idx + 1) ||
+		    (ra->ra_size && (index == ra->ra_start + ra->ra_size))) {
+			/* Sequential, but we either just started or fell behind.  The
+			 * window includes index, which the caller reads. */
+			ra->ra_size = ra->ra_size ? MIN(ra->ra_size * 2, PM_RA_MAX_PAGES)
+			                          : PM_RA_INIT_PAGES;
+			ra->ra_start = index;
+			ra->ra_async_size = ra->ra_size / 2;
+			*ra_idx = index + 1;
+			nr = ra->ra_size - 1;
+		} else {
+			ra->ra_size = 0;
+		}
+	} else if (ra->ra_size &&
+	           (index == ra->ra_start + ra->ra_size - ra->ra_async_size)) {
+		/* The reader caught up to the marker; read the next window.  Its
+		 * marker is its first page. */
+		ra->ra_start += ra->ra_size;
+		ra->ra_size = MIN(ra->ra_size * 2, PM_RA_MAX_PAGES);
+		ra->ra_async_size = ra->ra_size;
+		*ra_idx = ra->ra_start;
+		nr = ra->ra_size;
+	}
+	ra->ra_prev_idx = index;
+	if (nr)
+		ra->nr_ra_windows++;
+	spin_unlock(&pm->pm_lock);
+	return nr;
+}
+
+/* Cache-hit version of pm_ra_next(), which doesn't take the PM lock unless index
+ * is the window's async marker, i.e. unless there's a window to start.  Hits are
+ * the common case for a file that's being read a lot, and the readers shouldn't
+ * all fight over the lock just to note where they are.
+ *
+ * The fields can change under us, so the marker check is only a hint, and
+ * pm_ra_next() checks again with the lock held.  ra_prev_idx is only a hint for
+ * the next miss, so we set it without the lock. */
+static unsigned int pm_ra_hit(struct page_map *pm, unsigned long index,
+                              unsigned long *ra_idx)
+{
+	struct pm_readahead *ra = &pm->pm_ra;
+	unsigned int size = ACCESS_ONCE(ra->ra_size);
+
+	if (!size ||
+	    index != ACCESS_ONCE(ra->ra_start) + size -
+	             ACCESS_ONCE(ra->ra_async_size)) {
+		if (ACCESS_ONCE(ra->ra_prev_idx) != index)
+			ra->ra_prev_idx = index;
+		return 0;
+	}
+	return pm_ra_next(pm, index, FALSE, ra_idx);
+}
+
+/* Reads in up to nr pages starting at index, skipping any that are already in
+ * the PM, without waiting for the IO.  If page is non-zero, it's a locked page
+ * for index - 1 that goes out in the same batch, and the caller keeps its slot
+ * ref. */
+static void pm_readahead(struct page_map *pm, struct page *page,
+                         unsigned long index, unsigned int nr)
+{
+	struct page *pages[PM_RA_MAX_PAGES + 1];
+	struct page *ra_page;
+	unsigned int nr_pages = 0;
+	unsigned long eof_idx;
+
+	eof_idx = ROUNDUP(pm->pm_host->i_size, PGSIZE) >> PGSHIFT;
+	if (page) {
+		/* readpages will put a ref, and we want to keep ours */
+		pages[nr_pages++] = pm_find_page(pm, page->pg_index);
+	}
+	for (unsigned long i = index; i < MIN(index + nr, eof_idx); i++) {
+		ra_page = pm_find_page(pm, i);
+		if (ra_page) {
+			pm_put_page(ra_page);
+			continue;
+		}
+		if (kpage_alloc(&ra_page))
+			break;
+		atomic_set(&ra_page->pg_flags, PG_LOCKED | PG_PAGEMAP);
+		ra_page->pg_sem.nr_signals = 0;
+		if (pm_insert_page(pm, i, ra_page)) {
+			page_decref(ra_page);
+			continue;
+		}
+		pages[nr_pages++] = ra_page;
+	}
+	spin_lock(&pm->pm_lock);
+	pm->pm_ra.nr_ra_pages += nr_pages - (page ? 1 : 0);
+	spin_unlock(&pm->pm_lock);
+	if (nr_pages)
+		pm->pm_op->readpages(pm, pages, nr_pages);
+}
+
 /* Makes sure the index'th page of the mapped object is loaded in the page cache
  * and returns its location via **pp.
  *
@@ -194,6 +393,8 @@ int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp)
 {
 	struct page *page;
 	int error;
+	unsigned long ra_idx;
+	unsigned int nr_ra;
 
 	page = pm_find_page(pm, index);
 	while (!page) {
@@ -220,6 +421,11 @@ int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp)
 		}
 	}
 	assert(page && pm_slot_check_refcnt(*page->pg_tree_slot));
+	if (pm->pm_op->readpages) {
+		nr_ra = pm_ra_hit(pm, index, &ra_idx);
+		if (nr_ra)
+			pm_readahead(pm, 0, ra_idx, nr_ra);
+	}
 	if (atomic_read(&page->pg_flags) & PG_UPTODATE) {
 		*pp = page;
 		printd("pm %p FOUND page %p, addr %p, idx %d\n", pm, page,
@@ -237,6 +443,21 @@ int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp)
 	}
 	/* fall through */
 load_locked_page:
+	if (pm->pm_op->readpages) {
+		nr_ra = pm_ra_next(pm, index, TRUE, &ra_idx);
+		if (nr_ra) {
+			/* Our page goes out with the readahead, so it can be merged with
+			 * the rest.  readpages unlocks it when it's done. */
+			pm_readahead(pm, page, ra_idx, nr_ra);
+			lock_page(page);
+			if (atomic_read(&page->pg_flags) & PG_UPTODATE) {
+				unlock_page(page);
+				*pp = page;
+				return 0;
+			}
+			/* readpages failed on our page; try it the slow way */
+		}
+	}
 	error = pm->pm_op->readpage(pm, page);
 	assert(!error);
 	assert(atomic_read(&page->pg_flags) & PG_UPTODATE);
@@ -332,7 +553,7 @@ static int __pm_mark_dirty_pgs_unmap(struct proc *p, pte_t pte, void *va,
 	/* need to check for removal again, just like in mark_not_present */
 	if (atomic_read(&page->pg_flags) & PG_REMOVAL) {
 		if (pte_is_dirty(pte))
-			atomic_or(&page->pg_flags, PG_DIRTY);
+			pm_set_page_dirty(page->pg_mapping, page);
 		pte_clear(pte);
 	}
 	return 0;
@@ -533,15 +754,23 @@ handle_dirty:
 			ptr_store[ptr_free_idx++] = page;
 			/* once we've decided to WB, we can clear the dirty flag.  might
 			 * have an extra WB later, but we won't miss new data */
-			atomic_and(&page->pg_flags, ~PG_DIRTY);
+			pm_clear_page_dirty(pm, page);
 		}
 	}
 	/* we're unlocking, meaning VMRs and the radix tree can be changed, but we
 	 * are still the only remover. still can have new refs that clear REMOVAL */
 	spin_unlock(&pm->pm_lock);
 	/* could batch these up, etc. */
-	for (int j = 0; j < ptr_free_idx; j++)
-		pm->pm_op->writepage(pm, (struct page*)ptr_store[j]);
+	for (int j = 0; j < ptr_free_idx; j++) {
+		page = (struct page*)ptr_store[j];
+		if (pm->pm_op->writepage(pm, page)) {
+			/* the page still has the only copy of its data.  like
+			 * pm_writeback_done(), keep it dirty, and keep it in the PM: since
+			 * we set PG_REMOVAL, we're the ones to clear it. */
+			pm_set_page_dirty(pm, page);
+			atomic_and(&page->pg_flags, ~PG_REMOVAL);
+		}
+	}
 	ptr_free_idx = 0;
 	spin_lock(&pm->pm_lock);
 	/* bailed out of the dirty check loop earlier, need to finish and WB.  i is
@@ -598,6 +827,9 @@ void print_page_map_info(struct page_map *pm)
 	struct vm_region *vmr_i;
 	printk("Page Map %p\n", pm);
 	printk("\tNum pages: %lu\n", pm->pm_num_pages);
+	printk("\tReadahead: window %lu+%u, %lu windows, %lu pages\n",
+	       pm->pm_ra.ra_start, pm->pm_ra.ra_size, pm->pm_ra.nr_ra_windows,
+	       pm->pm_ra.nr_ra_pages);
 	spin_lock(&pm->pm_lock);
 	TAILQ_FOREACH(vmr_i, &pm->pm_vmrs, vm_pm_link) {
 		printk("\tVMR proc %d: (%p - %p): 0x%08x, 0x%08x, %p, %p\n",
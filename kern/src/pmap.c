@@ -74,7 +74,9 @@ void pmem_init(struct multiboot_info *mbi)
 	printk("Highest page number (including reserved): %lu\n", max_nr_pages);
 	pages = (struct page*)boot_zalloc(max_nr_pages * sizeof(struct page),
 	                                  PGSIZE);
+	free_area_init();
 	page_alloc_init(mbi);
+	free_area_populate();
 	vm_init();
 
 	static_assert(PROCINFO_NUM_PAGES*PGSIZE <= PTSIZE);
@@ -353,7 +353,9 @@ error_t proc_alloc(struct proc **pp, struct proc *parent, int flags)
 	p->heap_top = 0;
 	spinlock_init(&p->vmr_lock);
 	spinlock_init(&p->pte_lock);
+	spinlock_init(&p->arsc_lock);
 	TAILQ_INIT(&p->vm_regions); /* could init this in the slab */
+	rb_root_init(&p->vm_tree);
 	p->vmr_history = 0;
 	/* Initialize the vcore lists, we'll build the inactive list so that it
 	 * includes all vcores when we initialize procinfo.  Do this before initing
@@ -873,6 +875,8 @@ void proc_destroy(struct proc *p)
 	 * abortable sleepers are already prevented via the DYING state.  (signalled
 	 * DYING, no new sleepers will block, and now we wake all old sleepers). */
 	abort_all_sysc(p);
+	/* Stop polling our syscall ring, and drop the ring's ref */
+	arsc_proc_unregister(p);
 	/* we need to close files here, and not in free, since we could have a
 	 * refcnt indirectly related to one of our files.  specifically, if we have
 	 * a parent sleeping on our pipe, that parent won't wake up to decref until
@@ -0,0 +1,63 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * RAM-backed block device.
+ *
+ * The "hardware" services an IO by copying to or from the backing memory.  We
+ * do that in a routine kernel message on the submitting core, which plays the
+ * role of the completion interrupt.  Submitters usually sleep on their request
+ * right after submitting, so the IO runs as soon as they block. */
+
+#include <blockdev.h>
+#include <kmalloc.h>
+#include <kref.h>
+#include <string.h>
+#include <smp.h>
+#include <trap.h>
+
+static void __ramdisk_do_io(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct block_device *bdev = (struct block_device*)a0;
+	struct blk_io *io = (struct blk_io*)a1;
+	void *dev_addr = bdev->b_data + (io->sector << SECTOR_SZ_LOG);
+	struct buffer_head *bh;
+	size_t amt;
+
+	for (int i = 0; i < io->nr_segs; i++) {
+		bh = io->segs[i].bh;
+		amt = bh->bh_nr_sector << SECTOR_SZ_LOG;
+		if (io->flags & BREQ_READ)
+			memcpy(bh->bh_buffer, dev_addr, amt);
+		else
+			memcpy(dev_addr, bh->bh_buffer, amt);
+		dev_addr += amt;
+	}
+	bdev_io_done(bdev, io, 0);
+}
+
+static void ramdisk_submit_io(struct block_device *bdev, struct blk_io *io)
+{
+	send_kernel_message(io->core, __ramdisk_do_io, (long)bdev, (long)io, 0,
+	                    KMSG_ROUTINE);
+}
+
+static struct bdev_operations ramdisk_op = {
+	ramdisk_submit_io,
+};
+
+/* Makes a block device out of size bytes at data.  The caller still needs to
+ * hook it up to the file system. */
+struct block_device *ramdisk_create(char *name, void *data, size_t size)
+{
+	struct block_device *bdev = kzmalloc(sizeof(struct block_device),
+	                                     MEM_WAIT);
+
+	bdev->b_sector_sz = SECTOR_SZ;
+	bdev->b_nr_sector = size >> SECTOR_SZ_LOG;
+	kref_init(&bdev->b_kref, fake_release, 1);
+	bdev->b_data = data;
+	strlcpy(bdev->b_name, name, BDEV_INLINE_NAME);
+	bdev->b_op = &ramdisk_op;
+	bdev_init(bdev);
+	return bdev;
+}
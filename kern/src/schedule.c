@@ -16,11 +16,87 @@
 #include <alarm.h>
 #include <sys/queue.h>
 #include <arsc_server.h>
+#include <kmalloc.h>
+
+/* Locks / sync tools */
+
+/* The ksched used to have one 'big ksched lock' protecting everything.  It's
+ * now split three ways:
+ * - each core has an SCP run queue, with its own lock.  SCPs are queued on a
+ *   management core's runq, and mgmt cores pull from their own runq before
+ *   stealing from others.
+ * - mcp_lock protects the MCP lists.
+ * - alloc_lock protects the provisioning assignment, the prov lists of each
+ *   proc, and the core allocation structures (corealloc_*.c, coreprov.c).
+ *
+ * p->ksched_data.cur_lock is the lock for whichever list p is on, and protects
+ * p's membership on that list.  We never hold more than one of these at a time.
+ * The idle core CBs grab the alloc_lock while holding a proc_lock, so don't
+ * lock a proc while holding the alloc_lock.
+ *
+ * Procs on any ksched list hold a ref for it.  A proc can be put on a list
+ * concurrently with its death (we check for DYING under the list's lock, but
+ * we don't hold the list lock when __sched_proc_destroy() runs), in which case
+ * whoever pulls it off the list later sees it is DYING and drops the ref.
+ *
+ * All of these are ksched_locks, which track how long they are held and how
+ * often they are contended.  'ks diag' in the monitor reports them. */
+struct ksched_lock {
+	spinlock_t					lock;
+	const char					*name;
+	uint64_t					hold_start;
+	unsigned long				nr_acquires;
+	unsigned long				nr_contended;
+	uint64_t					total_hold;		/* TSC ticks */
+	uint64_t					max_hold;
+};
+
+#define KSCHED_LOCK_INITIALIZER(str) {.lock = SPINLOCK_INITIALIZER,			\
+                                      .name = (str)}
+
+static void ksched_lock_init(struct ksched_lock *kl, const char *name)
+{
+	memset(kl, 0, sizeof(struct ksched_lock));
+	spinlock_init(&kl->lock);
+	kl->name = name;
+}
+
+static void ksched_lock_acquire(struct ksched_lock *kl)
+{
+	bool contended = FALSE;
+
+	if (!spin_trylock(&kl->lock)) {
+		spin_lock(&kl->lock);
+		contended = TRUE;
+	}
+	kl->nr_acquires++;
+	kl->nr_contended += contended;
+	kl->hold_start = read_tsc();
+}
+
+static void ksched_lock_release(struct ksched_lock *kl)
+{
+	uint64_t held = read_tsc() - kl->hold_start;
+
+	kl->total_hold += held;
+	kl->max_hold = MAX(kl->max_hold, held);
+	spin_unlock(&kl->lock);
+}
+
+static struct ksched_lock alloc_lock = KSCHED_LOCK_INITIALIZER("alloc");
+static struct ksched_lock mcp_lock = KSCHED_LOCK_INITIALIZER("mcp");
+
+/* SCP run queues, one per core, though only the management cores use theirs.
+ * SCPs that are running or waiting aren't on any list. */
+struct scp_runq {
+	struct ksched_lock			lock;
+	struct proc_list			runnable;
+	unsigned long				nr_enqueued;
+	unsigned long				nr_stolen;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct scp_runq *scp_runqs;
 
-/* Process Lists.  'unrunnable' is a holding list for SCPs that are running or
- * waiting or otherwise not considered for sched decisions. */
-struct proc_list unrunnable_scps = TAILQ_HEAD_INITIALIZER(unrunnable_scps);
-struct proc_list runnable_scps = TAILQ_HEAD_INITIALIZER(runnable_scps);
 /* mcp lists.  we actually could get by with one list and a TAILQ_CONCAT, but
  * I'm expecting to want the flexibility of the pointers later. */
 struct proc_list all_mcps_1 = TAILQ_HEAD_INITIALIZER(all_mcps_1);
@@ -30,15 +106,14 @@ struct proc_list *secondary_mcps = &all_mcps_2;
 
 /* Helper, defined below */
 static void __core_request(struct proc *p, uint32_t amt_needed);
-static void add_to_list(struct proc *p, struct proc_list *list);
+static void add_to_list(struct proc *p, struct proc_list *new,
+                        struct ksched_lock *lock);
 static void remove_from_list(struct proc *p, struct proc_list *list);
 static void switch_lists(struct proc *p, struct proc_list *old,
                          struct proc_list *new);
 static void __run_mcp_ksched(void *arg);	/* don't call directly */
 static uint32_t get_cores_needed(struct proc *p);
 
-/* Locks / sync tools */
-
 /* poke-style ksched - ensures the MCP ksched only runs once at a time.  since
  * only one mcp ksched runs at a time, while this is set, the ksched knows no
  * cores are being allocated by other code (though they could be dealloc, due to
@@ -52,19 +127,6 @@ static uint32_t get_cores_needed(struct proc *p);
  * struct that can handle the posting of different types of work. */
 struct poke_tracker ksched_poker = POKE_INITIALIZER(__run_mcp_ksched);
 
-/* this 'big ksched lock' protects a bunch of things, which i may make fine
- * grained: */
-/* - protects the integrity of proc tailqs/structures, as well as the membership
- * of a proc on those lists.  proc lifetime within the ksched but outside this
- * lock is protected by the proc kref. */
-//spinlock_t proclist_lock = SPINLOCK_INITIALIZER; /* subsumed by bksl */
-/* - protects the provisioning assignment, and the integrity of all prov
- * lists (the lists of each proc). */
-//spinlock_t prov_lock = SPINLOCK_INITIALIZER;
-/* - protects allocation structures */
-//spinlock_t alloc_lock = SPINLOCK_INITIALIZER;
-spinlock_t sched_lock = SPINLOCK_INITIALIZER;
-
 /* Alarm struct, for our example 'timer tick' */
 struct alarm_waiter ksched_waiter;
 
@@ -101,12 +163,17 @@ static void __ksched_tick(struct alarm_waiter *waiter)
 
 void schedule_init(void)
 {
-	spin_lock(&sched_lock);
+	scp_runqs = kzmalloc(sizeof(struct scp_runq) * num_cores, MEM_WAIT);
+	for (int i = 0; i < num_cores; i++) {
+		ksched_lock_init(&scp_runqs[i].lock, "scp runq");
+		TAILQ_INIT(&scp_runqs[i].runnable);
+	}
+	ksched_lock_acquire(&alloc_lock);
 	assert(!core_id());		/* want the alarm on core0 for now */
 	init_awaiter(&ksched_waiter, __ksched_tick);
 	set_ksched_alarm();
 	corealloc_init();
-	spin_unlock(&sched_lock);
+	ksched_lock_release(&alloc_lock);
 
 #ifdef CONFIG_ARSC_SERVER
 	int arsc_coreid = get_any_idle_core();
@@ -116,12 +183,15 @@ void schedule_init(void)
 #endif /* CONFIG_ARSC_SERVER */
 }
 
-/* Round-robins on whatever list it's on */
-static void add_to_list(struct proc *p, struct proc_list *new)
+/* Round-robins on whatever list it's on.  Hold lock, which is the lock for
+ * new.  The caller deals with the list's proc ref. */
+static void add_to_list(struct proc *p, struct proc_list *new,
+                        struct ksched_lock *lock)
 {
 	assert(!(p->ksched_data.cur_list));
 	TAILQ_INSERT_TAIL(new, p, ksched_data.proc_link);
 	p->ksched_data.cur_list = new;
+	p->ksched_data.cur_lock = lock;
 }
 
 static void remove_from_list(struct proc *p, struct proc_list *old)
@@ -129,22 +199,96 @@ static void remove_from_list(struct proc *p, struct proc_list *old)
 	assert(p->ksched_data.cur_list == old);
 	TAILQ_REMOVE(old, p, ksched_data.proc_link);
 	p->ksched_data.cur_list = 0;
+	p->ksched_data.cur_lock = 0;
 }
 
+/* Both lists must be protected by the same lock */
 static void switch_lists(struct proc *p, struct proc_list *old,
                          struct proc_list *new)
 {
+	struct ksched_lock *lock = p->ksched_data.cur_lock;
+
 	remove_from_list(p, old);
-	add_to_list(p, new);
+	add_to_list(p, new, lock);
 }
 
-/* Removes from whatever list p is on */
-static void remove_from_any_list(struct proc *p)
+/* Removes from whatever list p is on, returning TRUE if it was on one.  The
+ * caller owns the list's ref, if so.  Don't hold any ksched locks. */
+static bool remove_from_any_list(struct proc *p)
 {
-	if (p->ksched_data.cur_list) {
-		TAILQ_REMOVE(p->ksched_data.cur_list, p, ksched_data.proc_link);
-		p->ksched_data.cur_list = 0;
+	struct ksched_lock *lock;
+
+	/* p could change lists between when we peek and when we lock */
+	while ((lock = ACCESS_ONCE(p->ksched_data.cur_lock))) {
+		ksched_lock_acquire(lock);
+		if (p->ksched_data.cur_lock == lock) {
+			remove_from_list(p, p->ksched_data.cur_list);
+			ksched_lock_release(lock);
+			return TRUE;
+		}
+		ksched_lock_release(lock);
 	}
+	return FALSE;
+}
+
+/* SCPs only run on management cores (just core 0, for now).  SCPs that wake up
+ * elsewhere go to core 0's runq. */
+static struct scp_runq *scp_home_runq(void)
+{
+	if (management_core())
+		return &scp_runqs[core_id()];
+	return &scp_runqs[0];
+}
+
+static void scp_runq_push(struct scp_runq *rq, struct proc *p, bool head)
+{
+	ksched_lock_acquire(&rq->lock);
+	if (head) {
+		assert(!p->ksched_data.cur_list);
+		TAILQ_INSERT_HEAD(&rq->runnable, p, ksched_data.proc_link);
+		p->ksched_data.cur_list = &rq->runnable;
+		p->ksched_data.cur_lock = &rq->lock;
+	} else {
+		add_to_list(p, &rq->runnable, &rq->lock);
+	}
+	rq->nr_enqueued++;
+	ksched_lock_release(&rq->lock);
+}
+
+static struct proc *scp_runq_pop(struct scp_runq *rq)
+{
+	struct proc *p;
+
+	/* unlocked peek, so idle mgmt cores don't hammer everyone's locks */
+	if (TAILQ_EMPTY(&rq->runnable))
+		return 0;
+	ksched_lock_acquire(&rq->lock);
+	p = TAILQ_FIRST(&rq->runnable);
+	if (p)
+		remove_from_list(p, &rq->runnable);
+	ksched_lock_release(&rq->lock);
+	return p;
+}
+
+/* Gets the next SCP for the calling core to run, from its own runq or stolen
+ * from another.  Returns the proc with the list's ref, or 0. */
+static struct proc *scp_runq_next(void)
+{
+	struct scp_runq *rq = &scp_runqs[core_id()];
+	struct proc *p;
+
+	for (int i = 0; i < num_cores; i++) {
+		while ((p = scp_runq_pop(&scp_runqs[(core_id() + i) % num_cores]))) {
+			if (p->state != PROC_DYING) {
+				if (i)
+					rq->nr_stolen++;
+				return p;
+			}
+			/* lost a race with __sched_proc_destroy() */
+			proc_decref(p);
+		}
+	}
+	return 0;
 }
 
 /************** Process Management Callbacks **************/
@@ -162,21 +306,27 @@ void __sched_proc_register(struct proc *p)
 	assert(p->state != PROC_DYING);	/* shouldn't be abel to happen yet */
 	/* one ref for the proc's existence, cradle-to-grave */
 	proc_incref(p, 1);	/* need at least this OR the 'one for existing' */
-	spin_lock(&sched_lock);
+	ksched_lock_acquire(&alloc_lock);
 	corealloc_proc_init(p);
-	add_to_list(p, &unrunnable_scps);
-	spin_unlock(&sched_lock);
+	ksched_lock_release(&alloc_lock);
 }
 
 /* Returns 0 if it succeeded, an error code otherwise. */
 void __sched_proc_change_to_m(struct proc *p)
 {
-	spin_lock(&sched_lock);
+	/* For now, this should only ever be called on a running SCP, which isn't
+	 * on a runq.  It's probably a bug, at this stage in development, to do
+	 * o/w. */
+	if (remove_from_any_list(p)) {
+		warn("Proc %d changing to an MCP while on a runq", p->pid);
+		proc_decref(p);
+	}
+	ksched_lock_acquire(&mcp_lock);
 	/* Need to make sure they aren't dying.  if so, we already dealt with their
 	 * list membership, etc (or soon will).  taking advantage of the 'immutable
 	 * state' of dying (so long as refs are held). */
 	if (p->state == PROC_DYING) {
-		spin_unlock(&sched_lock);
+		ksched_lock_release(&mcp_lock);
 		return;
 	}
 	/* Catch user bugs */
@@ -184,12 +334,9 @@ void __sched_proc_change_to_m(struct proc *p)
 		printk("[kernel] process needs to specify amt_wanted\n");
 		p->procdata->res_req[RES_CORES].amt_wanted = 1;
 	}
-	/* For now, this should only ever be called on an unrunnable.  It's
-	 * probably a bug, at this stage in development, to do o/w. */
-	remove_from_list(p, &unrunnable_scps);
-	//remove_from_any_list(p); 	/* ^^ instead of this */
-	add_to_list(p, primary_mcps);
-	spin_unlock(&sched_lock);
+	proc_incref(p, 1);	/* for the list */
+	add_to_list(p, primary_mcps, &mcp_lock);
+	ksched_lock_release(&mcp_lock);
 	//poke_ksched(p, RES_CORES);
 }
 
@@ -200,17 +347,18 @@ void __sched_proc_change_to_m(struct proc *p)
  * __proc_free will be called (when the last one is done). */
 void __sched_proc_destroy(struct proc *p, uint32_t *pc_arr, uint32_t nr_cores)
 {
-	spin_lock(&sched_lock);
+	ksched_lock_acquire(&alloc_lock);
 	/* Unprovision any cores.  Note this is different than track_core_dealloc.
 	 * The latter does bookkeeping when an allocation changes.  This is a
 	 * bulk *provisioning* change. */
 	__unprovision_all_cores(p);
-	/* Remove from whatever list we are on (if any - might not be on one if it
-	 * was in the middle of __run_mcp_sched) */
-	remove_from_any_list(p);
 	if (nr_cores)
 		__track_core_dealloc_bulk(p, pc_arr, nr_cores);
-	spin_unlock(&sched_lock);
+	ksched_lock_release(&alloc_lock);
+	/* Remove from whatever list we are on (if any - might not be on one if it
+	 * was in the middle of __run_mcp_sched, or is running) */
+	if (remove_from_any_list(p))
+		proc_decref(p);
 	/* Drop the cradle-to-the-grave reference, jet-li */
 	proc_decref(p);
 }
@@ -218,13 +366,10 @@ void __sched_proc_destroy(struct proc *p, uint32_t *pc_arr, uint32_t nr_cores)
 /* ksched callbacks.  p just woke up and is UNLOCKED. */
 void __sched_mcp_wakeup(struct proc *p)
 {
-	spin_lock(&sched_lock);
-	if (p->state == PROC_DYING) {
-		spin_unlock(&sched_lock);
+	/* unlocked peek; the ksched will check again */
+	if (p->state == PROC_DYING)
 		return;
-	}
 	/* could try and prioritize p somehow (move it to the front of the list). */
-	spin_unlock(&sched_lock);
 	/* note they could be dying at this point too. */
 	poke(&ksched_poker, p);
 }
@@ -232,15 +377,18 @@ void __sched_mcp_wakeup(struct proc *p)
 /* ksched callbacks.  p just woke up and is UNLOCKED. */
 void __sched_scp_wakeup(struct proc *p)
 {
-	spin_lock(&sched_lock);
-	if (p->state == PROC_DYING) {
-		spin_unlock(&sched_lock);
+	struct scp_runq *rq = scp_home_runq();
+
+	ksched_lock_acquire(&rq->lock);
+	/* might already be on a runq, if this is a spurious wakeup */
+	if ((p->state == PROC_DYING) || p->ksched_data.cur_list) {
+		ksched_lock_release(&rq->lock);
 		return;
 	}
-	/* might not be on a list if it is new.  o/w, it should be unrunnable */
-	remove_from_any_list(p);
-	add_to_list(p, &runnable_scps);
-	spin_unlock(&sched_lock);
+	proc_incref(p, 1);	/* for the runq */
+	add_to_list(p, &rq->runnable, &rq->lock);
+	rq->nr_enqueued++;
+	ksched_lock_release(&rq->lock);
 	/* we could be on a CG core, and all the mgmt cores could be halted.  if we
 	 * don't tell one of them about the new proc, they will sleep until the
 	 * timer tick goes off. */
@@ -267,38 +415,41 @@ void __sched_scp_wakeup(struct proc *p)
  * a scheduling decision (or at least plan to). */
 void __sched_put_idle_core(struct proc *p, uint32_t coreid)
 {
-	spin_lock(&sched_lock);
+	ksched_lock_acquire(&alloc_lock);
 	__track_core_dealloc(p, coreid);
-	spin_unlock(&sched_lock);
+	ksched_lock_release(&alloc_lock);
 }
 
 /* Callback, bulk interface for put_idle. The proclock is held for this. */
 void __sched_put_idle_cores(struct proc *p, uint32_t *pc_arr, uint32_t num)
 {
-	spin_lock(&sched_lock);
+	ksched_lock_acquire(&alloc_lock);
 	__track_core_dealloc_bulk(p, pc_arr, num);
-	spin_unlock(&sched_lock);
+	ksched_lock_release(&alloc_lock);
 	/* could trigger a sched decision here */
 }
 
 /* mgmt/LL cores should call this to schedule the calling core and give it to an
- * SCP.  will also prune the dead SCPs from the list.  hold the lock before
- * calling.  returns TRUE if it scheduled a proc. */
+ * SCP.  will also prune the dead SCPs from the runqs.  returns TRUE if it
+ * scheduled a proc. */
 static bool __schedule_scp(void)
 {
 	// TODO: sort out lock ordering (proc_run_s also locks)
 	struct proc *p;
 	uint32_t pcoreid = core_id();
 	struct per_cpu_info *pcpui = &per_cpu_info[pcoreid];
+	struct scp_runq *rq = &scp_runqs[pcoreid];
 	/* if there are any runnables, run them here and put any currently running
 	 * SCP on the tail of the runnable queue. */
-	if ((p = TAILQ_FIRST(&runnable_scps))) {
+	if ((p = scp_runq_next())) {
 		/* someone is currently running, dequeue them */
 		if (pcpui->owning_proc) {
 			spin_lock(&pcpui->owning_proc->proc_lock);
 			/* process might be dying, with a KMSG to clean it up waiting on
-			 * this core.  can't do much, so we'll attempt to restart */
+			 * this core.  can't do much, so we'll attempt to restart.  p goes
+			 * back where it was, more or less. */
 			if (pcpui->owning_proc->state == PROC_DYING) {
+				scp_runq_push(rq, p, TRUE);
 				send_kernel_message(core_id(), __just_sched, 0, 0, 0,
 				                    KMSG_ROUTINE);
 				spin_unlock(&pcpui->owning_proc->proc_lock);
@@ -316,8 +467,10 @@ static bool __schedule_scp(void)
 			__unmap_vcore(p, 0);
 			__seq_end_write(&p->procinfo->coremap_seqctr);
 			spin_unlock(&pcpui->owning_proc->proc_lock);
-			/* round-robin the SCPs (inserts at the end of the queue) */
-			switch_lists(pcpui->owning_proc, &unrunnable_scps, &runnable_scps);
+			/* round-robin the SCPs (inserts at the end of the queue).  the
+			 * runq gets its own ref; clear_owning drops the pcpui's. */
+			proc_incref(pcpui->owning_proc, 1);
+			scp_runq_push(rq, pcpui->owning_proc, FALSE);
 			clear_owning_proc(pcoreid);
 			/* Note we abandon core.  It's not strictly necessary.  If
 			 * we didn't, the TLB would still be loaded with the old
@@ -327,9 +480,10 @@ static bool __schedule_scp(void)
 			abandon_core();
 		} 
 		/* Run the new proc */
-		switch_lists(p, &runnable_scps, &unrunnable_scps);
 		printd("PID of the SCP i'm running: %d\n", p->pid);
 		proc_run_s(p);	/* gives it core we're running on */
+		/* proc_run_s took its own ref, for owning_proc */
+		proc_decref(p);
 		return TRUE;
 	}
 	return FALSE;
@@ -380,8 +534,9 @@ static void __run_mcp_ksched(void *arg)
 	struct proc *p, *temp;
 	uint32_t amt_needed;
 	struct proc_list *temp_mcp_list;
+	struct proc_list dead = TAILQ_HEAD_INITIALIZER(dead);
 	/* locking to protect the MCP lists' integrity and membership */
-	spin_lock(&sched_lock);
+	ksched_lock_acquire(&mcp_lock);
 	/* 2-pass scheme: check each proc on the primary list (FCFS).  if they need
 	 * nothing, put them on the secondary list.  if they need something, rip
 	 * them off the list, service them, and if they are still not dying, put
@@ -394,6 +549,13 @@ static void __run_mcp_ksched(void *arg)
 	 * another list and have wakeup move them back, etc. */
 	while (!TAILQ_EMPTY(primary_mcps)) {
 		TAILQ_FOREACH_SAFE(p, primary_mcps, ksched_data.proc_link, temp) {
+			/* Lost a race with __sched_proc_destroy().  We'll drop the list's
+			 * ref once we unlock. */
+			if (p->state == PROC_DYING) {
+				remove_from_list(p, primary_mcps);
+				TAILQ_INSERT_TAIL(&dead, p, ksched_data.proc_link);
+				continue;
+			}
 			if (p->state == PROC_WAITING) {	/* unlocked peek at the state */
 				switch_lists(p, primary_mcps, secondary_mcps);
 				continue;
@@ -403,24 +565,23 @@ static void __run_mcp_ksched(void *arg)
 				switch_lists(p, primary_mcps, secondary_mcps);
 				continue;
 			}
-			/* o/w, we want to give cores to this proc */
+			/* o/w, we want to give cores to this proc.  we keep the list's
+			 * ref while it is off the list, so it won't be freed, but it could
+			 * have its stuff unprov'd when we unlock */
 			remove_from_list(p, primary_mcps);
-			/* now it won't die, but it could get removed from lists and have
-			 * its stuff unprov'd when we unlock */
-			proc_incref(p, 1);
-			/* GIANT WARNING: __core_req will unlock the sched lock for a bit.
-			 * It will return with it locked still.  We could unlock before we
-			 * pass in, but they will relock right away. */
-			// notionally_unlock(&ksched_lock);	/* for mouse-eyed viewers */
+			/* Core requests only need the alloc_lock.  This way, procs can
+			 * join and leave the MCP lists while we're preempting. */
+			ksched_lock_release(&mcp_lock);
 			__core_request(p, amt_needed);
-			// notionally_lock(&ksched_lock);
+			ksched_lock_acquire(&mcp_lock);
 			/* Peeking at the state is okay, since we hold a ref.  Once it is
-			 * DYING, it'll remain DYING until we decref.  And if there is a
-			 * concurrent death, that will spin on the ksched lock (which we
-			 * hold, and which protects the proc lists). */
+			 * DYING, it'll remain DYING until we decref.  If there is a
+			 * concurrent death that sets DYING after our check, destroy will
+			 * find p on the secondary list. */
 			if (p->state != PROC_DYING)
-				add_to_list(p, secondary_mcps);
-			proc_decref(p);			/* fyi, this may trigger __proc_free */
+				add_to_list(p, secondary_mcps, &mcp_lock);
+			else
+				TAILQ_INSERT_TAIL(&dead, p, ksched_data.proc_link);
 			/* need to break: the proc lists may have changed when we unlocked
 			 * in core_req in ways that the FOREACH_SAFE can't handle. */
 			break;
@@ -432,7 +593,9 @@ static void __run_mcp_ksched(void *arg)
 	temp_mcp_list = primary_mcps;
 	primary_mcps = secondary_mcps;
 	secondary_mcps = temp_mcp_list;
-	spin_unlock(&sched_lock);
+	ksched_lock_release(&mcp_lock);
+	TAILQ_FOREACH_SAFE(p, &dead, ksched_data.proc_link, temp)
+		proc_decref(p);			/* fyi, this may trigger __proc_free */
 }
 
 /* Something has changed, and for whatever reason the scheduler should
@@ -447,11 +610,8 @@ void run_scheduler(void)
 	/* MCP scheduling: post work, then poke.  for now, i just want the func to
 	 * run again, so merely a poke is sufficient. */
 	poke(&ksched_poker, 0);
-	if (management_core()) {
-		spin_lock(&sched_lock);
+	if (management_core())
 		__schedule_scp();
-		spin_unlock(&sched_lock);
-	}
 }
 
 /* A process is asking the ksched to look at its resource desires.  The
@@ -475,9 +635,7 @@ void cpu_bored(void)
 	bool new_proc = FALSE;
 	if (!management_core())
 		return;
-	spin_lock(&sched_lock);
 	new_proc = __schedule_scp();
-	spin_unlock(&sched_lock);
 	/* if we just scheduled a proc, we need to manually restart it, instead of
 	 * returning.  if we return, the core will halt. */
 	if (new_proc) {
@@ -499,30 +657,30 @@ void avail_res_changed(int res_type, long change)
 
 int get_any_idle_core(void)
 {
-	spin_lock(&sched_lock);
+	ksched_lock_acquire(&alloc_lock);
 	int ret = __get_any_idle_core();
-	spin_unlock(&sched_lock);
+	ksched_lock_release(&alloc_lock);
 	return ret;
 }
 
 int get_specific_idle_core(int coreid)
 {
-	spin_lock(&sched_lock);
+	ksched_lock_acquire(&alloc_lock);
 	int ret = __get_specific_idle_core(coreid);
-	spin_unlock(&sched_lock);
+	ksched_lock_release(&alloc_lock);
 	return ret;
 }
 
 /* similar to __sched_put_idle_core, but without the prov tracking */
 void put_idle_core(int coreid)
 {
-	spin_lock(&sched_lock);
+	ksched_lock_acquire(&alloc_lock);
 	__put_idle_core(coreid);
-	spin_unlock(&sched_lock);
+	ksched_lock_release(&alloc_lock);
 }
 
 /* This deals with a request for more cores.  The amt of new cores needed is
- * passed in.  The ksched lock is held, but we are free to unlock if we want
+ * passed in.  We hold the alloc_lock, but we are free to unlock if we want
  * (and we must, if calling out of the ksched to anything high-level).
  *
  * Side note: if we want to warn, then we can't deal with this proc's prov'd
@@ -537,8 +695,8 @@ static void __core_request(struct proc *p, uint32_t amt_needed)
 	uint32_t pcoreid;
 	struct proc *proc_to_preempt;
 	bool success;
-	/* we come in holding the ksched lock, and we hold it here to protect
-	 * allocations and provisioning. */
+	/* we hold the alloc lock to protect allocations and provisioning. */
+	ksched_lock_acquire(&alloc_lock);
 	/* get all available cores from their prov_not_alloc list.  the list might
 	 * change when we unlock (new cores added to it, or the entire list emptied,
 	 * but no core allocations will happen (we hold the poke)). */
@@ -560,11 +718,11 @@ static void __core_request(struct proc *p, uint32_t amt_needed)
 			assert(proc_to_preempt != p);
 			/* need to keep a valid, external ref when we unlock */
 			proc_incref(proc_to_preempt, 1);
-			spin_unlock(&sched_lock);
+			ksched_lock_release(&alloc_lock);
 			/* sending no warning time for now - just an immediate preempt. */
 			success = proc_preempt_core(proc_to_preempt, pcoreid, 0);
 			/* reaquire locks to protect provisioning and idle lists */
-			spin_lock(&sched_lock);
+			ksched_lock_acquire(&alloc_lock);
 			if (success) {
 				/* we preempted it before the proc could yield or die.
 				 * alloc_proc should not have changed (it'll change in death and
@@ -595,9 +753,9 @@ static void __core_request(struct proc *p, uint32_t amt_needed)
 				cmb();
 				while (get_alloc_proc(pcoreid)) {
 					/* this loop should be very rare */
-					spin_unlock(&sched_lock);
+					ksched_lock_release(&alloc_lock);
 					udelay(1);
-					spin_lock(&sched_lock);
+					ksched_lock_acquire(&alloc_lock);
 				}
 			}
 			/* no longer need to keep p_to_pre alive */
@@ -627,7 +785,7 @@ static void __core_request(struct proc *p, uint32_t amt_needed)
 		 * allocator could have seen these cores (if they are prov to some proc)
 		 * and could be trying to give them out (and assuming they are already
 		 * on the idle list). */
-		spin_unlock(&sched_lock);
+		ksched_lock_release(&alloc_lock);
 		/* give them the cores.  this will start up the extras if RUNNING_M. */
 		spin_lock(&p->proc_lock);
 		/* if they fail, it is because they are WAITING or DYING.  we could give
@@ -639,7 +797,7 @@ static void __core_request(struct proc *p, uint32_t amt_needed)
 			spin_unlock(&p->proc_lock);
 			/* we failed, put the cores and track their dealloc.  lock is
 			 * protecting those structures. */
-			spin_lock(&sched_lock);
+			ksched_lock_acquire(&alloc_lock);
 			__track_core_dealloc_bulk(p, corelist, nr_to_grant);
 		} else {
 			/* at some point after giving cores, call proc_run_m() (harmless on
@@ -648,11 +806,11 @@ static void __core_request(struct proc *p, uint32_t amt_needed)
 			 * for bulk preempted processes). */
 			__proc_run_m(p);
 			spin_unlock(&p->proc_lock);
-			/* main mcp_ksched wants this held (it came to __core_req held) */
-			spin_lock(&sched_lock);
+			/* reacquire, since we're about to unlock below */
+			ksched_lock_acquire(&alloc_lock);
 		}
 	}
-	/* note the ksched lock is still held */
+	ksched_lock_release(&alloc_lock);
 }
 
 /* Provision a core to a process. This function wraps the primary logic
@@ -670,30 +828,67 @@ int provision_core(struct proc *p, uint32_t pcoreid)
 		set_errno(EBUSY);
 		return -1;
 	}
-	/* Note the sched lock protects the tailqs for all procs in this code.
-	 * If we need a finer grained sched lock, this is one place where we could
-	 * have a different lock */
-	spin_lock(&sched_lock);
+	/* The alloc lock protects the prov tailqs for all procs */
+	ksched_lock_acquire(&alloc_lock);
 	__provision_core(p, pcoreid);
-	spin_unlock(&sched_lock);
+	ksched_lock_release(&alloc_lock);
 	return 0;
 }
 
 /************** Debugging **************/
+static void print_ksched_lock(struct ksched_lock *kl, int id)
+{
+	if (!kl->nr_acquires)
+		return;
+	printk("%10s %3d %10lu %10lu %10llu %10llu\n", kl->name, id,
+	       kl->nr_acquires, kl->nr_contended,
+	       tsc2usec(kl->total_hold) / kl->nr_acquires,
+	       tsc2usec(kl->max_hold));
+}
+
 void sched_diag(void)
 {
 	struct proc *p;
-	spin_lock(&sched_lock);
-	TAILQ_FOREACH(p, &runnable_scps, ksched_data.proc_link)
-		printk("Runnable _S PID: %d\n", p->pid);
-	TAILQ_FOREACH(p, &unrunnable_scps, ksched_data.proc_link)
-		printk("Unrunnable _S PID: %d\n", p->pid);
+	struct scp_runq *rq;
+
+	/* Hash helper */
+	void __print_unrunnable(void *item, void *opaque)
+	{
+		p = (struct proc*)item;
+		if (!__proc_is_mcp(p) && !p->ksched_data.cur_list)
+			printk("Unrunnable _S PID: %d\n", p->pid);
+	}
+
+	for (int i = 0; i < num_cores; i++) {
+		rq = &scp_runqs[i];
+		ksched_lock_acquire(&rq->lock);
+		TAILQ_FOREACH(p, &rq->runnable, ksched_data.proc_link)
+			printk("Runnable _S PID: %d (runq %d)\n", p->pid, i);
+		ksched_lock_release(&rq->lock);
+	}
+	spin_lock(&pid_hash_lock);
+	hash_for_each(pid_hash, __print_unrunnable, NULL);
+	spin_unlock(&pid_hash_lock);
+	ksched_lock_acquire(&mcp_lock);
 	TAILQ_FOREACH(p, primary_mcps, ksched_data.proc_link)
 		printk("Primary MCP PID: %d\n", p->pid);
 	TAILQ_FOREACH(p, secondary_mcps, ksched_data.proc_link)
 		printk("Secondary MCP PID: %d\n", p->pid);
-	spin_unlock(&sched_lock);
-	return;
+	ksched_lock_release(&mcp_lock);
+	for (int i = 0; i < num_cores; i++) {
+		rq = &scp_runqs[i];
+		if (rq->nr_enqueued || rq->nr_stolen)
+			printk("SCP runq %d: %lu enqueued, %lu stolen\n", i,
+			       rq->nr_enqueued, rq->nr_stolen);
+	}
+	/* Unlocked reads; these are just stats */
+	printk("\nKsched locks:\n");
+	printk("%10s %3s %10s %10s %10s %10s\n", "Lock", "ID", "Acquires",
+	       "Contended", "Avg usec", "Max usec");
+	print_ksched_lock(&alloc_lock, 0);
+	print_ksched_lock(&mcp_lock, 0);
+	for (int i = 0; i < num_cores; i++)
+		print_ksched_lock(&scp_runqs[i].lock, i);
 }
 
 void print_resources(struct proc *p)
@@ -720,14 +915,14 @@ void print_all_resources(void)
 
 void next_core_to_alloc(uint32_t pcoreid)
 {
-	spin_lock(&sched_lock);
+	ksched_lock_acquire(&alloc_lock);
 	__next_core_to_alloc(pcoreid);
-	spin_unlock(&sched_lock);
+	ksched_lock_release(&alloc_lock);
 }
 
 void sort_idle_cores(void)
 {
-	spin_lock(&sched_lock);
+	ksched_lock_acquire(&alloc_lock);
 	__sort_idle_cores();
-	spin_unlock(&sched_lock);
+	ksched_lock_release(&alloc_lock);
 }
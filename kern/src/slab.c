@@ -16,9 +16,13 @@
 #include <assert.h>
 #include <pmap.h>
 #include <kmalloc.h>
+#include <percpu.h>
+#include <smp.h>
 
 struct kmem_cache_list kmem_caches;
 spinlock_t kmem_caches_lock;
+/* Set once num_cores is known and the magazine layer can be built */
+static bool kmem_pcpu_ready;
 
 /* Backend/internal functions, defined later.  Grab the lock before calling
  * these. */
@@ -27,6 +31,88 @@ static bool kmem_cache_grow(struct kmem_cache *cp);
 /* Cache of the kmem_cache objects, needed for bootstrapping */
 struct kmem_cache kmem_cache_cache;
 struct kmem_cache *kmem_slab_cache, *kmem_bufctl_cache;
+struct kmem_cache *kmem_magazine_cache;
+
+static void *__kmem_alloc_from_slab(struct kmem_cache *cp);
+static void __kmem_free_to_slab(struct kmem_cache *cp, void *buf);
+static void print_kmem_mag_stats(struct kmem_cache *cp);
+
+static struct kmem_magazine *kmem_mag_alloc(void)
+{
+	struct kmem_magazine *mag = __kmem_alloc_from_slab(kmem_magazine_cache);
+
+	if (mag)
+		mag->nr_rounds = 0;
+	return mag;
+}
+
+static void kmem_mag_free(struct kmem_magazine *mag)
+{
+	__kmem_free_to_slab(kmem_magazine_cache, mag);
+}
+
+/* Returns all of the magazine's rounds to the slab layer. */
+static void kmem_mag_drain(struct kmem_cache *cp, struct kmem_magazine *mag)
+{
+	for (int i = 0; i < mag->nr_rounds; i++)
+		__kmem_free_to_slab(cp, mag->rounds[i]);
+	mag->nr_rounds = 0;
+}
+
+/* Builds the per-core magazines for kc.  Panics on OOM; we're either booting
+ * or in kmem_cache_create(), which never fails. */
+static void kmem_build_pcpu_caches(struct kmem_cache *kc)
+{
+	struct kmem_pcpu_cache *pcc;
+
+	pcc = kzmalloc_align(sizeof(struct kmem_pcpu_cache) * num_cores, 0,
+	                     ARCH_CL_SIZE);
+	assert(pcc);
+	for (int i = 0; i < num_cores; i++) {
+		spinlock_init_irqsave(&pcc[i].lock);
+		pcc[i].magsize = kc->depot.magsize;
+		pcc[i].loaded = kmem_mag_alloc();
+		pcc[i].prev = kmem_mag_alloc();
+		assert(pcc[i].loaded && pcc[i].prev);
+	}
+	/* Once this is visible, allocs and frees will use the magazines */
+	wmb();
+	kc->pcpu_caches = pcc;
+}
+
+static void kmem_depot_init(struct kmem_depot *depot)
+{
+	spinlock_init_irqsave(&depot->lock);
+	SLIST_INIT(&depot->not_empty);
+	SLIST_INIT(&depot->empty);
+	depot->nr_not_empty = 0;
+	depot->nr_empty = 0;
+	depot->magsize = KMC_MAG_MIN_SZ;
+	depot->busy_count = 0;
+	depot->nr_alloc_hits = 0;
+	depot->nr_alloc_misses = 0;
+	depot->nr_free_hits = 0;
+	depot->nr_free_misses = 0;
+}
+
+/* Callers hold their pcpu cache lock, so IRQs are already disabled.  If the
+ * depot lock is contended often enough, we bump the magazine size so that cores
+ * come back to the depot less often (section 3.6 of the magazines paper). */
+static void lock_depot(struct kmem_depot *depot)
+{
+	if (spin_trylock(&depot->lock))
+		return;
+	spin_lock(&depot->lock);
+	if (++depot->busy_count < KMC_MAG_BUSY_LIMIT)
+		return;
+	depot->busy_count = 0;
+	depot->magsize = MIN(depot->magsize + KMC_MAG_GROW_SZ, KMC_MAG_MAX_SZ);
+}
+
+static void unlock_depot(struct kmem_depot *depot)
+{
+	spin_unlock(&depot->lock);
+}
 
 static void __kmem_cache_create(struct kmem_cache *kc, const char *name,
                                 size_t obj_size, int align, int flags,
@@ -46,7 +132,11 @@ static void __kmem_cache_create(struct kmem_cache *kc, const char *name,
 	kc->ctor = ctor;
 	kc->dtor = dtor;
 	kc->nr_cur_alloc = 0;
-	
+	kc->pcpu_caches = NULL;
+	kmem_depot_init(&kc->depot);
+	if (kmem_pcpu_ready && !(flags & KMC_NOMAG))
+		kmem_build_pcpu_caches(kc);
+
 	/* put in cache list based on it's size */
 	struct kmem_cache *i, *prev = NULL;
 	spin_lock_irqsave(&kmem_caches_lock);
@@ -79,6 +169,27 @@ void kmem_cache_init(void)
 	kmem_bufctl_cache = kmem_cache_create("kmem_bufctl",
 	                         sizeof(struct kmem_bufctl),
 	                         __alignof__(struct kmem_bufctl), 0, NULL, NULL); 
+	/* Magazines come straight from the slab layer, o/w we'd recurse */
+	kmem_magazine_cache = kmem_cache_create("kmem_magazine",
+	                           sizeof(struct kmem_magazine), ARCH_CL_SIZE,
+	                           KMC_NOMAG, NULL, NULL);
+}
+
+/* Runs once num_cores is known.  Every cache created so far gets its
+ * magazines now; later caches get them in kmem_cache_create(). */
+DEFINE_PERCPU_INIT(kmem_cache_pcpu_init);
+
+static void kmem_cache_pcpu_init(void)
+{
+	struct kmem_cache *i;
+
+	spin_lock_irqsave(&kmem_caches_lock);
+	kmem_pcpu_ready = TRUE;
+	SLIST_FOREACH(i, &kmem_caches, link) {
+		if (!(i->flags & KMC_NOMAG))
+			kmem_build_pcpu_caches(i);
+	}
+	spin_unlock_irqsave(&kmem_caches_lock);
 }
 
 /* Cache management */
@@ -128,12 +239,62 @@ static void kmem_slab_destroy(struct kmem_cache *cp, struct kmem_slab *a_slab)
 	}
 }
 
+/* Returns every round in the depot to the slab layer and frees the depot's
+ * magazines. */
+static void kmem_depot_drain(struct kmem_cache *cp)
+{
+	struct kmem_depot *depot = &cp->depot;
+	struct kmem_mag_slist not_empty, empty;
+	struct kmem_magazine *mag;
+
+	spin_lock_irqsave(&depot->lock);
+	not_empty = depot->not_empty;
+	empty = depot->empty;
+	SLIST_INIT(&depot->not_empty);
+	SLIST_INIT(&depot->empty);
+	depot->nr_not_empty = 0;
+	depot->nr_empty = 0;
+	spin_unlock_irqsave(&depot->lock);
+	while ((mag = SLIST_FIRST(&not_empty))) {
+		SLIST_REMOVE_HEAD(&not_empty, link);
+		kmem_mag_drain(cp, mag);
+		kmem_mag_free(mag);
+	}
+	while ((mag = SLIST_FIRST(&empty))) {
+		SLIST_REMOVE_HEAD(&empty, link);
+		kmem_mag_free(mag);
+	}
+}
+
+/* Returns every round held by any core to the slab layer and tears down the
+ * magazine layer.  Only safe when no one is using the cache. */
+static void kmem_pcpu_caches_destroy(struct kmem_cache *cp)
+{
+	struct kmem_pcpu_cache *pcc;
+
+	if (!cp->pcpu_caches)
+		return;
+	for (int i = 0; i < num_cores; i++) {
+		pcc = &cp->pcpu_caches[i];
+		spin_lock_irqsave(&pcc->lock);
+		kmem_mag_drain(cp, pcc->loaded);
+		kmem_mag_drain(cp, pcc->prev);
+		kmem_mag_free(pcc->loaded);
+		kmem_mag_free(pcc->prev);
+		spin_unlock_irqsave(&pcc->lock);
+	}
+	kfree(cp->pcpu_caches);
+	cp->pcpu_caches = NULL;
+	kmem_depot_drain(cp);
+}
+
 /* Once you call destroy, never use this cache again... o/w there may be weird
  * races, and other serious issues.  */
 void kmem_cache_destroy(struct kmem_cache *cp)
 {
 	struct kmem_slab *a_slab, *next;
 
+	kmem_pcpu_caches_destroy(cp);
 	spin_lock_irqsave(&cp->cache_lock);
 	assert(TAILQ_EMPTY(&cp->full_slab_list));
 	assert(TAILQ_EMPTY(&cp->partial_slab_list));
@@ -153,8 +314,8 @@ void kmem_cache_destroy(struct kmem_cache *cp)
 	spin_unlock_irqsave(&cp->cache_lock);
 }
 
-/* Front end: clients of caches use these */
-void *kmem_cache_alloc(struct kmem_cache *cp, int flags)
+/* Gets an object from the slab layer.  Returns 0 if we couldn't grow. */
+static void *__kmem_alloc_from_slab(struct kmem_cache *cp)
 {
 	void *retval = NULL;
 	spin_lock_irqsave(&cp->cache_lock);
@@ -166,10 +327,7 @@ void *kmem_cache_alloc(struct kmem_cache *cp, int flags)
 		if (TAILQ_EMPTY(&cp->empty_slab_list) &&
 			!kmem_cache_grow(cp)) {
 			spin_unlock_irqsave(&cp->cache_lock);
-			if (flags & MEM_ERROR)
-				error(ENOMEM, ERROR_FIXME);
-			else
-				panic("[German Accent]: OOM for a small slab growth!!!");
+			return NULL;
 		}
 		// move to partial list
 		a_slab = TAILQ_FIRST(&cp->empty_slab_list);
@@ -200,13 +358,79 @@ void *kmem_cache_alloc(struct kmem_cache *cp, int flags)
 	return retval;
 }
 
+/* Trades our empty prev magazine for a full one from the depot.  Returns TRUE
+ * if the loaded magazine has rounds.  Hold the pcc lock. */
+static bool kmem_depot_get_full(struct kmem_depot *depot,
+                                struct kmem_pcpu_cache *pcc)
+{
+	struct kmem_magazine *mag;
+
+	lock_depot(depot);
+	mag = SLIST_FIRST(&depot->not_empty);
+	if (!mag) {
+		depot->nr_alloc_misses++;
+		unlock_depot(depot);
+		return FALSE;
+	}
+	SLIST_REMOVE_HEAD(&depot->not_empty, link);
+	depot->nr_not_empty--;
+	SLIST_INSERT_HEAD(&depot->empty, pcc->prev, link);
+	depot->nr_empty++;
+	depot->nr_alloc_hits++;
+	pcc->magsize = depot->magsize;
+	unlock_depot(depot);
+	pcc->prev = pcc->loaded;
+	pcc->loaded = mag;
+	return TRUE;
+}
+
+/* Front end: clients of caches use these */
+void *kmem_cache_alloc(struct kmem_cache *cp, int flags)
+{
+	struct kmem_pcpu_cache *pcc;
+	struct kmem_magazine *mag;
+	void *retval;
+
+	if (!cp->pcpu_caches)
+		goto out_slab;
+	pcc = &cp->pcpu_caches[core_id_early()];
+	spin_lock_irqsave(&pcc->lock);
+	if (pcc->loaded->nr_rounds) {
+		pcc->nr_alloc_hits++;
+	} else if (pcc->prev->nr_rounds) {
+		mag = pcc->loaded;
+		pcc->loaded = pcc->prev;
+		pcc->prev = mag;
+		pcc->nr_alloc_hits++;
+	} else {
+		pcc->nr_alloc_misses++;
+		if (!kmem_depot_get_full(&cp->depot, pcc)) {
+			spin_unlock_irqsave(&pcc->lock);
+			goto out_slab;
+		}
+	}
+	retval = pcc->loaded->rounds[--pcc->loaded->nr_rounds];
+	spin_unlock_irqsave(&pcc->lock);
+	return retval;
+
+out_slab:
+	retval = __kmem_alloc_from_slab(cp);
+	if (!retval) {
+		if (flags & MEM_ERROR)
+			error(ENOMEM, ERROR_FIXME);
+		else
+			panic("[German Accent]: OOM for a small slab growth!!!");
+	}
+	return retval;
+}
+
 static inline struct kmem_bufctl *buf2bufctl(void *buf, size_t offset)
 {
 	// TODO: hash table for back reference (BUF)
 	return *((struct kmem_bufctl**)(buf + offset));
 }
 
-void kmem_cache_free(struct kmem_cache *cp, void *buf)
+static void __kmem_free_to_slab(struct kmem_cache *cp, void *buf)
 {
 	struct kmem_slab *a_slab;
 	struct kmem_bufctl *a_bufctl;
@@ -241,6 +465,70 @@ void kmem_cache_free(struct kmem_cache *cp, void *buf)
 	spin_unlock_irqsave(&cp->cache_lock);
 }
 
+/* Trades our full prev magazine for an empty one, either from the depot or a
+ * freshly allocated one.  Returns TRUE if the loaded magazine has room.  Hold
+ * the pcc lock. */
+static bool kmem_depot_get_empty(struct kmem_depot *depot,
+                                 struct kmem_pcpu_cache *pcc)
+{
+	struct kmem_magazine *mag;
+
+	lock_depot(depot);
+	mag = SLIST_FIRST(&depot->empty);
+	if (mag) {
+		SLIST_REMOVE_HEAD(&depot->empty, link);
+		depot->nr_empty--;
+		depot->nr_free_hits++;
+	} else {
+		depot->nr_free_misses++;
+		/* The magazine cache has no magazines, and we never lock it from
+		 * within the magazine layer, so this can't recurse or deadlock. */
+		unlock_depot(depot);
+		mag = kmem_mag_alloc();
+		if (!mag)
+			return FALSE;
+		lock_depot(depot);
+	}
+	SLIST_INSERT_HEAD(&depot->not_empty, pcc->prev, link);
+	depot->nr_not_empty++;
+	pcc->magsize = depot->magsize;
+	unlock_depot(depot);
+	pcc->prev = pcc->loaded;
+	pcc->loaded = mag;
+	return TRUE;
+}
+
+void kmem_cache_free(struct kmem_cache *cp, void *buf)
+{
+	struct kmem_pcpu_cache *pcc;
+	struct kmem_magazine *mag;
+
+	if (!cp->pcpu_caches)
+		goto out_slab;
+	pcc = &cp->pcpu_caches[core_id_early()];
+	spin_lock_irqsave(&pcc->lock);
+	if (pcc->loaded->nr_rounds < pcc->magsize) {
+		pcc->nr_free_hits++;
+	} else if (pcc->prev->nr_rounds < pcc->magsize) {
+		mag = pcc->loaded;
+		pcc->loaded = pcc->prev;
+		pcc->prev = mag;
+		pcc->nr_free_hits++;
+	} else {
+		pcc->nr_free_misses++;
+		if (!kmem_depot_get_empty(&cp->depot, pcc)) {
+			spin_unlock_irqsave(&pcc->lock);
+			goto out_slab;
+		}
+	}
+	pcc->loaded->rounds[pcc->loaded->nr_rounds++] = buf;
+	spin_unlock_irqsave(&pcc->lock);
+	return;
+
+out_slab:
+	__kmem_free_to_slab(cp, buf);
+}
+
 /* Back end: internal functions */
 /* When this returns, the cache has at least one slab in the empty list.  If
  * page_alloc fails, there are some serious issues.  This only grows by one slab
@@ -324,11 +612,15 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 
 /* This deallocs every slab from the empty list.  TODO: think a bit more about
  * this.  We can do things like not free all of the empty lists to prevent
- * thrashing.  See 3.4 in the paper. */
+ * thrashing.  See 3.4 in the paper.
+ *
+ * The depot's magazines are drained first, so their rounds can free up slabs.
+ * The cores keep their loaded and prev magazines. */
 void kmem_cache_reap(struct kmem_cache *cp)
 {
 	struct kmem_slab *a_slab, *next;
 	
+	kmem_depot_drain(cp);
 	// Destroy all empty slabs.  Refer to the notes about the while loop
 	spin_lock_irqsave(&cp->cache_lock);
 	a_slab = TAILQ_FIRST(&cp->empty_slab_list);
@@ -355,6 +647,47 @@ void print_kmem_cache(struct kmem_cache *cp)
 	printk("Slab Empty: %p\n", cp->empty_slab_list);
 	printk("Current Allocations: %d\n", cp->nr_cur_alloc);
 	spin_unlock_irqsave(&cp->cache_lock);
+	print_kmem_mag_stats(cp);
+}
+
+/* Prints the magazine layer's hit/miss counters.  A core 'hit' was served by
+ * its own magazines, a depot 'hit' by trading magazines with the depot, and a
+ * depot 'miss' went to the slab layer.  The counters are read racily. */
+static void print_kmem_mag_stats(struct kmem_cache *cp)
+{
+	struct kmem_depot *depot = &cp->depot;
+	struct kmem_pcpu_cache *pcc;
+	unsigned long a_hits = 0, a_misses = 0, f_hits = 0, f_misses = 0;
+
+	if (!cp->pcpu_caches) {
+		printk("Magazines: none\n");
+		return;
+	}
+	for (int i = 0; i < num_cores; i++) {
+		pcc = &cp->pcpu_caches[i];
+		a_hits += pcc->nr_alloc_hits;
+		a_misses += pcc->nr_alloc_misses;
+		f_hits += pcc->nr_free_hits;
+		f_misses += pcc->nr_free_misses;
+	}
+	printk("Magazine size: %d\n", depot->magsize);
+	printk("Depot magazines: %d full, %d empty\n", depot->nr_not_empty,
+	       depot->nr_empty);
+	printk("Core allocs: %lu hits, %lu misses\n", a_hits, a_misses);
+	printk("Core frees: %lu hits, %lu misses\n", f_hits, f_misses);
+	printk("Depot allocs: %lu hits, %lu misses\n", depot->nr_alloc_hits,
+	       depot->nr_alloc_misses);
+	printk("Depot frees: %lu hits, %lu misses\n", depot->nr_free_hits,
+	       depot->nr_free_misses);
+}
+
+void print_kmem_caches(void)
+{
+	struct kmem_cache *i;
+
+	/* Can't hold the list lock: print_kmem_cache grabs each cache's lock */
+	SLIST_FOREACH(i, &kmem_caches, link)
+		print_kmem_cache(i);
 }
 
 void print_kmem_slab(struct kmem_slab *slab)
@@ -20,6 +20,7 @@
 #include <kmalloc.h>
 #include <core_set.h>
 #include <completion.h>
+#include <arsc_server.h>
 
 struct all_cpu_work {
 	struct completion comp;
@@ -70,6 +71,11 @@ static void __attribute__((noinline, noreturn)) __smp_idle(void)
 		process_routine_kmsg();
 		try_run_proc();
 		cpu_bored();		/* call out to the ksched */
+#ifdef CONFIG_ARSC_SERVER
+		/* Run someone's ring syscalls instead of halting */
+		if (arsc_idle_poll())
+			continue;
+#endif /* CONFIG_ARSC_SERVER */
 		/* cpu_halt() atomically turns on interrupts and halts the core.
 		 * Important to do this, since we could have a RKM come in via an
 		 * interrupt right while PRKM is returning, and we wouldn't catch
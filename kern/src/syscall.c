@@ -750,6 +750,9 @@ static int sys_proc_yield(struct proc *p, bool being_nice)
 	systrace_finish_trace(pcpui->cur_kthread, 0);
 	finish_sysc(pcpui->cur_kthread->sysc, pcpui->cur_proc);
 	pcpui->cur_kthread->sysc = 0;	/* don't touch sysc again */
+	/* we're not coming back to run the rest of a batch */
+	pcpui->cur_kthread->batch = NULL;
+	pcpui->cur_kthread->batch_left = 0;
 	proc_incref(p, 1);
 	proc_yield(p, being_nice);
 	proc_decref(p);
@@ -969,6 +972,8 @@ all_out:
 	/* we can't return, since we'd write retvals to the old location of the
 	 * syscall struct (which has been freed and is in the old userspace) (or has
 	 * already been written to).*/
+	pcpui->cur_kthread->batch = NULL;
+	pcpui->cur_kthread->batch_left = 0;
 	disable_irq();			/* abandon_core/clear_own wants irqs disabled */
 	abandon_core();
 	smp_idle();				/* will reenable interrupts */
@@ -2583,18 +2588,20 @@ intreg_t syscall(struct proc *p, uintreg_t sc_num, uintreg_t a0, uintreg_t a1,
 	return ret;
 }
 
-/* Execute the syscall on the local core */
-void run_local_syscall(struct syscall *sysc)
+/* Execute the syscall on the local core.  Returns the errno we gave it, since
+ * once it is finished, userspace can reuse the sysc. */
+int run_local_syscall(struct syscall *sysc)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
 	struct proc *p = pcpui->cur_proc;
+	int err;
 
 	/* In lieu of pinning, we just check the sysc and will PF on the user addr
 	 * later (if the addr was unmapped).  Which is the plan for all UMEM. */
 	if (!is_user_rwaddr(sysc, sizeof(struct syscall))) {
 		printk("[kernel] bad user addr %p (+%p) in %s (user bug)\n", sysc,
 		       sizeof(struct syscall), __FUNCTION__);
-		return;
+		return EFAULT;
 	}
 	pcpui->cur_kthread->sysc = sysc;	/* let the core know which sysc it is */
 	systrace_start_trace(pcpui->cur_kthread, sysc);
@@ -2611,13 +2618,113 @@ void run_local_syscall(struct syscall *sysc)
 	 * this is somewhat hacky, since errno might get set unnecessarily */
 	if ((current_errstr()[0] != 0) && (!sysc->err))
 		sysc->err = EUNSPECIFIED;
+	err = sysc->err;
 	finish_sysc(sysc, pcpui->cur_proc);
 	pcpui->cur_kthread->sysc = NULL;	/* No longer working on sysc */
+	return err;
+}
+
+/* Fails sysc with err without running it */
+static void sysc_reject(struct syscall *sysc, int err)
+{
+	sysc->err = err;
+	sysc->retval = -1;
+	finish_sysc(sysc, current);
+}
+
+/* Runs a syscall that the process put on its arsc ring, instead of trapping.
+ * The caller is in the process's address space, but there is no user context
+ * behind it, so syscalls that work on the caller's context fail. */
+void run_arsc_syscall(struct syscall *sysc)
+{
+	if (!is_user_rwaddr(sysc, sizeof(struct syscall))) {
+		printk("[kernel] bad user addr %p (+%p) in %s (user bug)\n", sysc,
+		       sizeof(struct syscall), __FUNCTION__);
+		return;
+	}
+	/* Completions go to the ring's ev_q if the sysc doesn't have one */
+	atomic_or(&sysc->flags, SC_ARSC);
+	if (syscall_needs_ctx(sysc->num)) {
+		sysc_reject(sysc, EINVAL);
+		return;
+	}
+	run_local_syscall(sysc);
+}
+
+/* Runs a batch of syscalls, in order.  If a syscall blocks, the rest of the
+ * batch doesn't wait for it: sem_down() calls sysc_batch_blocked(), which
+ * sends the rest to this core as a KMSG, and the blocked kthread stops when it
+ * wakes up and finishes its syscall.
+ *
+ * A syscall with SC_BATCH_LINK depends on the one before it.  It won't be
+ * handed off ahead of it, and it is cancelled (ECANCELED) if that one failed,
+ * as is the rest of its chain.
+ *
+ * Syscalls that work on the caller's context fail with EINVAL: the ones that
+ * never return would strand the rest of the batch, with the kthread still
+ * pointing at it. */
+static void run_sysc_batch(struct syscall *sysc, unsigned int nr_syscs)
+{
+	struct kthread *kth;
+	bool failed = FALSE;
+	bool armed;
+	int err;
+
+	for (int i = 0; i < nr_syscs; i++) {
+		if (failed && (atomic_read(&sysc[i].flags) & SC_BATCH_LINK)) {
+			sysc_reject(&sysc[i], ECANCELED);
+			continue;
+		}
+		if (syscall_needs_ctx(sysc[i].num)) {
+			sysc_reject(&sysc[i], EINVAL);
+			failed = TRUE;
+			continue;
+		}
+		kth = per_cpu_info[core_id()].cur_kthread;
+		armed = (i + 1 < nr_syscs)
+		        && !(atomic_read(&sysc[i + 1].flags) & SC_BATCH_LINK);
+		if (armed) {
+			kth->batch = &sysc[i + 1];
+			kth->batch_left = nr_syscs - i - 1;
+		}
+		err = run_local_syscall(&sysc[i]);
+		/* We could be on another core, but we're the same kthread */
+		kth = per_cpu_info[core_id()].cur_kthread;
+		if (armed && !kth->batch_left)
+			return;		/* we blocked, and someone else has the rest */
+		kth->batch = NULL;
+		kth->batch_left = 0;
+		failed = err != 0;
+	}
+}
+
+static void __run_sysc_batch(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct proc *p = (struct proc*)a0;
+	uintptr_t old_proc;
+
+	old_proc = switch_to(p);
+	run_sysc_batch((struct syscall*)a1, (unsigned int)a2);
+	switch_back(p, old_proc);
+	proc_decref(p);
+}
+
+/* Called by sem_down() when kth, which is running part of a batch, is about to
+ * sleep.  IRQs are off, and kth isn't on its stack for much longer. */
+void sysc_batch_blocked(struct kthread *kth)
+{
+	struct proc *p = current;
+
+	proc_incref(p, 1);
+	send_kernel_message(core_id(), __run_sysc_batch, (long)p, (long)kth->batch,
+	                    kth->batch_left, KMSG_ROUTINE);
+	kth->batch = NULL;
+	kth->batch_left = 0;
 }
 
 /* A process can trap and call this function, which will set up the core to
- * handle all the syscalls.  a.k.a. "sys_debutante(needs, wants)".  If there is
- * at least one, it will run it directly. */
+ * handle all the syscalls.  a.k.a. "sys_debutante(needs, wants)".  The syscalls
+ * run in order, but ones that block don't hold up the rest of the batch. */
 void prep_syscalls(struct proc *p, struct syscall *sysc, unsigned int nr_syscs)
 {
 	/* Careful with pcpui here, we could have migrated */
@@ -2625,12 +2732,17 @@ void prep_syscalls(struct proc *p, struct syscall *sysc, unsigned int nr_syscs)
 		printk("[kernel] No nr_sysc, probably a bug, user!\n");
 		return;
 	}
-	/* For all after the first call, send ourselves a KMSG (TODO). */
-	if (nr_syscs != 1)
-		warn("Only one supported (Debutante calls: %d)\n", nr_syscs);
-	/* Call the first one directly.  (we already checked to make sure there is
-	 * 1) */
-	run_local_syscall(sysc);
+	if (nr_syscs == 1) {
+		run_local_syscall(sysc);
+		return;
+	}
+	if (nr_syscs > UMAPTOP / sizeof(struct syscall) ||
+	    !is_user_rwaddr(sysc, nr_syscs * sizeof(struct syscall))) {
+		printk("[kernel] bad user addr %p (+%p) in %s (user bug)\n", sysc,
+		       nr_syscs * sizeof(struct syscall), __FUNCTION__);
+		return;
+	}
+	run_sysc_batch(sysc, nr_syscs);
 }
 
 /* Call this when something happens on the syscall where userspace might want to
@@ -2642,16 +2754,23 @@ void __signal_syscall(struct syscall *sysc, struct proc *p)
 {
 	struct event_queue *ev_q;
 	struct event_msg local_msg;
+	int flags = atomic_read(&sysc->flags);
+
 	/* User sets the ev_q then atomically sets the flag (races with SC_DONE) */
-	if (atomic_read(&sysc->flags) & SC_UEVENT) {
+	if (flags & SC_UEVENT) {
 		rmb();	/* read the ev_q after reading the flag */
 		ev_q = sysc->ev_q;
-		if (ev_q) {
-			memset(&local_msg, 0, sizeof(struct event_msg));
-			local_msg.ev_type = EV_SYSCALL;
-			local_msg.ev_arg3 = sysc;
-			send_event(p, ev_q, &local_msg, 0);
-		}
+	} else if (flags & SC_ARSC) {
+		/* Ring syscalls nobody is waiting on go to the ring's ev_q */
+		ev_q = ACCESS_ONCE(p->procdata->arsc_ring.ev_q);
+	} else {
+		return;
+	}
+	if (ev_q) {
+		memset(&local_msg, 0, sizeof(struct event_msg));
+		local_msg.ev_type = EV_SYSCALL;
+		local_msg.ev_arg3 = sysc;
+		send_event(p, ev_q, &local_msg, 0);
 	}
 }
 
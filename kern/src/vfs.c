@@ -19,6 +19,7 @@
 #include <smp.h>
 #include <ns.h>
 #include <fdtap.h>
+#include <writeback.h>
 
 struct sb_tailq super_blocks = TAILQ_HEAD_INITIALIZER(super_blocks);
 spinlock_t super_blocks_lock = SPINLOCK_INITIALIZER;
@@ -66,6 +67,8 @@ struct vfsmount *__mount_fs(struct fs_type *fs, char *dev_name,
 	sb = fs->get_sb(fs, flags, dev_name, vmnt);
 	if (!sb)
 		panic("You're FS sucks");
+	if (sb->s_bdev && !sb->s_wb)
+		wb_start(sb);
 
 	/* TODO: consider moving this into get_sb or something, in case the SB
 	 * already exists (mounting again) (if we support that) */
@@ -604,6 +607,8 @@ struct super_block *get_sb(void)
 	spinlock_init(&sb->s_lru_lock);
 	spinlock_init(&sb->s_dcache_lock);
 	spinlock_init(&sb->s_icache_lock);
+	sb->s_bdev = 0;
+	sb->s_wb = 0;
 	sb->s_fs_info = 0; // can override somewhere else
 	return sb;
 }
@@ -1326,10 +1331,12 @@ ssize_t generic_file_write(struct file *file, const char *buf, size_t count,
 			memcpy(page2kva(page) + page_off, buf, copy_amt);
 		buf += copy_amt;
 		page_off = 0;
-		atomic_or(&page->pg_flags, PG_DIRTY);
+		pm_set_page_dirty(file->f_mapping, page);
 		pm_put_page(page);	/* it's still in the cache, we just don't need it */
 	}
 	assert(buf == buf_end);
+	if (file->f_mapping->pm_op->writepages)
+		wb_balance_dirty();
 	*offset = orig_off + count;
 	return count;
 }
@@ -0,0 +1,211 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Background writeback of dirty page map pages.  See writeback.h. */
+
+#include <writeback.h>
+#include <vfs.h>
+#include <pagemap.h>
+#include <pmap.h>
+#include <kmalloc.h>
+#include <kthread.h>
+#include <init.h>
+#include <ns.h>
+#include <string.h>
+#include <stdio.h>
+
+unsigned int wb_dirty_ratio = 20;
+unsigned int wb_dirty_bg_ratio = 10;
+unsigned int wb_expire_ms = 30000;
+unsigned int wb_interval_ms = 5000;
+atomic_t wb_nr_dirty;			/* PG_DIRTY pages in writeback PMs */
+atomic_t wb_nr_writeback;		/* pages being written back */
+
+DEVVARS_ENTRY(wb_dirty_ratio, "uw");
+DEVVARS_ENTRY(wb_dirty_bg_ratio, "uw");
+DEVVARS_ENTRY(wb_expire_ms, "uw");
+DEVVARS_ENTRY(wb_interval_ms, "uw");
+
+static struct sb_writeback_tailq wb_flushers =
+                                 TAILQ_HEAD_INITIALIZER(wb_flushers);
+static spinlock_t wb_flushers_lock = SPINLOCK_INITIALIZER;
+/* Throttled writers sleep here */
+static struct rendez wb_throttle_rv;
+static unsigned long wb_nr_throttled;
+
+static unsigned int wb_boot_option(const char *opt, unsigned int dflt)
+{
+	char param[32];
+
+	if (!get_boot_option(NULL, opt, param, sizeof(param)) || !param[0])
+		return dflt;
+	return strtol(param, 0, 10);
+}
+
+void writeback_init(void)
+{
+	wb_dirty_ratio = wb_boot_option("-wb_dirty_ratio", wb_dirty_ratio);
+	wb_dirty_bg_ratio = wb_boot_option("-wb_dirty_bg_ratio",
+	                                   wb_dirty_bg_ratio);
+	wb_expire_ms = wb_boot_option("-wb_expire_ms", wb_expire_ms);
+	wb_interval_ms = wb_boot_option("-wb_interval_ms", wb_interval_ms);
+	wb_dirty_bg_ratio = MIN(wb_dirty_bg_ratio, wb_dirty_ratio);
+	atomic_init(&wb_nr_dirty, 0);
+	atomic_init(&wb_nr_writeback, 0);
+	rendez_init(&wb_throttle_rv);
+}
+
+static bool wb_over_bg_limit(void)
+{
+	return atomic_read(&wb_nr_dirty) >
+	       max_nr_pages / 100 * wb_dirty_bg_ratio;
+}
+
+static bool wb_over_limit(void)
+{
+	return atomic_read(&wb_nr_dirty) + atomic_read(&wb_nr_writeback) >
+	       max_nr_pages / 100 * wb_dirty_ratio;
+}
+
+static void wb_kick(struct sb_writeback *wb)
+{
+	if (wb->kicked)
+		return;
+	wb->kicked = TRUE;
+	rendez_wakeup(&wb->rv);
+}
+
+static void wb_kick_all(void)
+{
+	struct sb_writeback *wb;
+
+	spin_lock(&wb_flushers_lock);
+	TAILQ_FOREACH(wb, &wb_flushers, link)
+		wb_kick(wb);
+	spin_unlock(&wb_flushers_lock);
+}
+
+static int wb_has_work(void *arg)
+{
+	struct sb_writeback *wb = (struct sb_writeback*)arg;
+
+	return wb->kicked;
+}
+
+/* Writes back inodes off the SB's dirty list, oldest first.  Unless we're over
+ * the background limit, we stop at the first one that hasn't expired. */
+static void wb_run(struct sb_writeback *wb)
+{
+	struct super_block *sb = wb->sb;
+	struct inode *inode;
+	uint64_t now = read_tsc();
+	uint64_t expire = usec2tsc((uint64_t)wb_expire_ms * 1000);
+
+	wb->nr_runs++;
+	while (1) {
+		spin_lock(&sb->s_lock);
+		inode = TAILQ_FIRST(&sb->s_dirty_i);
+		if (!inode || (!wb_over_bg_limit() &&
+		               (now - inode->dirtied_when < expire))) {
+			spin_unlock(&sb->s_lock);
+			break;
+		}
+		TAILQ_REMOVE(&sb->s_dirty_i, inode, i_list);
+		/* Pages dirtied from here on will put the inode back on the list */
+		inode->i_state &= ~I_STATE_DIRTY_PAGES;
+		spin_unlock(&sb->s_lock);
+		wb->nr_pages += pm_writeback(inode->i_mapping);
+		wb->nr_inodes++;
+		kref_put(&inode->i_kref);	/* the dirty list's ref */
+	}
+}
+
+static void wb_ktask(void *arg)
+{
+	struct sb_writeback *wb = (struct sb_writeback*)arg;
+
+	while (1) {
+		rendez_sleep_timeout(&wb->rv, wb_has_work, wb,
+		                     (uint64_t)wb_interval_ms * 1000);
+		wb->kicked = FALSE;
+		wb_run(wb);
+	}
+}
+
+/* Starts a flusher for sb, which needs to be on a block device. */
+void wb_start(struct super_block *sb)
+{
+	struct sb_writeback *wb = kzmalloc(sizeof(struct sb_writeback), MEM_WAIT);
+
+	wb->sb = sb;
+	rendez_init(&wb->rv);
+	sb->s_wb = wb;
+	spin_lock(&wb_flushers_lock);
+	TAILQ_INSERT_TAIL(&wb_flushers, wb, link);
+	spin_unlock(&wb_flushers_lock);
+	ktask("writeback", wb_ktask, wb);
+}
+
+/* Called when one of inode's pages goes from clean to dirty. */
+void wb_page_dirtied(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+
+	if (!(inode->i_state & I_STATE_DIRTY_PAGES)) {
+		spin_lock(&sb->s_lock);
+		if (!(inode->i_state & I_STATE_DIRTY_PAGES)) {
+			inode->i_state |= I_STATE_DIRTY_PAGES;
+			inode->dirtied_when = read_tsc();
+			kref_get(&inode->i_kref, 1);
+			TAILQ_INSERT_TAIL(&sb->s_dirty_i, inode, i_list);
+		}
+		spin_unlock(&sb->s_lock);
+	}
+	if (sb->s_wb && wb_over_bg_limit())
+		wb_kick(sb->s_wb);
+}
+
+/* Called when a page's writeback IO is done, from any context. */
+void wb_page_written(void)
+{
+	atomic_dec(&wb_nr_writeback);
+	if (!wb_over_limit())
+		rendez_wakeup(&wb_throttle_rv);
+}
+
+static int wb_under_limit(void *arg)
+{
+	return !wb_over_limit();
+}
+
+/* Writers call this after dirtying pages.  If there's too much dirty memory,
+ * we sleep until the flushers get us back under the limit. */
+void wb_balance_dirty(void)
+{
+	if (!wb_over_limit())
+		return;
+	wb_nr_throttled++;
+	while (wb_over_limit()) {
+		wb_kick_all();
+		rendez_sleep_timeout(&wb_throttle_rv, wb_under_limit, 0, 10000);
+	}
+}
+
+void print_writeback_info(void)
+{
+	struct sb_writeback *wb;
+
+	printk("Writeback: %ld dirty, %ld under writeback, of %lu pages\n",
+	       atomic_read(&wb_nr_dirty), atomic_read(&wb_nr_writeback),
+	       max_nr_pages);
+	printk("\tbg ratio %u%%, ratio %u%%, expire %u ms, interval %u ms\n",
+	       wb_dirty_bg_ratio, wb_dirty_ratio, wb_expire_ms, wb_interval_ms);
+	printk("\tThrottled writers: %lu\n", wb_nr_throttled);
+	spin_lock(&wb_flushers_lock);
+	TAILQ_FOREACH(wb, &wb_flushers, link) {
+		printk("\tSB %s: %lu runs, %lu inodes, %lu pages%s\n", wb->sb->s_name,
+		       wb->nr_runs, wb->nr_inodes, wb->nr_pages,
+		       wb->kicked ? ", kicked" : "");
+	}
+	spin_unlock(&wb_flushers_lock);
+}
@@ -0,0 +1,85 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * arsc_ring: microbenchmark for syscalls on the arsc ring.
+ *
+ * Runs NR_CALLS null syscalls from a pthread, first trapping, then on the
+ * ring (transparently, via blockon), then with up to SYSC_RING_SZ in flight,
+ * and prints the cost per syscall for each.  Needs CONFIG_ARSC_SERVER. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <parlib/parlib.h>
+#include <parlib/arsc.h>
+#include <parlib/timing.h>
+#include <parlib/arch/arch.h>
+
+#define NR_CALLS	1000000
+
+static struct syscall syscs[SYSC_RING_SZ];
+
+static void wait_for(struct syscall *sysc)
+{
+	while (!(atomic_read(&sysc->flags) & SC_DONE) ||
+	       (atomic_read(&sysc->flags) & SC_K_LOCK))
+		cpu_relax();
+}
+
+static uint64_t run_sync(unsigned long nr_calls)
+{
+	uint64_t start = read_tsc();
+
+	for (unsigned long i = 0; i < nr_calls; i++)
+		sys_null();
+	return read_tsc() - start;
+}
+
+static uint64_t run_pipelined(unsigned long nr_calls)
+{
+	uint64_t start = read_tsc();
+
+	for (unsigned long i = 0; i < nr_calls; i += SYSC_RING_SZ) {
+		for (int j = 0; j < SYSC_RING_SZ; j++) {
+			syscs[j].num = SYS_null;
+			syscs[j].flags = 0;
+			syscs[j].ev_q = 0;
+			while (!arsc_submit(&syscs[j]))
+				cpu_relax();
+		}
+		for (int j = 0; j < SYSC_RING_SZ; j++)
+			wait_for(&syscs[j]);
+	}
+	return read_tsc() - start;
+}
+
+static void *bench(void *arg)
+{
+	unsigned long nr_calls = (unsigned long)arg;
+	uint64_t ticks;
+
+	ticks = run_sync(nr_calls);
+	printf("trap:      %6llu nsec/call\n", tsc2nsec(ticks) / nr_calls);
+	if (arsc_init()) {
+		perror("arsc_init");
+		return 0;
+	}
+	ticks = run_sync(nr_calls);
+	printf("ring:      %6llu nsec/call\n", tsc2nsec(ticks) / nr_calls);
+	ticks = run_pipelined(nr_calls);
+	printf("pipelined: %6llu nsec/call\n", tsc2nsec(ticks) / nr_calls);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long nr_calls = NR_CALLS;
+	pthread_t thread;
+
+	if (argc > 1)
+		nr_calls = strtoul(argv[1], 0, 0);
+	pthread_mcp_init();
+	pthread_create(&thread, 0, bench, (void*)nr_calls);
+	pthread_join(thread, 0);
+	return 0;
+}
@@ -0,0 +1,265 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * etherq: checks the dummy ether device's (CONFIG_NET_DUMMY) rx queues.
+ *
+ * Sends multicast UDP frames out the device, with a different source port
+ * each, so RSS spreads them over the queues.  Each queue has its own
+ * conversation ("connect 0x800 q"), and every frame has to come back on
+ * exactly one of them, and none on the device's conversation.  Then one
+ * queue's conversation goes away, and its frames have to fall back to the
+ * device's conversation.  Skips if there's no dummy device. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <parlib/parlib.h>
+#include <parlib/uthread.h>
+
+#define MAX_ETHER	32
+#define MAX_QUEUES	32
+#define NR_FRAMES	64
+#define FRAME_SZ	(14 + 20 + 8 + 32)
+/* the frames come back asynchronously, on the queues' cores */
+#define RX_TIMEOUT_MS	5000
+
+#define handle_error(msg) \
+        do { perror(msg); exit(-1); } while (0)
+
+struct conv {
+	int id;
+	int ctl;
+	int data;				/* non-blocking, for reading */
+	int nr_rx;
+};
+
+static int ether = -1;
+static int nr_queues;
+static struct conv dev_conv;
+static struct conv q_convs[MAX_QUEUES];
+static int dev_wfd;
+/* the conversation each frame came back on: the queue, or -1 for dev_conv */
+static int rx_conv[NR_FRAMES];
+
+static bool find_dummy(void)
+{
+	char path[64], buf[1024], *p;
+	int fd, n;
+
+	for (int i = 0; i < MAX_ETHER; i++) {
+		snprintf(path, sizeof(path), "#ether.%d/ether%d/ifstats", i, i);
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			continue;
+		n = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if (n <= 0)
+			continue;
+		buf[n] = 0;
+		if (!strstr(buf, "type: dummy"))
+			continue;
+		ether = i;
+		p = strstr(buf, "queues: ");
+		nr_queues = p ? atoi(p + 8) : 0;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/* Opens a conversation for IPv4 frames from rx queue qid, or from the whole
+ * device if qid < 0.  Returns -1 with errno set if the connect fails. */
+static int open_conv(struct conv *cv, int qid)
+{
+	char path[64], msg[32];
+	int n, err;
+
+	snprintf(path, sizeof(path), "#ether.%d/ether%d/clone", ether, ether);
+	cv->ctl = open(path, O_RDWR);
+	if (cv->ctl < 0)
+		handle_error("open clone");
+	n = read(cv->ctl, msg, sizeof(msg) - 1);
+	if (n <= 0)
+		handle_error("read clone");
+	msg[n] = 0;
+	cv->id = atoi(msg);
+	if (qid < 0)
+		snprintf(msg, sizeof(msg), "connect 0x800");
+	else
+		snprintf(msg, sizeof(msg), "connect 0x800 %d", qid);
+	if (write(cv->ctl, msg, strlen(msg)) < 0) {
+		err = errno;
+		close(cv->ctl);
+		errno = err;
+		return -1;
+	}
+	snprintf(path, sizeof(path), "#ether.%d/ether%d/%d/data", ether, ether,
+	         cv->id);
+	cv->data = open(path, O_RDONLY | O_NONBLOCK);
+	if (cv->data < 0)
+		handle_error("open data");
+	cv->nr_rx = 0;
+	return 0;
+}
+
+static void close_conv(struct conv *cv)
+{
+	close(cv->data);
+	close(cv->ctl);
+}
+
+static void send_frames(void)
+{
+	static const uint8_t dst[6] = {0x01, 0x00, 0x5e, 0x00, 0x00, 0x01};
+	uint8_t f[FRAME_SZ], *ip, *udp;
+
+	for (int i = 0; i < NR_FRAMES; i++) {
+		memset(f, 0, sizeof(f));
+		memcpy(f, dst, 6);
+		f[12] = 0x08;
+		ip = f + 14;
+		ip[0] = 0x45;
+		ip[3] = FRAME_SZ - 14;
+		ip[8] = 64;
+		ip[9] = 17;		/* UDP */
+		ip[12] = 10;
+		ip[15] = 1;
+		ip[16] = 224;
+		ip[19] = 1;
+		udp = ip + 20;
+		udp[0] = (1000 + i) >> 8;
+		udp[1] = (1000 + i) & 0xff;
+		udp[3] = 9;
+		udp[5] = FRAME_SZ - 14 - 20;
+		/* which frame this is */
+		udp[8] = i;
+		if (write(dev_wfd, f, sizeof(f)) != sizeof(f))
+			handle_error("write frame");
+	}
+}
+
+/* Reads whatever cv has, noting which conversation each frame came back on.
+ * Returns how many frames it read. */
+static int drain_conv(struct conv *cv, int which)
+{
+	uint8_t f[2048];
+	int n, i, nr = 0;
+
+	while ((n = read(cv->data, f, sizeof(f))) > 0) {
+		if (n < FRAME_SZ || f[14 + 9] != 17) {
+			printf("Got a frame that isn't one of ours on conv %d\n", which);
+			exit(-1);
+		}
+		i = f[14 + 20 + 8];
+		if (i >= NR_FRAMES || rx_conv[i] != -2) {
+			printf("Frame %d came back twice, on conv %d\n", i, which);
+			exit(-1);
+		}
+		rx_conv[i] = which;
+		cv->nr_rx++;
+		nr++;
+	}
+	return nr;
+}
+
+static void recv_frames(void)
+{
+	int nr_rx = 0;
+
+	for (int i = 0; i < NR_FRAMES; i++)
+		rx_conv[i] = -2;
+	for (int ms = 0; ms < RX_TIMEOUT_MS && nr_rx < NR_FRAMES; ms++) {
+		nr_rx += drain_conv(&dev_conv, -1);
+		for (int q = 0; q < nr_queues; q++)
+			if (q_convs[q].ctl >= 0)
+				nr_rx += drain_conv(&q_convs[q], q);
+		if (nr_rx < NR_FRAMES)
+			uthread_usleep(1000);
+	}
+	if (nr_rx != NR_FRAMES) {
+		printf("Only %d of %d frames came back\n", nr_rx, NR_FRAMES);
+		exit(-1);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	char path[64];
+	struct conv extra;
+	int busy_queues = 0, nr_q0;
+
+	if (!find_dummy()) {
+		printf("No dummy ether device, skipping\n");
+		return 0;
+	}
+	if (nr_queues > MAX_QUEUES) {
+		printf("Dummy device has %d queues, can only test %d\n", nr_queues,
+		       MAX_QUEUES);
+		return -1;
+	}
+	if (open_conv(&dev_conv, -1)) {
+		/* someone else has IPv4 on it, e.g. it's bound to an ipifc */
+		printf("IPv4 on ether%d is in use (%s), skipping\n", ether,
+		       strerror(errno));
+		return 0;
+	}
+	if (write(dev_conv.ctl, "addmulti 01005e000001", 21) < 0)
+		handle_error("addmulti");
+	snprintf(path, sizeof(path), "#ether.%d/ether%d/%d/data", ether, ether,
+	         dev_conv.id);
+	dev_wfd = open(path, O_WRONLY);
+	if (dev_wfd < 0)
+		handle_error("open data for writing");
+	for (int q = 0; q < nr_queues; q++)
+		if (open_conv(&q_convs[q], q))
+			handle_error("connect to a queue");
+	if (!open_conv(&extra, nr_queues)) {
+		printf("Connected to queue %d of %d\n", nr_queues, nr_queues);
+		return -1;
+	}
+	if (nr_queues && !open_conv(&extra, 0)) {
+		printf("Connected to queue 0 twice\n");
+		return -1;
+	}
+
+	send_frames();
+	recv_frames();
+	if (nr_queues == 0) {
+		printf("Single-queue dummy: all %d frames came back\n", NR_FRAMES);
+		return 0;
+	}
+	if (dev_conv.nr_rx) {
+		printf("%d frames went to the device, not their queue\n",
+		       dev_conv.nr_rx);
+		return -1;
+	}
+	for (int q = 0; q < nr_queues; q++) {
+		printf("Queue %d: %d frames\n", q, q_convs[q].nr_rx);
+		busy_queues += q_convs[q].nr_rx != 0;
+	}
+	if (nr_queues > 1 && busy_queues < 2) {
+		printf("RSS didn't spread %d flows over the queues\n", NR_FRAMES);
+		return -1;
+	}
+
+	/* without queue 0's conversation, its flows go to the device's */
+	nr_q0 = q_convs[0].nr_rx;
+	close_conv(&q_convs[0]);
+	q_convs[0].ctl = -1;
+	dev_conv.nr_rx = 0;
+	send_frames();
+	recv_frames();
+	if (dev_conv.nr_rx != nr_q0) {
+		printf("Device got %d frames, queue 0 had had %d\n", dev_conv.nr_rx,
+		       nr_q0);
+		return -1;
+	}
+	for (int q = 1; q < nr_queues; q++)
+		close_conv(&q_convs[q]);
+	close(dev_wfd);
+	close_conv(&dev_conv);
+	printf("All %d frames came back on their queues\n", NR_FRAMES);
+	return 0;
+}
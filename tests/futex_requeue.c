@@ -0,0 +1,63 @@
+/* Checks FUTEX_CMP_REQUEUE: waiters on one futex get moved to another without
+ * waking, and a stale val3 gets EAGAIN. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <parlib/parlib.h>
+#include <parlib/assert.h>
+#include <futex.h>
+#include <pthread.h>
+
+#define NUM_THREADS 8
+
+static pthread_t threads[NUM_THREADS];
+static int cond_var = 0;
+static int mutex_var = 0;
+static atomic_t nr_done;
+
+/* How many threads are blocked on uaddr.  Requeueing a futex onto itself moves
+ * nothing, but the return value counts everyone who is queued on it. */
+static int nr_blocked(int *uaddr)
+{
+	return futex(uaddr, FUTEX_REQUEUE, 0, (void*)INT_MAX, uaddr, 0);
+}
+
+static void *waiter(void *arg)
+{
+	/* We'll either wake from cond_var, or be requeued and wake from mutex_var.
+	 * Either way, futex() returns once someone wakes us. */
+	futex(&cond_var, FUTEX_WAIT, 0, NULL, NULL, 0);
+	atomic_inc(&nr_done);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int ret;
+
+	atomic_init(&nr_done, 0);
+	for (int i = 0; i < NUM_THREADS; i++)
+		pthread_create(&threads[i], NULL, waiter, NULL);
+	/* Wait until they've all actually blocked, not just started */
+	while (nr_blocked(&cond_var) < NUM_THREADS)
+		pthread_yield();
+
+	ret = futex(&cond_var, FUTEX_CMP_REQUEUE, 1, (void*)INT_MAX, &mutex_var, 1);
+	assert(ret == -1 && errno == EAGAIN);
+
+	/* Wake one, move the rest */
+	ret = futex(&cond_var, FUTEX_CMP_REQUEUE, 1, (void*)INT_MAX, &mutex_var, 0);
+	assert(ret == NUM_THREADS);
+	assert(futex(&cond_var, FUTEX_WAKE, INT_MAX, NULL, NULL, 0) == 0);
+
+	/* Now they're all on mutex_var */
+	ret = futex(&mutex_var, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	assert(ret == NUM_THREADS - 1);
+	for (int i = 0; i < NUM_THREADS; i++)
+		pthread_join(threads[i], NULL);
+	assert(atomic_read(&nr_done) == NUM_THREADS);
+	printf("futex_requeue: passed\n");
+	return 0;
+}
@@ -0,0 +1,63 @@
+/* Hammers one mutex from many threads, with a condvar broadcast every round,
+ * then dumps the mutex's contention stats.
+ *
+ * pthread_mutex_handoff [nr_threads] [nr_rounds] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <parlib/parlib.h>
+#include <parlib/assert.h>
+#include <pthread.h>
+
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cv = PTHREAD_COND_INITIALIZER;
+static unsigned long counter;
+static unsigned int round_nr;
+static unsigned int nr_arrived;
+static int nr_threads = 32;
+static int nr_rounds = 1000;
+
+static void *worker(void *arg)
+{
+	unsigned int my_round;
+
+	for (int i = 0; i < nr_rounds; i++) {
+		pthread_mutex_lock(&mtx);
+		counter++;
+		/* Last one in for this round wakes everyone; the rest wait, which
+		 * requeues them onto mtx. */
+		my_round = round_nr;
+		if (++nr_arrived == nr_threads) {
+			nr_arrived = 0;
+			round_nr++;
+			pthread_cond_broadcast(&cv);
+		} else {
+			while (round_nr == my_round)
+				pthread_cond_wait(&cv, &mtx);
+		}
+		pthread_mutex_unlock(&mtx);
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t *threads;
+
+	if (argc > 1)
+		nr_threads = atoi(argv[1]);
+	if (argc > 2)
+		nr_rounds = atoi(argv[2]);
+	threads = malloc(sizeof(pthread_t) * nr_threads);
+	assert(threads);
+	pthread_mcp_init();
+	for (int i = 0; i < nr_threads; i++)
+		pthread_create(&threads[i], NULL, worker, NULL);
+	for (int i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	assert(counter == (unsigned long)nr_threads * nr_rounds);
+	assert(round_nr == nr_rounds);
+	pthread_mutex_print_stats(&mtx, "mtx");
+	free(threads);
+	return 0;
+}
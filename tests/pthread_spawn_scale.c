@@ -0,0 +1,121 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Scaling benchmark for the pthread 2LS's run queues.  One spawner thread per
+ * vcore creates short-lived threads in batches and joins on them, so every
+ * vcore is making threads runnable and running them at the same time.  Run it
+ * with a range of vcore counts (32+ is the interesting part) and compare the
+ * threads / sec.
+ *
+ * To build on linux, cd into tests and run:
+ * $ gcc -O2 -std=gnu99 -fno-stack-protector -g pthread_spawn_scale.c -lpthread
+ *
+ * Make sure you run it with taskset to fix the number of vcores/cpus. */
+
+#define _GNU_SOURCE /* for pth_yield on linux */
+
+#include <stdio.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "misc-compat.h" /* OS dependent #incs */
+
+#define MAX_BATCH		256
+#define STACK_SIZE		(64 * 1024)
+
+int nr_vcores = 32;
+long nr_threads = 100000;
+int batch = 32;
+int amt_fake_work = 0;
+
+pthread_attr_t attr;
+bool ready = FALSE;
+
+static void *short_thread(void *arg)
+{
+	if (amt_fake_work)
+		udelay(amt_fake_work);
+	/* Give someone else a chance to pick us up on the way back */
+	pthread_yield();
+	return arg;
+}
+
+static void *spawner(void *arg)
+{
+	long nr = (long)arg;
+	pthread_t kids[MAX_BATCH];
+	int nr_kids;
+
+	while (!ready)
+		cpu_relax();
+	for (long i = 0; i < nr; i += nr_kids) {
+		nr_kids = MIN(batch, nr - i);
+		for (int j = 0; j < nr_kids; j++) {
+			if (pthread_create(&kids[j], &attr, short_thread, NULL))
+				perror("pth_create failed");
+		}
+		for (int j = 0; j < nr_kids; j++)
+			pthread_join(kids[j], NULL);
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct timeval start_tv = {0};
+	struct timeval end_tv = {0};
+	pthread_t *spawners;
+	long usec_diff;
+
+	if (argc > 1)
+		nr_vcores = strtol(argv[1], 0, 10);
+	if (argc > 2)
+		nr_threads = strtol(argv[2], 0, 10);
+	if (argc > 3)
+		batch = MIN(strtol(argv[3], 0, 10), MAX_BATCH);
+	if (argc > 4)
+		amt_fake_work = strtol(argv[4], 0, 10);
+	if (nr_vcores < 1 || batch < 1) {
+		printf("Usage: %s [nr_vcores nr_threads batch fake_work]\n", argv[0]);
+		exit(-1);
+	}
+	printf("Making %ld threads, %d at a time per spawner, on %d vcores, "
+	       "%d work\n", nr_threads, batch, nr_vcores, amt_fake_work);
+
+	/* OS dependent prep work */
+#ifdef __ros__
+	pthread_can_vcore_request(FALSE);	/* 2LS won't manage vcores */
+	pthread_need_tls(FALSE);
+	pthread_mcp_init();					/* gives us one vcore */
+	vcore_request(nr_vcores - 1);		/* ghetto incremental interface */
+#endif /* __ros__ */
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, STACK_SIZE);
+	spawners = malloc(sizeof(pthread_t) * nr_vcores);
+	if (!spawners) {
+		perror("spawners alloc");
+		exit(-1);
+	}
+	for (int i = 0; i < nr_vcores; i++) {
+		if (pthread_create(&spawners[i], NULL, spawner,
+		                   (void*)(nr_threads / nr_vcores)))
+			perror("pth_create failed");
+	}
+	if (gettimeofday(&start_tv, 0))
+		perror("Start time error...");
+	ready = TRUE;
+	for (int i = 0; i < nr_vcores; i++)
+		pthread_join(spawners[i], NULL);
+	if (gettimeofday(&end_tv, 0))
+		perror("End time error...");
+	usec_diff = (end_tv.tv_sec - start_tv.tv_sec) * 1000000 +
+	            (end_tv.tv_usec - start_tv.tv_usec);
+	nr_threads = (nr_threads / nr_vcores) * nr_vcores;
+	printf("Done: %ld threads, %d vcores\n", nr_threads, nr_vcores);
+	printf("Time to run: %ld usec\n", usec_diff);
+	printf("Threads / sec: %lld\n\n", 1000000LL * nr_threads / usec_diff);
+	free(spawners);
+	return 0;
+}
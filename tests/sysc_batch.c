@@ -0,0 +1,69 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * sysc_batch: microbenchmark for batched syscall submission.
+ *
+ * Runs NR_CALLS null syscalls, first one per trap, then in batches of
+ * increasing size, and prints the cost per syscall for each. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <parlib/parlib.h>
+#include <parlib/timing.h>
+#include <parlib/arch/arch.h>
+
+#define NR_CALLS	1000000
+#define MAX_BATCH	64
+
+static struct syscall syscs[MAX_BATCH];
+
+static void wait_for(struct syscall *sysc)
+{
+	while (!(atomic_read(&sysc->flags) & SC_DONE) ||
+	       (atomic_read(&sysc->flags) & SC_K_LOCK))
+		cpu_relax();
+}
+
+static uint64_t run_single(unsigned long nr_calls)
+{
+	uint64_t start = read_tsc();
+
+	for (unsigned long i = 0; i < nr_calls; i++)
+		sys_null();
+	return read_tsc() - start;
+}
+
+static uint64_t run_batched(unsigned long nr_calls, unsigned int batch)
+{
+	uint64_t start = read_tsc();
+
+	for (unsigned long i = 0; i < nr_calls; i += batch) {
+		for (int j = 0; j < batch; j++) {
+			syscs[j].num = SYS_null;
+			syscs[j].flags = 0;
+			syscs[j].ev_q = 0;
+		}
+		syscall_async_batch(syscs, batch);
+		for (int j = 0; j < batch; j++)
+			wait_for(&syscs[j]);
+	}
+	return read_tsc() - start;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long nr_calls = NR_CALLS;
+	uint64_t ticks;
+
+	if (argc > 1)
+		nr_calls = strtoul(argv[1], 0, 0);
+	ticks = run_single(nr_calls);
+	printf("single:   %6llu nsec/call\n", tsc2nsec(ticks) / nr_calls);
+	for (unsigned int batch = 2; batch <= MAX_BATCH; batch *= 2) {
+		ticks = run_batched(nr_calls, batch);
+		printf("batch %2u: %6llu nsec/call\n", batch,
+		       tsc2nsec(ticks) / nr_calls);
+	}
+	return 0;
+}
@@ -51,6 +51,10 @@ extern struct event_queue __ros_scp_simple_evq;
  * made.  (function is in uthread.c) */
 extern void (*ros_syscall_blockon)(struct syscall *sysc);
 
+/* Issues sysc without trapping, returning FALSE if it should trap instead.
+ * Set by parlib when the process has an arsc ring.  (see parlib/arsc.h) */
+extern bool (*ros_syscall_submit)(struct syscall *sysc);
+
 /* Glibc initial blockon, usable before parlib code can init things (or if it
  * never can, like for RTLD).  MCPs will need the 'uthread-aware' blockon. */
 void __ros_early_syscall_blockon(struct syscall *sysc);
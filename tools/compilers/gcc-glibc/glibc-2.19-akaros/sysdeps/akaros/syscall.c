@@ -95,12 +95,18 @@ void __ros_early_syscall_blockon(struct syscall *sysc)
  * blockon before becoming an MCP.  Default is the glibc SCP handler */
 void (*ros_syscall_blockon)(struct syscall *sysc) = __ros_early_syscall_blockon;
 
+/* Function pointer for issuing a syscall without trapping, e.g. on the arsc
+ * ring.  Returns FALSE if the syscall should trap instead.  Parlib sets this
+ * once it has a ring; until then, everyone traps. */
+bool (*ros_syscall_submit)(struct syscall *sysc);
+
 /* Issue a single syscall and block into the 2LS until it completes */
 static inline void __ros_syscall_sync(struct syscall *sysc)
 {
 	/* There is only one syscall in the syscall array when we want to do it
 	* synchronously */
-	__ros_arch_syscall((long)sysc, 1);
+	if (!ros_syscall_submit || !ros_syscall_submit(sysc))
+		__ros_arch_syscall((long)sysc, 1);
 	/* Don't proceed til we are done */
 	while (!(atomic_read(&sysc->flags) & SC_DONE))
 		ros_syscall_blockon(sysc);
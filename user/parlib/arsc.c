@@ -0,0 +1,58 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Asynchronous remote syscalls, user side.  See parlib/arsc.h. */
+
+#include <parlib/arsc.h>
+#include <parlib/parlib.h>
+#include <parlib/uthread.h>
+#include <parlib/vcore.h>
+#include <parlib/arch/atomic.h>
+#include <ros/procdata.h>
+
+/* Puts sysc on the ring.  Any number of threads can submit at once: we reserve
+ * a slot by bumping sq_prod, then write the sysc into it.  The kernel won't
+ * take a slot until it is non-zero, and it zeros slots before it frees them.
+ * Returns FALSE if the ring is full. */
+bool arsc_submit(struct syscall *sysc)
+{
+	struct sysc_ring *ring = &__procdata.arsc_ring;
+	uint32_t prod;
+
+	do {
+		prod = ACCESS_ONCE(ring->sq_prod);
+		if (prod - ACCESS_ONCE(ring->sq_cons) >= SYSC_RING_SZ)
+			return FALSE;
+	} while (!atomic_cas_u32(&ring->sq_prod, prod, prod + 1));
+	wmb();	/* the sysc's contents before the pointer */
+	ACCESS_ONCE(ring->sq[prod & (SYSC_RING_SZ - 1)]) = sysc;
+	return TRUE;
+}
+
+void arsc_set_evq(struct event_queue *ev_q)
+{
+	ACCESS_ONCE(__procdata.arsc_ring.ev_q) = ev_q;
+}
+
+/* glibc's ros_syscall_submit.  Only uthreads that can block in the 2LS use the
+ * ring; everyone else would just spin on the poller. */
+static bool __arsc_syscall_submit(struct syscall *sysc)
+{
+	if (in_vcore_context())
+		return FALSE;
+	if (!current_uthread || (current_uthread->flags & UTHREAD_DONT_MIGRATE))
+		return FALSE;
+	/* These work on the caller's context, and need to trap */
+	if (syscall_needs_ctx(sysc->num))
+		return FALSE;
+	return arsc_submit(sysc);
+}
+
+/* Registers with the kernel's pollers, then sends our syscalls to the ring. */
+int arsc_init(void)
+{
+	if (sys_init_arsc())
+		return -1;
+	ros_syscall_submit = __arsc_syscall_submit;
+	return 0;
+}
@@ -0,0 +1,29 @@
+/* Copyright (c) 2016 Google Inc
+ * See LICENSE for details.
+ *
+ * Asynchronous remote syscalls: syscalls submitted on procdata's arsc_ring and
+ * run by a polling kernel core, without trapping.  Needs a kernel with
+ * CONFIG_ARSC_SERVER.  (see ros/ring_syscall.h)
+ *
+ * After arsc_init(), uthreads' syscalls go on the ring instead of trapping,
+ * and they block in the 2LS (thread_blockon_sysc) like any other syscall.
+ * Vcore context and DONT_MIGRATE uthreads still trap, since they can't block.
+ *
+ * You can also submit syscalls yourself with arsc_submit().  Completion sets
+ * SC_DONE as usual.  If the sysc had no ev_q of its own, the kernel sends an
+ * EV_SYSCALL (ev_arg3 == sysc) to the ring's ev_q, if you set one with
+ * arsc_set_evq(), e.g. a UCQ from get_eventq(EV_MBOX_UCQ) or a CEQ. */
+
+#pragma once
+
+#include <ros/syscall.h>
+#include <ros/event.h>
+#include <ros/ring_syscall.h>
+
+__BEGIN_DECLS
+
+int arsc_init(void);
+bool arsc_submit(struct syscall *sysc);
+void arsc_set_evq(struct event_queue *ev_q);
+
+__END_DECLS
@@ -46,7 +46,7 @@ int         sys_notify(int pid, unsigned int ev_type, struct event_msg *u_msg);
 int         sys_self_notify(uint32_t vcoreid, unsigned int ev_type,
                             struct event_msg *u_msg, bool priv);
 int         sys_halt_core(unsigned int usec);
-void*		sys_init_arsc();
+int         sys_init_arsc(void);
 int         sys_block(unsigned int usec);
 int         sys_change_vcore(uint32_t vcoreid, bool enable_my_notif);
 int         sys_change_to_m(void);
@@ -56,6 +56,7 @@ int         sys_abort_sysc_fd(int fd);
 int         sys_tap_fds(struct fd_tap_req *tap_reqs, size_t nr_reqs);
 
 void		syscall_async(struct syscall *sysc, unsigned long num, ...);
+void		syscall_async_batch(struct syscall *sysc, unsigned int nr);
 
 /* Control variables */
 extern bool parlib_wants_to_be_mcp;	/* instructs the 2LS to be an MCP */
@@ -93,9 +93,9 @@ int sys_halt_core(unsigned int usec)
 	return ros_syscall(SYS_halt_core, usec, 0, 0, 0, 0, 0);
 }
 
-void* sys_init_arsc()
+int sys_init_arsc(void)
 {
-	return (void*)ros_syscall(SYS_init_arsc, 0, 0, 0, 0, 0, 0);
+	return ros_syscall(SYS_init_arsc, 0, 0, 0, 0, 0, 0);
 }
 
 int sys_block(unsigned int usec)
@@ -191,3 +191,12 @@ void syscall_async(struct syscall *sysc, unsigned long num, ...)
 	va_end(args);
 	__ros_arch_syscall((long)sysc, 1);
 }
+
+/* Submits nr syscalls in one trap.  The caller fills in num, the args, ev_q and
+ * flags (0 or SC_BATCH_LINK) of each.  They run in order, except that one that
+ * blocks doesn't hold up the ones after it (unless they are linked).  Each one
+ * completes on its own, with SC_DONE and its ev_q, like any async syscall. */
+void syscall_async_batch(struct syscall *sysc, unsigned int nr)
+{
+	__ros_arch_syscall((long)sysc, nr);
+}
@@ -4,56 +4,116 @@
 #include <pthread.h>
 #include <parlib/parlib.h>
 #include <parlib/assert.h>
+#include <parlib/arch/arch.h>
+#include <parlib/spinlock.h>
 #include <stdio.h>
 #include <errno.h>
-#include <parlib/slab.h>
-#include <parlib/mcs.h>
 #include <benchutil/alarm.h>
 
+/* Waiters are hashed by uaddr into FUTEX_NR_BUCKETS buckets, each with its own
+ * lock, so a wake only looks at waiters that might share its uaddr, and waiters
+ * on unrelated futexes don't contend. */
+#define FUTEX_HASH_BITS 8
+#define FUTEX_NR_BUCKETS (1 << FUTEX_HASH_BITS)
+
 static inline int futex_wake(int *uaddr, int count);
-static inline int futex_wait(int *uaddr, int val, uint64_t ms_timeout);
-static void *timer_thread(void *arg);
+static inline int futex_wait(int *uaddr, int val, uint64_t us_timeout);
+static inline int futex_requeue(int *uaddr, int nr_wake, int nr_requeue,
+                                int *uaddr2, bool cmp, int val3);
+
+struct futex_bucket;
 
 struct futex_element {
   TAILQ_ENTRY(futex_element) link;
   pthread_t pthread;
   int *uaddr;
+  // The bucket we hash to.  Changes only on requeue, with both buckets locked.
+  struct futex_bucket *fb;
+  // Whether we're on fb's queue.  Protected by fb's lock.
+  bool queued;
   uint64_t us_timeout;
   struct alarm_waiter awaiter;
   bool timedout;
 };
 TAILQ_HEAD(futex_queue, futex_element);
 
-struct futex_data {
-  struct mcs_pdr_lock lock;
+struct futex_bucket {
+  struct spin_pdr_lock lock;
   struct futex_queue queue;
-};
-static struct futex_data __futex;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+static struct futex_bucket __futex_buckets[FUTEX_NR_BUCKETS];
 
 static inline void futex_init()
 {
-  mcs_pdr_init(&__futex.lock);
-  TAILQ_INIT(&__futex.queue);
+  for (int i = 0; i < FUTEX_NR_BUCKETS; i++) {
+    spin_pdr_init(&__futex_buckets[i].lock);
+    TAILQ_INIT(&__futex_buckets[i].queue);
+  }
+}
+
+static struct futex_bucket *futex_hash(int *uaddr)
+{
+  // Fibonacci hashing.  The low bits of an int* are always 0, so drop them.
+  uint64_t key = (uintptr_t)uaddr >> 2;
+  return &__futex_buckets[(key * 0x9e3779b97f4a7c15ULL) >>
+                          (64 - FUTEX_HASH_BITS)];
+}
+
+// Lock two buckets in address order, so requeues in opposite directions can't
+// deadlock.  They may be the same bucket.
+static void futex_lock_pair(struct futex_bucket *fb1, struct futex_bucket *fb2)
+{
+  if (fb1 > fb2) {
+    struct futex_bucket *tmp = fb1;
+    fb1 = fb2;
+    fb2 = tmp;
+  }
+  spin_pdr_lock(&fb1->lock);
+  if (fb2 != fb1)
+    spin_pdr_lock(&fb2->lock);
+}
+
+static void futex_unlock_pair(struct futex_bucket *fb1,
+                              struct futex_bucket *fb2)
+{
+  if (fb2 != fb1)
+    spin_pdr_unlock(&fb2->lock);
+  spin_pdr_unlock(&fb1->lock);
+}
+
+// Locks and returns the bucket e is on.  A requeue can move e while we wait for
+// the lock, so we check again once we hold it.
+static struct futex_bucket *futex_lock_element(struct futex_element *e)
+{
+  struct futex_bucket *fb;
+
+  while (1) {
+    fb = ACCESS_ONCE(e->fb);
+    spin_pdr_lock(&fb->lock);
+    if (fb == ACCESS_ONCE(e->fb))
+      return fb;
+    spin_pdr_unlock(&fb->lock);
+  }
 }
 
 static void __futex_timeout(struct alarm_waiter *awaiter) {
-  struct futex_element *__e = NULL;
   struct futex_element *e = (struct futex_element*)awaiter->data;
-  //printf("timeout fired: %p\n", e->uaddr);
+  struct futex_bucket *fb;
+  bool removed = false;
 
-  // Atomically remove the timed-out element from the futex queue if we won the
-  // race against actually completing.
-  mcs_pdr_lock(&__futex.lock);
-  TAILQ_FOREACH(__e, &__futex.queue, link)
-    if (__e == e) break;
-  if (__e != NULL)
-    TAILQ_REMOVE(&__futex.queue, e, link);
-  mcs_pdr_unlock(&__futex.lock);
+  // Atomically remove the timed-out element from its bucket if we won the
+  // race against actually completing.  This is O(1); we don't need to search.
+  fb = futex_lock_element(e);
+  if (e->queued) {
+    TAILQ_REMOVE(&fb->queue, e, link);
+    e->queued = false;
+    removed = true;
+  }
+  spin_pdr_unlock(&fb->lock);
 
   // If we removed it, restart it outside the lock
-  if (__e != NULL) {
+  if (removed) {
     e->timedout = true;
-    //printf("timeout: %p\n", e->uaddr);
     uthread_runnable((struct uthread*)e->pthread);
   }
   // Set this as the very last thing we do whether we successfully woke the
@@ -67,20 +127,22 @@ static void __futex_timeout(struct alarm_waiter *awaiter) {
 static void __futex_block(struct uthread *uthread, void *arg) {
   pthread_t pthread = (pthread_t)uthread;
   struct futex_element *e = (struct futex_element*)arg;
+  struct futex_bucket *fb = e->fb;
 
   // Set the remaining properties of the futex element
   e->pthread = pthread;
   e->timedout = false;
 
-  // Insert the futex element into the queue
-  TAILQ_INSERT_TAIL(&__futex.queue, e, link);
+  // Insert the futex element into its bucket
+  TAILQ_INSERT_TAIL(&fb->queue, e, link);
+  e->queued = true;
 
-  // Set an alarm for the futex timeout if applicable
+  // Set an alarm for the futex timeout if applicable.  If it fires right away,
+  // the handler waits on the bucket lock until we're done here.
   if(e->us_timeout != (uint64_t)-1) {
     e->awaiter.data = e;
     init_awaiter(&e->awaiter, __futex_timeout);
     set_awaiter_rel(&e->awaiter, e->us_timeout);
-    //printf("timeout set: %p\n", e->uaddr);
     set_alarm(&e->awaiter);
   }
 
@@ -88,24 +150,31 @@ static void __futex_block(struct uthread *uthread, void *arg) {
   __pthread_generic_yield(pthread);
   pthread->state = PTH_BLK_MUTEX;
 
-  // Unlock the pdr_lock 
-  mcs_pdr_unlock(&__futex.lock);
+  // Unlock the bucket.  e can be woken and gone as soon as we do.
+  spin_pdr_unlock(&fb->lock);
 }
 
 static inline int futex_wait(int *uaddr, int val, uint64_t us_timeout)
 {
+  struct futex_bucket *fb = futex_hash(uaddr);
+
   // Atomically do the following...
-  mcs_pdr_lock(&__futex.lock);
+  spin_pdr_lock(&fb->lock);
   // If the value of *uaddr matches val
   if(*uaddr == val) {
-    //printf("wait: %p, %d\n", uaddr, us_timeout);
+    if (us_timeout == 0) {
+      spin_pdr_unlock(&fb->lock);
+      errno = ETIMEDOUT;
+      return -1;
+    }
     // Create a new futex element and initialize it.
     struct futex_element e;
     e.uaddr = uaddr;
+    e.fb = fb;
     e.us_timeout = us_timeout;
     // Yield the uthread...
     // We set the remaining properties of the futex element, set the timeout
-    // timer, and unlock the pdr lock on the other side.  It is important that
+    // timer, and unlock the bucket on the other side.  It is important that
     // we do the unlock on the other side, because (unlike linux, etc.) its
     // possible to get interrupted and drop into vcore context right after
     // releasing the lock.  If that vcore code then calls futex_wake(), we
@@ -118,7 +187,7 @@ static inline int futex_wait(int *uaddr, int val, uint64_t us_timeout)
     // references to e are gone between the wake() and the timeout() code. We
     // use e.awaiter.data to do this.
     if(e.us_timeout != (uint64_t)-1)
-      while (e.awaiter.data != NULL)
+      while (ACCESS_ONCE(e.awaiter.data) != NULL)
         cpu_relax();
 
     // After waking, if we timed out, set the error
@@ -128,40 +197,19 @@ static inline int futex_wait(int *uaddr, int val, uint64_t us_timeout)
       return -1;
     }
   } else {
-      mcs_pdr_unlock(&__futex.lock);
+      spin_pdr_unlock(&fb->lock);
   }
   return 0;
 }
 
-static inline int futex_wake(int *uaddr, int count)
+// Wakes everyone on q, which the caller already took off their buckets.
+static void __futex_wake_list(struct futex_queue *q)
 {
-  int max = count;
-  struct futex_element *e,*n = NULL;
-  struct futex_queue q = TAILQ_HEAD_INITIALIZER(q);
-
-  // Atomically grab all relevant futex blockers
-  // from the global futex queue
-  mcs_pdr_lock(&__futex.lock);
-  e = TAILQ_FIRST(&__futex.queue);
-  while(e != NULL) {
-    if(count > 0) {
-      n = TAILQ_NEXT(e, link);
-      if(e->uaddr == uaddr) {
-        TAILQ_REMOVE(&__futex.queue, e, link);
-        TAILQ_INSERT_TAIL(&q, e, link);
-        count--;
-      }
-      e = n;
-    }
-    else break;
-  }
-  mcs_pdr_unlock(&__futex.lock);
+  struct futex_element *e, *n;
 
   // Unblock them outside the lock
-  e = TAILQ_FIRST(&q);
-  while(e != NULL) {
-    n = TAILQ_NEXT(e, link);
-    TAILQ_REMOVE(&q, e, link);
+  TAILQ_FOREACH_SAFE(e, q, link, n) {
+    TAILQ_REMOVE(q, e, link);
     // Cancel the timeout if one was set
     if(e->us_timeout != (uint64_t)-1) {
       // Try and unset the alarm.  If this fails, then we have already
@@ -172,41 +220,107 @@ static inline int futex_wake(int *uaddr, int count)
       // one who removed e from the queue, so we are basically just
       // deciding who should set awaiter->data to NULL to indicate that
       // there are no more references to it.
-      if(unset_alarm(&e->awaiter)) {
-        //printf("timeout canceled: %p\n", e->uaddr);
+      if(unset_alarm(&e->awaiter))
         e->awaiter.data = NULL;
-      }
     }
-    //printf("wake: %p\n", uaddr);
     uthread_runnable((struct uthread*)e->pthread);
-    e = n;
   }
-  return max-count;
+}
+
+static inline int futex_wake(int *uaddr, int count)
+{
+  struct futex_bucket *fb = futex_hash(uaddr);
+  struct futex_element *e, *n;
+  struct futex_queue q = TAILQ_HEAD_INITIALIZER(q);
+  int nr_woken = 0;
+
+  // Atomically grab up to count blockers on uaddr from its bucket
+  spin_pdr_lock(&fb->lock);
+  TAILQ_FOREACH_SAFE(e, &fb->queue, link, n) {
+    if (nr_woken == count)
+      break;
+    if (e->uaddr != uaddr)
+      continue;
+    TAILQ_REMOVE(&fb->queue, e, link);
+    e->queued = false;
+    TAILQ_INSERT_TAIL(&q, e, link);
+    nr_woken++;
+  }
+  spin_pdr_unlock(&fb->lock);
+
+  __futex_wake_list(&q);
+  return nr_woken;
+}
+
+// Wakes up to nr_wake waiters on uaddr, and moves up to nr_requeue of the rest
+// over to uaddr2, without waking them.  For CMP_REQUEUE, we bail with EAGAIN if
+// *uaddr no longer holds val3.  This is what lets a condvar broadcast wake one
+// waiter and hand the others to the mutex, instead of waking them all just to
+// have them fight over the mutex.
+static inline int futex_requeue(int *uaddr, int nr_wake, int nr_requeue,
+                                int *uaddr2, bool cmp, int val3)
+{
+  struct futex_bucket *fb1 = futex_hash(uaddr);
+  struct futex_bucket *fb2 = futex_hash(uaddr2);
+  struct futex_element *e, *n;
+  struct futex_queue q = TAILQ_HEAD_INITIALIZER(q);
+  int nr_woken = 0, nr_moved = 0;
+
+  futex_lock_pair(fb1, fb2);
+  if (cmp && *uaddr != val3) {
+    futex_unlock_pair(fb1, fb2);
+    errno = EAGAIN;
+    return -1;
+  }
+  TAILQ_FOREACH_SAFE(e, &fb1->queue, link, n) {
+    if (e->uaddr != uaddr)
+      continue;
+    if (nr_woken < nr_wake) {
+      TAILQ_REMOVE(&fb1->queue, e, link);
+      e->queued = false;
+      TAILQ_INSERT_TAIL(&q, e, link);
+      nr_woken++;
+      continue;
+    }
+    if (nr_moved == nr_requeue)
+      break;
+    e->uaddr = uaddr2;
+    if (fb2 != fb1) {
+      TAILQ_REMOVE(&fb1->queue, e, link);
+      TAILQ_INSERT_TAIL(&fb2->queue, e, link);
+      e->fb = fb2;
+    }
+    nr_moved++;
+  }
+  futex_unlock_pair(fb1, fb2);
+
+  __futex_wake_list(&q);
+  return nr_woken + nr_moved;
 }
 
 int futex(int *uaddr, int op, int val,
           const struct timespec *timeout,
           int *uaddr2, int val3)
 {
-  // Round to the nearest micro-second
   uint64_t us_timeout = (uint64_t)-1;
-  assert(uaddr2 == NULL);
-  assert(val3 == 0);
-  if(timeout != NULL) {
-    us_timeout = timeout->tv_sec*1000000L + timeout->tv_nsec/1000L;
-    assert(us_timeout > 0);
-  }
 
   run_once(futex_init());
   switch(op) {
     case FUTEX_WAIT:
+      // Round up to the next micro-second, so we never time out early
+      if(timeout != NULL)
+        us_timeout = timeout->tv_sec*1000000L + (timeout->tv_nsec + 999L)/1000L;
       return futex_wait(uaddr, val, us_timeout);
     case FUTEX_WAKE:
       return futex_wake(uaddr, val);
+    case FUTEX_REQUEUE:
+    case FUTEX_CMP_REQUEUE:
+      // Like Linux, the requeue count is passed in timeout's slot
+      return futex_requeue(uaddr, val, (int)(uintptr_t)timeout, uaddr2,
+                           op == FUTEX_CMP_REQUEUE, val3);
     default:
       errno = ENOSYS;
       return -1;
   }
   return -1;
 }
-
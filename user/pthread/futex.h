@@ -4,9 +4,12 @@
 
 __BEGIN_DECLS
 
+/* Numbered as in Linux */
 enum {
-	FUTEX_WAIT,
-	FUTEX_WAKE
+	FUTEX_WAIT = 0,
+	FUTEX_WAKE = 1,
+	FUTEX_REQUEUE = 3,
+	FUTEX_CMP_REQUEUE = 4,
 };
 
 int futex(int *uaddr, int op, int val, const struct timespec *timeout,
@@ -17,12 +17,11 @@
 #include <parlib/ucq.h>
 #include <parlib/signal.h>
 #include <parlib/arch/trap.h>
+#include <parlib/tsc-compat.h>
 
-struct pthread_queue ready_queue = TAILQ_HEAD_INITIALIZER(ready_queue);
-struct pthread_queue active_queue = TAILQ_HEAD_INITIALIZER(active_queue);
-struct mcs_pdr_lock queue_lock;
-int threads_ready = 0;
-int threads_active = 0;
+/* Array of per-vcore run queues, init'd in pthread_lib_init() */
+struct pth_runq *pth_runqs;
+atomic_t threads_ready;
 atomic_t threads_total;
 bool can_adjust_vcores = TRUE;
 bool need_tls = TRUE;
@@ -33,7 +32,6 @@ struct sysc_mgmt *sysc_mgmt = 0;
 
 /* Helper / local functions */
 static int get_next_pid(void);
-static inline void spin_to_sleep(unsigned int spins, unsigned int *spun);
 static inline void pthread_exit_no_cleanup(void *ret);
 
 /* Pthread 2LS operations */
@@ -63,6 +61,66 @@ static void __pthread_free_stack(struct pthread_tcb *pt);
 static int __pthread_allocate_stack(struct pthread_tcb *pt);
 static void __pth_yield_cb(struct uthread *uthread, void *junk);
 
+/* Puts pthread on rq's ready queue */
+static void pth_runq_add(struct pth_runq *rq, struct pthread_tcb *pthread)
+{
+	spin_pdr_lock(&rq->lock);
+	TAILQ_INSERT_TAIL(&rq->ready, pthread, tq_next);
+	rq->nr_ready++;
+	atomic_inc(&threads_ready);
+	spin_pdr_unlock(&rq->lock);
+}
+
+/* Takes a thread off rq's ready queue.  The owner takes from the head, thieves
+ * from the tail. */
+static struct pthread_tcb *pth_runq_get(struct pth_runq *rq, bool steal)
+{
+	struct pthread_tcb *pthread;
+
+	/* Racy peek, so we don't lock every empty queue while stealing.  If we
+	 * miss a thread, whoever made it runnable also asked for vcores. */
+	if (!ACCESS_ONCE(rq->nr_ready))
+		return 0;
+	spin_pdr_lock(&rq->lock);
+	if (steal)
+		pthread = TAILQ_LAST(&rq->ready, pthread_queue);
+	else
+		pthread = TAILQ_FIRST(&rq->ready);
+	if (pthread) {
+		TAILQ_REMOVE(&rq->ready, pthread, tq_next);
+		rq->nr_ready--;
+		atomic_dec(&threads_ready);
+	}
+	spin_pdr_unlock(&rq->lock);
+	return pthread;
+}
+
+/* Steals a thread from some other vcore's runq, starting from a random victim
+ * so idle vcores don't all gang up on the same one.  We check every runq,
+ * including those of vcores that are preempted or yielded, so a thread can't
+ * get stranded on a vcore that isn't running. */
+static struct pthread_tcb *pth_steal(uint32_t vcoreid)
+{
+	struct pth_runq *rq = &pth_runqs[vcoreid];
+	struct pthread_tcb *pthread;
+	uint32_t nr_vcores = max_vcores();
+	uint32_t victim;
+
+	/* xorshift32 */
+	rq->rand ^= rq->rand << 13;
+	rq->rand ^= rq->rand >> 17;
+	rq->rand ^= rq->rand << 5;
+	victim = rq->rand % nr_vcores;
+	for (int i = 0; i < nr_vcores; i++, victim = (victim + 1) % nr_vcores) {
+		if (victim == vcoreid)
+			continue;
+		pthread = pth_runq_get(&pth_runqs[victim], TRUE);
+		if (pthread)
+			return pthread;
+	}
+	return 0;
+}
+
 /* Called from vcore entry.  Options usually include restarting whoever was
  * running there before or running a new thread.  Events are handled out of
  * event.c (table of function pointers, stuff like that). */
@@ -85,16 +143,16 @@ static void __attribute__((noreturn)) pth_sched_entry(void)
 	do {
 		handle_events(vcoreid);
 		__check_preempt_pending(vcoreid);
-		mcs_pdr_lock(&queue_lock);
-		new_thread = TAILQ_FIRST(&ready_queue);
+		new_thread = pth_runq_get(&pth_runqs[vcoreid], FALSE);
+		if (!new_thread)
+			new_thread = pth_steal(vcoreid);
 		if (new_thread) {
-			TAILQ_REMOVE(&ready_queue, new_thread, tq_next);
 			assert(new_thread->state == PTH_RUNNABLE);
 			new_thread->state = PTH_RUNNING;
-			TAILQ_INSERT_TAIL(&active_queue, new_thread, tq_next);
-			threads_active++;
-			threads_ready--;
-			mcs_pdr_unlock(&queue_lock);
+			new_thread->vcoreid = vcoreid;
+			spin_pdr_lock(&pth_runqs[vcoreid].lock);
+			TAILQ_INSERT_TAIL(&pth_runqs[vcoreid].active, new_thread, tq_next);
+			spin_pdr_unlock(&pth_runqs[vcoreid].lock);
 			/* If you see what looks like the same uthread running in multiple
 			 * places, your list might be jacked up.  Turn this on. */
 			printd("[P] got uthread %08p on vc %d state %08p flags %08p\n",
@@ -103,7 +161,6 @@ static void __attribute__((noreturn)) pth_sched_entry(void)
 			       ((struct uthread*)new_thread)->flags);
 			break;
 		}
-		mcs_pdr_unlock(&queue_lock);
 		/* no new thread, try to yield */
 		printd("[P] No threads, vcore %d is yielding\n", vcore_id());
 		/* TODO: you can imagine having something smarter here, like spin for a
@@ -133,6 +190,8 @@ static void __pthread_run(void)
 static void pth_thread_runnable(struct uthread *uthread)
 {
 	struct pthread_tcb *pthread = (struct pthread_tcb*)uthread;
+	uint32_t vcoreid;
+
 	/* At this point, the 2LS can see why the thread blocked and was woken up in
 	 * the first place (coupling these things together).  On the yield path, the
 	 * 2LS was involved and was able to set the state.  Now when we get the
@@ -151,17 +210,18 @@ static void pth_thread_runnable(struct uthread *uthread)
 			panic("Odd state %d for pthread %08p\n", pthread->state, pthread);
 	}
 	pthread->state = PTH_RUNNABLE;
-	/* Insert the newly created thread into the ready queue of threads.
-	 * It will be removed from this queue later when vcore_entry() comes up */
-	mcs_pdr_lock(&queue_lock);
-	/* Again, GIANT WARNING: if you change this, change batch wakeup code */
-	TAILQ_INSERT_TAIL(&ready_queue, pthread, tq_next);
-	threads_ready++;
-	mcs_pdr_unlock(&queue_lock);
+	/* Put the thread back on the runq of the vcore it last ran on, where its
+	 * cache footprint is.  If that vcore isn't running, use ours.  Either way,
+	 * it can get stolen.  Again, GIANT WARNING: if you change this, change
+	 * batch wakeup code */
+	vcoreid = pthread->vcoreid;
+	if (!vcore_is_mapped(vcoreid) || vcore_is_preempted(vcoreid))
+		vcoreid = vcore_id();
+	pth_runq_add(&pth_runqs[vcoreid], pthread);
 	/* Smarter schedulers should look at the num_vcores() and how much work is
 	 * going on to make a decision about how many vcores to request. */
 	if (can_adjust_vcores)
-		vcore_request(threads_ready);
+		vcore_request(atomic_read(&threads_ready));
 }
 
 /* For some reason not under its control, the uthread stopped running (compared
@@ -467,7 +527,17 @@ void __attribute__((constructor)) pthread_lib_init(void)
 	init_once_racy(return);
 	uthread_lib_init();
 
-	mcs_pdr_init(&queue_lock);
+	ret = posix_memalign((void**)&pth_runqs, __alignof__(struct pth_runq),
+	                     sizeof(struct pth_runq) * max_vcores());
+	assert(!ret);
+	for (int i = 0; i < max_vcores(); i++) {
+		spin_pdr_init(&pth_runqs[i].lock);
+		TAILQ_INIT(&pth_runqs[i].ready);
+		TAILQ_INIT(&pth_runqs[i].active);
+		pth_runqs[i].nr_ready = 0;
+		pth_runqs[i].rand = (i + 1) * 2654435761U;	/* never 0 */
+	}
+	atomic_init(&threads_ready, 0);
 	/* Create a pthread_tcb for the main thread */
 	ret = posix_memalign((void**)&t, __alignof__(struct pthread_tcb),
 	                     sizeof(struct pthread_tcb));
@@ -484,11 +554,11 @@ void __attribute__((constructor)) pthread_lib_init(void)
 	t->sched_policy = SCHED_FIFO;
 	t->sched_priority = 0;
 	SLIST_INIT(&t->cr_stack);
-	/* Put the new pthread (thread0) on the active queue */
-	mcs_pdr_lock(&queue_lock);
-	threads_active++;
-	TAILQ_INSERT_TAIL(&active_queue, t, tq_next);
-	mcs_pdr_unlock(&queue_lock);
+	/* Put the new pthread (thread0) on vcore 0's active queue */
+	t->vcoreid = 0;
+	spin_pdr_lock(&pth_runqs[0].lock);
+	TAILQ_INSERT_TAIL(&pth_runqs[0].active, t, tq_next);
+	spin_pdr_unlock(&pth_runqs[0].lock);
 	/* Tell the kernel where and how we want to receive events.  This is just an
 	 * example of what to do to have a notification turned on.  We're turning on
 	 * USER_IPIs, posting events to vcore 0's vcpd, and telling the kernel to
@@ -586,6 +656,7 @@ int __pthread_create(pthread_t *thread, const pthread_attr_t *attr,
 	memset(pthread, 0, sizeof(struct pthread_tcb));	/* aggressively 0 for bugs*/
 	pthread->stacksize = PTHREAD_STACK_SIZE;	/* default */
 	pthread->state = PTH_CREATED;
+	pthread->vcoreid = vcore_id();			/* start near our parent */
 	pthread->id = get_next_pid();
 	pthread->detached = FALSE;				/* default */
 	pthread->joiner = 0;
@@ -636,10 +707,11 @@ int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
  * active queue is keeping us honest.  Need to export for sem and friends. */
 void __pthread_generic_yield(struct pthread_tcb *pthread)
 {
-	mcs_pdr_lock(&queue_lock);
-	threads_active--;
-	TAILQ_REMOVE(&active_queue, pthread, tq_next);
-	mcs_pdr_unlock(&queue_lock);
+	struct pth_runq *rq = &pth_runqs[pthread->vcoreid];
+
+	spin_pdr_lock(&rq->lock);
+	TAILQ_REMOVE(&rq->active, pthread, tq_next);
+	spin_pdr_unlock(&rq->lock);
 }
 
 /* Callback/bottom half of join, called from __uthread_yield (vcore context).
@@ -828,6 +900,10 @@ int pthread_mutex_init(pthread_mutex_t* m, const pthread_mutexattr_t* attr)
 {
   m->attr = attr;
   atomic_init(&m->lock, 0);
+  spin_pdr_init(&m->qlock);
+  SLIST_INIT(&m->waiters);
+  m->waiters_tail = NULL;
+  memset(&m->stats, 0, sizeof(m->stats));
   return 0;
 }
 
@@ -846,47 +922,159 @@ int pthread_mutex_init(pthread_mutex_t* m, const pthread_mutexattr_t* attr)
 /* TODO: consider making this a 2LS op */
 static inline bool safe_to_spin(unsigned int *state)
 {
-	return !threads_ready;
+	return !atomic_read(&threads_ready);
 }
 
-/* Set *spun to 0 when calling this the first time.  It will yield after 'spins'
- * calls.  Use this for adaptive mutexes and such. */
-static inline void spin_to_sleep(unsigned int spins, unsigned int *spun)
+#define MUTEX_FREE		0
+#define MUTEX_LOCKED	1
+#define MUTEX_WAITERS	2
+
+/* Gives m to pthread if m is free, otherwise puts pthread at the end of m's
+ * waiters.  Either way, pthread owns m by the time it runs again.  Returns TRUE
+ * if pthread got m, in which case the caller must make it runnable.  Hold
+ * m->qlock. */
+static bool __mutex_give_or_queue(pthread_mutex_t *m,
+                                  struct pthread_tcb *pthread)
 {
-	if ((*spun)++ == spins) {
-		pthread_yield();
-		*spun = 0;
+	long old;
+
+	for (;;) {
+		old = atomic_read(&m->lock);
+		if (old == MUTEX_FREE) {
+			if (atomic_cas(&m->lock, MUTEX_FREE, MUTEX_LOCKED))
+				return TRUE;
+			continue;
+		}
+		/* The holder's unlock fast path only succeeds on LOCKED, so once we
+		 * set WAITERS, it will come to us (the qlock). */
+		if (atomic_cas(&m->lock, old, MUTEX_WAITERS))
+			break;
 	}
+	if (m->waiters_tail)
+		SLIST_INSERT_AFTER(m->waiters_tail, pthread, sl_next);
+	else
+		SLIST_INSERT_HEAD(&m->waiters, pthread, sl_next);
+	m->waiters_tail = pthread;
+	return FALSE;
 }
 
+/* Gives m to pthread, possibly later.  pthread must already be blocked. */
+static void __mutex_requeue(pthread_mutex_t *m, struct pthread_tcb *pthread)
+{
+	bool got_it;
+
+	spin_pdr_lock(&m->qlock);
+	got_it = __mutex_give_or_queue(m, pthread);
+	spin_pdr_unlock(&m->qlock);
+	if (got_it)
+		pth_thread_runnable((struct uthread*)pthread);
+}
+
+/* Callback/bottom half of a contended mutex lock. */
+static void __pth_mutex_block_cb(struct uthread *uthread, void *arg)
+{
+	struct pthread_tcb *pthread = (struct pthread_tcb*)uthread;
+	pthread_mutex_t *m = (pthread_mutex_t*)arg;
+
+	__pthread_generic_yield(pthread);
+	pthread->state = PTH_BLK_MUTEX;
+	/* If it got freed since we stopped spinning, we just run again. */
+	__mutex_requeue(m, pthread);
+}
+
+/* Bookkeeping once we own m.  start_tsc is 0 if we got it on the fast path. */
+static void __mutex_note_acquire(pthread_mutex_t *m, uint64_t start_tsc,
+                                 bool blocked)
+{
+	uint64_t ticks;
+
+	m->stats.nr_acquires++;
+	if (!start_tsc)
+		return;
+	ticks = read_tsc() - start_tsc;
+	m->stats.nr_contended++;
+	m->stats.nr_blocked += blocked;
+	m->stats.wait_ticks += ticks;
+	if (ticks > m->stats.max_wait_ticks)
+		m->stats.max_wait_ticks = ticks;
+}
+
+/* Spin while that seems worthwhile, then sleep.  Spinners only take the mutex
+ * when it is free, which it never is while anyone sleeps on it. */
 int pthread_mutex_lock(pthread_mutex_t* m)
 {
-	unsigned int spinner = 0;
-	while(pthread_mutex_trylock(m))
-		while(*(volatile size_t*)&m->lock) {
-			cpu_relax();
-			spin_to_sleep(PTHREAD_MUTEX_SPINS, &spinner);
+	uint64_t start_tsc;
+
+	if (atomic_cas(&m->lock, MUTEX_FREE, MUTEX_LOCKED)) {
+		__mutex_note_acquire(m, 0, FALSE);
+		/* normally we'd need a wmb() and a wrmb() after locking, but the
+		 * atomic_cas handles the CPU mb(), so just a cmb() is necessary. */
+		cmb();
+		return 0;
+	}
+	start_tsc = read_tsc();
+	for (int i = 0; i < PTHREAD_MUTEX_SPINS && safe_to_spin(NULL); i++) {
+		if (atomic_read(&m->lock) == MUTEX_FREE &&
+		    atomic_cas(&m->lock, MUTEX_FREE, MUTEX_LOCKED)) {
+			__mutex_note_acquire(m, start_tsc, FALSE);
+			cmb();
+			return 0;
 		}
-	/* normally we'd need a wmb() and a wrmb() after locking, but the
-	 * atomic_swap handles the CPU mb(), so just a cmb() is necessary. */
-	cmb();
+		cpu_relax();
+	}
+	uthread_yield(TRUE, __pth_mutex_block_cb, m);
+	/* We were handed the mutex; the qlock and scheduling ordered us after the
+	 * previous holder. */
+	__mutex_note_acquire(m, start_tsc, TRUE);
 	return 0;
 }
 
 int pthread_mutex_trylock(pthread_mutex_t* m)
 {
-  return atomic_swap(&m->lock, 1) == 0 ? 0 : EBUSY;
+  if (!atomic_cas(&m->lock, MUTEX_FREE, MUTEX_LOCKED))
+    return EBUSY;
+  __mutex_note_acquire(m, 0, FALSE);
+  cmb();
+  return 0;
 }
 
+/* Safe to call from vcore context; cond wait's callback does. */
 int pthread_mutex_unlock(pthread_mutex_t* m)
 {
-  /* keep reads and writes inside the protected region */
-  rwmb();
-  wmb();
-  atomic_set(&m->lock, 0);
+  struct pthread_tcb *next;
+
+  /* keep reads and writes inside the protected region.  The CAS is a CPU mb,
+   * so this is just for the compiler. */
+  cmb();
+  if (atomic_cas(&m->lock, MUTEX_LOCKED, MUTEX_FREE))
+    return 0;
+  /* There are waiters, and only we can take them off, so there's a next. */
+  spin_pdr_lock(&m->qlock);
+  next = SLIST_FIRST(&m->waiters);
+  assert(next);
+  SLIST_REMOVE_HEAD(&m->waiters, sl_next);
+  if (SLIST_EMPTY(&m->waiters)) {
+    m->waiters_tail = NULL;
+    atomic_set(&m->lock, MUTEX_LOCKED);
+  }
+  m->stats.nr_handoffs++;
+  spin_pdr_unlock(&m->qlock);
+  pth_thread_runnable((struct uthread*)next);
   return 0;
 }
 
+void pthread_mutex_print_stats(pthread_mutex_t *m, const char *name)
+{
+	struct pthread_mutex_stats *st = &m->stats;
+
+	printf("mutex %s (%p): %llu acquires, %llu contended, %llu blocked, "
+	       "%llu handoffs, wait ticks: %llu total, %llu avg, %llu max\n",
+	       name ? name : "", m, st->nr_acquires, st->nr_contended,
+	       st->nr_blocked, st->nr_handoffs, st->wait_ticks,
+	       st->nr_contended ? st->wait_ticks / st->nr_contended : 0,
+	       st->max_wait_ticks);
+}
+
 int pthread_mutex_destroy(pthread_mutex_t* m)
 {
   return 0;
@@ -896,6 +1084,7 @@ int pthread_cond_init(pthread_cond_t *c, const pthread_condattr_t *a)
 {
 	SLIST_INIT(&c->waiters);
 	spin_pdr_init(&c->spdr_lock);
+	c->mutex = NULL;
 	if (a) {
 		c->attr_pshared = a->pshared;
 		c->attr_clock = a->clock;
@@ -923,29 +1112,48 @@ static void wake_slist(struct pthread_list *to_wake)
 {
 	unsigned int nr_woken = 0;	/* assuming less than 4 bil threads */
 	struct pthread_tcb *pthread_i, *pth_temp;
-	/* Amortize the lock grabbing over all restartees */
-	mcs_pdr_lock(&queue_lock);
-	/* Do the work of pth_thread_runnable().  We're in uth context here, but I
-	 * think it's okay.  When we need to (when locking) we drop into VC ctx, as
-	 * far as the kernel and other cores are concerned. */
+	struct pth_runq *rq = &pth_runqs[vcore_id()];
+	/* Amortize the lock grabbing over all restartees: they all go on our runq,
+	 * and other vcores will steal them.  Do the work of pth_thread_runnable().
+	 * We're in uth context here, but I think it's okay.  When we need to (when
+	 * locking) we drop into VC ctx, as far as the kernel and other cores are
+	 * concerned.  If we migrate after picking rq, that's fine too. */
+	spin_pdr_lock(&rq->lock);
 	SLIST_FOREACH_SAFE(pthread_i, to_wake, sl_next, pth_temp) {
 		pthread_i->state = PTH_RUNNABLE;
 		nr_woken++;
-		TAILQ_INSERT_TAIL(&ready_queue, pthread_i, tq_next);
+		TAILQ_INSERT_TAIL(&rq->ready, pthread_i, tq_next);
 	}
-	threads_ready += nr_woken;
-	mcs_pdr_unlock(&queue_lock);
+	rq->nr_ready += nr_woken;
+	atomic_fetch_and_add(&threads_ready, nr_woken);
+	spin_pdr_unlock(&rq->lock);
 	if (can_adjust_vcores)
-		vcore_request(threads_ready);
+		vcore_request(atomic_read(&threads_ready));
 }
 
+/* Waiters don't get woken, since they'd just fight over the mutex.  They get
+ * moved over to the mutex's waiters, and run as it gets handed to them. */
 int pthread_cond_broadcast(pthread_cond_t *c)
 {
 	struct pthread_list restartees = SLIST_HEAD_INITIALIZER(restartees);
+	struct pthread_tcb *pthread_i, *pth_temp, *first = NULL;
+	pthread_mutex_t *m;
+
 	spin_pdr_lock(&c->spdr_lock);
 	swap_slists(&restartees, &c->waiters);
+	m = c->mutex;
 	spin_pdr_unlock(&c->spdr_lock);
-	wake_slist(&restartees);
+	if (SLIST_EMPTY(&restartees))
+		return 0;
+	spin_pdr_lock(&m->qlock);
+	SLIST_FOREACH_SAFE(pthread_i, &restartees, sl_next, pth_temp) {
+		/* Only the first can get a free mutex */
+		if (__mutex_give_or_queue(m, pthread_i))
+			first = pthread_i;
+	}
+	spin_pdr_unlock(&m->qlock);
+	if (first)
+		pth_thread_runnable((struct uthread*)first);
 	return 0;
 }
 
@@ -954,6 +1162,7 @@ int pthread_cond_broadcast(pthread_cond_t *c)
 int pthread_cond_signal(pthread_cond_t *c)
 {
 	struct pthread_tcb *pthread;
+	pthread_mutex_t *m;
 	spin_pdr_lock(&c->spdr_lock);
 	pthread = SLIST_FIRST(&c->waiters);
 	if (!pthread) {
@@ -961,8 +1170,9 @@ int pthread_cond_signal(pthread_cond_t *c)
 		return 0;
 	}
 	SLIST_REMOVE_HEAD(&c->waiters, sl_next);
+	m = c->mutex;
 	spin_pdr_unlock(&c->spdr_lock);
-	pth_thread_runnable((struct uthread*)pthread);
+	__mutex_requeue(m, pthread);
 	return 0;
 }
 
@@ -984,6 +1194,8 @@ static void __pth_wait_cb(struct uthread *uthread, void *junk)
 	__pthread_generic_yield(pthread);
 	pthread->state = PTH_BLK_MUTEX;
 	spin_pdr_lock(&c->spdr_lock);
+	/* All concurrent waiters use the same mutex, per the spec */
+	c->mutex = m;
 	SLIST_INSERT_HEAD(&c->waiters, pthread, sl_next);
 	spin_pdr_unlock(&c->spdr_lock);
 	pthread_mutex_unlock(m);
@@ -995,7 +1207,8 @@ int pthread_cond_wait(pthread_cond_t *c, pthread_mutex_t *m)
 	local_junk.c = c;
 	local_junk.m = m;
 	uthread_yield(TRUE, __pth_wait_cb, &local_junk);
-	pthread_mutex_lock(m);
+	/* Signal and broadcast requeue us onto m, so we already own it. */
+	__mutex_note_acquire(m, 0, FALSE);
 	return 0;
 }
 
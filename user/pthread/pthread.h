@@ -43,6 +43,7 @@ struct pthread_tcb {
 		SLIST_ENTRY(pthread_tcb) sl_next;
 	};
 	int state;
+	uint32_t vcoreid;			/* last ran here; on that runq's active list */
 	bool detached;
 	struct pthread_tcb *joiner;			/* raced on by exit and join */
 	uint32_t id;
@@ -59,6 +60,18 @@ typedef struct pthread_tcb* pthread_t;
 SLIST_HEAD(pthread_list, pthread_tcb);
 TAILQ_HEAD(pthread_queue, pthread_tcb);
 
+/* Per-vcore run queue.  Vcores run threads from their own ready queue, and
+ * steal from the tail of other vcores' queues when theirs is empty.  Runnable
+ * threads go back to the vcore they last ran on.  rand is only touched by the
+ * owning vcore, in vcore context. */
+struct pth_runq {
+	struct spin_pdr_lock		lock;
+	struct pthread_queue		ready;
+	struct pthread_queue		active;
+	unsigned int				nr_ready;
+	uint32_t					rand;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
 /* Per-vcore data structures to manage syscalls.  The ev_q is where we tell the
  * kernel to signal us.  We don't need a lock since this is per-vcore and
  * accessed in vcore context. */
@@ -68,7 +81,9 @@ struct sysc_mgmt {
 
 #define PTHREAD_ONCE_INIT 0
 #define PTHREAD_BARRIER_SERIAL_THREAD 12345
-#define PTHREAD_MUTEX_INITIALIZER {0,0}
+#define PTHREAD_MUTEX_INITIALIZER {0, 0, SPINPDR_INITIALIZER,                 \
+                                   /* SLIST_HEAD_INITIALIZER */ {NULL}, NULL, \
+                                   {0}}
 #define PTHREAD_RWLOCK_INITIALIZER PTHREAD_MUTEX_INITIALIZER
 #define PTHREAD_MUTEX_NORMAL 0
 #define PTHREAD_MUTEX_RECURSIVE 1
@@ -76,7 +91,7 @@ struct sysc_mgmt {
 #define PTHREAD_MUTEX_SPINS 100 // totally arbitrary
 #define PTHREAD_BARRIER_SPINS 100 // totally arbitrary
 #define PTHREAD_COND_INITIALIZER {/* SLIST_HEAD_INITIALIZER */ {NULL},         \
-                                  SPINPDR_INITIALIZER, 0, 0}
+                                  SPINPDR_INITIALIZER, 0, 0, NULL}
 #define PTHREAD_PROCESS_PRIVATE 0
 #define PTHREAD_PROCESS_SHARED 1
 
@@ -85,10 +100,30 @@ typedef struct
   int type;
 } pthread_mutexattr_t;
 
+/* Contention stats, updated by whoever holds the mutex, so they need no
+ * atomics.  Dump them with pthread_mutex_print_stats(). */
+struct pthread_mutex_stats {
+	uint64_t					nr_acquires;
+	uint64_t					nr_contended;	/* missed the fast path */
+	uint64_t					nr_blocked;		/* gave up spinning and slept */
+	uint64_t					nr_handoffs;	/* unlocks straight to a waiter */
+	uint64_t					wait_ticks;		/* total TSC ticks contended */
+	uint64_t					max_wait_ticks;
+};
+
+/* Adaptive mutex.  lock is 0 (free), 1 (held) or 2 (held, with waiters).
+ * Lockers spin for a bit, then sleep on waiters, which is FIFO (waiters_tail
+ * points to the last one).  Unlock hands the mutex straight to the first
+ * waiter, without ever freeing it, so sleepers can't get starved by spinners.
+ * qlock protects the waiters and any changes to lock away from 2. */
 typedef struct
 {
   const pthread_mutexattr_t* attr;
   atomic_t lock;
+  struct spin_pdr_lock qlock;
+  struct pthread_list waiters;
+  struct pthread_tcb *waiters_tail;
+  struct pthread_mutex_stats stats;
 } pthread_mutex_t;
 
 typedef struct
@@ -135,6 +170,7 @@ typedef struct
 	struct spin_pdr_lock 		spdr_lock;
 	int 						attr_pshared;
 	int 						attr_clock;
+	pthread_mutex_t				*mutex;		/* waiters' mutex, for requeueing */
 } pthread_cond_t;
 
 typedef struct 
@@ -155,6 +191,7 @@ typedef dtls_key_t pthread_key_t;
 void pthread_can_vcore_request(bool can);	/* default is TRUE */
 void pthread_need_tls(bool need);			/* default is TRUE */
 void pthread_lib_init(void);
+void pthread_mutex_print_stats(pthread_mutex_t *m, const char *name);
 void pthread_mcp_init(void);
 void __pthread_generic_yield(struct pthread_tcb *pthread);
 